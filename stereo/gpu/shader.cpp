@@ -41,6 +41,31 @@ wgpu::ShaderModule shader_from_file(wgpu::Device device, const char* fpath) {
     return shader_from_str(device, src.c_str(), fpath);
 }
 
+wgpu::ShaderModule shader_from_file(
+        wgpu::Device device,
+        const char* fpath,
+        std::initializer_list<std::pair<std::string_view, uint32_t>> constants)
+{
+    std::string src = read_file(fpath);
+    if (src.empty()) {
+        std::cerr << "empty shader file" << std::endl;
+        return nullptr;
+    }
+    for (auto [name, value] : constants) {
+        std::string decl = "const " + std::string(name) + ": u32 = ";
+        size_t begin = src.find(decl);
+        size_t end   = begin == std::string::npos ? begin : src.find(';', begin);
+        if (end == std::string::npos) {
+            std::cerr << "No declaration of `" << name << "` in shader `" << fpath << "`";
+            std::cerr << std::endl;
+            std::abort();
+        }
+        begin += decl.size();
+        src.replace(begin, end - begin, std::to_string(value) + "u");
+    }
+    return shader_from_str(device, src.c_str(), fpath);
+}
+
 wgpu::ShaderModule shader_from_str(
         wgpu::Device device,
         const char* source,
@@ -117,13 +142,14 @@ wgpu::BindGroupLayoutEntry texture_layout(
 
 wgpu::BindGroupLayoutEntry texture_storage_layout(
         gpu_size_t binding,
-        wgpu::ShaderStage extra_stages)
+        wgpu::ShaderStage extra_stages,
+        wgpu::TextureFormat format)
 {
     wgpu::BindGroupLayoutEntry entry = wgpu::Default;
     entry.binding               = binding;
     entry.visibility            = wgpu::ShaderStage::Compute | extra_stages;
     entry.storageTexture.access = wgpu::StorageTextureAccess::WriteOnly;
-    entry.storageTexture.format = wgpu::TextureFormat::RGBA8Unorm;
+    entry.storageTexture.format = format;
     entry.storageTexture.viewDimension = wgpu::TextureViewDimension::_2D;
     return entry;
 }
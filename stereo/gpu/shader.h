@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string_view>
+
 #include <stereo/gpu/bindgroup.h>
 #include <stereo/gpu/buffer.h>
 
@@ -9,6 +11,18 @@ struct Texture;
 
 wgpu::ShaderModule shader_from_file(wgpu::Device device, const char* fpath);
 
+/**
+ * Load a shader from a file, replacing the value of each `const <name>: u32 = ...;`
+ * declaration named in `constants`.
+ *
+ * This stands in for pipeline-overridable constants, which wgpu does not support
+ * as array sizes.
+ */
+wgpu::ShaderModule shader_from_file(
+        wgpu::Device device,
+        const char* fpath,
+        std::initializer_list<std::pair<std::string_view, uint32_t>> constants);
+
 wgpu::ShaderModule shader_from_str(wgpu::Device device, const char* source, const char* label);
 
 wgpu::ComputePipeline create_compute_pipeline(
@@ -82,7 +96,8 @@ wgpu::BindGroupLayoutEntry texture_layout(
 
 wgpu::BindGroupLayoutEntry texture_storage_layout(
         gpu_size_t binding,
-        wgpu::ShaderStage extra_stages=wgpu::ShaderStage::None
+        wgpu::ShaderStage extra_stages=wgpu::ShaderStage::None,
+        wgpu::TextureFormat format=wgpu::TextureFormat::RGBA8Unorm
 );
 
 template <typename T>
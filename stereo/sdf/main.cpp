@@ -62,27 +62,18 @@ bool g_done = false;
 void run_compute(wgpu::Device device) {
     // sdf context
     gpu_size_t w = 1024;
-    gpu_size_t n_samples = w * w;
     SdfEvaluator sdf_eval {device};
     SdfNodeRef<float> sdf = std::make_shared<SdfUnion<float>>(
         std::make_shared<SdfSphere<float>>(sphere3({-1., 0., 0.}, 1.)),
         std::make_shared<SdfSphere<float>>(sphere3({ 1., 0., 0.}, 1.))
     );
-    SdfGpuExpr expr {sdf_eval, sdf};
-    SdfInput input {sdf_eval, n_samples, n_samples};
+    // prune the tape over 32x32 tiles covering the sample grid
+    SdfTiledTape tiled {SdfTape(sdf), range3({-2., -2., 0.}, {2., 2., 0.}), vec3ui(32, 32, 1)};
+    SdfGpuExpr expr {sdf_eval, tiled};
+    // pixel center grid on [-2, 2]^2, generated by the shader
+    SdfInput input {sdf_eval, SdfSampleSet::grid(range3({-2., -2., 0.}, {2., 2., 0.}), vec3ui(w, w, 1))};
     SdfOutputRef output;
     
-    // populate input (pixel center grid on [-2, 2]^2)
-    std::vector<vec3gpu> sample_pts {n_samples};
-    for (gpu_size_t y = 0; y < w; ++y) {
-        float t = (y + 0.5) / w * 2.f - 1.f;
-        for (gpu_size_t x = 0; x < w; ++x) {
-            float s = (x + 0.5) / w * 2.f - 1.f;
-            sample_pts[y * w + x] = vec3gpu {2 * s, 2 * t, 0};
-        }
-    }
-    input.write_samples_x(sample_pts.data());
-    
     int c = 0;
     auto start = std::chrono::high_resolution_clock::now();
     while (not g_app_error and c++ < 100) {
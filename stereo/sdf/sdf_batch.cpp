@@ -0,0 +1,45 @@
+#include <stereo/sdf/sdf_batch.h>
+
+namespace stereo {
+
+SdfTapeBatch::SdfTapeBatch(const std::vector<SdfTape>& tapes) {
+    for (const SdfTape& tape : tapes) append(tape);
+}
+
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+SdfTapeBatch::SdfTapeBatch(const std::vector<SdfNodeRef<T>>& exprs) {
+    for (const SdfNodeRef<T>& expr : exprs) append(SdfTape(expr));
+}
+
+size_t SdfTapeBatch::append(const SdfTape& tape) {
+    gpu_size_t op_begin = ops.size();
+    gpu_size_t p_begin  = params_x.size();
+    ops.insert(ops.end(), tape.ops.begin(), tape.ops.end());
+    params_x.insert(params_x.end(), tape.params_x.begin(), tape.params_x.end());
+    params_dx.insert(params_dx.end(), tape.params_dx.begin(), tape.params_dx.end());
+    exprs.push_back({op_begin, (gpu_size_t) ops.size()});
+    param_offsets.push_back({p_begin, p_begin});
+    stack_depth = std::max(stack_depth, tape.stack_depth());
+    return exprs.size() - 1;
+}
+
+SdfTapeView SdfTapeBatch::view() const {
+    return {
+        .ops            = ops.data(),
+        .n_ops          = (gpu_size_t) ops.size(),
+        .params_x       = params_x.data(),
+        .params_dx      = params_dx.data(),
+        .n_params       = (gpu_size_t) n_params(),
+        .tiles          = exprs.data(),
+        .n_tile_entries = (gpu_size_t) exprs.size(),
+        .grid           = SdfTileGrid {},
+        .stack_depth    = (gpu_size_t) stack_depth,
+    };
+}
+
+// explicit template instantiation
+template SdfTapeBatch::SdfTapeBatch(const std::vector<SdfNodeRef<float>>& exprs);
+template SdfTapeBatch::SdfTapeBatch(const std::vector<SdfNodeRef<Dual<float>>>& exprs);
+
+} // namespace stereo
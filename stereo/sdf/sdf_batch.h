@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stereo/sdf/sdf_prune.h>
+
+// Batches of distinct SDF expressions, evaluated together.
+//
+// A shape search evaluates many small, structurally different trees against the same
+// samples. Rather than one dispatch (or one pass over the samples) per tree, their tapes
+// are concatenated into a single tape, alongside a table of the op range and parameter
+// offset of each expression, and the evaluators run every (expression, sample) pair in
+// one pass. The expression takes the place of the parameter variation: results are laid
+// out expression-major, so that expression `e` at sample `i` is at `e * n_samples + i`.
+//
+// Each tape keeps its own numbering (parameter ranges relative to the expression's
+// parameter offset, op indices relative to the start of its tape), just as the pruned
+// tapes of an `SdfTiledTape` do, so nothing is rewritten when concatenating. The op
+// table has the layout of a tile table, and a batch is uploaded like a tiled tape whose
+// tiles are its expressions. Batched tapes are run whole, without tiles.
+
+namespace stereo {
+
+/**
+ * @brief Several tapes, concatenated to be evaluated together.
+ */
+struct SdfTapeBatch {
+    std::vector<SdfGpuOp>    ops;
+    std::vector<float>       params_x;
+    std::vector<float>       params_dx;
+    /// The op range of each expression within `ops`.
+    std::vector<SdfTile>     exprs;
+    /// The offset of each expression's parameters within `params_x` and `params_dx`.
+    std::vector<ParamOffset> param_offsets;
+    /// The deepest stack needed by any of the expressions.
+    size_t                   stack_depth = 0;
+
+    SdfTapeBatch() = default;
+
+    SdfTapeBatch(const std::vector<SdfTape>& tapes);
+
+    template <typename T>
+    requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+    SdfTapeBatch(const std::vector<SdfNodeRef<T>>& exprs);
+
+    size_t n_exprs()  const { return exprs.size(); }
+    size_t n_params() const { return params_x.size(); }
+
+    /// Append `tape` to the batch, returning its index.
+    size_t append(const SdfTape& tape);
+
+    /// A view of the buffers to upload to the GPU, with the expressions as its tiles.
+    SdfTapeView view() const;
+};
+
+} // namespace stereo
@@ -0,0 +1,365 @@
+#include <stereo/sdf/sdf_bricks.h>
+#include <stereo/util/parallel.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr uint32_t B = SdfBrickCache::BrickSize;
+constexpr uint32_t S = SdfBrickCache::BrickStride;
+
+// number of bricks baked per evaluation, to bound the size of the sample buffers
+constexpr size_t BakeBatch = 1024;
+
+uint64_t brick_key(uint32_t x, uint32_t y, uint32_t z) {
+    return (uint64_t(x) << 42) | (uint64_t(y) << 21) | uint64_t(z);
+}
+
+// offset within a brick of lattice point `(x, y, z)`, counted from the brick's
+// lowest voxel corner (the apron is at -1)
+size_t sample_offset(uint32_t x, uint32_t y, uint32_t z) {
+    return ((z + 1) * S + (y + 1)) * S + (x + 1);
+}
+
+SdfCpuOutputRef eval_points(
+        const SdfCpuEvaluator& evaluator,
+        const SdfCpuExpr& expr,
+        const std::vector<vec3>& pts,
+        SdfEvalMode mode=SdfEvalMode::Value)
+{
+    SdfCpuInput input(pts.size(), 0);
+    input.write_samples_x(pts.data());
+    return evaluator.evaluate(expr, input, 1, ParamVariation::VaryDerivative, nullptr, mode);
+}
+
+// Bounds on the gradient of each reconstruction, per unit Lipschitz constant of the
+// sampled function. Along each axis, a trilinear interpolant's derivative is a blend of
+// differences of neighboring samples, each at most one voxel's worth. A Catmull-Rom
+// derivative is at most 3/2 such differences, and the weights along the other two axes
+// sum to at most 5/4 in magnitude. The gradient is at most sqrt(3) times its components.
+constexpr float TrilinearLipschitz = 1.7320508f;
+constexpr float TricubicLipschitz  = 1.7320508f * 1.5f * 1.25f * 1.25f;
+
+// Catmull-Rom weights of the four taps around `t`, and their derivatives
+void cubic_weights(float t, float w[4], float dw[4]) {
+    float t2 = t * t;
+    float t3 = t2 * t;
+    w[0]  = 0.5f * (-t3 + 2 * t2 - t);
+    w[1]  = 0.5f * (3 * t3 - 5 * t2 + 2);
+    w[2]  = 0.5f * (-3 * t3 + 4 * t2 + t);
+    w[3]  = 0.5f * (t3 - t2);
+    dw[0] = 0.5f * (-3 * t2 + 4 * t - 1);
+    dw[1] = 0.5f * (9 * t2 - 10 * t);
+    dw[2] = 0.5f * (-9 * t2 + 8 * t + 1);
+    dw[3] = 0.5f * (3 * t2 - 2 * t);
+}
+
+// reconstruct from the brick samples `s`, in voxel `i` at fractional position `t`.
+// the gradient is in voxel units.
+void reconstruct(
+        SdfBrickFilter filter,
+        const float* s,
+        const vec3ui& i,
+        const vec3& t,
+        float* f,
+        vec3* grad)
+{
+    if (filter == SdfBrickFilter::Trilinear) {
+        const float* c = s + sample_offset(i.x, i.y, i.z);
+        float v000 = c[0],         v100 = c[1];
+        float v010 = c[S],         v110 = c[S + 1];
+        float v001 = c[S * S],     v101 = c[S * S + 1];
+        float v011 = c[S * S + S], v111 = c[S * S + S + 1];
+        // along x
+        float v00 = v000 + (v100 - v000) * t.x;
+        float v10 = v010 + (v110 - v010) * t.x;
+        float v01 = v001 + (v101 - v001) * t.x;
+        float v11 = v011 + (v111 - v011) * t.x;
+        // along y
+        float v0 = v00 + (v10 - v00) * t.y;
+        float v1 = v01 + (v11 - v01) * t.y;
+        *f = v0 + (v1 - v0) * t.z;
+
+        float dx00 = v100 - v000;
+        float dx10 = v110 - v010;
+        float dx01 = v101 - v001;
+        float dx11 = v111 - v011;
+        float dx0  = dx00 + (dx10 - dx00) * t.y;
+        float dx1  = dx01 + (dx11 - dx01) * t.y;
+        *grad = vec3(
+            dx0 + (dx1 - dx0) * t.z,
+            (v10 - v00) + ((v11 - v01) - (v10 - v00)) * t.z,
+            v1 - v0
+        );
+    } else {
+        float wx[4], wy[4], wz[4];
+        float dx[4], dy[4], dz[4];
+        cubic_weights(t.x, wx, dx);
+        cubic_weights(t.y, wy, dy);
+        cubic_weights(t.z, wz, dz);
+        // the taps run from voxel i - 1 to i + 2; with the apron, from offset i
+        const float* c = s + (i.z * S + i.y) * S + i.x;
+        float v = 0;
+        vec3  g;
+        for (uint32_t z = 0; z < 4; ++z) {
+            float vy = 0, gx_y = 0, gy_y = 0;
+            for (uint32_t y = 0; y < 4; ++y) {
+                const float* row = c + (z * S + y) * S;
+                float vx = 0, gx = 0;
+                for (uint32_t x = 0; x < 4; ++x) {
+                    vx += wx[x] * row[x];
+                    gx += dx[x] * row[x];
+                }
+                vy   += wy[y] * vx;
+                gx_y += wy[y] * gx;
+                gy_y += dy[y] * vx;
+            }
+            v   += wz[z] * vy;
+            g.x += wz[z] * gx_y;
+            g.y += wz[z] * gy_y;
+            g.z += dz[z] * vy;
+        }
+        *f    = v;
+        *grad = g;
+    }
+}
+
+} // namespace
+
+
+SdfBrickCache::SdfBrickCache(
+        SdfCpuExpr expr,
+        const SdfBrickOptions& opts,
+        const SdfCpuEvaluator& evaluator):
+    _expr(std::move(expr)),
+    _evaluator(evaluator),
+    _opts(opts)
+{
+    const float h     = opts.voxel_size;
+    const float brick = h * B;
+    vec3 extent = opts.region.hi - opts.region.lo;
+    _n_bricks = vec3ui(
+        std::max<uint32_t>(1, std::ceil(extent.x / brick)),
+        std::max<uint32_t>(1, std::ceil(extent.y / brick)),
+        std::max<uint32_t>(1, std::ceil(extent.z / brick))
+    );
+    uint32_t depth = 0;
+    while ((1u << depth) < std::max({_n_bricks.x, _n_bricks.y, _n_bricks.z})) ++depth;
+    if (depth > 20) {
+        std::cerr << "SDF brick cache of " << _n_bricks << " bricks is too large" << std::endl;
+        std::abort();
+    }
+
+    // find the bricks in the band, descending from a cell covering the whole region
+    std::vector<vec3ui> cells {vec3ui(0, 0, 0)};
+    for (uint32_t level = 0; ; ++level) {
+        float size   = brick * (1 << (depth - level));
+        float radius = size * std::sqrt(3.f) / 2 + opts.band;
+        std::vector<vec3> centers(cells.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            centers[i] = opts.region.lo + vec3(
+                (cells[i].x + 0.5f) * size,
+                (cells[i].y + 0.5f) * size,
+                (cells[i].z + 0.5f) * size
+            );
+        }
+        SdfCpuOutputRef f = eval_points(_evaluator, _expr, centers);
+        std::vector<vec3ui> near;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (std::abs(f->sdf_x[i]) <= radius) near.push_back(cells[i]);
+        }
+        if (level == depth) {
+            cells = std::move(near);
+            break;
+        }
+        cells.clear();
+        uint32_t child_bricks = 1 << (depth - level - 1);
+        for (const vec3ui& c : near) {
+            for (uint32_t k = 0; k < 8; ++k) {
+                vec3ui c1 = vec3ui(2 * c.x + (k & 1), 2 * c.y + ((k >> 1) & 1), 2 * c.z + (k >> 2));
+                // skip children entirely outside the region
+                if (c1.x * child_bricks >= _n_bricks.x or
+                    c1.y * child_bricks >= _n_bricks.y or
+                    c1.z * child_bricks >= _n_bricks.z) continue;
+                cells.push_back(c1);
+            }
+        }
+    }
+
+    size_t n = cells.size();
+    _index.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        _index[brick_key(cells[i].x, cells[i].y, cells[i].z)] = i;
+    }
+    _pool.resize(n * BrickVolume);
+    _error.resize(n);
+    const SdfTape& tape = _expr.tape();
+    float k = opts.filter == SdfBrickFilter::Trilinear ? TrilinearLipschitz : TricubicLipschitz;
+    float l = sdf_lipschitz(tape.ops.data(), tape.n_ops(), _expr.params_x().data());
+    _margin = (1 + k) * l * h * std::sqrt(3.f) / 2;
+
+    // sample the bricks, and measure their error at the voxel centers
+    for (size_t b0 = 0; b0 < n; b0 += BakeBatch) {
+        size_t b1 = std::min(n, b0 + BakeBatch);
+        std::vector<vec3> pts((b1 - b0) * BrickVolume);
+        std::vector<vec3> mids((b1 - b0) * B * B * B);
+        parallel_for(
+            b1 - b0,
+            16,
+            [&](size_t begin, size_t end, size_t thread_index) {
+                for (size_t b = begin; b < end; ++b) {
+                    const vec3ui& c = cells[b0 + b];
+                    vec3 lo = opts.region.lo + vec3(c.x, c.y, c.z) * brick;
+                    vec3* p = pts.data()  + b * BrickVolume;
+                    vec3* m = mids.data() + b * B * B * B;
+                    for (uint32_t z = 0; z < S; ++z) {
+                        for (uint32_t y = 0; y < S; ++y) {
+                            for (uint32_t x = 0; x < S; ++x) {
+                                *p++ = lo + vec3(x - 1.f, y - 1.f, z - 1.f) * h;
+                            }
+                        }
+                    }
+                    for (uint32_t z = 0; z < B; ++z) {
+                        for (uint32_t y = 0; y < B; ++y) {
+                            for (uint32_t x = 0; x < B; ++x) {
+                                *m++ = lo + vec3(x + 0.5f, y + 0.5f, z + 0.5f) * h;
+                            }
+                        }
+                    }
+                }
+            },
+            _evaluator.n_threads()
+        );
+        SdfCpuOutputRef f = eval_points(_evaluator, _expr, pts);
+        std::copy(f->sdf_x.begin(), f->sdf_x.end(), _pool.begin() + b0 * BrickVolume);
+        SdfCpuOutputRef f_mid = eval_points(_evaluator, _expr, mids);
+        parallel_for(
+            b1 - b0,
+            16,
+            [&](size_t begin, size_t end, size_t thread_index) {
+                for (size_t b = begin; b < end; ++b) {
+                    const float* s = _pool.data() + (b0 + b) * BrickVolume;
+                    const float* exact = f_mid->sdf_x.data() + b * B * B * B;
+                    float err = 0;
+                    for (uint32_t z = 0; z < B; ++z) {
+                        for (uint32_t y = 0; y < B; ++y) {
+                            for (uint32_t x = 0; x < B; ++x) {
+                                float v;
+                                vec3  g;
+                                reconstruct(opts.filter, s, vec3ui(x, y, z), vec3(0.5f), &v, &g);
+                                err = std::max(err, std::abs(v - *exact++));
+                            }
+                        }
+                    }
+                    _error[b0 + b] = err;
+                }
+            },
+            _evaluator.n_threads()
+        );
+    }
+}
+
+size_t SdfBrickCache::memory_bytes() const {
+    return _pool.size() * sizeof(float)
+        + _error.size() * sizeof(float)
+        + _index.size() * sizeof(std::pair<uint64_t, uint32_t>);
+}
+
+const float* SdfBrickCache::_brick_error(const vec3& p) const {
+    vec3 u = (p - _opts.region.lo) / (_opts.voxel_size * B);
+    if (not (u.x >= 0 and u.y >= 0 and u.z >= 0)) return nullptr;
+    if (not (u.x < _n_bricks.x and u.y < _n_bricks.y and u.z < _n_bricks.z)) return nullptr;
+    auto i = _index.find(brick_key(u.x, u.y, u.z));
+    return i == _index.end() ? nullptr : &_error[i->second];
+}
+
+float SdfBrickCache::error_estimate(const vec3& p) const {
+    const float* err = _brick_error(p);
+    return err ? *err : 0;
+}
+
+float SdfBrickCache::max_error() const {
+    float err = 0;
+    for (float e : _error) err = std::max(err, e);
+    return err;
+}
+
+float SdfBrickCache::error_bound(const vec3& p) const {
+    const float* err = _brick_error(p);
+    return err ? *err + _margin : 0;
+}
+
+float SdfBrickCache::max_error_bound() const {
+    return _error.empty() ? 0 : max_error() + _margin;
+}
+
+bool SdfBrickCache::sample(const vec3& p, float* f, vec3* grad) const {
+    vec3 u = (p - _opts.region.lo) / _opts.voxel_size;
+    // (written so that NaNs fail)
+    if (not (u.x >= 0 and u.y >= 0 and u.z >= 0)) return false;
+    if (not (u.x < _n_bricks.x * B and u.y < _n_bricks.y * B and u.z < _n_bricks.z * B)) {
+        return false;
+    }
+    vec3ui v = vec3ui(u.x, u.y, u.z);
+    auto i = _index.find(brick_key(v.x / B, v.y / B, v.z / B));
+    if (i == _index.end()) return false;
+    const float* s = _pool.data() + i->second * BrickVolume;
+    vec3 t = vec3(u.x - v.x, u.y - v.y, u.z - v.z);
+    vec3 g;
+    reconstruct(_opts.filter, s, vec3ui(v.x % B, v.y % B, v.z % B), t, f, &g);
+    *grad = g / _opts.voxel_size;
+    return true;
+}
+
+SdfCpuOutputRef SdfBrickCache::evaluate(const SdfCpuInput& input, SdfCpuOutputRef output) const {
+    size_t n = input.n_samples_x();
+    if (not output) {
+        output = std::make_shared<SdfCpuOutput>(n, SdfEvalMode::Gradient);
+    } else if (output->n_samples() < n or output->mode < SdfEvalMode::Gradient) {
+        std::cerr << "SDF brick cache output has " << output->n_samples() << " samples"
+                  << (output->mode < SdfEvalMode::Gradient ? " without normals" : "")
+                  << ", but " << n << " are needed" << std::endl;
+        std::abort();
+    }
+
+    // answer from the cache where possible, noting the misses of each chunk in order
+    size_t grain    = 4096;
+    size_t n_chunks = (n + grain - 1) / grain;
+    std::vector<std::vector<uint32_t>> chunk_misses(n_chunks);
+    parallel_for(
+        n,
+        grain,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            std::vector<uint32_t>& misses = chunk_misses[begin / grain];
+            for (size_t i = begin; i < end; ++i) {
+                float f;
+                vec3  g;
+                if (sample(input.sample_x(i), &f, &g)) {
+                    float m = g.mag();
+                    output->sdf_x[i]    = f;
+                    output->normal_x[i] = m > 0 ? g / m : g;
+                } else {
+                    misses.push_back(i);
+                }
+            }
+        },
+        _evaluator.n_threads()
+    );
+
+    // evaluate the rest exactly
+    std::vector<uint32_t> misses;
+    for (const std::vector<uint32_t>& m : chunk_misses) {
+        misses.insert(misses.end(), m.begin(), m.end());
+    }
+    if (misses.empty()) return output;
+    std::vector<vec3> pts(misses.size());
+    for (size_t j = 0; j < misses.size(); ++j) pts[j] = input.sample_x(misses[j]);
+    SdfCpuOutputRef exact = eval_points(_evaluator, _expr, pts, SdfEvalMode::Gradient);
+    for (size_t j = 0; j < misses.size(); ++j) {
+        output->sdf_x[misses[j]]    = exact->sdf_x[j];
+        output->normal_x[misses[j]] = exact->normal_x[j];
+    }
+    return output;
+}
+
+} // namespace stereo
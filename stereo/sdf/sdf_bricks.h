@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stereo/sdf/sdf_cpu_eval.h>
+
+// A baked, sparse cache of SDF values, for expressions which are queried many times
+// without changing.
+//
+// The region of interest is divided into bricks of `BrickSize^3` voxels. Only the
+// bricks within a narrow band of the surface are allocated; they are found by
+// descending an implicit octree, discarding any cell which the SDF proves to be
+// farther than the band (as in sdf_mesh.h). Each allocated brick stores the exact
+// SDF at its lattice points, plus a one-sample apron on each side, so that both
+// trilinear and tricubic reconstruction can read from a single brick. Bricks live
+// contiguously in one pool, indexed by a hash of their brick coordinates.
+//
+// A query inside the band costs one hash lookup and 8 (trilinear) or 64 (tricubic)
+// reads from a single brick, independent of the size of the expression. Queries which
+// miss every brick fall back to evaluating the tape.
+//
+// Each brick records the largest difference between its reconstruction and the exact
+// SDF, measured at the centers of its voxels when baking. This is an estimate of the
+// brick's error, not a bound: the error between the measured points may be larger.
+// Every point of a brick is within half a voxel diagonal of a measured point, and both
+// the SDF and its reconstruction change by at most their Lipschitz constants per unit
+// distance, so adding `(1 + K) * L * h * sqrt(3) / 2` to the measured error bounds it,
+// where `L` is the tape's `sdf_lipschitz()`, `h` the voxel size, and `K * L` bounds
+// the gradient of the reconstruction from samples of an `L`-Lipschitz function.
+
+namespace stereo {
+
+enum struct SdfBrickFilter {
+    /// 8 samples per query; continuous values, piecewise-constant gradient.
+    Trilinear,
+    /// 64 samples per query (Catmull-Rom); continuous values and gradient.
+    Tricubic,
+};
+
+struct SdfBrickOptions {
+    /// Region to bake. Queries outside it are always evaluated exactly.
+    range3         region;
+    /// Edge length of a voxel.
+    float          voxel_size = 1.f / 64;
+    /// Bricks are allocated wherever they may come within this distance of the surface.
+    float          band       = 1.f / 16;
+    SdfBrickFilter filter     = SdfBrickFilter::Trilinear;
+};
+
+/**
+ * @brief A narrow-band sparse brick cache of an SDF expression.
+ *
+ * The expression must not depend on its parameter variations; the first variation
+ * is baked.
+ */
+struct SdfBrickCache {
+    /// Number of voxels along each edge of a brick.
+    static constexpr uint32_t BrickSize   = 8;
+    /// Number of samples stored along each edge of a brick, including the apron.
+    static constexpr uint32_t BrickStride = BrickSize + 3;
+    static constexpr uint32_t BrickVolume = BrickStride * BrickStride * BrickStride;
+
+private:
+    SdfCpuExpr                   _expr;
+    SdfCpuEvaluator              _evaluator;
+    SdfBrickOptions              _opts;
+    vec3ui                       _n_bricks;
+    DenseMap<uint64_t, uint32_t> _index;
+    std::vector<float>           _pool;
+    std::vector<float>           _error;
+    float                        _margin; // error bound less the measured error
+
+    // the measured error of the brick containing `p`, or null if it isn't cached
+    const float* _brick_error(const vec3& p) const;
+
+public:
+
+    /// Bake `expr` in parallel, using `evaluator`.
+    SdfBrickCache(
+        SdfCpuExpr expr,
+        const SdfBrickOptions& opts,
+        const SdfCpuEvaluator& evaluator=SdfCpuEvaluator()
+    );
+
+    const SdfBrickOptions& options() const { return _opts; }
+
+    /// Number of allocated bricks.
+    size_t n_bricks()     const { return _error.size(); }
+    /// Memory used by the brick pool and its index, in bytes.
+    size_t memory_bytes() const;
+
+    /// Estimated reconstruction error of the brick containing `p` (the largest error
+    /// measured at its voxel centers; not a bound), or zero if `p` is not cached.
+    float error_estimate(const vec3& p) const;
+    /// Largest estimated reconstruction error over all bricks.
+    float max_error() const;
+    /// A bound on the reconstruction error at any point of the brick containing `p`,
+    /// or zero if `p` is not cached. (As for `sdf_lipschitz()`, repetitions are
+    /// assumed not to cut their child at a cell boundary.)
+    float error_bound(const vec3& p) const;
+    /// The largest `error_bound()` over all bricks.
+    float max_error_bound() const;
+
+    /**
+     * @brief Reconstruct the SDF and its gradient at `p` from the cache.
+     *
+     * Returns false, writing nothing, if `p` is not in an allocated brick.
+     */
+    bool sample(const vec3& p, float* f, vec3* grad) const;
+
+    /**
+     * @brief Evaluate the SDF at every sample of `input`.
+     *
+     * Fills `sdf_x` and `normal_x` of the output, in the same layout as
+     * `SdfCpuEvaluator::evaluate()` with a single variation. Samples outside the
+     * cache are evaluated from the tape. The tangents (`*_dx`) are not computed.
+     */
+    SdfCpuOutputRef evaluate(const SdfCpuInput& input, SdfCpuOutputRef output=nullptr) const;
+};
+
+} // namespace stereo
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <numeric>
+
+#include <stereo/sdf/sdf_bvh.h>
+#include <stereo/sdf/sdf_instances.h>
+#include <stereo/sdf/sdf_trimesh.h>
+
+namespace stereo {
+
+namespace {
+
+// bounds are only used for culling, so they're computed from the primal values
+float value(float x)              { return x; }
+float value(const Dual<float>& x) { return x.x; }
+
+float length(const vec3& v) {
+    return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+vec3 cross(const vec3& a, const vec3& b) {
+    return {
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x,
+    };
+}
+
+} // namespace
+
+
+SdfBound sdf_bound_union(const SdfBound& a, const SdfBound& b) {
+    vec3  v = b.center - a.center;
+    float d = length(v);
+    if (d + b.radius <= a.radius) return a;
+    if (d + a.radius <= b.radius) return b;
+    float r = (d + a.radius + b.radius) / 2;
+    return {a.center + v * ((r - a.radius) / d), r};
+}
+
+SdfBound sdf_bound_transform(const SdfBound& b, const float xf[7]) {
+    vec3  u(xf[0], xf[1], xf[2]);
+    float w = xf[3];
+    vec3  t(xf[4], xf[5], xf[6]);
+    // (the same rotation as `qrot()` in quat.wgsl)
+    vec3 c = cross(u, b.center) * 2.f;
+    return {b.center + c * w + cross(u, c) + t, b.radius};
+}
+
+template <typename T>
+std::optional<SdfBound> sdf_node_bound(
+        const SdfNode<T>&       node,
+        std::optional<SdfBound> a,
+        std::optional<SdfBound> b)
+{
+    const T* ps = node.params();
+    auto x = [&](size_t i) { return value(ps[i]); };
+    auto v = [&](size_t i) { return vec3(x(i), x(i + 1), x(i + 2)); };
+    if (node.variant() != SdfOpVariant::None and node.n_children() == 2) {
+        // a smooth blend may be nearer than either operand
+        return std::nullopt;
+    }
+    switch (node.op()) {
+        case SdfOp::Sphere: return SdfBound {v(0), x(3)};
+        case SdfOp::Box: {
+            vec3 lo = v(0);
+            vec3 hi = v(3);
+            return SdfBound {(lo + hi) / 2.f, length(hi - lo) / 2.f};
+        }
+        case SdfOp::Cylinder: {
+            float h = length(v(3) - v(0)) / 2.f;
+            return SdfBound {(v(0) + v(3)) / 2.f, std::sqrt(h * h + x(6) * x(6))};
+        }
+        case SdfOp::Capsule: {
+            return SdfBound {(v(0) + v(3)) / 2.f, length(v(3) - v(0)) / 2.f + x(6)};
+        }
+        case SdfOp::Triangle: {
+            vec3 c = (v(0) + v(3) + v(6)) / 3.f;
+            float r = std::max({length(v(0) - c), length(v(3) - c), length(v(6) - c)});
+            return SdfBound {c, r};
+        }
+        case SdfOp::Mesh: {
+            size_t k = sdf_mesh_node_param(0);
+            return SdfBound {v(k + 8), x(k + 11)};
+        }
+        // the union and xor are at least the nearer operand, and the intersection and
+        // difference at least their first
+        case SdfOp::Union:
+        case SdfOp::Xor:
+            if (a and b) return sdf_bound_union(*a, *b);
+            return std::nullopt;
+        case SdfOp::Intersect:
+            if (a and b) return a->radius <= b->radius ? a : b;
+            return a ? a : b;
+        case SdfOp::Subtract: return a;
+        case SdfOp::Dilate:
+        case SdfOp::Shell:
+            if (a) a->radius = std::max(a->radius + x(0), 0.f);
+            return a;
+        // domain ops: the union of the images of the child's bound
+        case SdfOp::Transform: {
+            if (not a) return a;
+            float xf[7];
+            for (size_t k = 0; k < 7; ++k) xf[k] = x(k);
+            return sdf_bound_transform(*a, xf);
+        }
+        case SdfOp::Repeat: {
+            if (not a) return a;
+            vec3 period = v(0);
+            vec3 lo     = v(3);
+            vec3 hi     = v(6);
+            vec3 extent;
+            for (size_t k = 0; k < 3; ++k) {
+                a->center[k] += (lo[k] + hi[k]) / 2.f * period[k];
+                extent[k]     = (hi[k] - lo[k]) / 2.f * period[k];
+            }
+            a->radius += length(extent);
+            return a;
+        }
+        case SdfOp::Mirror: {
+            if (not a) return a;
+            vec3  n = v(0);
+            float s = a->center.x * n.x + a->center.y * n.y + a->center.z * n.z + x(3);
+            return sdf_bound_union(*a, {a->center - n * (2.f * s), a->radius});
+        }
+        case SdfOp::RotSym: {
+            // the copies lie on a circle about the axis
+            if (not a) return a;
+            size_t axis = node.variant() == SdfOpVariant::XAxis ? 0
+                        : node.variant() == SdfOpVariant::YAxis ? 1
+                        : 2;
+            vec3 c(0.f, 0.f, 0.f);
+            c[axis] = a->center[axis];
+            return SdfBound {c, length(a->center - c) + a->radius};
+        }
+        case SdfOp::Instances: {
+            size_t k = sdf_instance_node_param(sdf_instance_count(node.n_params()), 0);
+            return SdfBound {v(k), x(k + 3)};
+        }
+        default: return std::nullopt;
+    }
+}
+
+std::vector<uint32_t> sdf_bvh_order(const std::vector<SdfBound>& leaves) {
+    std::vector<uint32_t> order(leaves.size());
+    std::iota(order.begin(), order.end(), 0);
+    // the split point must be the midpoint of the range, to match the layout
+    auto split = [&](auto& self, size_t b, size_t e) -> void {
+        if (e - b <= 1) return;
+        vec3 lo = leaves[order[b]].center;
+        vec3 hi = lo;
+        for (size_t i = b + 1; i < e; ++i) {
+            const vec3& c = leaves[order[i]].center;
+            for (size_t a = 0; a < 3; ++a) {
+                lo[a] = std::min(lo[a], c[a]);
+                hi[a] = std::max(hi[a], c[a]);
+            }
+        }
+        size_t axis = 0;
+        for (size_t a = 1; a < 3; ++a) {
+            if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+        }
+        size_t mid = (b + e) / 2;
+        std::nth_element(
+            order.begin() + b,
+            order.begin() + mid,
+            order.begin() + e,
+            [&](uint32_t i, uint32_t j) { return leaves[i].center[axis] < leaves[j].center[axis]; }
+        );
+        self(self, b, mid);
+        self(self, mid, e);
+    };
+    split(split, 0, leaves.size());
+    return order;
+}
+
+std::vector<SdfBound> sdf_bvh_fit(const std::vector<SdfBound>& leaves) {
+    size_t n = leaves.size();
+    if (n == 0) return {};
+    std::vector<SdfBound> nodes(sdf_bvh_nodes(n));
+    auto fit = [&](auto& self, size_t node, size_t b, size_t e) -> SdfBound {
+        if (e - b == 1) return nodes[node] = leaves[b];
+        size_t mid = (b + e) / 2;
+        return nodes[node] = sdf_bound_union(
+            self(self, node + 1, b, mid),
+            self(self, node + 2 * (mid - b), mid, e)
+        );
+    };
+    fit(fit, 0, 0, n);
+    return nodes;
+}
+
+// explicit template instantiation
+template std::optional<SdfBound> sdf_node_bound(const SdfNode<float>&, std::optional<SdfBound>, std::optional<SdfBound>);
+template std::optional<SdfBound> sdf_node_bound(const SdfNode<Dual<float>>&, std::optional<SdfBound>, std::optional<SdfBound>);
+
+} // namespace stereo
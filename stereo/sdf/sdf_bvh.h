@@ -0,0 +1,80 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include <stereo/sdf/sdf_structs.h>
+
+// Implicit bounding volume hierarchies of spheres, for culling unions of many bounded
+// subtrees (the instances of `SdfInstances`, and the operands of wide unions in a tape).
+//
+// If the surface of a subtree lies within a sphere `(c, r)`, and the subtree is a true
+// distance bound, then its value at `p` is at least `|p - c| - r`. (This holds inside
+// the surface as well as outside, and is preserved by the range ops and the rigid domain
+// ops). So a walk which visits the nodes nearest-first, and skips any node whose sphere
+// is farther from `p` than the nearest leaf found so far, finds the same minimum as the
+// full union, while visiting a number of leaves which grows with log(leaves).
+//
+// The hierarchy is implicit. Leaves are ordered so that every node covers a range
+// [b, e) of consecutive leaves, split at `(b + e) / 2`; the nodes are stored in
+// pre-order, so the children of node `i` are `i + 1` and `i + 2 * (mid - b)`. A
+// hierarchy over `n` leaves has `2n - 1` nodes, each stored as four parameters
+// (center, radius).
+//
+// Keep the layout in sync with sdf_eval.wgsl.
+
+namespace stereo {
+
+/// A sphere containing the surface of a subtree.
+struct SdfBound {
+    vec3  center;
+    float radius;
+};
+
+/// Parameters per node of a hierarchy.
+constexpr size_t SdfBvhNodeParams = 4;
+
+/// The number of nodes of a hierarchy over `n_leaves` leaves.
+inline size_t sdf_bvh_nodes(size_t n_leaves) {
+    return 2 * n_leaves - 1;
+}
+
+/// The smallest sphere containing both `a` and `b`.
+SdfBound sdf_bound_union(const SdfBound& a, const SdfBound& b);
+
+/// `b`, moved by the rigid transform `xf` (a quaternion, then a translation: the seven
+/// parameters of a `Transform` op).
+SdfBound sdf_bound_transform(const SdfBound& b, const float xf[7]);
+
+/**
+ * @brief A sphere containing the surface of `node`, in the domain it's evaluated in,
+ * given the bounds `a` and `b` of its first two children (if it has them), if one is
+ * known.
+ *
+ * Bounds are found from the primal values of the parameters. Smooth blends, and ops
+ * without a known bound, have none.
+ */
+template <typename T>
+std::optional<SdfBound> sdf_node_bound(
+    const SdfNode<T>&       node,
+    std::optional<SdfBound> a,
+    std::optional<SdfBound> b
+);
+
+/**
+ * @brief The order in which to store the leaves with bounds `leaves` in a hierarchy.
+ *
+ * Leaves are split recursively at the median of their centers along the longest axis.
+ * Element `s` of the result is the index of the leaf stored in position `s`.
+ */
+std::vector<uint32_t> sdf_bvh_order(const std::vector<SdfBound>& leaves);
+
+/**
+ * @brief Fit the nodes of a hierarchy bottom-up.
+ *
+ * `leaves` are the bounds of the leaves, in hierarchy order; the bounds of the nodes
+ * are returned in pre-order.
+ */
+std::vector<SdfBound> sdf_bvh_fit(const std::vector<SdfBound>& leaves);
+
+} // namespace stereo
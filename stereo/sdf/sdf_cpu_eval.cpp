@@ -0,0 +1,1253 @@
+#include <stereo/sdf/sdf_cpu_eval.h>
+#include <stereo/sdf/sdf_cpu_math.h>
+#include <stereo/sdf/sdf_instances.h>
+#include <stereo/util/parallel.h>
+
+#include <array>
+#include <numeric>
+
+namespace stereo {
+
+using simd::Lanes;
+using simd::Quat;
+using simd::ParamBlock;
+using simd::SdfDomain;
+using simd::SdfRange;
+using simd::Vec3;
+
+namespace {
+
+constexpr size_t W = SdfCpuEvaluator::BatchWidth;
+
+using LaneF  = Lanes<float, W>;
+using LaneD  = simd::Dual<LaneF>;
+template <size_t K>
+using LaneDN = simd::DualN<LaneF, K>;
+
+// the number of tangents carried by a number type
+template <typename N>
+constexpr size_t Tangents = 0;
+template <>
+constexpr size_t Tangents<LaneD> = 1;
+template <size_t K>
+constexpr size_t Tangents<LaneDN<K>> = K;
+
+LaneF& tangent(LaneD& a, size_t) { return a.dx; }
+template <size_t K>
+LaneF& tangent(LaneDN<K>& a, size_t k) { return a.dx[k]; }
+
+// a run of samples (indices into the sorted sample order) which share a tile
+struct SdfBatch {
+    gpu_size_t tile;
+    gpu_size_t begin;
+    gpu_size_t end;
+};
+
+// the ops and parameters which a batch runs
+struct BatchTape {
+    const SdfGpuOp* ops;
+    size_t          n_ops;
+    ParamBlock      params;
+};
+
+constexpr float Inf = std::numeric_limits<float>::infinity();
+
+template <typename N>
+struct TapeStacks {
+    std::vector<SdfDomain<N>>   p;
+    std::vector<SdfRange<N>>    f;
+    SdfRange<N>                 slots[SdfTape::MaxSlots];
+    // for running the child of an `Instances` op, or the operands of a `BvhUnion`
+    std::unique_ptr<TapeStacks> inner;
+};
+
+template <bool Grad, typename N>
+SdfRange<N> eval_tape(
+        const SdfGpuOp*     ops,
+        size_t              begin,
+        size_t              end,
+        ParamBlock          params,
+        const SdfDomain<N>& x,
+        TapeStacks<N>&      stacks);
+
+// the values of the range ops, without their gradients, selecting exactly as
+// `sdf_union()` etc. do
+
+LaneF union_x(const LaneF& a, const LaneF& b) { return simd::select(a, b, a > b); }
+LaneF inter_x(const LaneF& a, const LaneF& b) { return simd::select(a, b, a < b); }
+LaneF sub_x  (const LaneF& a, const LaneF& b) { return simd::select(a, -b, a < -b); }
+
+// the index of the `PopDomain` op which closes the domain pushed by `ops[i]`
+size_t find_pop(const SdfGpuOp* ops, size_t i, size_t end) {
+    for (size_t j = i + 1; j < end; ++j) {
+        if (ops[j].op == SdfOp::PopDomain and ops[j].push_index == i) return j;
+    }
+    return end;
+}
+
+/**
+ * Walk the hierarchy of spheres (see sdf_bvh.h) over `n` leaves, whose nodes are
+ * `nodes`, nearest-first, and call `leaf(k, best)` for each leaf `k` which may be
+ * nearer to `x` than `best`, the union of the leaves visited so far. `leaf` unions its
+ * value into `best`. Since the samples of a batch share a walk, a node is visited if it
+ * may hold a nearer leaf for any of them.
+ */
+template <typename N, typename Leaf>
+SdfRange<N> walk_bvh(ParamBlock nodes, size_t n, const SdfDomain<N>& x, Leaf&& leaf) {
+    using S = std::decay_t<decltype(simd::primal(std::declval<N>()))>;
+    struct Visit {
+        uint32_t node;
+        uint32_t b; // the leaves [b, e) under the node
+        uint32_t e;
+    };
+    Vec3<S> p = primal(x.p);
+    // lower bound on the distance to anything under `node`
+    auto node_dist = [&](uint32_t node) {
+        size_t k = SdfBvhNodeParams * node;
+        return S(length(p - nodes.vec3<S>(k)) - nodes.scalar<float>(k + 3));
+    };
+
+    SdfRange<N> best {N(Inf), {N(0.f), N(0.f), N(0.f)}};
+    // (the walk holds at most one pending sibling per level of the hierarchy)
+    Visit todo[64];
+    size_t n_todo = 0;
+    todo[n_todo++] = {0, 0, (uint32_t) n};
+    while (n_todo > 0) {
+        Visit v = todo[--n_todo];
+        if (not simd::any(node_dist(v.node) < primal(best.f))) continue;
+        if (v.e - v.b == 1) {
+            leaf(v.b, best);
+        } else {
+            uint32_t mid = (v.b + v.e) / 2;
+            Visit l {v.node + 1, v.b, mid};
+            Visit r {v.node + 2 * (mid - v.b), mid, v.e};
+            // visit the nearer child first
+            if (simd::any(node_dist(l.node) < node_dist(r.node))) std::swap(l, r);
+            todo[n_todo++] = l;
+            todo[n_todo++] = r;
+        }
+    }
+    return best;
+}
+
+/**
+ * Evaluate the `Instances` op `ops[i]` (whose child is `ops(i, pop)`) by walking its
+ * hierarchy. If not `Grad`, the gradient of the result is left unset.
+ *
+ * If `nearest` is not null, it receives the index of the nearest instance (in hierarchy
+ * order) for each sample, as a float.
+ */
+template <bool Grad, typename N, typename S = std::decay_t<decltype(simd::primal(std::declval<N>()))>>
+SdfRange<N> eval_instances(
+        const SdfGpuOp*     ops,
+        size_t              i,
+        size_t              pop,
+        ParamBlock          params,
+        const SdfDomain<N>& x,
+        TapeStacks<N>&      stacks,
+        S*                  nearest=nullptr)
+{
+    const SdfGpuOp& op = ops[i];
+    ParamBlock ps = params.at(op.param_start);
+    size_t n = sdf_instance_count(op.param_end - op.param_start);
+    size_t k_nodes = sdf_instance_node_param(n, 0);
+    if (not stacks.inner) stacks.inner = std::make_unique<TapeStacks<N>>();
+
+    S best_index(0.f);
+    SdfRange<N> best = walk_bvh(
+        ps.at(k_nodes),
+        n,
+        x,
+        [&](uint32_t j, SdfRange<N>& best) {
+            size_t  k = sdf_instance_xf_param(j);
+            Quat<N> q = ps.quat<N>(k);
+            SdfDomain<N> y = simd::sdf_transform(q, ps.vec3<N>(k + 4), x);
+            SdfRange<N>  f = eval_tape<Grad>(ops, i + 1, pop, params, y, *stacks.inner);
+            if constexpr (Grad) f = simd::sdf_untransform(q, f);
+            best_index = simd::select(best_index, S((float) j), primal(f.f) < primal(best.f));
+            best       = simd::sdf_union(best, f);
+        }
+    );
+    if (nearest) *nearest = best_index;
+    return best;
+}
+
+// evaluate the `BvhUnion` op `ops[i]` by walking its hierarchy, running each operand
+// the walk reaches
+template <bool Grad, typename N>
+SdfRange<N> eval_bvh_union(
+        const SdfGpuOp*     ops,
+        size_t              i,
+        ParamBlock          params,
+        const SdfDomain<N>& x,
+        TapeStacks<N>&      stacks)
+{
+    const SdfGpuOp& op = ops[i];
+    if (not stacks.inner) stacks.inner = std::make_unique<TapeStacks<N>>();
+    return walk_bvh(
+        params.at(op.param_start),
+        sdf_bvh_count(op),
+        x,
+        [&](uint32_t k, SdfRange<N>& best) {
+            size_t b = sdf_bvh_operand(ops, i, k);
+            size_t e = sdf_bvh_operand(ops, i, k + 1);
+            // (the operand may have been pruned)
+            if (b < e) best = simd::sdf_union(best, eval_tape<Grad>(ops, b, e, params, x, *stacks.inner));
+        }
+    );
+}
+
+/**
+ * Run the tape `ops[begin, end)` over one batch of samples. This mirrors `sdf_eval_ops()`
+ * in sdf_eval.wgsl; keep the two in sync.
+ *
+ * If not `Grad`, only values are computed: the gradients on the stack are left unset,
+ * and the ops which only transform a gradient are skipped.
+ */
+template <bool Grad, typename N>
+SdfRange<N> eval_tape(
+        const SdfGpuOp*     ops,
+        size_t              begin,
+        size_t              end,
+        ParamBlock          params,
+        const SdfDomain<N>& x,
+        TapeStacks<N>&      stacks)
+{
+    std::vector<SdfDomain<N>>& p_stack   = stacks.p;
+    std::vector<SdfRange<N>>&  f_p_stack = stacks.f;
+    p_stack.clear();
+    f_p_stack.clear();
+    p_stack.push_back(x);
+    for (size_t i = begin; i < end; ++i) {
+        SdfGpuOp op = ops[i];
+        bool is_pop = false;
+        if (op.op == SdfOp::PopDomain) {
+            p_stack.pop_back();
+            op     = ops[op.push_index];
+            is_pop = true;
+        }
+        ParamBlock ps = params.at(op.param_start);
+        const SdfDomain<N>& p = p_stack.back();
+        switch (op.op) {
+            // range operations
+            case SdfOp::Union:
+            case SdfOp::Intersect:
+            case SdfOp::Subtract:
+            case SdfOp::Xor: {
+                SdfRange<N> f_b = f_p_stack.back();
+                f_p_stack.pop_back();
+                SdfRange<N>& f_a = f_p_stack.back();
+                if constexpr (Grad) {
+                    switch (op.op) {
+                        case SdfOp::Union:     f_a = sdf_union(f_a, f_b);        break;
+                        case SdfOp::Intersect: f_a = sdf_intersection(f_a, f_b); break;
+                        case SdfOp::Subtract:  f_a = sdf_subtract(f_a, f_b);     break;
+                        default:               f_a = sdf_xor(f_a, f_b);          break;
+                    }
+                } else {
+                    switch (op.op) {
+                        case SdfOp::Union:     f_a.f = union_x(f_a.f, f_b.f); break;
+                        case SdfOp::Intersect: f_a.f = inter_x(f_a.f, f_b.f); break;
+                        case SdfOp::Subtract:  f_a.f = sub_x  (f_a.f, f_b.f); break;
+                        default: {
+                            f_a.f = sub_x(union_x(f_a.f, f_b.f), inter_x(f_a.f, f_b.f));
+                        } break;
+                    }
+                }
+            } break;
+            case SdfOp::Dilate: {
+                f_p_stack.back() = sdf_dilate(f_p_stack.back(), ps.scalar<N>(0));
+            } break;
+            case SdfOp::Shell: {
+                SdfRange<N>& f = f_p_stack.back();
+                if constexpr (Grad) {
+                    f = sdf_shell(f, ps.scalar<N>(0));
+                } else {
+                    f.f = simd::abs(f.f) - ps.scalar<N>(0);
+                }
+            } break;
+            // value slots
+            case SdfOp::Store: {
+                stacks.slots[op.slot] = f_p_stack.back();
+            } break;
+            case SdfOp::Load: {
+                f_p_stack.push_back(stacks.slots[op.slot]);
+            } break;
+            // domain operations
+            case SdfOp::Transform:
+            case SdfOp::Repeat:
+            case SdfOp::Mirror:
+            case SdfOp::RotSym: {
+                if (is_pop) {
+                    // `p` is the outer domain again. (a pop only changes the gradient)
+                    if constexpr (Grad) {
+                        f_p_stack.back() = simd::sdf_pop_domain(op.op, op.variant, ps, p, f_p_stack.back());
+                    }
+                } else {
+                    // (`p` refers into the stack, so don't push until we're done with it)
+                    SdfDomain<N> x_p;
+                    simd::sdf_push_domain(op.op, op.variant, ps, p, x_p);
+                    p_stack.push_back(x_p);
+                }
+            } break;
+            case SdfOp::Instances: {
+                // the child is run once per instance visited, so its ops (and the
+                // closing pop) are skipped here
+                size_t pop = find_pop(ops, i, end);
+                f_p_stack.push_back(eval_instances<Grad>(ops, i, pop, params, p, stacks));
+                i = pop;
+            } break;
+            case SdfOp::BvhUnion: {
+                // likewise, the operands are run as the walk reaches them
+                f_p_stack.push_back(eval_bvh_union<Grad>(ops, i, params, p, stacks));
+                i = sdf_bvh_operand(ops, i, sdf_bvh_count(op)) - 1;
+            } break;
+            // shapes
+            default: {
+                SdfRange<N> f;
+                bool is_shape;
+                if constexpr (Grad) {
+                    is_shape = simd::sdf_shape(op.op, ps, p, f);
+                } else {
+                    is_shape = simd::sdf_shape_value(op.op, ps, p, f.f);
+                }
+                if (is_shape) {
+                    f_p_stack.push_back(f);
+                }
+                // otherwise: not implemented yet
+            } break;
+        }
+    }
+    return f_p_stack.back();
+}
+
+// evaluate `tape` at the `n <= W` samples `sample_index[0, n)`, and write them to `out`,
+// offset by `out_begin`. `N` is `LaneD` to evaluate tangents, `LaneDN<K>` to evaluate
+// `K` tangents (the first `n_tangents` of which are written to successive variations
+// from `out_begin` on), or `LaneF` not to; only values are found unless `Grad`.
+template <typename N, bool Grad>
+void eval_batch(
+        const BatchTape&    tape,
+        const SdfCpuInput&  input,
+        const gpu_size_t*   sample_index,
+        size_t              n,
+        SdfCpuOutput&       out,
+        size_t              out_begin,
+        size_t              n_tangents,
+        TapeStacks<N>&      stacks)
+{
+    constexpr size_t K = Tangents<N>;
+    // gather the batch into SoA lanes. a partial batch repeats its last sample.
+    // every tangent direction starts from the sample's tangent.
+    SdfDomain<N> x;
+    for (size_t i = 0; i < W; ++i) {
+        size_t j = sample_index[std::min(i, n - 1)];
+        vec3 p = input.sample_x(j);
+        if constexpr (K > 0) {
+            vec3 dp = input.sample_dx(j);
+            x.p.x.x[i] = p.x;
+            x.p.y.x[i] = p.y;
+            x.p.z.x[i] = p.z;
+            for (size_t k = 0; k < K; ++k) {
+                tangent(x.p.x, k)[i] = dp.x;
+                tangent(x.p.y, k)[i] = dp.y;
+                tangent(x.p.z, k)[i] = dp.z;
+            }
+        } else {
+            x.p.x[i] = p.x;
+            x.p.y[i] = p.y;
+            x.p.z[i] = p.z;
+        }
+    }
+
+    SdfRange<N> r = eval_tape<Grad>(tape.ops, 0, tape.n_ops, tape.params, x, stacks);
+
+    // scatter the results
+    size_t n_samples = input.n_samples_x();
+    for (size_t i = 0; i < n; ++i) {
+        size_t k = out_begin + sample_index[i];
+        if constexpr (K > 0) {
+            vec3 normal(r.grad_f.x.x[i], r.grad_f.y.x[i], r.grad_f.z.x[i]);
+            for (size_t t = 0; t < n_tangents; ++t, k += n_samples) {
+                out.sdf_x[k]     = r.f.x[i];
+                out.sdf_dx[k]    = tangent(r.f, t)[i];
+                out.normal_x[k]  = normal;
+                out.normal_dx[k] = vec3(
+                    tangent(r.grad_f.x, t)[i],
+                    tangent(r.grad_f.y, t)[i],
+                    tangent(r.grad_f.z, t)[i]
+                );
+            }
+        } else {
+            out.sdf_x[k] = r.f[i];
+            if constexpr (Grad) {
+                out.normal_x[k] = vec3(r.grad_f.x[i], r.grad_f.y[i], r.grad_f.z[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Evaluate the batches of the variations `[v_begin, v_end)` in parallel, with the
+ * interpreter of `eval_batch<N, Grad>()`. `tape(v, batch)` gives the `BatchTape` which
+ * `batch` runs for variation `v` (a copy of the parameters, or an expression of a
+ * batch). A batch never straddles two variations, so that the tape and parameters are
+ * uniform over it; except that a `LaneDN<K>` runs K variations at once (the last pass
+ * possibly fewer), which must differ only in their parameter tangents.
+ */
+template <typename N, bool Grad, typename F>
+void eval_batches(
+        F&&                            tape,
+        const SdfCpuInput&             input,
+        const std::vector<gpu_size_t>& order,
+        const std::vector<SdfBatch>&   batches,
+        size_t                         v_begin,
+        size_t                         v_end,
+        SdfCpuOutput&                  out,
+        size_t                         n_threads)
+{
+    constexpr size_t Step = std::max<size_t>(1, Tangents<N>);
+    size_t n_samples = input.n_samples_x();
+    size_t batches_per_variation = batches.size();
+    size_t n_batches = batches_per_variation * ((v_end - v_begin + Step - 1) / Step);
+    size_t grain     = std::max<size_t>(1, n_batches / (n_threads * 8));
+    parallel_for(
+        n_batches,
+        grain,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            TapeStacks<N> stacks;
+            for (size_t b = begin; b < end; ++b) {
+                size_t v = v_begin + Step * (b / batches_per_variation);
+                const SdfBatch& batch = batches[b % batches_per_variation];
+                eval_batch<N, Grad>(
+                    tape(v, batch),
+                    input,
+                    order.data() + batch.begin,
+                    batch.end - batch.begin,
+                    out,
+                    v * n_samples,
+                    std::min(Step, v_end - v),
+                    stacks
+                );
+            }
+        },
+        n_threads
+    );
+}
+
+// reverse mode
+
+// the largest number of parameters of any op
+constexpr size_t MaxOpParams = 16;
+
+// `UnitSeeds + MaxOpParams - j` is a tangent which is 1 for parameter `j` and 0 for
+// all the others; `UnitSeeds` itself is zero for all parameters.
+constexpr std::array<float, 2 * MaxOpParams> UnitSeeds = [] {
+    std::array<float, 2 * MaxOpParams> e {};
+    e[MaxOpParams] = 1;
+    return e;
+}();
+
+// the primal state needed to differentiate one op, recorded on the forward pass
+struct OpRecord {
+    SdfDomain<LaneF> p; // the domain the op is evaluated in
+    LaneF            a; // the primal values of the op's operands (for `Instances`,
+    LaneF            b; // `a` is the index of each sample's nearest instance)
+};
+
+struct AdjointStacks {
+    // forward
+    std::vector<SdfDomain<LaneF>> p;
+    std::vector<LaneF>            f;
+    LaneF                         slots[SdfTape::MaxSlots];
+    std::vector<OpRecord>         record;
+    TapeStacks<LaneF>             instances;
+    // (op index, record index) of each union of an operand of a `BvhUnion` into those
+    // before it, made before running the op
+    std::vector<std::pair<size_t, size_t>> joins;
+    // backward
+    std::vector<Vec3<LaneF>>      p_adj;
+    std::vector<LaneF>            f_adj;
+    LaneF                         slot_adj[SdfTape::MaxSlots];
+};
+
+// a dual copy of `x`, with the tangent along axis `axis` (or none, if `axis > 2`)
+SdfDomain<LaneD> seed_domain(const SdfDomain<LaneF>& x, size_t axis) {
+    LaneF zero(0.f);
+    LaneF one(1.f);
+    return {{
+        {x.p.x, axis == 0 ? one : zero},
+        {x.p.y, axis == 1 ? one : zero},
+        {x.p.z, axis == 2 ? one : zero},
+    }};
+}
+
+// the transforms of the instances `index` (one per sample) of the `Instances` op with
+// parameters `x`, with a tangent of 1 on transform parameter `seed` (if `seed < 7`)
+std::pair<Quat<LaneD>, Vec3<LaneD>> gather_instances(const float* x, const LaneF& index, size_t seed) {
+    LaneD v[7];
+    for (size_t k = 0; k < 7; ++k) {
+        for (size_t l = 0; l < W; ++l) {
+            v[k].x[l] = x[sdf_instance_xf_param((size_t) index[l]) + k];
+        }
+        v[k].dx = LaneF(k == seed ? 1.f : 0.f);
+    }
+    return {{v[0], v[1], v[2], v[3]}, {v[4], v[5], v[6]}};
+}
+
+/**
+ * Run the tape `ops[0, n_ops)` over one batch of samples, keeping only primal values,
+ * and record what `adjoint_tape()` will need.
+ */
+void record_tape(
+        const SdfGpuOp*         ops,
+        size_t                  n_ops,
+        ParamBlock              params,
+        const SdfDomain<LaneF>& x,
+        AdjointStacks&          st)
+{
+    st.p.clear();
+    st.f.clear();
+    st.joins.clear();
+    st.record.resize(n_ops);
+    st.p.push_back(x);
+    // the operands of a `BvhUnion` are all run, in order, and each is unioned into those
+    // before it as it ends. (only the nearest contributes to the gradient, but a batch
+    // may need any of them). the union is recorded at the operand's entry in the table.
+    size_t bvh  = n_ops; // the enclosing `BvhUnion`, if any
+    size_t k    = 0;     // the operand being run
+    bool   have = false; // whether any operand before it left a value
+    for (size_t i = 0; i <= n_ops; ++i) {
+        while (bvh < n_ops and k < sdf_bvh_count(ops[bvh]) and
+               i == sdf_bvh_operand(ops, bvh, k + 1))
+        {
+            if (sdf_bvh_operand(ops, bvh, k) < i) {
+                if (have) {
+                    size_t j = bvh + 1 + k;
+                    OpRecord& r = st.record[j];
+                    r.b = st.f.back();
+                    st.f.pop_back();
+                    r.a = st.f.back();
+                    st.f.back() = union_x(r.a, r.b);
+                    st.joins.push_back({i, j});
+                }
+                have = true;
+            }
+            k += 1;
+        }
+        if (i == n_ops) break;
+        SdfGpuOp op = ops[i];
+        if (op.op == SdfOp::PopDomain) {
+            // the value is unchanged; only its gradient is transformed
+            st.p.pop_back();
+            continue;
+        }
+        ParamBlock ps {params.x + op.param_start, params.dx + op.param_start};
+        OpRecord& r = st.record[i];
+        r.p = st.p.back();
+        switch (op.op) {
+            case SdfOp::Union:
+            case SdfOp::Intersect:
+            case SdfOp::Subtract:
+            case SdfOp::Xor: {
+                r.b = st.f.back();
+                st.f.pop_back();
+                r.a = st.f.back();
+                switch (op.op) {
+                    case SdfOp::Union:     st.f.back() = union_x(r.a, r.b); break;
+                    case SdfOp::Intersect: st.f.back() = inter_x(r.a, r.b); break;
+                    case SdfOp::Subtract:  st.f.back() = sub_x  (r.a, r.b); break;
+                    default: {
+                        st.f.back() = sub_x(union_x(r.a, r.b), inter_x(r.a, r.b));
+                    } break;
+                }
+            } break;
+            case SdfOp::Dilate: {
+                r.a = st.f.back();
+                st.f.back() = r.a - ps.scalar<LaneF>(0);
+            } break;
+            case SdfOp::Shell: {
+                r.a = st.f.back();
+                st.f.back() = simd::abs(r.a) - ps.scalar<LaneF>(0);
+            } break;
+            case SdfOp::Store: {
+                st.slots[op.slot] = st.f.back();
+            } break;
+            case SdfOp::Load: {
+                st.f.push_back(st.slots[op.slot]);
+            } break;
+            case SdfOp::Transform:
+            case SdfOp::Repeat:
+            case SdfOp::Mirror:
+            case SdfOp::RotSym: {
+                SdfDomain<LaneF> y;
+                simd::sdf_push_domain(op.op, op.variant, ps, r.p, y);
+                st.p.push_back(y);
+            } break;
+            case SdfOp::Instances: {
+                // only the nearest instance contributes to the value (and its gradient),
+                // so the child is recorded once, each sample in its nearest instance
+                size_t pop = find_pop(ops, i, n_ops);
+                eval_instances<false>(ops, i, pop, params, r.p, st.instances, &r.a);
+                auto [q, tx] = gather_instances(ps.x, r.a, 7);
+                SdfDomain<LaneD> y = simd::sdf_transform(q, tx, seed_domain(r.p, 3));
+                st.p.push_back({primal(y.p)});
+            } break;
+            case SdfOp::BvhUnion: {
+                bvh  = i;
+                k    = 0;
+                have = false;
+                // (skip the table of operands)
+                i = sdf_bvh_operand(ops, i, 0) - 1;
+            } break;
+            default: {
+                SdfRange<LaneF> f;
+                if (simd::sdf_shape(op.op, ps, r.p, f)) {
+                    st.f.push_back(f.f);
+                }
+            } break;
+        }
+    }
+}
+
+/**
+ * Sweep the tape recorded by `record_tape()` backwards, starting from the adjoint
+ * `d_loss` of its result, and add the adjoint of each parameter to `grad`.
+ *
+ * Only distances are differentiated: no op's value depends on a gradient, so the
+ * adjoints are scalars on the range stack, and 3-vectors on the domain stack.
+ * The local derivatives of shapes and transforms are found in forward mode, one
+ * input at a time.
+ */
+void adjoint_tape(
+        const SdfGpuOp* ops,
+        size_t          n_ops,
+        const float*    params_x,
+        const LaneF&    d_loss,
+        AdjointStacks&  st,
+        float*          grad)
+{
+    LaneF zero(0.f);
+    st.f_adj.clear();
+    st.p_adj.clear();
+    st.f_adj.push_back(d_loss);
+    st.p_adj.push_back({zero, zero, zero});
+    std::fill(st.slot_adj, st.slot_adj + SdfTape::MaxSlots, zero);
+    size_t n_joins = st.joins.size();
+    for (size_t i = n_ops; i-- > 0;) {
+        // the unions of the operands of a `BvhUnion` which ended after this op
+        while (n_joins > 0 and st.joins[n_joins - 1].first == i + 1) {
+            const OpRecord& r = st.record[st.joins[--n_joins].second];
+            LaneF g = st.f_adj.back();
+            auto take_b = r.a > r.b;
+            st.f_adj.back() = simd::select(g, zero, take_b);
+            st.f_adj.push_back(simd::select(zero, g, take_b));
+        }
+        SdfGpuOp op = ops[i];
+        if (op.op == SdfOp::PopDomain) {
+            // re-entering the domain pushed by `ops[op.push_index]`
+            st.p_adj.push_back({zero, zero, zero});
+            continue;
+        }
+        if (op.op == SdfOp::BvhUnion or op.op == SdfOp::BvhOperand) {
+            // (the operands were unioned in by the joins)
+            continue;
+        }
+        const OpRecord& r = st.record[i];
+        const float* x = params_x + op.param_start;
+        size_t n_params = op.param_end - op.param_start;
+        bool big_op = op.op == SdfOp::Instances or op.op == SdfOp::Mesh or op.op == SdfOp::VoxelGrid;
+        if (n_params > MaxOpParams and not big_op) {
+            std::cerr << "SDF op has too many parameters to differentiate ("
+                      << n_params << ")" << std::endl;
+            std::abort();
+        }
+        switch (op.op) {
+            case SdfOp::Union:
+            case SdfOp::Intersect:
+            case SdfOp::Subtract:
+            case SdfOp::Xor: {
+                LaneF g = st.f_adj.back();
+                LaneF g_a;
+                LaneF g_b;
+                switch (op.op) {
+                    case SdfOp::Union:
+                    case SdfOp::Intersect: {
+                        auto take_b = op.op == SdfOp::Union ? r.a > r.b : r.a < r.b;
+                        g_a = simd::select(g, zero, take_b);
+                        g_b = simd::select(zero, g, take_b);
+                    } break;
+                    case SdfOp::Subtract: {
+                        auto take_b = r.a < -r.b;
+                        g_a = simd::select(g, zero, take_b);
+                        g_b = simd::select(zero, -g, take_b);
+                    } break;
+                    default: {
+                        auto u_is_b = r.a > r.b;
+                        auto i_is_b = r.a < r.b;
+                        LaneF u = union_x(r.a, r.b);
+                        LaneF n = inter_x(r.a, r.b);
+                        auto take_n = u < -n;
+                        LaneF g_u = simd::select(g, zero, take_n);
+                        LaneF g_n = simd::select(zero, -g, take_n);
+                        g_a = simd::select(g_u, zero, u_is_b) + simd::select(g_n, zero, i_is_b);
+                        g_b = simd::select(zero, g_u, u_is_b) + simd::select(zero, g_n, i_is_b);
+                    } break;
+                }
+                st.f_adj.back() = g_a;
+                st.f_adj.push_back(g_b);
+            } break;
+            case SdfOp::Dilate: {
+                grad[op.param_start] -= simd::hsum(st.f_adj.back());
+            } break;
+            case SdfOp::Shell: {
+                LaneF& g = st.f_adj.back();
+                grad[op.param_start] -= simd::hsum(g);
+                g = simd::select(g, -g, r.a < 0.f);
+            } break;
+            case SdfOp::Store: {
+                // the stored value stayed on the stack, and was also loaded later
+                st.f_adj.back() += st.slot_adj[op.slot];
+                st.slot_adj[op.slot] = zero;
+            } break;
+            case SdfOp::Load: {
+                st.slot_adj[op.slot] += st.f_adj.back();
+                st.f_adj.pop_back();
+            } break;
+            case SdfOp::Transform:
+            case SdfOp::Repeat:
+            case SdfOp::Mirror:
+            case SdfOp::RotSym: {
+                Vec3<LaneF> g = st.p_adj.back();
+                st.p_adj.pop_back();
+                Vec3<LaneF>& g_outer = st.p_adj.back();
+                SdfDomain<LaneD> y;
+                // with respect to the op's parameters
+                SdfDomain<LaneD> x_outer = seed_domain(r.p, 3);
+                for (size_t j = 0; j < n_params; ++j) {
+                    ParamBlock ps {x, UnitSeeds.data() + MaxOpParams - j};
+                    simd::sdf_push_domain(op.op, op.variant, ps, x_outer, y);
+                    grad[op.param_start + j] += simd::hsum(
+                        g.x * y.p.x.dx + g.y * y.p.y.dx + g.z * y.p.z.dx
+                    );
+                }
+                // with respect to the outer domain
+                ParamBlock ps {x, UnitSeeds.data()};
+                LaneF* g_out[3] = {&g_outer.x, &g_outer.y, &g_outer.z};
+                for (size_t axis = 0; axis < 3; ++axis) {
+                    simd::sdf_push_domain(op.op, op.variant, ps, seed_domain(r.p, axis), y);
+                    *g_out[axis] += g.x * y.p.x.dx + g.y * y.p.y.dx + g.z * y.p.z.dx;
+                }
+            } break;
+            case SdfOp::Instances: {
+                Vec3<LaneF> g = st.p_adj.back();
+                st.p_adj.pop_back();
+                Vec3<LaneF>& g_outer = st.p_adj.back();
+                // with respect to the transform of each sample's nearest instance
+                SdfDomain<LaneD> x_outer = seed_domain(r.p, 3);
+                for (size_t j = 0; j < 7; ++j) {
+                    auto [q, tx] = gather_instances(x, r.a, j);
+                    SdfDomain<LaneD> y = simd::sdf_transform(q, tx, x_outer);
+                    LaneF d = g.x * y.p.x.dx + g.y * y.p.y.dx + g.z * y.p.z.dx;
+                    for (size_t l = 0; l < W; ++l) {
+                        grad[op.param_start + sdf_instance_xf_param((size_t) r.a[l]) + j] += d[l];
+                    }
+                }
+                // with respect to the outer domain
+                auto [q, tx] = gather_instances(x, r.a, 7);
+                LaneF* g_out[3] = {&g_outer.x, &g_outer.y, &g_outer.z};
+                for (size_t axis = 0; axis < 3; ++axis) {
+                    SdfDomain<LaneD> y = simd::sdf_transform(q, tx, seed_domain(r.p, axis));
+                    *g_out[axis] += g.x * y.p.x.dx + g.y * y.p.y.dx + g.z * y.p.z.dx;
+                }
+            } break;
+            case SdfOp::Mesh:
+            case SdfOp::VoxelGrid: {
+                // the parameters (vertices, or grid values) are not differentiable, so one
+                // evaluation gives the gradient with respect to the sample
+                SdfRange<LaneF> f;
+                simd::sdf_shape(op.op, ParamBlock {x, x}, r.p, f);
+                LaneF g = st.f_adj.back();
+                st.f_adj.pop_back();
+                Vec3<LaneF>& g_p = st.p_adj.back();
+                g_p.x += g * f.grad_f.x;
+                g_p.y += g * f.grad_f.y;
+                g_p.z += g * f.grad_f.z;
+            } break;
+            default: {
+                SdfRange<LaneD> f;
+                ParamBlock ps {x, UnitSeeds.data()};
+                // (unimplemented ops produced no value)
+                if (not simd::sdf_shape(op.op, ps, seed_domain(r.p, 0), f)) break;
+                LaneF g = st.f_adj.back();
+                st.f_adj.pop_back();
+                Vec3<LaneF>& g_p = st.p_adj.back();
+                g_p.x += g * f.f.dx;
+                simd::sdf_shape(op.op, ps, seed_domain(r.p, 1), f);
+                g_p.y += g * f.f.dx;
+                simd::sdf_shape(op.op, ps, seed_domain(r.p, 2), f);
+                g_p.z += g * f.f.dx;
+                SdfDomain<LaneD> x_d = seed_domain(r.p, 3);
+                for (size_t j = 0; j < n_params; ++j) {
+                    ParamBlock ps_j {x, UnitSeeds.data() + MaxOpParams - j};
+                    simd::sdf_shape(op.op, ps_j, x_d, f);
+                    grad[op.param_start + j] += simd::hsum(g * f.f.dx);
+                }
+            } break;
+        }
+    }
+}
+
+// accumulate the parameter gradient of the `n <= W` samples `sample_index[0, n)`
+// into `grad`
+void gradient_batch(
+        const SdfTile&      tile,
+        const SdfCpuExpr&   expr,
+        const SdfCpuInput&  input,
+        const float*        d_loss,
+        const gpu_size_t*   sample_index,
+        size_t              n,
+        AdjointStacks&      st,
+        float*              grad)
+{
+    // gather the batch. lanes past the end of a partial batch have no effect on the loss
+    SdfDomain<LaneF> x;
+    LaneF g(0.f);
+    for (size_t i = 0; i < W; ++i) {
+        size_t j = sample_index[std::min(i, n - 1)];
+        vec3 p = input.sample_x(j);
+        x.p.x[i] = p.x;
+        x.p.y[i] = p.y;
+        x.p.z[i] = p.z;
+        if (i < n) g[i] = d_loss[j];
+    }
+    const SdfGpuOp* ops = expr.tiled_tape().ops.data() + tile.op_begin;
+    size_t n_ops = tile.op_end - tile.op_begin;
+    ParamBlock params {expr.params_x().data(), expr.params_dx().data()};
+    record_tape(ops, n_ops, params, x, st);
+    adjoint_tape(ops, n_ops, expr.params_x().data(), g, st, grad);
+}
+
+// split the samples of `input` into batches of at most W samples, taken in the input's
+// order (into `order`). if `tiled` is not null, samples are also sorted by its tiles, so
+// that each batch runs a single tape; otherwise every batch is of tile 0.
+void make_batches(
+        const SdfTiledTape*      tiled,
+        const SdfCpuInput&       input,
+        std::vector<gpu_size_t>& order,
+        std::vector<SdfBatch>&   batches)
+{
+    size_t n_samples = input.n_samples_x();
+    const std::vector<gpu_size_t>& sorted = input.order();
+    order.resize(n_samples);
+    batches.clear();
+    if (tiled) {
+        size_t n_tiles = tiled->tiles.size();
+        std::vector<gpu_size_t> sample_tile(n_samples);
+        std::vector<gpu_size_t> tile_start(n_tiles + 1, 0);
+        for (size_t i = 0; i < n_samples; ++i) {
+            sample_tile[i] = tiled->tile_index(input.sample_x(i));
+            tile_start[sample_tile[i] + 1] += 1;
+        }
+        for (size_t t = 0; t < n_tiles; ++t) {
+            tile_start[t + 1] += tile_start[t];
+        }
+        // (a stable counting sort, which keeps the input's order within each tile)
+        std::vector<gpu_size_t> cursor(tile_start.begin(), tile_start.end() - 1);
+        for (size_t k = 0; k < n_samples; ++k) {
+            gpu_size_t i = sorted.empty() ? k : sorted[k];
+            order[cursor[sample_tile[i]]++] = i;
+        }
+        for (gpu_size_t t = 0; t < n_tiles; ++t) {
+            gpu_size_t tile_end = tile_start[t + 1];
+            for (gpu_size_t b = tile_start[t]; b < tile_end; b += W) {
+                batches.push_back({t, b, std::min<gpu_size_t>(b + W, tile_end)});
+            }
+        }
+    } else {
+        if (sorted.empty()) {
+            std::iota(order.begin(), order.end(), 0);
+        } else {
+            std::copy(sorted.begin(), sorted.end(), order.begin());
+        }
+        for (gpu_size_t b = 0; b < n_samples; b += W) {
+            batches.push_back({0, b, (gpu_size_t) std::min<size_t>(n_samples, b + W)});
+        }
+    }
+}
+
+} // namespace
+
+
+SdfCpuExpr::SdfCpuExpr(
+        SdfTiledTape tape,
+        gpu_size_t param_x_variations,
+        gpu_size_t param_dx_variations):
+    _tiled(std::move(tape)),
+    _n_param_x_variations(param_x_variations),
+    _n_param_dx_variations(param_dx_variations),
+    _culled(std::any_of(_tiled.ops.begin(), _tiled.ops.end(), [](const SdfGpuOp& op) {
+        return op.op == SdfOp::BvhUnion;
+    }))
+{
+    // keep a copy of the parameters for each variation
+    const SdfTape& t = _tiled.tape;
+    size_t n = t.n_params();
+    _params_x.reserve(n * param_x_variations);
+    _params_dx.reserve(n * param_dx_variations);
+    for (gpu_size_t i = 0; i < param_x_variations; ++i) {
+        _params_x.insert(_params_x.end(), t.params_x.begin(), t.params_x.end());
+    }
+    for (gpu_size_t i = 0; i < param_dx_variations; ++i) {
+        _params_dx.insert(_params_dx.end(), t.params_dx.begin(), t.params_dx.end());
+    }
+}
+
+void SdfCpuExpr::_write_params(
+        gpu_size_t v_begin,
+        gpu_size_t v_end,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n)
+{
+    gpu_size_t n_params = this->n_params();
+    if (begin + n > n_params) {
+        std::cerr << "SDF parameter update [" << begin << ", " << begin + n << ") "
+                  << "is out of range (" << n_params << " parameters)" << std::endl;
+        std::abort();
+    }
+    if (x) {
+        bool changed = false;
+        for (size_t v = v_begin; v < std::min(v_end, _n_param_x_variations); ++v) {
+            float* ps = _params_x.data() + v * n_params + begin;
+            changed |= not std::equal(x, x + n, ps);
+            std::copy(x, x + n, ps);
+        }
+        if (changed and _culled) {
+            std::cerr << "SDF parameter values can't be updated: the tape has a culled "
+                      << "union, whose bounds were fit to the old values" << std::endl;
+            std::abort();
+        }
+        // the tiles were pruned with the old values
+        if (changed and _tiled.n_tiles() > 0) _tiled = SdfTiledTape(std::move(_tiled.tape));
+    }
+    if (dx) {
+        for (size_t v = v_begin; v < std::min(v_end, _n_param_dx_variations); ++v) {
+            std::copy(dx, dx + n, _params_dx.data() + v * n_params + begin);
+        }
+    }
+}
+
+void SdfCpuExpr::update_params(gpu_size_t begin, const float* x, const float* dx, gpu_size_t n) {
+    _write_params(0, std::max(_n_param_x_variations, _n_param_dx_variations), begin, x, dx, n);
+}
+
+void SdfCpuExpr::update_variation_params(
+        gpu_size_t variation,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n)
+{
+    if ((x and variation >= _n_param_x_variations) or
+        (dx and variation >= _n_param_dx_variations))
+    {
+        std::cerr << "SDF parameter variation " << variation << " is out of range ("
+                  << _n_param_x_variations << " value and " << _n_param_dx_variations
+                  << " tangent variations)" << std::endl;
+        std::abort();
+    }
+    _write_params(variation, variation + 1, begin, x, dx, n);
+}
+
+SdfCpuInput::SdfCpuInput(gpu_size_t samples_x, gpu_size_t samples_dx, SdfSampleOrder order):
+    _samples_x(samples_x),
+    _samples_dx(samples_dx),
+    _sample_order(order) {}
+
+SdfCpuInput::SdfCpuInput(const SdfSampleSet& samples):
+    SdfCpuInput(0, 0)
+{
+    write_sample_set(samples);
+}
+
+void SdfCpuInput::write_sample_set(const SdfSampleSet& samples) {
+    if (not samples.procedural()) {
+        std::cerr << "SDF input sample set is not procedural" << std::endl;
+        std::abort();
+    }
+    _set = samples;
+}
+
+void SdfCpuInput::write_samples_x(const vec3* samples) {
+    if (procedural()) {
+        std::cerr << "SDF input samples are procedural, and can't be written" << std::endl;
+        std::abort();
+    }
+    std::copy(samples, samples + _samples_x.size(), _samples_x.begin());
+    if (_sample_order != SdfSampleOrder::Unsorted) {
+        _order = stereo::sample_order(samples, _samples_x.size(), _sample_order);
+    }
+}
+
+void SdfCpuInput::write_samples_dx(const vec3* samples) {
+    if (procedural()) {
+        std::cerr << "SDF input samples are procedural, and can't be written" << std::endl;
+        std::abort();
+    }
+    std::copy(samples, samples + _samples_dx.size(), _samples_dx.begin());
+}
+
+SdfCpuOutput::SdfCpuOutput(gpu_size_t n_samples, SdfEvalMode mode):
+    sdf_x    (n_samples),
+    sdf_dx   (mode == SdfEvalMode::Dual  ? n_samples : 0),
+    normal_x (mode != SdfEvalMode::Value ? n_samples : 0),
+    normal_dx(mode == SdfEvalMode::Dual  ? n_samples : 0),
+    mode(mode) {}
+
+SdfCpuEvaluator::SdfCpuEvaluator(size_t n_threads):
+    _n_threads(n_threads > 0 ? n_threads : hardware_threads()) {}
+
+SdfCpuOutputRef SdfCpuEvaluator::evaluate(
+        const SdfCpuExpr& expr,
+        const SdfCpuInput& input,
+        gpu_size_t param_variations,
+        ParamVariation variation_scheme,
+        SdfCpuOutputRef output,
+        SdfEvalMode mode) const
+{
+    // set up the output
+    size_t n_samples     = input.n_samples_x();
+    size_t sample_points = n_samples * param_variations;
+    if (output == nullptr or output->n_samples() < sample_points or output->mode < mode) {
+        output = std::make_shared<SdfCpuOutput>(sample_points, mode);
+    }
+    // (nothing to evaluate; this also keeps `param_variations - 1` below from wrapping)
+    if (n_samples == 0 or param_variations == 0 or expr.tape().ops.empty()) return output;
+
+    // each variation reads its own copy of the parameter block
+    size_t n_params  = expr.n_params();
+    size_t x_stride  = variation_scheme == ParamVariation::VaryDerivative ? 0 : n_params;
+    size_t dx_stride = variation_scheme == ParamVariation::VaryParam      ? 0 : n_params;
+    if ((param_variations - 1) * x_stride  + n_params > expr.params_x().size() or
+        (param_variations - 1) * dx_stride + n_params > expr.params_dx().size())
+    {
+        std::cerr << "SDF expression has too few parameter variations ("
+                  << expr.n_x_variations() << " x, " << expr.n_dx_variations() << " dx) "
+                  << "for " << param_variations << " requested" << std::endl;
+        std::abort();
+    }
+
+    // sort the samples by tile, so that every batch runs a single tape. tiles are only
+    // valid for the parameters they were pruned with, so they can't be used if those vary.
+    const SdfTiledTape& tiled = expr.tiled_tape();
+    bool use_tiles = tiled.n_tiles() > 0 and variation_scheme == ParamVariation::VaryDerivative;
+    std::vector<gpu_size_t> order;
+    std::vector<SdfBatch>   batches;
+    make_batches(use_tiles ? &tiled : nullptr, input, order, batches);
+
+    // the tangents of the variations from `n_whole` on, padded with zero tangents
+    // to a whole pass of vector duals (see below)
+    size_t             n_whole = param_variations;
+    std::vector<float> tail_dx;
+    auto tape = [&](size_t v, const SdfBatch& batch) {
+        const SdfTile& tile = tiled.tiles[batch.tile];
+        const float* dx = v < n_whole
+            ? expr.params_dx().data() + v * dx_stride
+            : tail_dx.data() + (v - n_whole) * dx_stride;
+        return BatchTape {
+            tiled.ops.data() + tile.op_begin,
+            tile.op_end - tile.op_begin,
+            {expr.params_x().data() + v * x_stride, dx, dx_stride},
+        };
+    };
+    SdfCpuOutput& out = *output;
+    switch (mode) {
+        case SdfEvalMode::Value:
+            eval_batches<LaneF, false>(tape, input, order, batches, 0, param_variations, out, _n_threads);
+            break;
+        case SdfEvalMode::Gradient:
+            eval_batches<LaneF, true> (tape, input, order, batches, 0, param_variations, out, _n_threads);
+            break;
+        case SdfEvalMode::Dual: {
+            // variations which differ only in their tangents share the value, so run
+            // them together on vector duals, `MaxTangents` at a time. the remainder
+            // runs in one more pass, on the narrowest duals which hold it.
+            constexpr size_t K = MaxTangents;
+            size_t v = 0;
+            if (variation_scheme == ParamVariation::VaryDerivative and param_variations > 1) {
+                size_t n    = param_variations;
+                size_t tail = n % K;
+                v = n - tail;
+                eval_batches<LaneDN<K>, true>(tape, input, order, batches, 0, v, out, _n_threads);
+                if (tail > 1) {
+                    const float* dx = expr.params_dx().data() + v * dx_stride;
+                    tail_dx.assign(K * n_params, 0.f);
+                    std::copy(dx, dx + tail * n_params, tail_dx.begin());
+                    n_whole = v;
+                    if (tail > K / 2) {
+                        eval_batches<LaneDN<K>,     true>(tape, input, order, batches, v, n, out, _n_threads);
+                    } else {
+                        eval_batches<LaneDN<K / 2>, true>(tape, input, order, batches, v, n, out, _n_threads);
+                    }
+                    v = n;
+                }
+            }
+            eval_batches<LaneD, true>(tape, input, order, batches, v, param_variations, out, _n_threads);
+        } break;
+    }
+    return output;
+}
+
+SdfCpuOutputRef SdfCpuEvaluator::evaluate(
+        const SdfTapeBatch& batch,
+        const SdfCpuInput& input,
+        SdfCpuOutputRef output,
+        SdfEvalMode mode) const
+{
+    // set up the output
+    size_t n_samples     = input.n_samples_x();
+    size_t sample_points = n_samples * batch.n_exprs();
+    if (output == nullptr or output->n_samples() < sample_points or output->mode < mode) {
+        output = std::make_shared<SdfCpuOutput>(sample_points, mode);
+    }
+    if (n_samples == 0 or batch.n_exprs() == 0) return output;
+
+    // every expression runs every batch of samples, with its own ops and parameters
+    std::vector<gpu_size_t> order;
+    std::vector<SdfBatch>   batches;
+    make_batches(nullptr, input, order, batches);
+
+    auto tape = [&](size_t e, const SdfBatch&) {
+        const SdfTile&     ops    = batch.exprs[e];
+        const ParamOffset& offset = batch.param_offsets[e];
+        return BatchTape {
+            batch.ops.data() + ops.op_begin,
+            ops.op_end - ops.op_begin,
+            {batch.params_x.data() + offset.x_offset, batch.params_dx.data() + offset.dx_offset},
+        };
+    };
+    size_t n_exprs = batch.n_exprs();
+    SdfCpuOutput& out = *output;
+    switch (mode) {
+        case SdfEvalMode::Value:
+            eval_batches<LaneF, false>(tape, input, order, batches, 0, n_exprs, out, _n_threads);
+            break;
+        case SdfEvalMode::Gradient:
+            eval_batches<LaneF, true> (tape, input, order, batches, 0, n_exprs, out, _n_threads);
+            break;
+        case SdfEvalMode::Dual:
+            eval_batches<LaneD, true> (tape, input, order, batches, 0, n_exprs, out, _n_threads);
+            break;
+    }
+    return output;
+}
+
+std::vector<float> SdfCpuEvaluator::gradient(
+        const SdfCpuExpr& expr,
+        const SdfCpuInput& input,
+        const float* d_loss) const
+{
+    size_t n_params = expr.n_params();
+    std::vector<float> grad(n_params, 0.f);
+    if (input.n_samples_x() == 0 or expr.tape().ops.empty()) return grad;
+
+    const SdfTiledTape& tiled = expr.tiled_tape();
+    std::vector<gpu_size_t> order;
+    std::vector<SdfBatch>   batches;
+    make_batches(tiled.n_tiles() > 0 ? &tiled : nullptr, input, order, batches);
+
+    // each thread accumulates into its own gradient; these are summed at the end
+    std::vector<std::vector<float>> thread_grads(_n_threads, std::vector<float>(n_params, 0.f));
+    size_t grain = std::max<size_t>(1, batches.size() / (_n_threads * 8));
+    parallel_for(
+        batches.size(),
+        grain,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            AdjointStacks st;
+            float* g = thread_grads[thread_index].data();
+            for (size_t b = begin; b < end; ++b) {
+                const SdfBatch& batch = batches[b];
+                gradient_batch(
+                    tiled.tiles[batch.tile],
+                    expr,
+                    input,
+                    d_loss,
+                    order.data() + batch.begin,
+                    batch.end - batch.begin,
+                    st,
+                    g
+                );
+            }
+        },
+        _n_threads
+    );
+    parallel_for(
+        n_params,
+        std::max<size_t>(1024, n_params / _n_threads),
+        [&](size_t begin, size_t end, size_t thread_index) {
+            for (const std::vector<float>& tg : thread_grads) {
+                for (size_t i = begin; i < end; ++i) grad[i] += tg[i];
+            }
+        },
+        _n_threads
+    );
+    return grad;
+}
+
+struct SdfCpuProbe::Stacks {
+    TapeStacks<LaneF> stacks;
+};
+
+SdfCpuProbe::SdfCpuProbe(const SdfCpuExpr& expr):
+    _expr(expr),
+    _stacks(std::make_unique<Stacks>()) {}
+
+SdfCpuProbe::~SdfCpuProbe() = default;
+
+namespace {
+
+// the tape which a probe runs at the points `p[0, n)`, and the points as lanes
+template <typename F>
+auto probe_batch(const SdfCpuExpr& expr, const vec3* p, size_t n, F&& run) {
+    if (n == 0 or n > W) {
+        std::cerr << "SDF probe of " << n << " points; at most " << W << " are allowed" << std::endl;
+        std::abort();
+    }
+    const SdfTiledTape& tiled = expr.tiled_tape();
+    gpu_size_t tile = tiled.tile_index(p[0]);
+    SdfDomain<LaneF> x;
+    for (size_t i = 0; i < W; ++i) {
+        // a partial batch repeats its last point
+        const vec3& q = p[std::min(i, n - 1)];
+        x.p.x[i] = q.x;
+        x.p.y[i] = q.y;
+        x.p.z[i] = q.z;
+        if (tile != 0 and i < n and tiled.tile_index(q) != tile) tile = 0;
+    }
+    const SdfTile& t = tiled.tiles[tile];
+    ParamBlock params {expr.params_x().data(), expr.params_dx().data(), 0};
+    return run(tiled.ops.data(), (size_t) t.op_begin, (size_t) t.op_end, params, x);
+}
+
+} // namespace
+
+void SdfCpuProbe::values(const vec3* p, size_t n, float* f) {
+    SdfRange<LaneF> r = probe_batch(_expr, p, n, [&](auto ops, size_t b, size_t e, ParamBlock ps, auto& x) {
+        return eval_tape<false>(ops, b, e, ps, x, _stacks->stacks);
+    });
+    for (size_t i = 0; i < n; ++i) f[i] = r.f[i];
+}
+
+void SdfCpuProbe::gradients(const vec3* p, size_t n, float* f, vec3* grad) {
+    SdfRange<LaneF> r = probe_batch(_expr, p, n, [&](auto ops, size_t b, size_t e, ParamBlock ps, auto& x) {
+        return eval_tape<true>(ops, b, e, ps, x, _stacks->stacks);
+    });
+    for (size_t i = 0; i < n; ++i) {
+        f[i]    = r.f[i];
+        grad[i] = vec3(r.grad_f.x[i], r.grad_f.y[i], r.grad_f.z[i]);
+    }
+}
+
+} // namespace stereo
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <memory>
+
+#include <stereo/sdf/sdf_batch.h>
+#include <stereo/sdf/sdf_order.h>
+#include <stereo/sdf/sdf_prune.h>
+#include <stereo/sdf/sdf_samples.h>
+
+// CPU backend for SDF evaluation, for machines without a GPU.
+//
+// This runs exactly the same tape as `SdfEvaluator` (i.e. an `SdfTape`, which
+// `SdfGpuExpr` uploads verbatim), with the same parameter-variation scheme and the
+// same output layout. Samples are processed in structure-of-arrays batches of
+// `SdfCpuEvaluator::BatchWidth` points, so that each op of the tape is decoded once
+// per batch and its arithmetic runs as SIMD ops across the batch. Batches are
+// spread across all available cores.
+//
+// If the expression was built from an `SdfTiledTape`, samples are first sorted by
+// tile, and each batch runs its tile's pruned tape (see sdf_prune.h). An input may also
+// sort its samples along a space-filling curve when they are written (see sdf_order.h);
+// batches then gather their samples in that order, and the results are scattered back
+// to the order in which the samples were written.
+//
+// A batch of distinct expressions (see sdf_batch.h) runs each expression over every
+// batch of samples, just as the variations of a single expression do.
+//
+// The interpreter is specialized for each `SdfEvalMode`. `Dual` runs on dual numbers;
+// `Gradient` runs the same code on plain floats, without any tangents; `Value` also
+// drops the gradients, so that range ops are bare mins and maxes, and the ops which
+// only transform a gradient (e.g. the pop of a `Transform`) are skipped entirely.
+// With `ParamVariation::VaryDerivative`, the variations differ only in their tangents,
+// so `Dual` runs up to `MaxTangents` of them in one pass, on vector duals (`DualN`)
+// which share the value and every branch on it. Seeding each variation's tangents with
+// one parameter gives the Jacobian over those parameters for about the cost of a
+// single variation plus the tangent arithmetic.
+//
+// Accuracy: the CPU path computes the same formulas as sdf_eval.wgsl in f32, so
+// results should agree with the GPU up to rounding; how closely has not been measured
+// against a device. Samples that lie (to within rounding) on a discontinuity of the
+// gradient, e.g. where two children of a union are equidistant, or on the medial axis
+// of a shape, are an exception: there, the two backends may legitimately pick
+// different branches, and the normals can differ entirely.
+
+namespace stereo {
+
+struct SdfCpuExpr;
+struct SdfCpuInput;
+struct SdfCpuOutput;
+
+using SdfCpuOutputRef = std::shared_ptr<SdfCpuOutput>;
+
+/**
+ * @brief Host-side counterpart of `SdfGpuExpr`: a tape, plus one copy of
+ * its parameters per variation.
+ */
+struct SdfCpuExpr {
+private:
+    SdfTiledTape       _tiled;
+    std::vector<float> _params_x;
+    std::vector<float> _params_dx;
+    gpu_size_t         _n_param_x_variations;
+    gpu_size_t         _n_param_dx_variations;
+    // whether the tape has a culled union, whose bounds fix `params_x`
+    bool               _culled;
+
+    // write `[begin, begin + n)` of the variations `[v_begin, v_end)`
+    void _write_params(
+        gpu_size_t v_begin,
+        gpu_size_t v_end,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n);
+
+public:
+
+    SdfCpuExpr(
+            SdfTiledTape tape,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1);
+
+    SdfCpuExpr(
+            SdfTape tape,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1):
+        SdfCpuExpr(SdfTiledTape(std::move(tape)), param_x_variations, param_dx_variations) {}
+
+    template <typename T>
+    requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+    SdfCpuExpr(
+            SdfNodeRef<T> expr,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1):
+        SdfCpuExpr(SdfTape(expr), param_x_variations, param_dx_variations) {}
+
+    const SdfTape&      tape()       const { return _tiled.tape; }
+    const SdfTiledTape& tiled_tape() const { return _tiled; }
+
+    /// Number of parameters in a single variation of the expression.
+    gpu_size_t n_params()        const { return _tiled.tape.n_params(); }
+    gpu_size_t n_x_variations()  const { return _n_param_x_variations; }
+    gpu_size_t n_dx_variations() const { return _n_param_dx_variations; }
+
+    /// The parameters of every variation, one after another. (`tape()` keeps the
+    /// parameters it was built with).
+    const std::vector<float>& params_x()  const { return _params_x; }
+    const std::vector<float>& params_dx() const { return _params_dx; }
+
+    /**
+     * @brief Overwrite the parameters `[begin, begin + n)` of every variation.
+     *
+     * Either of `x` or `dx` may be null to leave those values unchanged. As with
+     * `SdfGpuExpr::update_params()`, changing a value of `params_x` discards the pruned
+     * tiles, which are only valid for the parameters they were built with, and is an
+     * error if the tape has a culled union (see `SdfMerge::Static`).
+     */
+    void update_params(gpu_size_t begin, const float* x, const float* dx, gpu_size_t n);
+
+    /**
+     * @brief Overwrite the parameters `[begin, begin + n)` of a single variation, as
+     * `update_params()` does for all of them.
+     *
+     * `variation` must be in range for each of `x` and `dx` which is given.
+     */
+    void update_variation_params(
+        gpu_size_t variation,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n);
+};
+
+/**
+ * @brief Host-side counterpart of `SdfInput`.
+ *
+ * As on the GPU, an input made from a procedural `SdfSampleSet` holds no sample
+ * arrays; each batch generates its samples as it gathers them.
+ */
+struct SdfCpuInput {
+private:
+    std::vector<vec3>       _samples_x;
+    std::vector<vec3>       _samples_dx;
+    SdfSampleOrder          _sample_order;
+    std::vector<gpu_size_t> _order;
+    SdfSampleSet            _set;
+
+public:
+
+    /**
+     * @brief Space for `samples_x` points and `samples_dx` tangents, which are evaluated
+     * in `order` (see sdf_order.h).
+     */
+    SdfCpuInput(
+        gpu_size_t samples_x,
+        gpu_size_t samples_dx,
+        SdfSampleOrder order=SdfSampleOrder::Unsorted);
+
+    /// The samples of the procedural set `samples`.
+    SdfCpuInput(const SdfSampleSet& samples);
+
+    // (the procedural samples each have a tangent)
+    gpu_size_t n_samples_x()  const { return procedural() ? _set.n_samples() : _samples_x.size(); }
+    gpu_size_t n_samples_dx() const { return procedural() ? _set.n_samples() : _samples_dx.size(); }
+
+    /// The sample arrays; empty if the input is procedural.
+    const vec3* samples_x()  const { return _samples_x.data(); }
+    const vec3* samples_dx() const { return _samples_dx.data(); }
+
+    /// Sample `i`, whether written or procedural.
+    vec3 sample_x(gpu_size_t i) const {
+        return procedural() ? _set.point(i) : _samples_x[i];
+    }
+
+    /// The tangent of sample `i`, or zero if there are fewer tangents than samples.
+    vec3 sample_dx(gpu_size_t i) const {
+        if (procedural()) return _set.tangent();
+        return _samples_dx.size() >= _samples_x.size() ? _samples_dx[i] : vec3();
+    }
+
+    bool                procedural() const { return _set.procedural(); }
+    const SdfSampleSet& sample_set() const { return _set; }
+
+    SdfSampleOrder sample_order() const { return _sample_order; }
+
+    /// The indices of the samples in the order they are evaluated, or empty if unsorted.
+    const std::vector<gpu_size_t>& order() const { return _order; }
+
+    // write the entire buffer. must provide n_samples_x() samples, which are sorted
+    // into the input's order. not for procedural inputs.
+    void write_samples_x(const vec3* samples);
+    void write_samples_dx(const vec3* samples);
+
+    /// Replace the sample set of a procedural input.
+    void write_sample_set(const SdfSampleSet& samples);
+};
+
+/**
+ * @brief Host-side counterpart of `SdfOutput`.
+ *
+ * Results are laid out variation-major: index `v * n_samples + i` holds sample `i`
+ * evaluated with parameter variation `v`. Only the buffers which `mode` computes are
+ * allocated; the others are empty.
+ */
+struct SdfCpuOutput {
+    std::vector<float> sdf_x;
+    std::vector<float> sdf_dx;    // (`Dual` only)
+    std::vector<vec3>  normal_x;  // (`Gradient` and `Dual`)
+    std::vector<vec3>  normal_dx; // (`Dual` only)
+    SdfEvalMode        mode;
+
+    SdfCpuOutput(gpu_size_t n_samples, SdfEvalMode mode=SdfEvalMode::Dual);
+
+    gpu_size_t n_samples() const { return sdf_x.size(); }
+};
+
+/**
+ * @brief Evaluates SDF tapes on the CPU, in parallel.
+ */
+struct SdfCpuEvaluator {
+private:
+    size_t _n_threads;
+
+public:
+
+    /// Number of samples evaluated together, in SIMD lanes.
+    static constexpr size_t BatchWidth = 16;
+
+    /// Most parameter variations whose tangents are evaluated together, with a `DualN`.
+    static constexpr size_t MaxTangents = 8;
+
+    /// Create an evaluator using `n_threads` threads, or all hardware threads if zero.
+    SdfCpuEvaluator(size_t n_threads=0);
+
+    size_t n_threads() const { return _n_threads; }
+
+    /**
+     * @brief Evaluate `expr` at every sample of `input`, for each of `param_variations`
+     * variations of its parameters.
+     *
+     * `output` is reused if it is large enough and holds the buffers of `mode`;
+     * otherwise a new output is allocated.
+     */
+    SdfCpuOutputRef evaluate(
+        const SdfCpuExpr& expr,
+        const SdfCpuInput& input,
+        gpu_size_t param_variations,
+        ParamVariation variation_scheme=ParamVariation::VaryDerivative,
+        SdfCpuOutputRef output=nullptr,
+        SdfEvalMode mode=SdfEvalMode::Dual
+    ) const;
+
+    /**
+     * @brief Evaluate every expression of `batch` at every sample of `input`.
+     *
+     * Results are laid out expression-major: expression `e` at sample `i` is at index
+     * `e * n_samples + i`. `output` is reused as above.
+     */
+    SdfCpuOutputRef evaluate(
+        const SdfTapeBatch& batch,
+        const SdfCpuInput& input,
+        SdfCpuOutputRef output=nullptr,
+        SdfEvalMode mode=SdfEvalMode::Dual
+    ) const;
+
+    /**
+     * @brief Gradient of a loss over the samples with respect to every parameter.
+     *
+     * `d_loss` holds `input.n_samples_x()` values, the derivative of the loss with
+     * respect to the distance at each sample. Returns `d loss / d params_x`, for the
+     * parameters of the first variation, with one entry per parameter of the tape.
+     *
+     * This runs in reverse mode: a forward pass over each batch records the primal
+     * values of the tape, then a single backward sweep accumulates the adjoints of all
+     * the parameters at once, so the cost does not grow with the number of parameters.
+     * Batches run in parallel, each thread accumulating its own gradient, and the
+     * results are summed at the end.
+     *
+     * Only the distance is differentiated; the loss may not depend on the normals.
+     * At kinks (e.g. where two operands of a union are equidistant), the gradient
+     * follows the branch picked by the forward evaluation.
+     */
+    std::vector<float> gradient(
+        const SdfCpuExpr& expr,
+        const SdfCpuInput& input,
+        const float* d_loss
+    ) const;
+};
+
+/**
+ * @brief Evaluates an expression at a few points at a time, on the calling thread.
+ *
+ * For algorithms which choose each set of samples from the results of the last (e.g.
+ * sphere tracing), and so can't hand all their samples to an `SdfCpuEvaluator` at once.
+ * Points are evaluated one batch of up to `Width` at a time, with the parameters of
+ * the expression's first variation. If the expression is tiled, a batch whose points
+ * all lie in one tile runs that tile's pruned tape; otherwise it runs the full tape.
+ *
+ * A probe keeps its interpreter's stacks from one batch to the next, so each thread
+ * should have its own.
+ */
+struct SdfCpuProbe {
+private:
+    struct Stacks;
+
+    const SdfCpuExpr&       _expr;
+    std::unique_ptr<Stacks> _stacks;
+
+public:
+
+    static constexpr size_t Width = SdfCpuEvaluator::BatchWidth;
+
+    SdfCpuProbe(const SdfCpuExpr& expr);
+    ~SdfCpuProbe();
+
+    /// Write the distances at the `n <= Width` points `p` to `f`.
+    void values(const vec3* p, size_t n, float* f);
+
+    /// Write the distances and gradients at the `n <= Width` points `p` to `f` and `grad`.
+    void gradients(const vec3* p, size_t n, float* f, vec3* grad);
+};
+
+} // namespace stereo
@@ -0,0 +1,1019 @@
+#pragma once
+
+#include <type_traits>
+
+#include <stereo/util/simd.h>
+#include <stereo/sdf/sdf_structs.h>
+#include <stereo/sdf/sdf_grid.h>
+#include <stereo/sdf/sdf_trimesh.h>
+
+// CPU mirror of dual.wgsl, dual3.wgsl, sdf_shapes.wgsl and sdf_ops.wgsl.
+//
+// Everything is generic over a "number" type `N`, which is one of:
+//   - a plain value type `S` (`float`, or `Lanes<float,W>` for a batch of W samples)
+//   - `Dual<S>`, which carries a tangent alongside the value, like `Dual` in dual.wgsl.
+//   - `DualN<S,K>`, which carries `K` tangents, so that one evaluation finds `K`
+//     directional derivatives while computing the value (and every comparison and
+//     branch on it) only once.
+//
+// With `S = Lanes<float,W>` every field of every struct below is W samples wide, so
+// the structs are structure-of-arrays and each arithmetic op is one SIMD op.
+// Data-dependent branches in the shaders are turned into `select()`s, so that
+// every lane computes every branch. (`any()` is used to skip a branch when no lane
+// needs it).
+//
+// Keep the shape functions in sync with sdf_shapes.wgsl; they are written to be
+// compared side by side. (The exceptions are `sdf_mesh()` and `sdf_voxel_grid()`,
+// which are CPU-only).
+
+namespace stereo {
+namespace simd {
+
+/**
+ * @brief Forward-mode dual number over a value type `S` (a float or a batch of floats).
+ */
+template <typename S>
+struct Dual {
+    S x;
+    S dx;
+
+    Dual() = default;
+    Dual(float c): x(c), dx(0.f) {}
+    Dual(const S& x, const S& dx): x(x), dx(dx) {}
+};
+
+// primal value, for comparisons
+
+inline float primal(float x) { return x; }
+
+template <typename T, size_t W>
+inline const Lanes<T,W>& primal(const Lanes<T,W>& x) { return x; }
+
+template <typename S>
+inline const S& primal(const Dual<S>& x) { return x.x; }
+
+template <typename S, size_t K>
+struct DualN;
+
+template <typename S, size_t K>
+inline const S& primal(const DualN<S,K>& x) { return x.x; }
+
+// per-sample access to a value, for the shapes which run a scalar query per sample
+
+inline size_t lane_count(float) { return 1; }
+
+inline float& lane(float& x, size_t) { return x; }
+
+template <typename T, size_t W>
+inline size_t lane_count(const Lanes<T,W>&) { return W; }
+
+template <typename T, size_t W>
+inline T& lane(Lanes<T,W>& x, size_t i) { return x[i]; }
+
+// dual arithmetic
+
+template <typename S>
+inline Dual<S> operator+(const Dual<S>& a, const Dual<S>& b) { return {a.x + b.x, a.dx + b.dx}; }
+template <typename S>
+inline Dual<S> operator-(const Dual<S>& a, const Dual<S>& b) { return {a.x - b.x, a.dx - b.dx}; }
+template <typename S>
+inline Dual<S> operator*(const Dual<S>& a, const Dual<S>& b) {
+    return {a.x * b.x, a.x * b.dx + a.dx * b.x};
+}
+template <typename S>
+inline Dual<S> operator/(const Dual<S>& a, const Dual<S>& b) {
+    return {a.x / b.x, (a.dx * b.x - a.x * b.dx) / (b.x * b.x)};
+}
+template <typename S>
+inline Dual<S> operator-(const Dual<S>& a) { return {-a.x, -a.dx}; }
+
+template <typename S>
+inline Dual<S> operator+(const Dual<S>& a, float b) { return {a.x + b, a.dx}; }
+template <typename S>
+inline Dual<S> operator-(const Dual<S>& a, float b) { return {a.x - b, a.dx}; }
+template <typename S>
+inline Dual<S> operator*(const Dual<S>& a, float b) { return {a.x * b, a.dx * b}; }
+template <typename S>
+inline Dual<S> operator/(const Dual<S>& a, float b) { return {a.x / b, a.dx / b}; }
+template <typename S>
+inline Dual<S> operator+(float a, const Dual<S>& b) { return {a + b.x, b.dx}; }
+template <typename S>
+inline Dual<S> operator-(float a, const Dual<S>& b) { return {a - b.x, -b.dx}; }
+template <typename S>
+inline Dual<S> operator*(float a, const Dual<S>& b) { return {a * b.x, a * b.dx}; }
+
+template <typename S>
+inline Dual<S> sqrt(const Dual<S>& a) {
+    S s = sqrt(a.x);
+    return {s, a.dx / (s * 2.f)};
+}
+
+template <typename S, typename M>
+inline Dual<S> select(const Dual<S>& f, const Dual<S>& t, const M& cond) {
+    return {select(f.x, t.x, cond), select(f.dx, t.dx, cond)};
+}
+
+template <typename S>
+inline Dual<S> abs(const Dual<S>& a) {
+    return select(-a, a, a.x > 0.f);
+}
+
+/**
+ * @brief Forward-mode dual number with `K` tangents over a value type `S`.
+ *
+ * Each tangent is a separate `S`, so with `S = Lanes<float,W>` the tangent arithmetic
+ * is K SIMD ops per op, and the primal work is shared by all K directions.
+ */
+template <typename S, size_t K>
+struct DualN {
+    S x;
+    S dx[K];
+
+    DualN() = default;
+    DualN(float c): x(c) {
+        for (S& d : dx) d = S(0.f);
+    }
+};
+
+// vector dual arithmetic. (the loops over the tangents are unrolled by the compiler)
+
+template <typename S, size_t K>
+inline DualN<S,K> operator+(const DualN<S,K>& a, const DualN<S,K>& b) {
+    DualN<S,K> r;
+    r.x = a.x + b.x;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.dx[k] + b.dx[k];
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator-(const DualN<S,K>& a, const DualN<S,K>& b) {
+    DualN<S,K> r;
+    r.x = a.x - b.x;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.dx[k] - b.dx[k];
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator*(const DualN<S,K>& a, const DualN<S,K>& b) {
+    DualN<S,K> r;
+    r.x = a.x * b.x;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.x * b.dx[k] + a.dx[k] * b.x;
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator/(const DualN<S,K>& a, const DualN<S,K>& b) {
+    DualN<S,K> r;
+    S b2 = b.x * b.x;
+    r.x = a.x / b.x;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = (a.dx[k] * b.x - a.x * b.dx[k]) / b2;
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator-(const DualN<S,K>& a) {
+    DualN<S,K> r;
+    r.x = -a.x;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = -a.dx[k];
+    return r;
+}
+
+template <typename S, size_t K>
+inline DualN<S,K> operator+(const DualN<S,K>& a, float b) { DualN<S,K> r = a; r.x = a.x + b; return r; }
+template <typename S, size_t K>
+inline DualN<S,K> operator-(const DualN<S,K>& a, float b) { DualN<S,K> r = a; r.x = a.x - b; return r; }
+template <typename S, size_t K>
+inline DualN<S,K> operator*(const DualN<S,K>& a, float b) {
+    DualN<S,K> r;
+    r.x = a.x * b;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.dx[k] * b;
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator/(const DualN<S,K>& a, float b) {
+    DualN<S,K> r;
+    r.x = a.x / b;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.dx[k] / b;
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator+(float a, const DualN<S,K>& b) { return b + a; }
+template <typename S, size_t K>
+inline DualN<S,K> operator-(float a, const DualN<S,K>& b) {
+    DualN<S,K> r = -b;
+    r.x = a - b.x;
+    return r;
+}
+template <typename S, size_t K>
+inline DualN<S,K> operator*(float a, const DualN<S,K>& b) { return b * a; }
+
+template <typename S, size_t K>
+inline DualN<S,K> sqrt(const DualN<S,K>& a) {
+    DualN<S,K> r;
+    r.x = sqrt(a.x);
+    S d = r.x * 2.f;
+    for (size_t k = 0; k < K; ++k) r.dx[k] = a.dx[k] / d;
+    return r;
+}
+
+template <typename S, size_t K, typename M>
+inline DualN<S,K> select(const DualN<S,K>& f, const DualN<S,K>& t, const M& cond) {
+    DualN<S,K> r;
+    r.x = select(f.x, t.x, cond);
+    for (size_t k = 0; k < K; ++k) r.dx[k] = select(f.dx[k], t.dx[k], cond);
+    return r;
+}
+
+template <typename S, size_t K>
+inline DualN<S,K> abs(const DualN<S,K>& a) {
+    return select(-a, a, a.x > 0.f);
+}
+
+// generic min/max/clamp, which (like d_max() in dual.wgsl) select the
+// whole number, tangent and all.
+
+template <typename N>
+inline N d_max(const N& a, const N& b) {
+    return select(b, a, primal(a) > primal(b));
+}
+
+template <typename N>
+inline N d_min(const N& a, const N& b) {
+    return select(b, a, primal(a) < primal(b));
+}
+
+template <typename N>
+inline N d_clamp(const N& e, const N& lo, const N& hi) {
+    return d_max(lo, d_min(hi, e));
+}
+
+/**
+ * @brief A 3D vector of numbers.
+ */
+template <typename N>
+struct Vec3 {
+    N x;
+    N y;
+    N z;
+
+    Vec3() = default;
+    Vec3(const N& x, const N& y, const N& z): x(x), y(y), z(z) {}
+
+    Vec3& operator+=(const Vec3& o) { x = x + o.x; y = y + o.y; z = z + o.z; return *this; }
+    Vec3& operator-=(const Vec3& o) { x = x - o.x; y = y - o.y; z = z - o.z; return *this; }
+};
+
+template <typename N>
+inline Vec3<N> operator+(const Vec3<N>& a, const Vec3<N>& b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+template <typename N>
+inline Vec3<N> operator-(const Vec3<N>& a, const Vec3<N>& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+template <typename N>
+inline Vec3<N> operator-(const Vec3<N>& a) { return {-a.x, -a.y, -a.z}; }
+template <typename N>
+inline Vec3<N> operator*(const N& s, const Vec3<N>& v) { return {s * v.x, s * v.y, s * v.z}; }
+template <typename N>
+inline Vec3<N> operator/(const Vec3<N>& v, const N& s) { return {v.x / s, v.y / s, v.z / s}; }
+
+template <typename N>
+requires (not std::is_same_v<N, float>)
+inline Vec3<N> operator*(float s, const Vec3<N>& v) { return {s * v.x, s * v.y, s * v.z}; }
+
+template <typename N>
+inline N dot(const Vec3<N>& a, const Vec3<N>& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+template <typename N>
+inline Vec3<N> cross(const Vec3<N>& a, const Vec3<N>& b) {
+    return {
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x,
+    };
+}
+
+template <typename N>
+inline N length2(const Vec3<N>& a) { return dot(a, a); }
+
+template <typename N>
+inline N length(const Vec3<N>& a) { return sqrt(dot(a, a)); }
+
+template <typename N>
+inline Vec3<N> normalize(const Vec3<N>& a) { return a / length(a); }
+
+template <typename N, typename M>
+inline Vec3<N> select(const Vec3<N>& f, const Vec3<N>& t, const M& cond) {
+    return {select(f.x, t.x, cond), select(f.y, t.y, cond), select(f.z, t.z, cond)};
+}
+
+/// Per-component select, like `select()` on vectors in WGSL.
+template <typename N, typename M>
+inline Vec3<N> selectv(const Vec3<N>& f, const Vec3<N>& t, const Vec3<M>& cond) {
+    return {select(f.x, t.x, cond.x), select(f.y, t.y, cond.y), select(f.z, t.z, cond.z)};
+}
+
+template <typename N>
+inline auto primal(const Vec3<N>& v) {
+    using S = std::decay_t<decltype(primal(v.x))>;
+    return Vec3<S> {primal(v.x), primal(v.y), primal(v.z)};
+}
+
+/**
+ * @brief A quaternion of numbers, with `(x, y, z)` the imaginary part and `w` the real part.
+ */
+template <typename N>
+struct Quat {
+    N x;
+    N y;
+    N z;
+    N w;
+
+    Vec3<N> imag() const { return {x, y, z}; }
+    Quat    conj() const { return {-x, -y, -z, w}; }
+};
+
+/// Rotate `v` by the unit quaternion `q`. Mirrors `qrot()` in quat.wgsl.
+template <typename N>
+inline Vec3<N> qrot(const Quat<N>& q, const Vec3<N>& v) {
+    Vec3<N> u = q.imag();
+    Vec3<N> b = 2.f * cross(u, v);
+    return v + q.w * b + cross(u, b);
+}
+
+// loading parameters from the tape
+
+template <typename N>
+struct ParamLoader;
+
+template <>
+struct ParamLoader<float> {
+    static float load(const float* x, const float* dx, size_t) { return *x; }
+};
+
+template <typename T, size_t W>
+struct ParamLoader<Lanes<T,W>> {
+    static Lanes<T,W> load(const float* x, const float* dx, size_t) { return Lanes<T,W>(*x); }
+};
+
+template <typename S>
+struct ParamLoader<Dual<S>> {
+    static Dual<S> load(const float* x, const float* dx, size_t) { return {S(*x), S(*dx)}; }
+};
+
+template <typename S, size_t K>
+struct ParamLoader<DualN<S,K>> {
+    static DualN<S,K> load(const float* x, const float* dx, size_t dx_stride) {
+        DualN<S,K> r;
+        r.x = S(*x);
+        for (size_t k = 0; k < K; ++k) r.dx[k] = S(dx[k * dx_stride]);
+        return r;
+    }
+};
+
+/**
+ * @brief Pointers to the parameter block of a single variation of an expression.
+ *
+ * Parameters are the same across all the samples in a batch, so they are
+ * broadcast to every lane as they're loaded. A `DualN` loads its `K` tangents from
+ * `K` consecutive tangent blocks, `dx_stride` apart.
+ */
+struct ParamBlock {
+    const float* x;
+    const float* dx;
+    size_t       dx_stride = 0;
+
+    /// The block of the parameters from `i` on.
+    ParamBlock at(size_t i) const {
+        return {x + i, dx + i, dx_stride};
+    }
+
+    template <typename N>
+    N scalar(size_t i) const {
+        return ParamLoader<N>::load(x + i, dx + i, dx_stride);
+    }
+
+    template <typename N>
+    Vec3<N> vec3(size_t i) const {
+        return {scalar<N>(i), scalar<N>(i + 1), scalar<N>(i + 2)};
+    }
+
+    template <typename N>
+    Quat<N> quat(size_t i) const {
+        return {scalar<N>(i), scalar<N>(i + 1), scalar<N>(i + 2), scalar<N>(i + 3)};
+    }
+};
+
+// sdf structs (see sdf_structs.wgsl)
+
+template <typename N>
+struct SdfDomain {
+    Vec3<N> p;
+};
+
+template <typename N>
+struct SdfRange {
+    N       f;      // value of sdf
+    Vec3<N> grad_f; // gradient of sdf
+};
+
+// sdf_ops.wgsl
+
+template <typename N>
+inline SdfRange<N> sdf_union(const SdfRange<N>& f_a, const SdfRange<N>& f_b) {
+    auto b = primal(f_a.f) > primal(f_b.f);
+    return {select(f_a.f, f_b.f, b), select(f_a.grad_f, f_b.grad_f, b)};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_intersection(const SdfRange<N>& f_a, const SdfRange<N>& f_b) {
+    auto b = primal(f_a.f) < primal(f_b.f);
+    return {select(f_a.f, f_b.f, b), select(f_a.grad_f, f_b.grad_f, b)};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_subtract(const SdfRange<N>& f_a, const SdfRange<N>& f_b) {
+    auto b = primal(f_a.f) < -primal(f_b.f);
+    return {select(f_a.f, -f_b.f, b), select(f_a.grad_f, -f_b.grad_f, b)};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_xor(const SdfRange<N>& f_a, const SdfRange<N>& f_b) {
+    return sdf_subtract(sdf_union(f_a, f_b), sdf_intersection(f_a, f_b));
+}
+
+template <typename N>
+inline SdfRange<N> sdf_dilate(const SdfRange<N>& f, const N& r) {
+    return {f.f - r, f.grad_f};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_shell(const SdfRange<N>& f, const N& r) {
+    return {abs(f.f) - r, select(f.grad_f, -f.grad_f, primal(f.f) < 0.f)};
+}
+
+/// Inverse-transform the domain by the rigid transform `(q, tx)`.
+template <typename N>
+inline SdfDomain<N> sdf_transform(const Quat<N>& q, const Vec3<N>& tx, const SdfDomain<N>& x) {
+    return {qrot(q.conj(), x.p - tx)};
+}
+
+/// Transform the gradient of a transformed sub-expr back to the outer domain.
+template <typename N>
+inline SdfRange<N> sdf_untransform(const Quat<N>& q, const SdfRange<N>& f) {
+    // nb: normals transform by the inverse transpose, which for a rotation is itself
+    return {f.f, qrot(q, f.grad_f)};
+}
+
+/// A number with value `s` and no tangent.
+template <typename N, typename S>
+inline N constant(const S& s) {
+    if constexpr (std::is_same_v<N, S>) {
+        return s;
+    } else {
+        N c(0.f);
+        c.x = s;
+        return c;
+    }
+}
+
+/// The index of the axis named by an axis variant (the z axis if there is none).
+inline size_t sdf_axis(SdfOpVariant v) {
+    switch (v) {
+        case SdfOpVariant::XAxis: return 0;
+        case SdfOpVariant::YAxis: return 1;
+        default:                  return 2;
+    }
+}
+
+/// Rotate `v` by `angle` about the axis with index `axis`.
+template <typename N, typename S>
+inline Vec3<N> rotate_about(const Vec3<N>& v, const S& angle, size_t axis) {
+    N c = constant<N>(S(cos(angle)));
+    N s = constant<N>(S(sin(angle)));
+    const N* in[3] = {&v.x, &v.y, &v.z};
+    Vec3<N> out = v;
+    N* o[3] = {&out.x, &out.y, &out.z};
+    size_t a = (axis + 1) % 3;
+    size_t b = (axis + 2) % 3;
+    *o[a] = c * *in[a] - s * *in[b];
+    *o[b] = s * *in[a] + c * *in[b];
+    return out;
+}
+
+/// Fold the domain into the cell `k` nearest to it, of a grid with spacing `period`,
+/// with `k` clamped to `[lo, hi]`. An axis whose period is not positive is not repeated.
+template <typename N>
+inline SdfDomain<N> sdf_repeat(
+        const Vec3<N>&     period,
+        const Vec3<float>& lo,
+        const Vec3<float>& hi,
+        const SdfDomain<N>& x)
+{
+    auto fold = [](const N& p, const N& c, float lo, float hi) {
+        auto c_x = primal(c);
+        using S  = decltype(c_x);
+        S k = d_clamp(S(round(primal(p) / c_x)), S(lo), S(hi));
+        k = select(k, S(0.f), c_x <= 0.f);
+        return p - constant<N>(k) * c;
+    };
+    return {{
+        fold(x.p.x, period.x, lo.x, hi.x),
+        fold(x.p.y, period.y, lo.y, hi.y),
+        fold(x.p.z, period.z, lo.z, hi.z),
+    }};
+}
+
+/// Reflect the domain on the negative side of the plane `(n, d)` to the positive side.
+template <typename N>
+inline SdfDomain<N> sdf_mirror(const Vec3<N>& n, const N& d, const SdfDomain<N>& x) {
+    N s = dot(x.p, n) + d;
+    return {select(x.p, x.p - (2.f * s) * n, primal(s) < 0.f)};
+}
+
+/// Transform the gradient of a mirrored sub-expr back to the outer domain `x`.
+template <typename N>
+inline SdfRange<N> sdf_unmirror(
+        const Vec3<N>& n,
+        const N& d,
+        const SdfDomain<N>& x,
+        const SdfRange<N>& f)
+{
+    // a reflection is its own inverse transpose
+    auto flip = primal(dot(x.p, n) + d) < 0.f;
+    N g_n = dot(f.grad_f, n);
+    return {f.f, select(f.grad_f, f.grad_f - (2.f * g_n) * n, flip)};
+}
+
+/// The angle of the sector, of `count` around `axis`, which contains `p`.
+template <typename S>
+inline S rotsym_angle(const Vec3<S>& p, float count, size_t axis) {
+    const S* c[3] = {&p.x, &p.y, &p.z};
+    const S& u = *c[(axis + 1) % 3];
+    const S& v = *c[(axis + 2) % 3];
+    float w = 2.f * (float) M_PI / std::max(std::round(count), 1.f);
+    return round(atan2(v, u) / w) * w;
+}
+
+/// Rotate the domain about `axis` into the sector of `count` which is centered on
+/// the +u axis.
+template <typename N>
+inline SdfDomain<N> sdf_rotsym(float count, size_t axis, const SdfDomain<N>& x) {
+    auto angle = rotsym_angle(primal(x.p), count, axis);
+    return {rotate_about(x.p, -angle, axis)};
+}
+
+/// Transform the gradient of a sub-expr under rotational symmetry back to the outer
+/// domain `x`.
+template <typename N>
+inline SdfRange<N> sdf_unrotsym(
+        float count,
+        size_t axis,
+        const SdfDomain<N>& x,
+        const SdfRange<N>& f)
+{
+    auto angle = rotsym_angle(primal(x.p), count, axis);
+    return {f.f, rotate_about(f.grad_f, angle, axis)};
+}
+
+// sdf_shapes.wgsl
+
+template <typename N>
+inline SdfRange<N> sdf_sphere(const Vec3<N>& center, const N& radius, const SdfDomain<N>& x) {
+    Vec3<N> r = x.p - center;
+    N len = length(r);
+    return {len - radius, r / len};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_box(const Vec3<N>& lo, const Vec3<N>& hi, const SdfDomain<N>& x) {
+    auto p = primal(x.p);
+    auto l = primal(lo);
+    auto h = primal(hi);
+    using M = decltype(p.x < l.x);
+    Vec3<M> below {p.x < l.x, p.y < l.y, p.z < l.z};
+    Vec3<M> above {p.x > h.x, p.y > h.y, p.z > h.z};
+    M outside = below.x || below.y || below.z || above.x || above.y || above.z;
+
+    // outside: distance to the nearest point on the box
+    Vec3<N> c = selectv(selectv(x.p, lo, below), hi, above);
+    Vec3<N> v = x.p - c;
+    N d_out = length(v);
+    Vec3<N> n_out = v / d_out;
+
+    // inside: (negative) distance to the nearest face
+    Vec3<N> d_lo = lo - x.p;
+    Vec3<N> d_hi = x.p - hi;
+    auto ql = primal(d_lo);
+    auto qh = primal(d_hi);
+    Vec3<M> to_hi {qh.x > ql.x, qh.y > ql.y, qh.z > ql.z};
+    Vec3<N> q = selectv(d_lo, d_hi, to_hi);
+    N zero = N(0.f);
+    N f_in = q.x;
+    Vec3<N> n_in {select(N(-1.f), N(1.f), to_hi.x), zero, zero};
+    M y_nearer = primal(q.y) > primal(f_in);
+    f_in = select(f_in, q.y, y_nearer);
+    n_in = select(n_in, Vec3<N> {zero, select(N(-1.f), N(1.f), to_hi.y), zero}, y_nearer);
+    M z_nearer = primal(q.z) > primal(f_in);
+    f_in = select(f_in, q.z, z_nearer);
+    n_in = select(n_in, Vec3<N> {zero, zero, select(N(-1.f), N(1.f), to_hi.z)}, z_nearer);
+
+    return {select(f_in, d_out, outside), select(n_in, n_out, outside)};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_cylinder(
+        const Vec3<N>& p0,
+        const Vec3<N>& p1,
+        const N& radius,
+        const SdfDomain<N>& x)
+{
+    N zero = N(0.f);
+    N one  = N(1.f);
+    // cylinder axis:
+    Vec3<N> a = p1 - p0;
+    // vector from p0 to p:
+    Vec3<N> b = x.p - p0;
+    N b2 = length2(b);
+    N a2 = length2(a);
+    N d  = dot(a, b);
+    // fractional distance along axis in [0,1]:
+    N s  = d / a2;
+    // square of distance from the base to the projected axial point
+    N x2 = d * s;
+    N r_dist = sqrt(b2 - x2);
+    // signed distance to the surface of the cylinder:
+    N r  = r_dist - radius;
+    // signed fractional distance along the axis to nearest cap:
+    N t  = d_max(-s, s - 1.f);
+    // radial vector
+    Vec3<N> r_vec = (x.p - p0) - s * a;
+    Vec3<N> r_hat = r_vec / r_dist;
+    N a_len = sqrt(a2);
+    Vec3<N> a_hat = a / a_len;
+    // sdf is negative (inside shape) iff (t, r) both negative:
+    auto inside = primal(t) < 0.f && primal(r) < 0.f;
+    // inside, the distance is to the nearer of the wall and the cap:
+    N d_in = d_max(r, t * a_len);
+    // clamped coordinates, to project orthogonally to wall/cap
+    t = d_max(t, zero);
+    r = d_max(r, zero);
+    // squared axis-parallel distance to cap
+    N y2 = t * t * a2;
+    // squared distance to surface point
+    N z2 = r * r + y2;
+    N dist = select(sqrt(z2), d_in, inside);
+
+    // compute normal
+    auto s_x     = primal(s);
+    auto on_cap  = s_x < 0.f || s_x > 1.f;
+    auto near_p0 = s_x < 0.5f;
+    // p projects to the cap face
+    Vec3<N> n_face = select(a_hat, -a_hat, near_p0);
+    // p projects to the cap rim
+    N s_c = d_clamp(s, zero, one);
+    Vec3<N> surf_pt = p0 + s_c * a + radius * r_hat;
+    Vec3<N> n_rim = (x.p - surf_pt) / dist;
+    Vec3<N> n_cap = select(n_rim, n_face, primal(r_dist) <= primal(radius));
+    // p is interior and the cap is closer than the wall;
+    // normal points along the axis, toward the cap
+    auto cap_nearer =
+            primal(r_dist) < primal(radius) &&
+            primal(a_len) * min(s_x, 1.f - s_x) < primal(radius) - primal(r_dist);
+    Vec3<N> n_axial = select(a_hat, -a_hat, near_p0);
+    // otherwise p projects to the cylinder wall
+    Vec3<N> n = select(select(r_hat, n_axial, cap_nearer), n_cap, on_cap);
+
+    return {dist, n};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_capsule(
+        const Vec3<N>& p0,
+        const Vec3<N>& p1,
+        const N& radius,
+        const SdfDomain<N>& x)
+{
+    // capsule axis:
+    Vec3<N> a = p1 - p0;
+    // vector from p0 to p:
+    Vec3<N> b = x.p - p0;
+    N a2 = length2(a);
+    N d  = dot(a, b);
+    // fractional distance along axis in [0,1]:
+    N s  = d_clamp(d / a2, N(0.f), N(1.f));
+    // vector from the projected point to p:
+    Vec3<N> v = x.p - (p0 + s * a);
+    return {length(v) - radius, normalize(v)};
+}
+
+template <typename N>
+inline SdfRange<N> sdf_plane(const Vec3<N>& n, const N& d, const SdfDomain<N>& x) {
+    return {dot(x.p, n) + d, n};
+}
+
+template <typename N>
+inline Vec3<N> project_to_segment(const Vec3<N>& p, const Vec3<N>& v) {
+    N s = dot(p, v) / dot(v, v);
+    return d_clamp(s, N(0.f), N(1.f)) * v;
+}
+
+template <typename N>
+inline SdfRange<N> sdf_triangle(
+        const Vec3<N>& p0,
+        const Vec3<N>& p1,
+        const Vec3<N>& p2,
+        const SdfDomain<N>& x)
+{
+    Vec3<N> v0 = p1 - p0;
+    Vec3<N> v1 = p2 - p1;
+    Vec3<N> v2 = p0 - p2;
+    Vec3<N> b0 = x.p - p0;
+    Vec3<N> b1 = x.p - p1;
+    Vec3<N> b2 = x.p - p2;
+    Vec3<N> n  = cross(v0, v2); // tri normal
+
+    // p projects to the interior of the face iff it is on the inner side of all three edges
+    auto n_x = primal(n);
+    auto inside =
+            sign(dot(cross(primal(v0), n_x), primal(b0))) +
+            sign(dot(cross(primal(v1), n_x), primal(b1))) +
+            sign(dot(cross(primal(v2), n_x), primal(b2))) >= 2.f;
+
+    // projection inside the triangle face
+    Vec3<N> n_hat = normalize(n);
+    N h = dot(n_hat, b0); // signed height above the plane
+    N d_face = abs(h);
+    Vec3<N> normal_face = select(-n_hat, n_hat, primal(h) > 0.f);
+
+    // outside the triangle:
+    // find the vector from the projected point on each edge to p
+    Vec3<N> v_e0 = b0 - project_to_segment(b0, v0);
+    Vec3<N> v_e1 = b1 - project_to_segment(b1, v1);
+    Vec3<N> v_e2 = b2 - project_to_segment(b2, v2);
+    // distance to each edge
+    N d0 = length(v_e0);
+    N d1 = length(v_e1);
+    N d2 = length(v_e2);
+    // find closest edge point
+    N d = d0;
+    Vec3<N> normal = v_e0;
+    auto c1 = primal(d1) < primal(d);
+    d      = select(d, d1, c1);
+    normal = select(normal, v_e1, c1);
+    auto c2 = primal(d2) < primal(d);
+    d      = select(d, d2, c2);
+    normal = select(normal, v_e2, c2);
+    normal = normal / d;
+
+    return {select(d, d_face, inside), select(normal, normal_face, inside)};
+}
+
+/**
+ * @brief The signed distance to the mesh whose parameters start at `ps` (see
+ * sdf_trimesh.h).
+ *
+ * The nearest triangle and the winding number are found for each sample by walking
+ * the mesh's hierarchy; the value and its tangents are then those of the nearest
+ * triangle, negated inside the mesh. The mesh's vertices have no tangents.
+ */
+template <typename N>
+inline SdfRange<N> sdf_mesh(const ParamBlock& ps, const SdfDomain<N>& x) {
+    using S = std::decay_t<decltype(primal(std::declval<N>()))>;
+    Vec3<S> p = primal(x.p);
+    Vec3<S> v[3];
+    S       w;
+    for (size_t l = 0; l < lane_count(p.x); ++l) {
+        vec3 q(lane(p.x, l), lane(p.y, l), lane(p.z, l));
+        const float* t = sdf_mesh_triangle(ps.x, sdf_mesh_nearest(ps.x, q));
+        for (size_t k = 0; k < 3; ++k) {
+            lane(v[k].x, l) = t[3 * k];
+            lane(v[k].y, l) = t[3 * k + 1];
+            lane(v[k].z, l) = t[3 * k + 2];
+        }
+        lane(w, l) = sdf_mesh_winding(ps.x, q);
+    }
+    auto vn = [](const Vec3<S>& u) {
+        return Vec3<N> {constant<N>(u.x), constant<N>(u.y), constant<N>(u.z)};
+    };
+    SdfRange<N> f = sdf_triangle(vn(v[0]), vn(v[1]), vn(v[2]), x);
+    auto inside = w > 0.5f;
+    return {select(f.f, -f.f, inside), select(f.grad_f, -f.grad_f, inside)};
+}
+
+/**
+ * @brief The distance reconstructed by trilinear interpolation from the voxel grid whose
+ * parameters start at `ps` (see sdf_grid.h).
+ *
+ * Outside the grid, the distance to its box is added to the value at the nearest point
+ * of the box. The grid's values have no tangents.
+ */
+template <typename N>
+inline SdfRange<N> sdf_voxel_grid(const ParamBlock& ps, const SdfDomain<N>& x) {
+    using S = std::decay_t<decltype(primal(std::declval<N>()))>;
+    const float* g = ps.x;
+    float        h = g[6];
+    const float* values = g + SdfVoxelGridHeader;
+    size_t dims[3] = {(size_t) g[0], (size_t) g[1], (size_t) g[2]};
+    N p[3] = {x.p.x, x.p.y, x.p.z};
+
+    // lattice coordinates, clamped to the grid, and the offset to the grid's box
+    using M = decltype(primal(x.p.x) < 0.f);
+    N u[3];
+    N out[3];
+    M clamped[3];
+    S cell[3];
+    for (size_t a = 0; a < 3; ++a) {
+        N v        = (p[a] - g[3 + a]) * (1.f / h);
+        N hi       = N((float) (dims[a] - 1));
+        u[a]       = d_clamp(v, N(0.f), hi);
+        out[a]     = (v - u[a]) * h;
+        clamped[a] = primal(v) < 0.f or primal(v) > primal(hi);
+        cell[a]    = d_min(floor(primal(u[a])), S((float) (dims[a] - 2)));
+        u[a]       = u[a] - constant<N>(cell[a]);
+    }
+    M outside = clamped[0] or clamped[1] or clamped[2];
+
+    // the values at the corners of each sample's cell
+    S c[8];
+    for (size_t l = 0; l < lane_count(cell[0]); ++l) {
+        size_t i[3] = {
+            (size_t) lane(cell[0], l),
+            (size_t) lane(cell[1], l),
+            (size_t) lane(cell[2], l),
+        };
+        const float* v = values + (i[2] * dims[1] + i[1]) * dims[0] + i[0];
+        size_t sy = dims[0];
+        size_t sz = dims[0] * dims[1];
+        for (size_t k = 0; k < 8; ++k) {
+            lane(c[k], l) = v[(k & 1) + (k & 2 ? sy : 0) + (k & 4 ? sz : 0)];
+        }
+    }
+    N v[8];
+    for (size_t k = 0; k < 8; ++k) v[k] = constant<N>(c[k]);
+
+    // interpolate, and differentiate along each axis
+    auto lerp = [](const N& a, const N& b, const N& t) { return a + (b - a) * t; };
+    auto bilerp = [&](const N& a, const N& b, const N& c, const N& d, const N& s, const N& t) {
+        return lerp(lerp(a, b, s), lerp(c, d, s), t);
+    };
+    N f    = lerp(
+        bilerp(v[0], v[1], v[2], v[3], u[0], u[1]),
+        bilerp(v[4], v[5], v[6], v[7], u[0], u[1]),
+        u[2]
+    );
+    N df_x = bilerp(v[1] - v[0], v[3] - v[2], v[5] - v[4], v[7] - v[6], u[1], u[2]) * (1.f / h);
+    N df_y = bilerp(v[2] - v[0], v[3] - v[1], v[6] - v[4], v[7] - v[5], u[0], u[2]) * (1.f / h);
+    N df_z = bilerp(v[4] - v[0], v[5] - v[1], v[6] - v[2], v[7] - v[3], u[0], u[1]) * (1.f / h);
+    Vec3<N> grad {df_x, df_y, df_z};
+
+    // outside, the gradient along the clamped axes is that of the distance to the box
+    if (any(outside)) {
+        Vec3<N> e {out[0], out[1], out[2]};
+        N d_out = length(select(Vec3<N> {N(1.f), N(0.f), N(0.f)}, e, outside));
+        Vec3<N> n = e / d_out;
+        grad = {
+            select(grad.x, n.x, clamped[0]),
+            select(grad.y, n.y, clamped[1]),
+            select(grad.z, n.z, clamped[2]),
+        };
+        f = select(f, f + d_out, outside);
+    }
+    return {f, grad};
+}
+
+// the domain cases of `sdf_eval()` in sdf_eval.wgsl
+
+/**
+ * @brief Transform the domain `x` by the domain op `op`, whose parameters start at `ps`.
+ *
+ * Returns false and leaves `y` untouched if `op` is not a domain op (or not one which
+ * is implemented yet).
+ */
+template <typename N>
+inline bool sdf_push_domain(
+        SdfOp op,
+        SdfOpVariant variant,
+        const ParamBlock& ps,
+        const SdfDomain<N>& x,
+        SdfDomain<N>& y)
+{
+    switch (op) {
+        case SdfOp::Transform:
+            y = sdf_transform(ps.quat<N>(0), ps.vec3<N>(4), x);
+            break;
+        case SdfOp::Repeat:
+            y = sdf_repeat(ps.vec3<N>(0), ps.vec3<float>(3), ps.vec3<float>(6), x);
+            break;
+        case SdfOp::Mirror:
+            y = sdf_mirror(ps.vec3<N>(0), ps.scalar<N>(3), x);
+            break;
+        case SdfOp::RotSym:
+            y = sdf_rotsym(ps.scalar<float>(0), sdf_axis(variant), x);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Transform the gradient of `f`, the value of the sub-expr under the domain op
+ * `op`, back to the outer domain `x` (which the op was applied to).
+ */
+template <typename N>
+inline SdfRange<N> sdf_pop_domain(
+        SdfOp op,
+        SdfOpVariant variant,
+        const ParamBlock& ps,
+        const SdfDomain<N>& x,
+        const SdfRange<N>& f)
+{
+    switch (op) {
+        case SdfOp::Transform:
+            return sdf_untransform(ps.quat<N>(0), f);
+        case SdfOp::Mirror:
+            return sdf_unmirror(ps.vec3<N>(0), ps.scalar<N>(3), x, f);
+        case SdfOp::RotSym:
+            return sdf_unrotsym(ps.scalar<float>(0), sdf_axis(variant), x, f);
+        default:
+            // translations (e.g. `Repeat`) leave the gradient unchanged
+            return f;
+    }
+}
+
+// the shape cases of `sdf_eval()` in sdf_eval.wgsl (with the loaders in load_shape.wgsl)
+
+/**
+ * @brief Evaluate the shape `op`, whose parameters start at `ps`, over the domain `x`.
+ *
+ * Returns false and leaves `f` untouched if `op` is not a shape (or not one which
+ * is implemented yet).
+ */
+template <typename N>
+inline bool sdf_shape(SdfOp op, const ParamBlock& ps, const SdfDomain<N>& x, SdfRange<N>& f) {
+    switch (op) {
+        case SdfOp::Sphere:
+            f = sdf_sphere(ps.vec3<N>(0), ps.scalar<N>(3), x);
+            break;
+        case SdfOp::Box:
+            f = sdf_box(ps.vec3<N>(0), ps.vec3<N>(3), x);
+            break;
+        case SdfOp::Cylinder:
+            f = sdf_cylinder(ps.vec3<N>(0), ps.vec3<N>(3), ps.scalar<N>(6), x);
+            break;
+        case SdfOp::Capsule:
+            f = sdf_capsule(ps.vec3<N>(0), ps.vec3<N>(3), ps.scalar<N>(6), x);
+            break;
+        case SdfOp::Plane:
+            f = sdf_plane(ps.vec3<N>(0), ps.scalar<N>(3), x);
+            break;
+        case SdfOp::Triangle:
+            f = sdf_triangle(ps.vec3<N>(0), ps.vec3<N>(3), ps.vec3<N>(6), x);
+            break;
+        case SdfOp::Mesh:
+            f = sdf_mesh(ps, x);
+            break;
+        case SdfOp::VoxelGrid:
+            f = sdf_voxel_grid(ps, x);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief The value of the shape `op` alone, as `sdf_shape()` finds it.
+ *
+ * The shape's gradient is discarded as soon as it's found, so that once the shape is
+ * inlined here, the compiler drops the arithmetic which only feeds the gradient.
+ */
+template <typename N>
+inline bool sdf_shape_value(SdfOp op, const ParamBlock& ps, const SdfDomain<N>& x, N& f) {
+    switch (op) {
+        case SdfOp::Sphere:
+            f = sdf_sphere(ps.vec3<N>(0), ps.scalar<N>(3), x).f;
+            break;
+        case SdfOp::Box:
+            f = sdf_box(ps.vec3<N>(0), ps.vec3<N>(3), x).f;
+            break;
+        case SdfOp::Cylinder:
+            f = sdf_cylinder(ps.vec3<N>(0), ps.vec3<N>(3), ps.scalar<N>(6), x).f;
+            break;
+        case SdfOp::Capsule:
+            f = sdf_capsule(ps.vec3<N>(0), ps.vec3<N>(3), ps.scalar<N>(6), x).f;
+            break;
+        case SdfOp::Plane:
+            f = sdf_plane(ps.vec3<N>(0), ps.scalar<N>(3), x).f;
+            break;
+        case SdfOp::Triangle:
+            f = sdf_triangle(ps.vec3<N>(0), ps.vec3<N>(3), ps.vec3<N>(6), x).f;
+            break;
+        case SdfOp::Mesh:
+            f = sdf_mesh(ps, x).f;
+            break;
+        case SdfOp::VoxelGrid:
+            f = sdf_voxel_grid(ps, x).f;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+} // namespace simd
+} // namespace stereo
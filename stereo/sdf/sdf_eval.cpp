@@ -1,182 +1,558 @@
 #include <stereo/sdf/sdf_eval.h>
 #include <stereo/gpu/shader.h>
 
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
 namespace stereo {
 
 constexpr gpu_size_t Wg_W = 8;
 constexpr gpu_size_t Wg_H = 8;
 
-size_t SdfGpuExpr::ExprBuffer::size() const { return params_x.size(); }
-
-size_t SdfGpuExpr::ExprBuffer::extend(const float* v, size_t n) {
-    params_x.insert(params_x.end(), v, v + n);
-    params_dx.insert(params_dx.end(), n, 0.);
-    return params_x.size();
+gpu_size_t sdf_stack_size(size_t stack_depth) {
+    if (stack_depth > SdfMaxStackSize) {
+        std::cerr << "SDF expression needs a stack of depth " << stack_depth << "; "
+                  << "at most " << SdfMaxStackSize << " is supported" << std::endl;
+        std::abort();
+    }
+    gpu_size_t size = SdfMinStackSize;
+    while (size < stack_depth) size *= 2;
+    return size;
 }
 
-size_t SdfGpuExpr::ExprBuffer::extend(const Dual<float>* v, size_t n) {
-    params_x.reserve(size() + n);
-    params_dx.reserve(size() + n);
-    for (size_t i = 0; i < n; ++i) {
-        params_x.push_back(v[i].x);
-        params_dx.push_back(v[i].dx);
+namespace {
+
+size_t hash_words(size_t h, const void* data, size_t n_bytes) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i + 4 <= n_bytes; i += 4) {
+        uint32_t w;
+        std::memcpy(&w, bytes + i, 4);
+        h = geom::hash_combine(h, std::hash<uint32_t>{}(w));
     }
-    return params_x.size();
+    return h;
+}
+
+// the hash of the structure of `view`: its ops and tile tables, but not its parameters
+size_t structure_hash(const SdfTapeView& view) {
+    size_t h = 0x3c6ef372fe94f82bULL; // nonce
+    h = hash_words(h, view.ops,   view.n_ops * sizeof(SdfGpuOp));
+    h = hash_words(h, view.tiles, view.n_tile_entries * sizeof(SdfTile));
+    h = hash_words(h, &view.grid, sizeof(SdfTileGrid));
+    return h;
 }
 
 template <typename T>
-requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+bool same_items(const std::vector<T>& a, const T* b, size_t n) {
+    return a.size() == n and (n == 0 or std::memcmp(a.data(), b, n * sizeof(T)) == 0);
+}
+
+} // namespace
+
+SdfTapeCache::SdfTapeCache(wgpu::Device device, size_t capacity):
+    _device(device),
+    _capacity(capacity) {}
+
+SdfTapeBuffers SdfTapeCache::buffers(const SdfTapeView& view) {
+    size_t h = structure_hash(view);
+    auto [begin, end] = _index.equal_range(h);
+    for (auto i = begin; i != end; ++i) {
+        EntryList::iterator e = i->second;
+        if (same_items(e->ops,   view.ops,   view.n_ops) and
+            same_items(e->tiles, view.tiles, view.n_tile_entries) and
+            std::memcmp(&e->grid, &view.grid, sizeof(SdfTileGrid)) == 0)
+        {
+            // mark it most recently used
+            _entries.splice(_entries.begin(), _entries, e);
+            _hits += 1;
+            return e->buffers;
+        }
+    }
+    _misses += 1;
+    
+    // upload the structure
+    SdfTapeBuffers buffers {
+        DataBuffer<SdfGpuOp>(
+            _device,
+            view.n_ops,
+            BufferKind::Storage,
+            wgpu::BufferUsage::CopyDst
+        ),
+        DataBuffer<SdfTileGrid>(
+            _device,
+            1,
+            BufferKind::Storage,
+            wgpu::BufferUsage::CopyDst
+        ),
+        DataBuffer<SdfTile>(
+            _device,
+            view.n_tile_entries,
+            BufferKind::Storage,
+            wgpu::BufferUsage::CopyDst
+        ),
+    };
+    buffers.ops.submit_write(view.ops, {0, (int32_t) view.n_ops - 1});
+    buffers.tile_grid.submit_write(view.grid, 0);
+    buffers.tiles.submit_write(view.tiles, {0, (int32_t) view.n_tile_entries - 1});
+    if (_capacity == 0) return buffers;
+    
+    _evict(_capacity - 1);
+    _entries.push_front({
+        h,
+        std::vector<SdfGpuOp>(view.ops,   view.ops   + view.n_ops),
+        std::vector<SdfTile> (view.tiles, view.tiles + view.n_tile_entries),
+        view.grid,
+        buffers,
+    });
+    _index.insert({h, _entries.begin()});
+    return buffers;
+}
+
+void SdfTapeCache::_evict(size_t capacity) {
+    while (_entries.size() > capacity) {
+        EntryList::iterator e = std::prev(_entries.end());
+        auto [begin, end] = _index.equal_range(e->hash);
+        for (auto i = begin; i != end; ++i) {
+            if (i->second == e) {
+                _index.erase(i);
+                break;
+            }
+        }
+        _entries.erase(e);
+    }
+}
+
+void SdfTapeCache::set_capacity(size_t capacity) {
+    _capacity = capacity;
+    _evict(capacity);
+}
+
+void SdfTapeCache::clear() {
+    _index.clear();
+    _entries.clear();
+}
+
+namespace {
+
+// `variations` copies of the `n` parameters `params`, one after another
+std::vector<float> repeat_params(const float* params, gpu_size_t n, gpu_size_t variations) {
+    std::vector<float> out((size_t) n * variations);
+    for (size_t v = 0; v < variations; ++v) {
+        std::copy(params, params + n, out.begin() + v * n);
+    }
+    return out;
+}
+
+} // namespace
+
 SdfGpuExpr::SdfGpuExpr(
         SdfEvaluator& evaluator,
-        SdfNodeRef<T> expr,
+        const SdfTapeView& view,
         gpu_size_t param_x_variations,
         gpu_size_t param_dx_variations):
+    _n_params(view.n_params),
+    _n_tiles(view.n_tile_entries - 1),
+    _stack_depth(view.stack_depth),
     _n_param_x_variations(param_x_variations),
-    _n_param_dx_variations(param_dx_variations)
+    _n_param_dx_variations(param_dx_variations),
+    _host_params_x(repeat_params(view.params_x, view.n_params, param_x_variations)),
+    _host_params_dx(repeat_params(view.params_dx, view.n_params, param_dx_variations)),
+    _dirty_x {0, 0},
+    _dirty_dx {0, 0},
+    _culled(std::any_of(view.ops, view.ops + view.n_ops, [](const SdfGpuOp& op) {
+        return op.op == SdfOp::BvhUnion;
+    }))
 {
+    // sdf_eval.wgsl skips the ops it doesn't implement, which would leave it short of
+    // values on its stack
+    for (gpu_size_t i = 0; i < view.n_ops; ++i) {
+        if (view.ops[i].op == SdfOp::Mesh or view.ops[i].op == SdfOp::VoxelGrid) {
+            std::cerr << "SDF tape has an op which is only evaluated on the CPU "
+                      << "(op " << (uint32_t) view.ops[i].op << ")" << std::endl;
+            std::abort();
+        }
+    }
     wgpu::Device device = evaluator.device();
     
-    // serialize expression
-    ExprBuffer buf;
-    _push_expr(buf, expr);
+    // share the structure of the tape with any other expression of the same shape
+    _tape = evaluator.tape_cache().buffers(view);
     
     // initialize buffers
-    _ops = DataBuffer<SdfGpuOp>(
-        device,
-        buf.ops.size(),
-        BufferKind::Storage,
-        wgpu::BufferUsage::CopyDst
-    );
     _params_x = DataBuffer<float>(
         device,
-        param_x_variations * buf.size(),
+        param_x_variations * view.n_params,
         BufferKind::Storage,
         wgpu::BufferUsage::CopyDst
     );
     _params_dx = DataBuffer<float>(
         device,
-        param_dx_variations * buf.size(),
+        param_dx_variations * view.n_params,
         BufferKind::Storage,
         wgpu::BufferUsage::CopyDst
     );
     
-    // upload data
-    _ops.submit_write(buf.ops);
-    int32_t n = buf.size();
-    for (int32_t i = 0; i < param_x_variations; ++i) {
-        // write a copy of the parameters for each variation
-        _params_x.submit_write(buf.params_x.data(), {i * n, (i + 1) * n - 1});
-    }
-    for (int32_t i = 0; i < param_dx_variations; ++i) {
-        // ...
-        _params_dx.submit_write(buf.params_dx.data(), {i * n, (i + 1) * n - 1});
-    }
+    // upload data (every variation at once, from the host copies)
+    if (not _host_params_x.empty())  _params_x.submit_write(_host_params_x);
+    if (not _host_params_dx.empty()) _params_dx.submit_write(_host_params_dx);
     
     // init bindgroup
     _bindgroup = {
         device,
         evaluator.expr_layout(),
         {
-            buffer_entry<SdfGpuOp>(0, _ops, _ops.size()),
+            buffer_entry<SdfGpuOp>(0, _tape.ops, _tape.ops.size()),
             buffer_entry<float>(1, _params_x,  _params_x.size()),
             buffer_entry<float>(2, _params_dx, _params_dx.size()),
+            buffer_entry<SdfTileGrid>(3, _tape.tile_grid, 1),
+            buffer_entry<SdfTile>(4, _tape.tiles, _tape.tiles.size()),
         },
         "SDF GPU expression bindgroup",
     };
 }
 
+SdfGpuExpr::SdfGpuExpr(
+        SdfEvaluator& evaluator,
+        const SdfTiledTape& tiled,
+        gpu_size_t param_x_variations,
+        gpu_size_t param_dx_variations):
+    SdfGpuExpr(evaluator, tiled.view(), param_x_variations, param_dx_variations)
+{
+    _node_params = tiled.tape.node_params;
+}
+
+SdfGpuExpr::SdfGpuExpr(
+        SdfEvaluator& evaluator,
+        const SdfTape& tape,
+        gpu_size_t param_x_variations,
+        gpu_size_t param_dx_variations):
+    SdfGpuExpr(evaluator, SdfTiledTape(tape), param_x_variations, param_dx_variations) {}
+
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+SdfGpuExpr::SdfGpuExpr(
+        SdfEvaluator& evaluator,
+        SdfNodeRef<T> expr,
+        gpu_size_t param_x_variations,
+        gpu_size_t param_dx_variations,
+        SdfMerge merge):
+    SdfGpuExpr(evaluator, SdfTape(expr, merge), param_x_variations, param_dx_variations) {}
+
 // explicit template instantiation
 template SdfGpuExpr::SdfGpuExpr(
     SdfEvaluator& evaluator,
     SdfNodeRef<float> expr,
     gpu_size_t param_x_variations,
-    gpu_size_t param_dx_variations
+    gpu_size_t param_dx_variations,
+    SdfMerge merge
 );
 
 template SdfGpuExpr::SdfGpuExpr(
     SdfEvaluator& evaluator,
     SdfNodeRef<Dual<float>> expr,
     gpu_size_t param_x_variations,
-    gpu_size_t param_dx_variations
+    gpu_size_t param_dx_variations,
+    SdfMerge merge
 );
 
+namespace {
+
+const SdfTapeBatch& nonempty_batch(const SdfTapeBatch& batch) {
+    if (batch.n_exprs() == 0) {
+        std::cerr << "SdfGpuExprBatch needs at least one expression" << std::endl;
+        std::abort();
+    }
+    return batch;
+}
+
+} // namespace
+
+SdfGpuExprBatch::SdfGpuExprBatch(SdfEvaluator& evaluator, const SdfTapeBatch& batch):
+    _expr(evaluator, nonempty_batch(batch).view()),
+    _param_offsets(batch.param_offsets) {}
+
+namespace {
+
+// overwrite `host[begin, begin + n)` with `v`, and widen `dirty` to cover the values
+// which changed. returns whether any did.
+bool write_params(
+        std::vector<float>& host,
+        SdfParamRange& dirty,
+        size_t begin,
+        const float* v,
+        gpu_size_t n)
+{
+    size_t lo = n;
+    size_t hi = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (host[begin + i] != v[i]) {
+            host[begin + i] = v[i];
+            lo = std::min(lo, i);
+            hi = i + 1;
+        }
+    }
+    if (lo >= hi) return false;
+    if (dirty.begin < dirty.end) {
+        dirty.begin = std::min<gpu_size_t>(dirty.begin, begin + lo);
+        dirty.end   = std::max<gpu_size_t>(dirty.end,   begin + hi);
+    } else {
+        dirty = {(gpu_size_t) (begin + lo), (gpu_size_t) (begin + hi)};
+    }
+    return true;
+}
+
+} // namespace
+
+void SdfGpuExpr::_write_params(
+        gpu_size_t v_begin,
+        gpu_size_t v_end,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n)
+{
+    if (begin + n > _n_params) {
+        std::cerr << "SDF parameter update [" << begin << ", " << begin + n << ") "
+                  << "is out of range (" << _n_params << " parameters)" << std::endl;
+        std::abort();
+    }
+    if (x) {
+        bool changed = false;
+        for (size_t v = v_begin; v < std::min(v_end, _n_param_x_variations); ++v) {
+            changed |= write_params(_host_params_x, _dirty_x, v * _n_params + begin, x, n);
+        }
+        if (changed and _culled) {
+            std::cerr << "SDF parameter values can't be updated: the tape has a culled "
+                      << "union, whose bounds were fit to the old values" << std::endl;
+            std::abort();
+        }
+        // the tiles were pruned with the old values
+        if (changed) _n_tiles = 0;
+    }
+    if (dx) {
+        for (size_t v = v_begin; v < std::min(v_end, _n_param_dx_variations); ++v) {
+            write_params(_host_params_dx, _dirty_dx, v * _n_params + begin, dx, n);
+        }
+    }
+}
+
+void SdfGpuExpr::update_params(
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n)
+{
+    _write_params(0, std::max(_n_param_x_variations, _n_param_dx_variations), begin, x, dx, n);
+}
+
+void SdfGpuExpr::update_variation_params(
+        gpu_size_t variation,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n)
+{
+    if ((x and variation >= _n_param_x_variations) or
+        (dx and variation >= _n_param_dx_variations))
+    {
+        std::cerr << "SDF parameter variation " << variation << " is out of range ("
+                  << _n_param_x_variations << " value and " << _n_param_dx_variations
+                  << " tangent variations)" << std::endl;
+        std::abort();
+    }
+    _write_params(variation, variation + 1, begin, x, dx, n);
+}
+
 template <typename T>
-void SdfGpuExpr::_push_expr(ExprBuffer& buf, SdfNodeRef<T> expr) {
-    size_t n_params = expr->n_params();
-    gpu_size_t param_start = buf.size();
-    gpu_size_t param_end   = param_start;
-    if (n_params > 0) {
-        param_end = buf.extend(expr->params(), n_params);
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+void SdfGpuExpr::update_params(const SdfNode<T>& node) {
+    if (node.n_params() == 0) return;
+    auto i = _node_params.find(&node);
+    if (i == _node_params.end()) {
+        std::cerr << "SDF node is not part of the expression being updated" << std::endl;
+        std::abort();
     }
-    uint32_t op_index = buf.size(); 
-    buf.ops.push_back({
-        .op          = expr->op(),
-        .variant     = SdfOpVariant::None,
-        .param_start = param_start,
-        .param_end   = param_end
-    });
-    for (size_t i = 0; i < expr->n_children(); ++i) {
-        _push_expr(buf, expr->child(i));
+    SdfParamRange r = i->second;
+    gpu_size_t n = r.end - r.begin;
+    if (node.n_params() != n) {
+        std::cerr << "SDF node has " << node.n_params() << " parameters, "
+                  << "but was serialized with " << n << std::endl;
+        std::abort();
     }
-    if (expr->transforms_domain()) {
-        buf.ops.push_back({
-            .op          = SdfOp::PopDomain,
-            .push_index  = op_index,
-            .param_start = 0,
-            .param_end   = 0,
-        });
+    if constexpr (std::is_same_v<T, float>) {
+        update_params(r.begin, node.params(), nullptr, n);
+    } else {
+        std::vector<float> x(n);
+        std::vector<float> dx(n);
+        const Dual<float>* ps = node.params();
+        for (gpu_size_t j = 0; j < n; ++j) {
+            x[j]  = ps[j].x;
+            dx[j] = ps[j].dx;
+        }
+        update_params(r.begin, x.data(), dx.data(), n);
     }
 }
 
 // explicit template instantiation
-template void SdfGpuExpr::_push_expr(ExprBuffer&, SdfNodeRef<float>);
-template void SdfGpuExpr::_push_expr(ExprBuffer&, SdfNodeRef<Dual<float>>);
+template void SdfGpuExpr::update_params(const SdfNode<float>& node);
+template void SdfGpuExpr::update_params(const SdfNode<Dual<float>>& node);
 
-SdfInput::SdfInput(SdfEvaluator& evaluator, gpu_size_t samples_x, gpu_size_t samples_dx):
+void SdfGpuExpr::_upload_dirty(
+        DataBuffer<float>& buffer,
+        const std::vector<float>& host,
+        SdfParamRange& dirty)
+{
+    if (dirty.begin >= dirty.end) return;
+    // the host copy holds every variation, so the values between the changed ones are
+    // current too, and the whole span goes in one write
+    buffer.submit_write(
+        host.data() + dirty.begin,
+        {(int32_t) dirty.begin, (int32_t) (dirty.end - 1)}
+    );
+    dirty = {0, 0};
+}
+
+void SdfGpuExpr::upload_params() {
+    _upload_dirty(_params_x,  _host_params_x,  _dirty_x);
+    _upload_dirty(_params_dx, _host_params_dx, _dirty_dx);
+}
+
+SdfInput::SdfInput(
+        SdfEvaluator& evaluator,
+        gpu_size_t samples_x,
+        gpu_size_t samples_dx,
+        SdfSampleOrder order):
     _samples_x (evaluator.device(), samples_x,  BufferKind::Storage, wgpu::BufferUsage::CopyDst),
     _samples_dx(evaluator.device(), samples_dx, BufferKind::Storage, wgpu::BufferUsage::CopyDst),
+    _order(
+        evaluator.device(),
+        order != SdfSampleOrder::Unsorted ? samples_x : 1,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopyDst
+    ),
+    _set_buffer(evaluator.device(), 1, BufferKind::Uniform),
     _read_bindgroup {
         evaluator.device(),
         evaluator.samples_layout(),
         {
-            buffer_entry<vec3gpu>(0, _samples_x,  _samples_x.size()),
-            buffer_entry<vec3gpu>(1, _samples_dx, _samples_dx.size()),
+            buffer_entry<vec3gpu>        (0, _samples_x,  _samples_x.size()),
+            buffer_entry<vec3gpu>        (1, _samples_dx, _samples_dx.size()),
+            buffer_entry<gpu_size_t>     (2, _order,      _order.size()),
+            buffer_entry<PaddedSampleSet>(3, _set_buffer, 1),
         },
         "SDF input samples bindgroup",
-    } {}
+    },
+    _sample_order(order)
+{
+    _set_buffer.submit_write(PaddedSampleSet {_set}, 0);
+}
+
+SdfInput::SdfInput(SdfEvaluator& evaluator, const SdfSampleSet& samples):
+    SdfInput(evaluator, 1, 1)
+{
+    write_sample_set(samples);
+}
+
+void SdfInput::write_sample_set(const SdfSampleSet& samples) {
+    if (not samples.procedural()) {
+        std::cerr << "SDF input sample set is not procedural" << std::endl;
+        std::abort();
+    }
+    _set = samples;
+    _set_buffer.submit_write(PaddedSampleSet {_set}, 0);
+}
 
 void SdfInput::write_samples_x(const vec3gpu* samples) {
-    _samples_x.submit_write(samples, {0, n_samples_x() - 1});
+    if (procedural()) {
+        std::cerr << "SDF input samples are procedural, and can't be written" << std::endl;
+        std::abort();
+    }
+    if (not sorted()) {
+        _samples_x.submit_write(samples, {0, n_samples_x() - 1});
+        return;
+    }
+    gpu_size_t n = n_samples_x();
+    _host_order = stereo::sample_order(samples, n, _sample_order);
+    std::vector<vec3gpu> sorted_samples(n);
+    for (gpu_size_t k = 0; k < n; ++k) {
+        sorted_samples[k] = samples[_host_order[k]];
+    }
+    _samples_x.submit_write(sorted_samples.data(), {0, n - 1});
+    _order.submit_write(_host_order.data(), {0, n - 1});
 }
 
 void SdfInput::write_samples_dx(const vec3gpu* samples) {
+    if (procedural()) {
+        std::cerr << "SDF input samples are procedural, and can't be written" << std::endl;
+        std::abort();
+    }
+    // per-sample tangents follow their samples
+    if (sorted() and n_samples_dx() == n_samples_x() and not _host_order.empty()) {
+        gpu_size_t n = n_samples_dx();
+        std::vector<vec3gpu> sorted_samples(n);
+        for (gpu_size_t k = 0; k < n; ++k) {
+            sorted_samples[k] = samples[_host_order[k]];
+        }
+        _samples_dx.submit_write(sorted_samples.data(), {0, n - 1});
+        return;
+    }
     _samples_dx.submit_write(samples, {0, n_samples_dx() - 1});
 }
     
-SdfOutput::SdfOutput(SdfEvaluator& evaluator, gpu_size_t n_samples):
-    _sdf_x    (evaluator.device(), n_samples, BufferKind::Storage, wgpu::BufferUsage::CopySrc),
-    _sdf_dx   (evaluator.device(), n_samples, BufferKind::Storage, wgpu::BufferUsage::CopySrc),
-    _normal_x (evaluator.device(), n_samples, BufferKind::Storage, wgpu::BufferUsage::CopySrc),
-    _normal_dx(evaluator.device(), n_samples, BufferKind::Storage, wgpu::BufferUsage::CopySrc),
+SdfOutput::SdfOutput(
+        SdfEvaluator&   evaluator,
+        gpu_size_t      n_samples,
+        SdfEvalMode     mode,
+        SdfOutputLayout layout):
+    _sdf_x    (
+        evaluator.device(),
+        layout == SdfOutputLayout::Separate ? n_samples : 1,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopySrc
+    ),
+    _sdf_dx   (
+        evaluator.device(),
+        layout == SdfOutputLayout::Separate and mode >= SdfEvalMode::Dual ? n_samples : 1,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopySrc
+    ),
+    _normal_x (
+        evaluator.device(),
+        layout == SdfOutputLayout::Separate and mode >= SdfEvalMode::Gradient ? n_samples : 1,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopySrc
+    ),
+    _normal_dx(
+        evaluator.device(),
+        layout == SdfOutputLayout::Separate and mode >= SdfEvalMode::Dual ? n_samples : 1,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopySrc
+    ),
+    _records  (
+        evaluator.device(),
+        std::max<gpu_size_t>(n_samples * sdf_record_words(layout, mode), 1),
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopySrc
+    ),
     _bindgroup {
         evaluator.device(),
         evaluator.output_layout(),
         {
-            buffer_entry<float>  (0, _sdf_x,    _sdf_x.size()),
+            // (the shader writes the distances or the records through binding 0)
+            layout == SdfOutputLayout::Separate
+                ? buffer_entry<float>   (0, _sdf_x,   _sdf_x.size())
+                : buffer_entry<uint32_t>(0, _records, _records.size()),
             buffer_entry<float>  (1, _sdf_dx,   _sdf_dx.size()),
             buffer_entry<vec3gpu>(2, _normal_x, _normal_x.size()),
             buffer_entry<vec3gpu>(3, _normal_dx,_normal_dx.size()),
         },
         "SDF output values bindgroup"
-    } {}
+    },
+    _n_samples(n_samples),
+    _mode(mode),
+    _layout(layout) {}
 
-std::pair<gpu_size_t, gpu_size_t> SdfEvaluator::_prepare_ranges(
-    gpu_size_t samples,
-    gpu_size_t n_variations,
-    ParamVariation variation_scheme)
-{
-    // todo: handle "no variation" case and break up
-    //   samples into smaller ranges with identical parameters.
+void SdfEvaluator::_upload_offsets(const std::vector<ParamOffset>& param_offsets) {
+    gpu_size_t n_variations = param_offsets.size();
     if (not _point_offsets or _point_offsets.size() < n_variations) {
         // buffer not created to the correct size. (re)create
         _point_offsets = DataBuffer<ParamOffset>(
@@ -211,18 +587,31 @@ std::pair<gpu_size_t, gpu_size_t> SdfEvaluator::_prepare_ranges(
     // point variation first
     // (we are not doing point variation for now, so they all have zero offset
     _point_offsets.submit_write(buf.data(), {0, (int32_t) n_variations - 1});
-    gpu_size_t x_stride  = variation_scheme == ParamVariation::VaryDerivative ? 0 : samples;
-    gpu_size_t dx_stride = variation_scheme == ParamVariation::VaryParam      ? 0 : samples;
-    for (gpu_size_t i = 0; i < n_variations; ++i) {
-        buf[i] = {i * x_stride, i * dx_stride};
-    }
     _param_offsets.submit_write(
-        buf.data() + n_variations, 
+        param_offsets.data(),
         {
             0,
             (int32_t) n_variations - 1
         }
     );
+}
+
+std::pair<gpu_size_t, gpu_size_t> SdfEvaluator::_prepare_ranges(
+    gpu_size_t samples,
+    gpu_size_t n_variations,
+    gpu_size_t n_params,
+    ParamVariation variation_scheme)
+{
+    // todo: handle "no variation" case and break up
+    //   samples into smaller ranges with identical parameters.
+    // each variation reads its own copy of the parameter block
+    gpu_size_t x_stride  = variation_scheme == ParamVariation::VaryDerivative ? 0 : n_params;
+    gpu_size_t dx_stride = variation_scheme == ParamVariation::VaryParam      ? 0 : n_params;
+    std::vector<ParamOffset> buf {n_variations};
+    for (gpu_size_t i = 0; i < n_variations; ++i) {
+        buf[i] = {i * x_stride, i * dx_stride};
+    }
+    _upload_offsets(buf);
     
     return {samples, n_variations};
 }
@@ -240,6 +629,8 @@ SdfEvaluator::SdfEvaluator(wgpu::Device device):
             storage_buffer_layout<SdfGpuOp>(0, BufferTarget::Read, BothStages),
             storage_buffer_layout<float>(1, BufferTarget::Read, BothStages),
             storage_buffer_layout<float>(2, BufferTarget::Read, BothStages),
+            storage_buffer_layout<SdfTileGrid>(3, BufferTarget::Read, BothStages),
+            storage_buffer_layout<SdfTile>(4, BufferTarget::Read, BothStages),
         },
         "SDF expression bindgroup layout",
     },
@@ -248,6 +639,8 @@ SdfEvaluator::SdfEvaluator(wgpu::Device device):
         {
             compute_r_buffer_layout<vec3gpu>(0),
             compute_r_buffer_layout<vec3gpu>(1),
+            compute_r_buffer_layout<gpu_size_t>(2),
+            uniform_layout<UniformBox<SdfSampleSet>>(3),
         },
         "SDF input samples layout",
     },
@@ -275,18 +668,34 @@ SdfEvaluator::SdfEvaluator(wgpu::Device device):
         1,
         BufferKind::Uniform,
         wgpu::BufferUsage::CopyDst,
-    }
+    },
+    _tape_cache(_device) {}
+
+wgpu::ComputePipeline SdfEvaluator::_eval_pipeline(
+        gpu_size_t stack_size,
+        SdfEvalMode mode,
+        SdfOutputLayout layout)
 {
+    // stack sizes are powers of two, starting from the smallest
+    size_t i = std::countr_zero(stack_size / SdfMinStackSize);
+    wgpu::ComputePipeline& pipeline = _eval_pipelines[(size_t) layout][(size_t) mode][i];
+    if (pipeline) return pipeline;
+    
     wgpu::ShaderModule shader = shader_from_file(
         _device,
-        "resource/shaders/sdf/sdf_eval_main.wgsl"
+        "resource/shaders/sdf/sdf_eval_main.wgsl",
+        {
+            {"STACK_SIZE",    stack_size},
+            {"EVAL_MODE",     (uint32_t) mode},
+            {"OUTPUT_LAYOUT", (uint32_t) layout},
+        }
     );
     if (not shader) {
         std::cerr << "Failed to load SDF evaluation shader." << std::endl;
         std::abort();
     }
     
-    _eval_pipeline = create_compute_pipeline(
+    pipeline = create_compute_pipeline(
         _device,
         shader,
         {
@@ -297,6 +706,7 @@ SdfEvaluator::SdfEvaluator(wgpu::Device device):
         },
         "SDF evaluation pipeline"
     );
+    return pipeline;
 }
 
 SdfOutputRef SdfEvaluator::evaluate(
@@ -304,32 +714,83 @@ SdfOutputRef SdfEvaluator::evaluate(
     const SdfInput& input,
     gpu_size_t param_variations,
     ParamVariation variation_scheme,
-    SdfOutputRef output)
+    SdfOutputRef output,
+    SdfEvalMode mode)
 {
     // set up the output
     gpu_size_t sample_points = input.n_samples_x() * param_variations;
-    if (output == nullptr or output->n_samples() < sample_points) {
-        output = std::make_shared<SdfOutput>(*this, sample_points);
+    if (output == nullptr or output->n_samples() < sample_points or output->mode() < mode) {
+        SdfOutputLayout layout = output ? output->layout() : SdfOutputLayout::Separate;
+        output = std::make_shared<SdfOutput>(*this, sample_points, mode, layout);
     }
     // set up the parameter ranges
     auto [samples, variations] = _prepare_ranges(
         input.n_samples_x(),
         param_variations,
+        expr.n_params(),
         variation_scheme
     );
-    // pass the explicit range to the shader
-    PaddedWorkRange wr {samples, variations};
-    _work_range.submit_write(wr, 0);
+    // pass the explicit range to the shader. pruned tiles are only valid
+    // for the parameters they were built with, so they can't be used if those vary.
+    bool use_tiles = expr.n_tiles() > 0 and variation_scheme == ParamVariation::VaryDerivative;
+    WorkRange wr {
+        samples,
+        variations,
+        (gpu_size_t) use_tiles,
+        (gpu_size_t) input.sorted(),
+        0,
+        output->record_words(),
+    };
+    _dispatch(expr, input, *output, wr, mode);
+    return output;
+}
+
+SdfOutputRef SdfEvaluator::evaluate(
+    const SdfGpuExprBatch& batch,
+    const SdfInput& input,
+    SdfOutputRef output,
+    SdfEvalMode mode)
+{
+    // set up the output
+    gpu_size_t n_exprs       = batch.n_exprs();
+    gpu_size_t sample_points = input.n_samples_x() * n_exprs;
+    if (output == nullptr or output->n_samples() < sample_points or output->mode() < mode) {
+        SdfOutputLayout layout = output ? output->layout() : SdfOutputLayout::Separate;
+        output = std::make_shared<SdfOutput>(*this, sample_points, mode, layout);
+    }
+    // each expression is a "variation", with its own offset into the parameters;
+    // and each runs its own tape, which is stored as a tile
+    _upload_offsets(batch.param_offsets());
+    WorkRange wr {input.n_samples_x(), n_exprs, 0, (gpu_size_t) input.sorted(), 1, output->record_words()};
+    _dispatch(batch.expr(), input, *output, wr, mode);
+    return output;
+}
+
+void SdfEvaluator::_dispatch(
+    const SdfGpuExpr& expr,
+    const SdfInput& input,
+    const SdfOutput& output,
+    const WorkRange& work_range,
+    SdfEvalMode mode)
+{
+    _work_range.submit_write(PaddedWorkRange {work_range}, 0);
+    
+    gpu_size_t wg_x = ceil_div(work_range.n_samples,    Wg_W);
+    gpu_size_t wg_y = ceil_div(work_range.n_variations, Wg_H);
     
-    gpu_size_t wg_x = ceil_div(samples,    Wg_W);
-    gpu_size_t wg_y = ceil_div(variations, Wg_H);
+    // use the smallest stacks which fit the tape, to save registers
+    wgpu::ComputePipeline pipeline = _eval_pipeline(
+        sdf_stack_size(expr.stack_depth()),
+        mode,
+        output.layout()
+    );
     
     wgpu::CommandEncoder encoder = _device.createCommandEncoder();
     wgpu::ComputePassEncoder pass = encoder.beginComputePass();
-    pass.setPipeline(_eval_pipeline);
+    pass.setPipeline(pipeline);
     pass.setBindGroup(0, expr.bindgroup(),       0, nullptr);
     pass.setBindGroup(1, input.read_bindgroup(), 0, nullptr);
-    pass.setBindGroup(2, output->bindgroup(),    0, nullptr);
+    pass.setBindGroup(2, output.bindgroup(),     0, nullptr);
     pass.setBindGroup(3, _offsets_bindgroup,     0, nullptr);
     pass.dispatchWorkgroups(wg_x, wg_y, 1);
     pass.end();
@@ -340,8 +801,6 @@ SdfOutputRef SdfEvaluator::evaluate(
     encoder.release();
     queue.submit(commands);
     queue.release();
-    
-    return output;
 }
     
 } // namespace stereo
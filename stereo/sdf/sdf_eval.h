@@ -1,8 +1,14 @@
 #pragma once
 
+#include <list>
+
 #include <geomc/linalg/Quaternion.h>
 
-#include <stereo/sdf/sdf_structs.h>
+#include <stereo/sdf/sdf_batch.h>
+#include <stereo/sdf/sdf_order.h>
+#include <stereo/sdf/sdf_packing.h>
+#include <stereo/sdf/sdf_prune.h>
+#include <stereo/sdf/sdf_samples.h>
 #include <stereo/gpu/uniform.h>
 #include <stereo/gpu/bindgroup.h>
 #include <stereo/gpu/buffer.h>
@@ -12,40 +18,98 @@
 //   - if zero variation, break up the points into eight groups (stride = samples / 8)
 //     and hold variation constant (stride = 0)
 //   > return from the setup calc the exact X and Y dimensions, bc of the above
-// todo: readback functionality
-// todo: means of going from a parameters back to an expr tree
 
 namespace stereo {
 
-enum struct ParamVariation {
-    VaryParam,
-    VaryDerivative,
-    VaryBoth,
-};
-
-struct SdfGpuOp {
-    SdfOp op;
-    union {
-        SdfOpVariant variant;
-        uint32_t     push_index;
-        int32_t      int_param;
-    };
-    gpu_size_t param_start;
-    gpu_size_t param_end;
-};
-
-struct ParamOffset {
-    gpu_size_t x_offset  = 0;
-    gpu_size_t dx_offset = 0;
-};
-
 struct SdfEvaluator;
 struct SdfGpuExpr;
+struct SdfGpuExprBatch;
 struct SdfInput;
 struct SdfOutput;
 
 using SdfOutputRef = std::shared_ptr<SdfOutput>;
 
+/// Smallest and largest stack sizes of the evaluation shader.
+constexpr gpu_size_t SdfMinStackSize = 4;
+constexpr gpu_size_t SdfMaxStackSize = 64;
+
+/**
+ * @brief The `STACK_SIZE` of the shader variant which runs tapes of `stack_depth`.
+ *
+ * Stacks are sized to the next power of two, so that only a few variants are compiled.
+ * Aborts if the tape is too deep for any variant.
+ */
+gpu_size_t sdf_stack_size(size_t stack_depth);
+
+/**
+ * @brief The GPU buffers of the structure of a tiled tape: its ops, and its tile tables.
+ *
+ * These never change once uploaded, so they may be shared between expressions.
+ */
+struct SdfTapeBuffers {
+    DataBuffer<SdfGpuOp>    ops;
+    DataBuffer<SdfTileGrid> tile_grid;
+    DataBuffer<SdfTile>     tiles;
+};
+
+/**
+ * @brief A cache of uploaded tape structures, shared by expressions of the same shape.
+ *
+ * Trees which differ only in their parameter values (e.g. the candidates of an optimizer)
+ * serialize to the same ops, so their expressions can share one set of `SdfTapeBuffers`,
+ * and each only owns its parameter buffers and bindgroup (the bindgroup layout is the
+ * evaluator's). Structures are keyed by a hash of the serialized ops and tile tables,
+ * rather than of the node tree: with `SdfMerge::Identical` (or `Static`), subtrees are
+ * merged when their parameters happen to be equal, so the ops of a tree depend on its
+ * values too. (Tiles are pruned with the parameter values, so tiled tapes rarely share.)
+ * A hit is confirmed by comparing the whole structure, so collisions of the hash are
+ * harmless.
+ *
+ * When more than `capacity()` structures are cached, the least recently used one is
+ * dropped. Buffers are reference counted, so expressions which still use a dropped
+ * structure keep it alive.
+ */
+struct SdfTapeCache {
+private:
+    struct Entry {
+        size_t                hash;
+        std::vector<SdfGpuOp> ops;
+        std::vector<SdfTile>  tiles;
+        SdfTileGrid           grid;
+        SdfTapeBuffers        buffers;
+    };
+    using EntryList = std::list<Entry>;
+    
+    wgpu::Device _device;
+    size_t       _capacity;
+    // most recently used first
+    EntryList    _entries;
+    Multimap<size_t, EntryList::iterator> _index;
+    size_t       _hits   = 0;
+    size_t       _misses = 0;
+    
+    void _evict(size_t capacity);
+    
+public:
+    
+    static constexpr size_t DefaultCapacity = 64;
+    
+    SdfTapeCache(wgpu::Device device, size_t capacity=DefaultCapacity);
+    
+    /// The buffers holding the structure of `view`, uploaded if not already cached.
+    SdfTapeBuffers buffers(const SdfTapeView& view);
+    
+    /// Set the most structures to keep, dropping the least recently used beyond it.
+    void set_capacity(size_t capacity);
+    void clear();
+    
+    size_t size()     const { return _entries.size(); }
+    size_t capacity() const { return _capacity; }
+    /// Number of lookups which found (or did not find) their structure, since creation.
+    size_t hits()     const { return _hits; }
+    size_t misses()   const { return _misses; }
+};
+
 /**
  * Keeps a pipeline for evaluating SDFs.
  */
@@ -55,6 +119,10 @@ private:
     struct WorkRange {
         gpu_size_t n_samples;
         gpu_size_t n_variations;
+        gpu_size_t use_tiles;
+        gpu_size_t sorted;
+        gpu_size_t batched;
+        gpu_size_t out_stride;
     };
     
     using PaddedWorkRange = UniformBox<WorkRange>;
@@ -73,39 +141,86 @@ private:
     DataBuffer<PaddedWorkRange> _work_range;
     BindGroup                   _offsets_bindgroup;
     
-    // compute pipeline
-    wgpu::ComputePipeline _eval_pipeline;
+    // uploaded tape structures
+    SdfTapeCache _tape_cache;
+    
+    // compute pipelines, one per output layout, evaluation mode, and stack size
+    // from 4 to 64 (compiled on demand)
+    wgpu::ComputePipeline _eval_pipelines[3][3][5];
     
     friend class SdfGpuExpr;
     friend class SdfInput;
     friend class SdfOutput;
     
 protected:
+    // get the pipeline which evaluates `mode` with stacks `stack_size` deep, and
+    // writes outputs of `layout`
+    wgpu::ComputePipeline _eval_pipeline(
+        gpu_size_t stack_size,
+        SdfEvalMode mode,
+        SdfOutputLayout layout);
+    
+    // upload the parameter offset of each variation (or batched expression)
+    void _upload_offsets(const std::vector<ParamOffset>& param_offsets);
+    
     // return the sample count (x) by parameter variation count (y)
     std::pair<gpu_size_t, gpu_size_t> _prepare_ranges(
         gpu_size_t samples,
         gpu_size_t n_variations,
+        gpu_size_t n_params,
         ParamVariation variation_scheme
     );
     
+    // run the evaluation shader over `work_range`, with the offsets already uploaded
+    void _dispatch(
+        const SdfGpuExpr& expr,
+        const SdfInput& input,
+        const SdfOutput& output,
+        const WorkRange& work_range,
+        SdfEvalMode mode
+    );
+    
 public:
     
     SdfEvaluator(wgpu::Device device);
 
     wgpu::Device device() const { return _device; }
     
+    /**
+     * @brief Evaluate `expr` at every sample of `input`, for each of `param_variations`.
+     *
+     * Only the outputs of `mode` are computed, by a shader variant which skips the work
+     * of the other outputs. If `output` is null, too small, or was allocated for a
+     * lesser mode, a new one is allocated for `mode` (in the layout of `output`, if any).
+     */
     SdfOutputRef evaluate(
         const SdfGpuExpr& expr,
         const SdfInput& input,
         gpu_size_t param_variations,
         ParamVariation variation_scheme=ParamVariation::VaryDerivative,
-        SdfOutputRef output=nullptr
+        SdfOutputRef output=nullptr,
+        SdfEvalMode mode=SdfEvalMode::Dual
+    );
+    
+    /**
+     * @brief Evaluate every expression of `batch` at every sample of `input`, in a
+     * single dispatch.
+     *
+     * Results are laid out expression-major: expression `e` at sample `i` is at index
+     * `e * n_samples + i`. `output` and `mode` are as for a single expression.
+     */
+    SdfOutputRef evaluate(
+        const SdfGpuExprBatch& batch,
+        const SdfInput& input,
+        SdfOutputRef output=nullptr,
+        SdfEvalMode mode=SdfEvalMode::Dual
     );
     
     BindGroupLayout& expr_layout()     { return _expr_layout;    }
     BindGroupLayout& samples_layout()  { return _samples_layout; }
     BindGroupLayout& output_layout()   { return _output_layout;  }
     BindGroupLayout& offsets_layout()  { return _offsets_layout;  }
+    SdfTapeCache&    tape_cache()      { return _tape_cache;     }
     
 };
 
@@ -115,70 +230,259 @@ public:
  */
 struct SdfGpuExpr {
 private:
-    DataBuffer<SdfGpuOp> _ops;
-    DataBuffer<float>    _params_x;
-    DataBuffer<float>    _params_dx;
+    // (shared with other expressions of the same structure; see `SdfTapeCache`)
+    SdfTapeBuffers          _tape;
+    DataBuffer<float>       _params_x;
+    DataBuffer<float>       _params_dx;
+    gpu_size_t              _n_params;
+    gpu_size_t              _n_tiles;
+    gpu_size_t              _stack_depth;
     gpu_size_t           _n_param_x_variations;
     gpu_size_t           _n_param_dx_variations;
     BindGroup            _bindgroup;
     
-    // temporary buffer for serializing an sdf expr
-    struct ExprBuffer {
-        std::vector<SdfGpuOp> ops;
-        std::vector<float>    params_x;
-        std::vector<float>    params_dx;
-        
-        size_t size() const;
-        size_t extend(const float* v, size_t n);
-        size_t extend(const Dual<float>* v, size_t n);
-    };
+    // host copy of every variation of the parameters, and the span of it which has
+    // changed since the last upload (empty if `begin == end`)
+    std::vector<float>         _host_params_x;
+    std::vector<float>         _host_params_dx;
+    SdfParamRange              _dirty_x;
+    SdfParamRange              _dirty_dx;
+    DenseMap<const void*, SdfParamRange> _node_params;
+    // whether the tape has a culled union, whose bounds fix `params_x`
+    bool                       _culled;
     
-    // serialize a sub-expr
-    template <typename T>
-    void _push_expr(ExprBuffer& buf, SdfNodeRef<T> expr);
+    // write `[begin, begin + n)` of the variations `[v_begin, v_end)`
+    void _write_params(
+        gpu_size_t v_begin,
+        gpu_size_t v_end,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n);
+    
+    void _upload_dirty(
+        DataBuffer<float>& buffer,
+        const std::vector<float>& host,
+        SdfParamRange& dirty);
     
 public:
     
+    /**
+     * @brief Upload the buffers of a tiled tape, e.g. straight from a mapped file.
+     *
+     * The ops and tiles are only uploaded if the evaluator's `tape_cache()` does not
+     * already hold the same structure; the parameters are always uploaded.
+     * Since the view does not know the nodes the tape was built from,
+     * `update_params(const SdfNode<T>&)` is not available on the result; parameters
+     * may still be updated by index.
+     *
+     * It is an error for the tape to hold an op which is only evaluated on the CPU
+     * (`Mesh` or `VoxelGrid`).
+     */
+    SdfGpuExpr(
+            SdfEvaluator& evaluator,
+            const SdfTapeView& view,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1);
+    
+    /**
+     * @brief Upload a tape along with its per-tile pruned copies.
+     *
+     * Tiles are used only when evaluating with `ParamVariation::VaryDerivative`, since
+     * they are not valid for other values of `params_x` than those they were built with.
+     */
+    SdfGpuExpr(
+            SdfEvaluator& evaluator,
+            const SdfTiledTape& tape,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1);
+    
+    SdfGpuExpr(
+            SdfEvaluator& evaluator,
+            const SdfTape& tape,
+            gpu_size_t param_x_variations=1,
+            gpu_size_t param_dx_variations=1);
+    
+    /**
+     * @brief Serialize and upload the tree `expr`.
+     *
+     * By default only nodes which are the same object are merged, so that
+     * `update_params(const SdfNode<T>&)` changes exactly the node it is given (see
+     * `SdfMerge`).
+     */
     template <typename T>
     requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
     SdfGpuExpr(
             SdfEvaluator& evaluator,
             SdfNodeRef<T> expr,
             gpu_size_t param_x_variations=1,
-            gpu_size_t param_dx_variations=1);
+            gpu_size_t param_dx_variations=1,
+            SdfMerge merge=SdfMerge::Shared);
     
+    /// Number of parameters in a single variation of the expression.
+    gpu_size_t n_params()        const { return _n_params; }
+    /// Number of pruned tiles (zero if the expression is not tiled, or if its tiles
+    /// were invalidated by `update_params()`).
+    gpu_size_t n_tiles()         const { return _n_tiles; }
+    /// Stack depth needed to evaluate the expression (see `SdfTape::stack_depth()`).
+    gpu_size_t stack_depth()     const { return _stack_depth; }
     gpu_size_t n_x_variations()  const { return _n_param_x_variations; }
     gpu_size_t n_dx_variations() const { return _n_param_dx_variations; }
     
-    DataBuffer<float>& params_x()  { return _params_x; }
-    DataBuffer<float>& params_dx() { return _params_dx; }
+    /// The parameters of every variation, one after another. Write them with
+    /// `update_params()` or `update_variation_params()`, which keep a host copy.
+    const DataBuffer<float>& params_x()  const { return _params_x; }
+    const DataBuffer<float>& params_dx() const { return _params_dx; }
     
     const BindGroup& bindgroup() const { return _bindgroup; }
+    
+    /**
+     * @brief Overwrite the parameters `[begin, begin + n)` of every variation.
+     *
+     * Either of `x` or `dx` may be null to leave those values unchanged. Only values
+     * which actually change are marked for upload; nothing is sent to the GPU until
+     * `upload_params()`.
+     *
+     * Changing `params_x` disables the pruned tiles, since they are only valid for the
+     * parameters they were built with. It is an error if the tape has a culled union
+     * (see `SdfMerge::Static`), whose bounds would go stale.
+     */
+    void update_params(gpu_size_t begin, const float* x, const float* dx, gpu_size_t n);
+    
+    /**
+     * @brief Overwrite the parameters `[begin, begin + n)` of a single variation, as
+     * `update_params()` does for all of them.
+     *
+     * `variation` must be in range for each of `x` and `dx` which is given.
+     */
+    void update_variation_params(
+        gpu_size_t variation,
+        gpu_size_t begin,
+        const float* x,
+        const float* dx,
+        gpu_size_t n);
+    
+    /**
+     * @brief Copy the current parameters of `node` into the expression.
+     *
+     * `node` must be part of the tree the expression was built from, and may only change
+     * the values of its parameters, not their number. If the tape was built with
+     * `SdfMerge::Identical`, nodes which were identical at that time share their
+     * parameters, and will all see the update; build it with `SdfMerge::Shared` (the
+     * default when building from a tree) to update such nodes independently.
+     *
+     * The parameters of a `float` node only update `params_x`.
+     */
+    template <typename T>
+    requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+    void update_params(const SdfNode<T>& node);
+    
+    /**
+     * @brief Upload all parameters changed since the last upload.
+     *
+     * Each buffer gets at most one write, of the span from the first changed value to
+     * the last, across all the variations (the values between them are rewritten from
+     * the host copy, unchanged). The op buffer and the bindgroup are untouched.
+     */
+    void upload_params();
+};
+
+
+/**
+ * @brief A batch of distinct SDF expressions, evaluated together on the GPU (see
+ * sdf_batch.h).
+ *
+ * The expressions' tapes are uploaded as the tiles of a single tape, and each is
+ * evaluated as one "variation" with its own parameter offset.
+ */
+struct SdfGpuExprBatch {
+private:
+    SdfGpuExpr               _expr;
+    std::vector<ParamOffset> _param_offsets;
+    
+public:
+    
+    /// Upload `batch`, which must hold at least one expression.
+    SdfGpuExprBatch(SdfEvaluator& evaluator, const SdfTapeBatch& batch);
+    
+    gpu_size_t n_exprs() const { return _param_offsets.size(); }
+    
+    /// The offset of each expression's parameters, in the parameters of `expr()`.
+    const std::vector<ParamOffset>& param_offsets() const { return _param_offsets; }
+    
+    /**
+     * @brief The concatenated expressions.
+     *
+     * Its parameters may be updated by index; see `SdfGpuExpr::update_params()`.
+     */
+          SdfGpuExpr& expr()       { return _expr; }
+    const SdfGpuExpr& expr() const { return _expr; }
 };
 
 
 /**
  * @brief Represents a sampling of points at which to evaluate an SDF.
+ *
+ * If the input has a sample order (see sdf_order.h), the samples are uploaded sorted in
+ * that order, along with the permutation which sorted them; each invocation evaluates
+ * one sorted sample, and writes its results back to the sample's original index. The
+ * outputs are thus laid out as if the samples had not been sorted.
+ *
+ * An input may instead be made from a procedural `SdfSampleSet` (see sdf_samples.h),
+ * whose samples are generated by the evaluation shader; then no sample arrays are
+ * allocated, and only the set's descriptor is uploaded.
  */
 struct SdfInput {
 private:
-    DataBuffer<vec3gpu> _samples_x;
-    DataBuffer<vec3gpu> _samples_dx;
-    BindGroup           _read_bindgroup;
+    using PaddedSampleSet = UniformBox<SdfSampleSet>;
+    
+    DataBuffer<vec3gpu>     _samples_x;
+    DataBuffer<vec3gpu>     _samples_dx;
+    // the original index of each sorted sample (a placeholder if unsorted)
+    DataBuffer<gpu_size_t>  _order;
+    // the procedural sample set (of kind `Explicit` if the arrays hold the samples)
+    DataBuffer<PaddedSampleSet> _set_buffer;
+    BindGroup               _read_bindgroup;
+    SdfSampleOrder          _sample_order;
+    std::vector<gpu_size_t> _host_order;
+    SdfSampleSet            _set;
     
 public:
-    SdfInput(SdfEvaluator& evaluator, gpu_size_t samples_x, gpu_size_t samples_dx);
+    SdfInput(
+        SdfEvaluator& evaluator,
+        gpu_size_t samples_x,
+        gpu_size_t samples_dx,
+        SdfSampleOrder order=SdfSampleOrder::Unsorted);
+    
+    /// Evaluate the samples of the procedural set `samples`.
+    SdfInput(SdfEvaluator& evaluator, const SdfSampleSet& samples);
+    
+          DataBuffer<vec3gpu>& samples_x()        { return _samples_x; }
+    const DataBuffer<vec3gpu>& samples_x()  const { return _samples_x; }
+    
+          DataBuffer<vec3gpu>& samples_dx()       { return _samples_dx; }
+    const DataBuffer<vec3gpu>& samples_dx() const { return _samples_dx; }
     
-          DataBuffer<vec3gpu>& n_samples_x()        { return _samples_x; }
-    const DataBuffer<vec3gpu>& n_samples_x()  const { return _samples_x; }
+    // (the procedural samples each have a tangent)
+    gpu_size_t n_samples_x()  const { return procedural() ? _set.n_samples() : _samples_x.size(); }
+    gpu_size_t n_samples_dx() const { return procedural() ? _set.n_samples() : _samples_dx.size(); }
     
-          DataBuffer<vec3gpu>& n_samples_dx()       { return _samples_dx; }
-    const DataBuffer<vec3gpu>& n_samples_dx() const { return _samples_dx; }
+    SdfSampleOrder sample_order() const { return _sample_order; }
+    bool           sorted()       const { return _sample_order != SdfSampleOrder::Unsorted; }
     
-    // write the entire buffer. must provide samples_x() samples
+    bool                procedural() const { return _set.procedural(); }
+    const SdfSampleSet& sample_set() const { return _set; }
+    
+    // write the entire buffer. must provide n_samples_x() samples. if the input is sorted,
+    // per-sample tangents are permuted along with the samples last written, so they
+    // must be (re)written after the samples. not for procedural inputs.
     void write_samples_x(const vec3gpu* samples);
     void write_samples_dx(const vec3gpu* samples);
     
+    /// Replace the sample set of a procedural input, which may change its number of
+    /// samples (e.g. to follow a moving camera).
+    void write_sample_set(const SdfSampleSet& samples);
+    
     const BindGroup& read_bindgroup() const { return _read_bindgroup; }
 };
 
@@ -187,18 +491,47 @@ public:
  */
 struct SdfOutput {
 private:
-    DataBuffer<float>   _sdf_x;
-    DataBuffer<float>   _sdf_dx;
-    DataBuffer<vec3gpu> _normal_x;
-    DataBuffer<vec3gpu> _normal_dx;
-    BindGroup           _bindgroup;
+    DataBuffer<float>    _sdf_x;
+    DataBuffer<float>    _sdf_dx;
+    DataBuffer<vec3gpu>  _normal_x;
+    DataBuffer<vec3gpu>  _normal_dx;
+    DataBuffer<uint32_t> _records;
+    BindGroup            _bindgroup;
+    gpu_size_t           _n_samples;
+    SdfEvalMode          _mode;
+    SdfOutputLayout      _layout;
 
 public:
     
-    SdfOutput(SdfEvaluator& evaluator, gpu_size_t n_samples);
+    /**
+     * @brief Allocate the outputs of `mode` for `n_samples` samples, in `layout`.
+     *
+     * The buffers of outputs which `mode` does not compute (`sdf_dx` and `normal_dx`
+     * below `Dual`; `normal_x` below `Gradient`) hold a single placeholder element.
+     * With a layout other than `Separate`, all the outputs are in `records()`, and
+     * the four separate buffers are placeholders; and vice versa.
+     */
+    SdfOutput(
+        SdfEvaluator&   evaluator,
+        gpu_size_t      n_samples,
+        SdfEvalMode     mode=SdfEvalMode::Dual,
+        SdfOutputLayout layout=SdfOutputLayout::Separate);
     
-    gpu_size_t n_samples() const { return _sdf_x.size(); }
+    gpu_size_t      n_samples() const { return _n_samples; }
+    SdfEvalMode     mode()      const { return _mode; }
+    SdfOutputLayout layout()    const { return _layout; }
     const BindGroup& bindgroup() const { return _bindgroup; }
+    
+    /// Words per sample of `records()`; 0 for `Separate`.
+    gpu_size_t record_words() const { return sdf_record_words(_layout, _mode); }
+    
+    // (to read these back to the host, see sdf_readback.h; to decode the records,
+    // see sdf_packing.h)
+    const DataBuffer<float>&    sdf_x()     const { return _sdf_x;     }
+    const DataBuffer<float>&    sdf_dx()    const { return _sdf_dx;    }
+    const DataBuffer<vec3gpu>&  normal_x()  const { return _normal_x;  }
+    const DataBuffer<vec3gpu>&  normal_dx() const { return _normal_dx; }
+    const DataBuffer<uint32_t>& records()   const { return _records;   }
 };
 
 } // namespace stereo
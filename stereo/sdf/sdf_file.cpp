@@ -0,0 +1,528 @@
+#include <bit>
+#include <cstring>
+#include <fstream>
+
+#if !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stereo/sdf/sdf_bvh.h>
+#include <stereo/sdf/sdf_file.h>
+#include <stereo/sdf/sdf_grid.h>
+#include <stereo/sdf/sdf_instances.h>
+#include <stereo/sdf/sdf_trimesh.h>
+
+namespace stereo {
+
+static_assert(
+    std::endian::native == std::endian::little,
+    "SDF files are stored little-endian, in host byte order"
+);
+static_assert(sizeof(SdfFileHeader) == 192, "SDF file header layout changed; bump SdfFileVersion");
+static_assert(sizeof(SdfFileNode)   == 24,  "SDF file node layout changed; bump SdfFileVersion");
+static_assert(sizeof(SdfGpuOp)      == 16,  "SDF op layout changed; bump SdfFileVersion");
+
+namespace {
+
+constexpr char SdfFileMagic[8] = {'S', 'D', 'F', 'T', 'A', 'P', 'E', '\0'};
+
+uint64_t align8(uint64_t n) {
+    return (n + 7) & ~uint64_t(7);
+}
+
+bool is_domain_op(SdfOp op) {
+    return op >= SdfOp::Transform and op <= SdfOp::Instances;
+}
+
+// flattens a tree into the node and child tables, in postfix order
+template <typename T>
+struct TreeWriter {
+    const SdfTape&                          tape;
+    DenseMap<const SdfNode<T>*, gpu_size_t> index;
+    std::vector<SdfFileNode>                nodes;
+    std::vector<gpu_size_t>                 children;
+
+    gpu_size_t add(const SdfNodeRef<T>& node) {
+        auto i = index.find(node.get());
+        if (i != index.end()) return i->second;
+        size_t n_children = node->n_children();
+        std::vector<gpu_size_t> kids(n_children);
+        for (size_t c = 0; c < n_children; ++c) {
+            kids[c] = add(node->child(c));
+        }
+        SdfParamRange params {0, 0};
+        if (node->n_params() > 0) {
+            auto p = tape.node_params.find(node.get());
+            if (p == tape.node_params.end()) {
+                std::cerr << "SDF node being saved is not part of the tape" << std::endl;
+                std::abort();
+            }
+            params = p->second;
+        }
+        gpu_size_t id = nodes.size();
+        nodes.push_back({
+            .op          = node->op(),
+            .variant     = node->variant(),
+            .param_begin = params.begin,
+            .param_end   = params.end,
+            .child_begin = (gpu_size_t) children.size(),
+            .n_children  = (gpu_size_t) n_children,
+        });
+        children.insert(children.end(), kids.begin(), kids.end());
+        index[node.get()] = id;
+        return id;
+    }
+};
+
+// a node rebuilt from a file
+template <typename T>
+struct SdfFileTreeNode : public SdfNode<T> {
+    SdfOpVariant               var;
+    std::vector<T>             ps;
+    std::vector<SdfNodeRef<T>> kids;
+
+    SdfFileTreeNode(SdfOp op, SdfOpVariant var): SdfNode<T>(op), var(var) {}
+
+    size_t        n_children()        const override { return kids.size(); }
+    SdfNodeRef<T> child(size_t i)     const override { return kids[i]; }
+    size_t        n_params()          const override { return ps.size(); }
+    const T*      params()            const override { return ps.data(); }
+    const SdfOpVariant variant()      const override { return var; }
+    bool          transforms_domain() const override { return is_domain_op(this->op()); }
+};
+
+bool write_file(
+        std::string_view filename,
+        const SdfTiledTape& tiled,
+        const std::vector<SdfFileNode>& nodes,
+        const std::vector<gpu_size_t>& children)
+{
+    const SdfTape& tape = tiled.tape;
+    SdfFileHeader h {};
+    std::memcpy(h.magic, SdfFileMagic, sizeof(SdfFileMagic));
+    h.version     = SdfFileVersion;
+    h.header_size = sizeof(SdfFileHeader);
+    h.n_tape_ops  = tape.n_ops();
+    h.n_ops       = tiled.ops.size();
+    h.n_params    = tape.n_params();
+    h.n_slots     = tape.n_slots;
+    h.stack_depth = tape.stack_depth();
+    h.n_tiles     = tiled.tiles.size();
+    h.n_nodes     = nodes.size();
+    h.n_children  = children.size();
+    for (size_t a = 0; a < 3; ++a) {
+        h.region_lo[a] = tiled.region.lo[a];
+        h.region_hi[a] = tiled.region.hi[a];
+        h.tile_dims[a] = tiled.tile_dims[a];
+    }
+    h.grid = tiled.grid();
+
+    struct Section {
+        uint64_t*   offset;
+        const void* data;
+        size_t      bytes;
+    };
+    Section sections[] = {
+        {&h.ops_offset,       tiled.ops.data(),      tiled.ops.size()      * sizeof(SdfGpuOp)},
+        {&h.params_x_offset,  tape.params_x.data(),  tape.params_x.size()  * sizeof(float)},
+        {&h.params_dx_offset, tape.params_dx.data(), tape.params_dx.size() * sizeof(float)},
+        {&h.tiles_offset,     tiled.tiles.data(),    tiled.tiles.size()    * sizeof(SdfTile)},
+        {&h.nodes_offset,     nodes.data(),          nodes.size()          * sizeof(SdfFileNode)},
+        {&h.children_offset,  children.data(),       children.size()       * sizeof(gpu_size_t)},
+    };
+    uint64_t offset = sizeof(SdfFileHeader);
+    for (Section& s : sections) {
+        *s.offset = offset;
+        offset    = align8(offset + s.bytes);
+    }
+    h.file_size = offset;
+
+    std::ofstream out(std::string(filename), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Cannot open SDF file for writing: " << filename << std::endl;
+        return false;
+    }
+    const char zeros[8] = {};
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    for (const Section& s : sections) {
+        out.write(reinterpret_cast<const char*>(s.data), s.bytes);
+        out.write(zeros, align8(s.bytes) - s.bytes);
+    }
+    if (!out) {
+        std::cerr << "Error writing SDF file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// whether `count` items of `S` at `offset` lie within a file of `size` bytes
+template <typename S>
+bool section_fits(uint64_t offset, uint64_t count, uint64_t size) {
+    return offset % alignof(S) == 0
+        and offset <= size
+        and count <= (size - offset) / sizeof(S);
+}
+
+// check the structure of the tape `ops[0, n_ops)`, whose indices are relative to its
+// start and whose ops have been checked to be in bounds: that every op is known, that
+// none pops a value or a domain which isn't there, that each `PopDomain` ends the
+// domain of the op it names, and that each `BvhUnion` has a table of operands in
+// order, each of which leaves a single value. returns the depth of its stacks (as
+// `SdfTape::stack_depth()`), or nothing if the tape is malformed.
+std::optional<size_t> tape_depth(const SdfGpuOp* ops, size_t n_ops) {
+    std::vector<size_t> domains; // the ops which pushed the current domains
+    size_t f_size = 0;
+    size_t depth  = 1;
+    // the enclosing `BvhUnion` (or `n_ops`), the operand being run, the number of
+    // values before it began, and the stacks at the union
+    size_t bvh         = n_ops;
+    size_t k           = 0;
+    size_t k_f_size    = 0;
+    size_t bvh_f_size  = 0;
+    size_t bvh_domains = 0;
+    for (size_t i = 0; i <= n_ops; ++i) {
+        while (bvh < n_ops and k < sdf_bvh_count(ops[bvh]) and
+               i == sdf_bvh_operand(ops, bvh, k + 1))
+        {
+            bool empty = sdf_bvh_operand(ops, bvh, k) == i;
+            if (f_size != k_f_size + (empty ? 0 : 1) or domains.size() != bvh_domains) {
+                return std::nullopt;
+            }
+            // (unioned into the operands before it)
+            f_size   = bvh_f_size + 1;
+            k_f_size = f_size;
+            k += 1;
+        }
+        if (bvh < n_ops and k == sdf_bvh_count(ops[bvh])) bvh = n_ops;
+        if (i == n_ops) break;
+        const SdfGpuOp& op = ops[i];
+        if (op.op == SdfOp::PopDomain) {
+            // (popping re-runs the op which pushed the domain, on the value)
+            if (domains.empty() or op.push_index != domains.back() or f_size < 1) {
+                return std::nullopt;
+            }
+            domains.pop_back();
+        } else if (op.op >= SdfOp::Union and op.op <= SdfOp::Xor) {
+            if (f_size < 2) return std::nullopt;
+            f_size -= 1;
+        } else if (op.op == SdfOp::Shell or op.op == SdfOp::Dilate or op.op == SdfOp::Store) {
+            if (f_size < 1) return std::nullopt;
+        } else if (op.op == SdfOp::Load) {
+            f_size += 1;
+        } else if (is_domain_op(op.op)) {
+            domains.push_back(i);
+        } else if (op.op == SdfOp::BvhUnion) {
+            // (which can't be nested)
+            if (bvh < n_ops or op.int_param < 0) return std::nullopt;
+            size_t n = sdf_bvh_count(op);
+            if (n + 1 >= n_ops - i) return std::nullopt;
+            if (sdf_bvh_operand(ops, i, 0) != i + n + 2) return std::nullopt;
+            for (size_t s = 0; s <= n; ++s) {
+                if (ops[i + 1 + s].op != SdfOp::BvhOperand) return std::nullopt;
+                if (s > 0 and sdf_bvh_operand(ops, i, s) < sdf_bvh_operand(ops, i, s - 1)) {
+                    return std::nullopt;
+                }
+            }
+            if (sdf_bvh_operand(ops, i, n) > n_ops) return std::nullopt;
+            bvh         = i;
+            k           = 0;
+            k_f_size    = f_size;
+            bvh_f_size  = f_size;
+            bvh_domains = domains.size();
+            if (n == 0) {
+                // (an empty union still gives a value)
+                f_size += 1;
+                bvh = n_ops;
+            }
+            // (skip the table of operands)
+            i = sdf_bvh_operand(ops, i, 0) - 1;
+        } else if (op.op >= SdfOp::Sphere and op.op <= SdfOp::VoxelGrid) {
+            f_size += 1;
+        } else {
+            // (including a `BvhOperand` outside of a table)
+            return std::nullopt;
+        }
+        depth = std::max({depth, 1 + domains.size(), f_size});
+    }
+    if (not domains.empty() or f_size != (n_ops > 0 ? 1 : 0)) return std::nullopt;
+    return depth;
+}
+
+// whether the parameters `xs` of `op` (already in bounds) are as many as the op reads
+bool op_params_valid(const SdfGpuOp& op, const float* xs) {
+    size_t n = op.param_end - op.param_start;
+    xs += op.param_start;
+    switch (op.op) {
+        case SdfOp::Union:
+        case SdfOp::Intersect:
+        case SdfOp::Subtract:
+        case SdfOp::Xor:       return n == 0;
+        case SdfOp::Shell:
+        case SdfOp::Dilate:
+        case SdfOp::RotSym:    return n == 1;
+        case SdfOp::Mirror:
+        case SdfOp::Sphere:
+        case SdfOp::Plane:     return n == 4;
+        case SdfOp::Box:       return n == 6;
+        case SdfOp::Transform:
+        case SdfOp::Cylinder:
+        case SdfOp::Capsule:   return n == 7;
+        case SdfOp::Repeat:
+        case SdfOp::Triangle:  return n == 9;
+        case SdfOp::Instances: return n > 0 and n % SdfInstanceParams == 0;
+        case SdfOp::BvhUnion:
+            // (an empty table culls nothing, and needs no nodes)
+            return n == (op.int_param > 0 ?
+                SdfBvhNodeParams * sdf_bvh_nodes(op.int_param) : 0);
+        case SdfOp::Mesh:      return sdf_mesh_params_valid(xs, n);
+        case SdfOp::VoxelGrid: {
+            if (n < SdfVoxelGridHeader) return false;
+            // count the points an axis at a time, so that the product can't overflow
+            size_t n_points = 1;
+            for (size_t a = 0; a < 3; ++a) {
+                float d = xs[a];
+                if (not (d >= 2 and d == std::floor(d) and d <= n)) return false;
+                n_points *= (size_t) d;
+                if (n_points > n) return false;
+            }
+            return n == SdfVoxelGridHeader + n_points;
+        }
+        default:
+            // (ops which the evaluators don't implement read no parameters)
+            return true;
+    }
+}
+
+// check that a file is complete and self-consistent, so that it can be used
+// without any further bounds checks
+bool validate(const SdfFile& file, size_t size, std::string_view filename) {
+    auto fail = [&](const char* why) {
+        std::cerr << "Invalid SDF file " << filename << ": " << why << std::endl;
+        return false;
+    };
+    if (size < sizeof(SdfFileHeader)) return fail("truncated header");
+    const SdfFileHeader& h = file.header();
+    if (std::memcmp(h.magic, SdfFileMagic, sizeof(SdfFileMagic)) != 0) {
+        return fail("not an SDF file");
+    }
+    if (h.version != SdfFileVersion) {
+        std::cerr << "Unsupported SDF file version " << h.version << " "
+                  << "(expected " << SdfFileVersion << "): " << filename << std::endl;
+        return false;
+    }
+    if (h.header_size != sizeof(SdfFileHeader)) return fail("bad header size");
+    if (h.file_size != size) return fail("truncated file");
+    if (not section_fits<SdfGpuOp>(h.ops_offset, h.n_ops, size) or
+        not section_fits<float>(h.params_x_offset, h.n_params, size) or
+        not section_fits<float>(h.params_dx_offset, h.n_params, size) or
+        not section_fits<SdfTile>(h.tiles_offset, h.n_tiles, size) or
+        not section_fits<SdfFileNode>(h.nodes_offset, h.n_nodes, size) or
+        not section_fits<gpu_size_t>(h.children_offset, h.n_children, size))
+    {
+        return fail("section out of bounds");
+    }
+    if (h.n_tape_ops > h.n_ops or h.n_tiles == 0) return fail("bad tape size");
+    if (h.n_slots > SdfTape::MaxSlots) return fail("too many value slots");
+
+    const SdfGpuOp* ops = file.ops();
+    for (uint32_t i = 0; i < h.n_ops; ++i) {
+        if (ops[i].op == SdfOp::PopDomain) continue;
+        if (ops[i].op == SdfOp::Store or ops[i].op == SdfOp::Load) {
+            if (ops[i].slot >= SdfTape::MaxSlots) return fail("value slot out of bounds");
+            continue;
+        }
+        if (ops[i].param_start > ops[i].param_end or ops[i].param_end > h.n_params) {
+            return fail("op parameters out of bounds");
+        }
+        if (not op_params_valid(ops[i], file.params_x())) {
+            return fail("op parameters don't match the op");
+        }
+    }
+    const SdfTile* tiles = file.tiles();
+    if (tiles[0].op_begin != 0 or tiles[0].op_end != h.n_tape_ops) {
+        return fail("bad full tape");
+    }
+    for (uint32_t i = 0; i < h.n_tiles; ++i) {
+        if (tiles[i].op_begin > tiles[i].op_end or tiles[i].op_end > h.n_ops) {
+            return fail("tile out of bounds");
+        }
+        // the evaluators trust the structure of the tape, and size their stacks by
+        // the depth recorded in the header
+        std::optional<size_t> depth = tape_depth(
+            ops + tiles[i].op_begin, tiles[i].op_end - tiles[i].op_begin);
+        if (not depth) return fail("malformed tape");
+        if (*depth > h.stack_depth) return fail("stack depth too small for the tape");
+    }
+    const SdfFileNode* nodes    = file.nodes();
+    const gpu_size_t*  children = file.children();
+    for (uint32_t i = 0; i < h.n_nodes; ++i) {
+        const SdfFileNode& n = nodes[i];
+        if (n.param_begin > n.param_end or n.param_end > h.n_params) {
+            return fail("node parameters out of bounds");
+        }
+        if (n.child_begin > h.n_children or n.n_children > h.n_children - n.child_begin) {
+            return fail("node children out of bounds");
+        }
+        for (uint32_t c = 0; c < n.n_children; ++c) {
+            // children come before their parents, so the tree can't have cycles
+            if (children[n.child_begin + c] >= i) return fail("node children out of order");
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+
+SdfFile::~SdfFile() {
+#if !defined(__EMSCRIPTEN__)
+    if (_mapped) munmap(const_cast<uint8_t*>(_data), _size);
+#endif
+}
+
+SdfTapeView SdfFile::view() const {
+    const SdfFileHeader& h = header();
+    return {
+        .ops            = ops(),
+        .n_ops          = h.n_ops,
+        .params_x       = params_x(),
+        .params_dx      = params_dx(),
+        .n_params       = h.n_params,
+        .tiles          = tiles(),
+        .n_tile_entries = h.n_tiles,
+        .grid           = h.grid,
+        .stack_depth    = h.stack_depth,
+    };
+}
+
+SdfTiledTape SdfFile::tiled_tape() const {
+    const SdfFileHeader& h = header();
+    SdfTape tape;
+    tape.ops.assign(ops(), ops() + h.n_tape_ops);
+    tape.params_x.assign(params_x(), params_x() + h.n_params);
+    tape.params_dx.assign(params_dx(), params_dx() + h.n_params);
+    tape.n_slots = h.n_slots;
+
+    SdfTiledTape tiled(std::move(tape));
+    tiled.region    = range3(
+        vec3(h.region_lo[0], h.region_lo[1], h.region_lo[2]),
+        vec3(h.region_hi[0], h.region_hi[1], h.region_hi[2])
+    );
+    tiled.tile_dims = vec3ui(h.tile_dims[0], h.tile_dims[1], h.tile_dims[2]);
+    tiled.ops.assign(ops(), ops() + h.n_ops);
+    tiled.tiles.assign(tiles(), tiles() + h.n_tiles);
+    return tiled;
+}
+
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+SdfNodeRef<T> SdfFile::tree(DenseMap<const void*, SdfParamRange>* node_params) const {
+    const SdfFileHeader& h = header();
+    if (h.n_nodes == 0) return nullptr;
+    const SdfFileNode* file_nodes = nodes();
+    const gpu_size_t*  kids       = children();
+    const float*       xs         = params_x();
+    const float*       dxs        = params_dx();
+    std::vector<std::shared_ptr<SdfFileTreeNode<T>>> built(h.n_nodes);
+    for (uint32_t i = 0; i < h.n_nodes; ++i) {
+        const SdfFileNode& n = file_nodes[i];
+        auto node = std::make_shared<SdfFileTreeNode<T>>(n.op, n.variant);
+        node->ps.reserve(n.param_end - n.param_begin);
+        for (gpu_size_t j = n.param_begin; j < n.param_end; ++j) {
+            if constexpr (std::is_same_v<T, float>) {
+                node->ps.push_back(xs[j]);
+            } else {
+                node->ps.push_back(Dual<float>(xs[j], dxs[j]));
+            }
+        }
+        node->kids.reserve(n.n_children);
+        for (gpu_size_t c = 0; c < n.n_children; ++c) {
+            node->kids.push_back(built[kids[n.child_begin + c]]);
+        }
+        if (node_params and n.param_end > n.param_begin) {
+            (*node_params)[node.get()] = {n.param_begin, n.param_end};
+        }
+        built[i] = std::move(node);
+    }
+    return built.back();
+}
+
+SdfFileRef load_sdf_file(std::string_view filename) {
+    SdfFileRef file {new SdfFile()};
+    std::string path {filename};
+#if defined(__EMSCRIPTEN__)
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "Cannot open SDF file: " << filename << std::endl;
+        return nullptr;
+    }
+    size_t size = in.tellg();
+    in.seekg(0);
+    file->_buffer.reset(new uint8_t[std::max<size_t>(size, 1)]);
+    if (!in.read(reinterpret_cast<char*>(file->_buffer.get()), size)) {
+        std::cerr << "Error reading SDF file: " << filename << std::endl;
+        return nullptr;
+    }
+    file->_data = file->_buffer.get();
+    file->_size = size;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open SDF file: " << filename << std::endl;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size == 0) {
+        std::cerr << "Cannot read SDF file: " << filename << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Cannot map SDF file: " << filename << std::endl;
+        return nullptr;
+    }
+    file->_data   = static_cast<const uint8_t*>(data);
+    file->_size   = st.st_size;
+    file->_mapped = true;
+#endif
+    if (not validate(*file, file->_size, filename)) return nullptr;
+    return file;
+}
+
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+bool save_sdf_file(std::string_view filename, const SdfTiledTape& tiled, SdfNodeRef<T> expr) {
+    TreeWriter<T> writer {tiled.tape};
+    if (expr) writer.add(expr);
+    return write_file(filename, tiled, writer.nodes, writer.children);
+}
+
+bool save_sdf_file(std::string_view filename, const SdfTiledTape& tiled) {
+    return write_file(filename, tiled, {}, {});
+}
+
+// explicit template instantiation
+template SdfNodeRef<float> SdfFile::tree(
+    DenseMap<const void*, SdfParamRange>* node_params
+) const;
+template SdfNodeRef<Dual<float>> SdfFile::tree(
+    DenseMap<const void*, SdfParamRange>* node_params
+) const;
+
+template bool save_sdf_file(
+    std::string_view filename,
+    const SdfTiledTape& tiled,
+    SdfNodeRef<float> expr
+);
+template bool save_sdf_file(
+    std::string_view filename,
+    const SdfTiledTape& tiled,
+    SdfNodeRef<Dual<float>> expr
+);
+
+} // namespace stereo
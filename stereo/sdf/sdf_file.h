@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stereo/sdf/sdf_prune.h>
+
+// A binary file format for serialized SDF expressions.
+//
+// A file holds an `SdfTiledTape` exactly as it is uploaded to the GPU (the ops of
+// the full tape and its pruned tiles, the tile table and grid, and one variation of
+// `params_x` and `params_dx`), plus the structure of the expression tree it was built
+// from, so that the tree can be rebuilt and edited.
+//
+// Layout: an `SdfFileHeader`, followed by the sections it points to. Every section
+// starts on an 8-byte boundary, and holds a packed array of the same structs the
+// program uses, in host (little-endian) byte order. A file can therefore be mapped
+// into memory and used in place: `SdfFile::view()` points straight into the mapped
+// pages, and `SdfGpuExpr` can be built from it without copying or allocating per node.
+//
+// The tree is stored as a table of `SdfFileNode`s in postfix order (children before
+// their parents; the root is last), each referring to its children by index through
+// a separate child table. A node which is shared within the tree is stored once.
+// Parameters are not duplicated: each node points at its block of the tape's
+// parameters.
+//
+// Readers reject files whose version is not `SdfFileVersion`; bump the version
+// whenever the layout of any of the stored structs (including `SdfGpuOp`, `SdfTile`
+// and `SdfTileGrid`) or the numbering of `SdfOp` changes.
+
+namespace stereo {
+
+constexpr uint32_t SdfFileVersion = 1;
+
+struct SdfFileHeader {
+    char        magic[8];     // "SDFTAPE\0"
+    uint32_t    version;
+    uint32_t    header_size;  // sizeof(SdfFileHeader)
+    uint64_t    file_size;
+
+    uint32_t    n_tape_ops;   // ops of the full tape, which come first
+    uint32_t    n_ops;        // ops of the full tape and all the tiles
+    uint32_t    n_params;
+    uint32_t    n_slots;
+    uint32_t    stack_depth;
+    uint32_t    n_tiles;      // entries of the tile table, including the full tape
+    uint32_t    n_nodes;
+    uint32_t    n_children;
+    float       region_lo[3];
+    uint32_t    tile_dims[3];
+    float       region_hi[3];
+    uint32_t    _pad;
+    SdfTileGrid grid;
+
+    // byte offsets of the sections from the start of the file
+    uint64_t    ops_offset;
+    uint64_t    params_x_offset;
+    uint64_t    params_dx_offset;
+    uint64_t    tiles_offset;
+    uint64_t    nodes_offset;
+    uint64_t    children_offset;
+};
+
+struct SdfFileNode {
+    SdfOp        op;
+    SdfOpVariant variant;
+    // parameter block in the tape (empty if the node has no parameters)
+    gpu_size_t   param_begin;
+    gpu_size_t   param_end;
+    // children, as a range of the child table
+    gpu_size_t   child_begin;
+    gpu_size_t   n_children;
+};
+
+/**
+ * @brief A read-only SDF expression file, mapped into memory.
+ */
+struct SdfFile {
+private:
+    const uint8_t*             _data = nullptr;
+    size_t                     _size = 0;
+    bool                       _mapped = false;
+    std::unique_ptr<uint8_t[]> _buffer;
+
+    template <typename S>
+    const S* _section(uint64_t offset) const {
+        return reinterpret_cast<const S*>(_data + offset);
+    }
+
+    SdfFile() = default;
+
+    friend std::shared_ptr<SdfFile> load_sdf_file(std::string_view filename);
+
+public:
+
+    SdfFile(const SdfFile&) = delete;
+    SdfFile& operator=(const SdfFile&) = delete;
+    ~SdfFile();
+
+    const SdfFileHeader& header() const { return *_section<SdfFileHeader>(0); }
+
+    const SdfGpuOp*    ops()       const { return _section<SdfGpuOp>(header().ops_offset); }
+    const float*       params_x()  const { return _section<float>(header().params_x_offset); }
+    const float*       params_dx() const { return _section<float>(header().params_dx_offset); }
+    const SdfTile*     tiles()     const { return _section<SdfTile>(header().tiles_offset); }
+    const SdfFileNode* nodes()     const { return _section<SdfFileNode>(header().nodes_offset); }
+    const gpu_size_t*  children()  const { return _section<gpu_size_t>(header().children_offset); }
+
+    /// The tiled tape, pointing into the file, for uploading with `SdfGpuExpr`.
+    SdfTapeView view() const;
+
+    /// A copy of the tiled tape, e.g. for `SdfCpuExpr`. Its `node_params` is empty.
+    SdfTiledTape tiled_tape() const;
+
+    /**
+     * @brief Rebuild the expression tree.
+     *
+     * The nodes are generic: they have the ops, variants, parameters and children of
+     * the original nodes, but not their types. Nodes which were shared are shared again.
+     * For `Dual<float>` trees, the tangents come from `params_dx`.
+     *
+     * If `node_params` is not null, it receives the parameter block of each rebuilt
+     * node, as in `SdfTape::node_params`.
+     *
+     * Returns null if the file holds no tree.
+     */
+    template <typename T>
+    requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+    SdfNodeRef<T> tree(DenseMap<const void*, SdfParamRange>* node_params=nullptr) const;
+};
+
+using SdfFileRef = std::shared_ptr<SdfFile>;
+
+/**
+ * @brief Map an SDF expression file into memory.
+ *
+ * Returns null (and reports why) if the file can't be read, or is not a valid file
+ * of the current version.
+ */
+SdfFileRef load_sdf_file(std::string_view filename);
+
+/**
+ * @brief Write `tiled` to a file, along with the tree `expr` it was built from.
+ *
+ * `expr` may be null, in which case only the tape is stored. Returns false (and
+ * reports why) if the file can't be written.
+ */
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+bool save_sdf_file(std::string_view filename, const SdfTiledTape& tiled, SdfNodeRef<T> expr);
+
+/// Write `tiled` to a file, without a tree.
+bool save_sdf_file(std::string_view filename, const SdfTiledTape& tiled);
+
+} // namespace stereo
@@ -0,0 +1,268 @@
+#include <bit>
+
+#include <stereo/sdf/sdf_grid.h>
+#include <stereo/sdf/sdf_trimesh.h>
+#include <stereo/util/parallel.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr float Inf = std::numeric_limits<float>::infinity();
+
+float dist2(const vec3& a, const vec3& b) {
+    vec3 d = a - b;
+    return d.x * d.x + d.y * d.y + d.z * d.z;
+}
+
+// the lattice of a grid being baked, and the nearest known point of the geometry to
+// each of its points (or infinity, if none is known yet)
+struct Lattice {
+    vec3ui            dims;
+    vec3              origin;
+    float             h;
+    std::vector<vec3> nearest;
+    std::vector<bool> band;
+
+    Lattice(const SdfGridOptions& opts):
+        origin(opts.region.lo),
+        h(opts.voxel_size)
+    {
+        for (size_t a = 0; a < 3; ++a) {
+            float extent = opts.region.hi[a] - opts.region.lo[a];
+            dims[a] = std::max<uint32_t>(2, (uint32_t) std::ceil(extent / h) + 1);
+        }
+        size_t n = (size_t) dims.x * dims.y * dims.z;
+        nearest.assign(n, vec3(Inf, Inf, Inf));
+        band.assign(n, false);
+    }
+
+    size_t index(uint32_t x, uint32_t y, uint32_t z) const {
+        return ((size_t) z * dims.y + y) * dims.x + x;
+    }
+
+    vec3 point(uint32_t x, uint32_t y, uint32_t z) const {
+        return origin + vec3(x, y, z) * h;
+    }
+
+    // record the nearest point `closest(p)` of a piece of geometry whose bounds are
+    // `[lo, hi]`, at each lattice point within a voxel of those bounds
+    template <typename F>
+    void rasterize(const vec3& lo, const vec3& hi, F&& closest) {
+        uint32_t b[3];
+        uint32_t e[3];
+        for (size_t a = 0; a < 3; ++a) {
+            float l = std::floor((lo[a] - origin[a]) / h) - 1;
+            float u = std::ceil ((hi[a] - origin[a]) / h) + 1;
+            b[a] = (uint32_t) std::clamp(l, 0.f, (float) dims[a]);
+            e[a] = (uint32_t) std::clamp(u + 1, 0.f, (float) dims[a]);
+        }
+        for (uint32_t z = b[2]; z < e[2]; ++z) {
+            for (uint32_t y = b[1]; y < e[1]; ++y) {
+                for (uint32_t x = b[0]; x < e[0]; ++x) {
+                    size_t i = index(x, y, z);
+                    vec3   p = point(x, y, z);
+                    vec3   q = closest(p);
+                    if (dist2(p, q) < dist2(p, nearest[i])) nearest[i] = q;
+                    band[i] = true;
+                }
+            }
+        }
+    }
+
+    // propagate the nearest points across the whole lattice
+    void jump_flood() {
+        std::vector<vec3> next(nearest.size());
+        uint32_t n = std::max({dims.x, dims.y, dims.z});
+        std::vector<uint32_t> steps;
+        for (uint32_t k = std::bit_ceil(n) / 2; k >= 1; k /= 2) steps.push_back(k);
+        steps.push_back(1);
+        for (uint32_t k : steps) {
+            parallel_for(dims.z, 1, [&](size_t z_begin, size_t z_end, size_t) {
+                for (uint32_t z = z_begin; z < z_end; ++z) {
+                    for (uint32_t y = 0; y < dims.y; ++y) {
+                        for (uint32_t x = 0; x < dims.x; ++x) {
+                            vec3  p    = point(x, y, z);
+                            vec3  best = nearest[index(x, y, z)];
+                            float d    = dist2(p, best);
+                            for (int dz = -1; dz <= 1; ++dz) {
+                                int64_t nz = z + dz * (int64_t) k;
+                                if (nz < 0 or nz >= dims.z) continue;
+                                for (int dy = -1; dy <= 1; ++dy) {
+                                    int64_t ny = y + dy * (int64_t) k;
+                                    if (ny < 0 or ny >= dims.y) continue;
+                                    for (int dx = -1; dx <= 1; ++dx) {
+                                        int64_t nx = x + dx * (int64_t) k;
+                                        if (nx < 0 or nx >= dims.x) continue;
+                                        const vec3& q = nearest[index(nx, ny, nz)];
+                                        float d_q = dist2(p, q);
+                                        if (d_q < d) {
+                                            d    = d_q;
+                                            best = q;
+                                        }
+                                    }
+                                }
+                            }
+                            next[index(x, y, z)] = best;
+                        }
+                    }
+                }
+            });
+            std::swap(nearest, next);
+        }
+    }
+
+    // the distance to the nearest point, with the sign of `inside` (where known)
+    SdfGrid distances(const std::vector<int8_t>* sign) const {
+        SdfGrid out {Grid3d<float>(dims), origin, h};
+        float* v = out.values.buf.get();
+        parallel_for(dims.z, 1, [&](size_t z_begin, size_t z_end, size_t) {
+            for (uint32_t z = z_begin; z < z_end; ++z) {
+                for (uint32_t y = 0; y < dims.y; ++y) {
+                    for (uint32_t x = 0; x < dims.x; ++x) {
+                        size_t i = index(x, y, z);
+                        float  d = std::sqrt(dist2(point(x, y, z), nearest[i]));
+                        v[i] = sign and (*sign)[i] < 0 ? -d : d;
+                    }
+                }
+            }
+        });
+        return out;
+    }
+
+    // the sign of each lattice point: from `band_sign` in the band, and elsewhere from
+    // the band around it
+    std::vector<int8_t> flood_sign(const std::vector<int8_t>& band_sign) const {
+        std::vector<int8_t> sign(band_sign);
+        std::vector<size_t> todo;
+        std::vector<size_t> component;
+        for (size_t start = 0; start < sign.size(); ++start) {
+            if (band[start] or sign[start] != 0) continue;
+            // gather the region of points outside the band reachable from `start`
+            int8_t s = 0;
+            todo.push_back(start);
+            sign[start] = 1;
+            while (not todo.empty()) {
+                size_t i = todo.back();
+                todo.pop_back();
+                component.push_back(i);
+                uint32_t x = i % dims.x;
+                uint32_t y = (i / dims.x) % dims.y;
+                uint32_t z = i / ((size_t) dims.x * dims.y);
+                auto visit = [&](bool ok, size_t j) {
+                    if (not ok) return;
+                    if (band[j]) {
+                        if (s == 0) s = band_sign[j];
+                    } else if (sign[j] == 0) {
+                        sign[j] = 1;
+                        todo.push_back(j);
+                    }
+                };
+                visit(x > 0,          i - 1);
+                visit(x + 1 < dims.x, i + 1);
+                visit(y > 0,          i - dims.x);
+                visit(y + 1 < dims.y, i + dims.x);
+                visit(z > 0,          i - (size_t) dims.x * dims.y);
+                visit(z + 1 < dims.z, i + (size_t) dims.x * dims.y);
+            }
+            // (a region which touches no band can only be empty space)
+            for (size_t i : component) sign[i] = s < 0 ? -1 : 1;
+            component.clear();
+        }
+        return sign;
+    }
+};
+
+vec3 min3(const vec3& a, const vec3& b, const vec3& c) {
+    return {
+        std::min({a.x, b.x, c.x}),
+        std::min({a.y, b.y, c.y}),
+        std::min({a.z, b.z, c.z}),
+    };
+}
+
+vec3 max3(const vec3& a, const vec3& b, const vec3& c) {
+    return {
+        std::max({a.x, b.x, c.x}),
+        std::max({a.y, b.y, c.y}),
+        std::max({a.z, b.z, c.z}),
+    };
+}
+
+} // namespace
+
+
+SdfGrid bake_sdf_grid(const Model& model, range1i prims, const SdfGridOptions& opts) {
+    return bake_sdf_grid(model_triangles(model, prims), opts);
+}
+
+SdfGrid bake_sdf_grid(const std::vector<vec3>& tri_verts, const SdfGridOptions& opts) {
+    Lattice lattice(opts);
+    size_t n_tris = tri_verts.size() / 3;
+    for (size_t t = 0; t < n_tris; ++t) {
+        const vec3& a = tri_verts[3 * t];
+        const vec3& b = tri_verts[3 * t + 1];
+        const vec3& c = tri_verts[3 * t + 2];
+        lattice.rasterize(min3(a, b, c), max3(a, b, c), [&](const vec3& p) {
+            return sdf_triangle_closest(p, a, b, c);
+        });
+    }
+    lattice.jump_flood();
+    if (n_tris == 0) return lattice.distances(nullptr);
+
+    // the sign of the band, from the winding number
+    std::vector<float>  mesh = sdf_mesh_params(tri_verts);
+    std::vector<int8_t> band_sign(lattice.band.size(), 0);
+    parallel_for(lattice.dims.z, 1, [&](size_t z_begin, size_t z_end, size_t) {
+        for (uint32_t z = z_begin; z < z_end; ++z) {
+            for (uint32_t y = 0; y < lattice.dims.y; ++y) {
+                for (uint32_t x = 0; x < lattice.dims.x; ++x) {
+                    size_t i = lattice.index(x, y, z);
+                    if (not lattice.band[i]) continue;
+                    float w = sdf_mesh_winding(mesh.data(), lattice.point(x, y, z));
+                    band_sign[i] = w > 0.5f ? -1 : 1;
+                }
+            }
+        }
+    });
+    std::vector<int8_t> sign = lattice.flood_sign(band_sign);
+    return lattice.distances(&sign);
+}
+
+SdfGrid bake_point_grid(const std::vector<vec3>& points, const SdfGridOptions& opts) {
+    Lattice lattice(opts);
+    for (const vec3& p : points) {
+        lattice.rasterize(p, p, [&](const vec3&) { return p; });
+    }
+    lattice.jump_flood();
+    return lattice.distances(nullptr);
+}
+
+
+template <typename T>
+SdfVoxelGrid<T>::SdfVoxelGrid(const SdfGrid& grid):
+    SdfNode<T>(SdfOp::VoxelGrid)
+{
+    const vec3ui& dims = grid.values.dims;
+    if (dims.x < 2 or dims.y < 2 or dims.z < 2) {
+        std::cerr << "SdfVoxelGrid needs at least two points along each axis" << std::endl;
+        std::abort();
+    }
+    size_t n = (size_t) dims.x * dims.y * dims.z;
+    _params.reserve(SdfVoxelGridHeader + n);
+    _params.push_back(T(dims.x));
+    _params.push_back(T(dims.y));
+    _params.push_back(T(dims.z));
+    _params.push_back(T(grid.origin.x));
+    _params.push_back(T(grid.origin.y));
+    _params.push_back(T(grid.origin.z));
+    _params.push_back(T(grid.voxel_size));
+    const float* v = grid.values.data();
+    _params.insert(_params.end(), v, v + n);
+}
+
+// explicit template instantiation
+template struct SdfVoxelGrid<float>;
+template struct SdfVoxelGrid<Dual<float>>;
+
+} // namespace stereo
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+
+#include <stereo/gpu/model.h>
+#include <stereo/sdf/sdf_structs.h>
+#include <stereo/util/grid.h>
+
+// Dense distance grids, baked from triangle meshes or point sets.
+//
+// This trades accuracy for speed: rather than finding the exact nearest point for every
+// lattice point (as `SdfMesh` would), the geometry is first rasterized into a narrow band
+// of lattice points around it, each of which records its exact nearest point on the
+// geometry. The nearest points are then propagated to the rest of the grid by jump
+// flooding: at steps `k = N/2, N/4, ..., 1` (and a final pass at `k = 1` to correct
+// most of the errors of the flood), every lattice point adopts the nearest of the
+// nearest points held by its 26 neighbors at offset `k`. Each pass is a stencil over the
+// whole grid, so it runs in parallel across threads; the whole bake costs
+// O(N^3 log N) for an N^3 grid. Distances away from the band may be slightly too large,
+// where the flood passed by the true nearest point.
+//
+// For meshes, the sign comes from the generalized winding number (see sdf_trimesh.h),
+// which is found exactly for the points of the band. The surface can't pass between two
+// neighboring lattice points unless one of them is in the band, so the remaining points
+// take the sign of the band around them, by flood fill. Point sets have no inside, so
+// their grids are unsigned.
+//
+// The baked grid may be used as an SDF leaf (`SdfVoxelGrid`), which reconstructs the
+// distance by trilinear interpolation. Its parameter block holds:
+//   - the number of lattice points along each axis                     3 params
+//   - the position of lattice point (0, 0, 0), and the lattice spacing  4 params
+//   - the value at each lattice point, in the order of `Grid3d`         1 per point
+// Outside the grid, the distance to the grid's box is added to the value at the nearest
+// point of the box. The values are not differentiable; tangents of the parameters are
+// ignored. The `VoxelGrid` op is evaluated only on the CPU.
+
+namespace stereo {
+
+/// Parameters of a voxel grid before its values.
+constexpr size_t SdfVoxelGridHeader = 7;
+
+struct SdfGridOptions {
+    /// Region to bake. Lattice points lie on its low corner, and then every `voxel_size`
+    /// along each axis, up to and including the first point at or past its high corner.
+    range3 region;
+    /// Spacing of the lattice.
+    float  voxel_size = 1.f / 64;
+};
+
+/// A baked distance grid: `values(i, j, k)` is the distance at
+/// `origin + voxel_size * (i, j, k)`.
+struct SdfGrid {
+    Grid3d<float> values;
+    vec3          origin;
+    float         voxel_size;
+};
+
+/**
+ * @brief Bake the signed distance to the triangle prims `prims` of `model` (see
+ * `model_triangles()`) over `opts.region`, using all hardware threads.
+ */
+SdfGrid bake_sdf_grid(const Model& model, range1i prims, const SdfGridOptions& opts);
+
+/**
+ * @brief Bake the signed distance to a list of triangles (three vertices each, wound
+ * counterclockwise when seen from outside) over `opts.region`.
+ */
+SdfGrid bake_sdf_grid(const std::vector<vec3>& tri_verts, const SdfGridOptions& opts);
+
+/**
+ * @brief Bake the (unsigned) distance to a set of points over `opts.region`.
+ */
+SdfGrid bake_point_grid(const std::vector<vec3>& points, const SdfGridOptions& opts);
+
+/**
+ * @brief A baked distance grid as an SDF leaf, reconstructed by trilinear interpolation.
+ */
+template <typename T>
+struct SdfVoxelGrid : public SdfNode<T> {
+private:
+    std::vector<T> _params;
+
+public:
+
+    /// A leaf holding a copy of `grid`, which must have at least two points along each axis.
+    SdfVoxelGrid(const SdfGrid& grid);
+
+    size_t   n_params() const override { return _params.size(); }
+    const T* params()   const override { return _params.data(); }
+};
+
+} // namespace stereo
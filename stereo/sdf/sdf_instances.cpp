@@ -0,0 +1,127 @@
+#include <stereo/sdf/sdf_instances.h>
+
+namespace stereo {
+
+namespace {
+
+// bounds are only used for culling, so they're computed from the primal values
+float value(float x)              { return x; }
+float value(const Dual<float>& x) { return x.x; }
+
+template <typename T>
+SdfBound read_bound(const T* p) {
+    return {vec3(value(p[0]), value(p[1]), value(p[2])), value(p[3])};
+}
+
+template <typename T>
+void write_bound(T* p, const SdfBound& s) {
+    p[0] = T(s.center.x);
+    p[1] = T(s.center.y);
+    p[2] = T(s.center.z);
+    p[3] = T(s.radius);
+}
+
+// the bound of the child, moved by the transform at `xf` (a quaternion, then a translation)
+template <typename T>
+SdfBound instance_bound(const SdfBound& child, const T* xf) {
+    float v[7];
+    for (size_t k = 0; k < 7; ++k) v[k] = value(xf[k]);
+    return sdf_bound_transform(child, v);
+}
+
+} // namespace
+
+
+template <typename T>
+SdfInstances<T>::SdfInstances(
+        SdfNodeRef<T> child,
+        const Sphere<T,3>& bound,
+        const std::vector<SdfInstance<T>>& instances):
+    SdfUnop<T, SdfOp::Instances>(child),
+    _slot(instances.size())
+{
+    size_t n = instances.size();
+    if (n == 0) {
+        std::cerr << "SdfInstances needs at least one instance" << std::endl;
+        std::abort();
+    }
+    _params.resize(SdfInstanceParams * n);
+    _params[0] = bound.center[0];
+    _params[1] = bound.center[1];
+    _params[2] = bound.center[2];
+    _params[3] = bound.radius;
+    SdfBound child_bound = read_bound(_params.data());
+
+    std::vector<SdfBound> bounds(n);
+    for (size_t i = 0; i < n; ++i) {
+        T xf[7] = {
+            instances[i].q[0], instances[i].q[1], instances[i].q[2], instances[i].q[3],
+            instances[i].tx[0], instances[i].tx[1], instances[i].tx[2],
+        };
+        bounds[i] = instance_bound(child_bound, xf);
+    }
+
+    std::vector<uint32_t> order = sdf_bvh_order(bounds);
+    std::vector<SdfBound> leaves(n);
+    for (size_t s = 0; s < n; ++s) {
+        const SdfInstance<T>& inst = instances[order[s]];
+        T* xf = _params.data() + sdf_instance_xf_param(s);
+        for (size_t k = 0; k < 4; ++k) xf[k]     = inst.q[k];
+        for (size_t k = 0; k < 3; ++k) xf[4 + k] = inst.tx[k];
+        _slot[order[s]] = s;
+        leaves[s] = bounds[order[s]];
+    }
+
+    std::vector<SdfBound> nodes = sdf_bvh_fit(leaves);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        write_bound(_params.data() + sdf_instance_node_param(n, i), nodes[i]);
+    }
+}
+
+template <typename T>
+SdfInstance<T> SdfInstances<T>::instance(size_t i) const {
+    const T* xf = _params.data() + sdf_instance_xf_param(_slot[i]);
+    SdfInstance<T> out;
+    for (size_t k = 0; k < 4; ++k) out.q[k]  = xf[k];
+    for (size_t k = 0; k < 3; ++k) out.tx[k] = xf[4 + k];
+    return out;
+}
+
+template <typename T>
+void SdfInstances<T>::set_instance(size_t i, const SdfInstance<T>& inst) {
+    size_t s = _slot[i];
+    T* xf = _params.data() + sdf_instance_xf_param(s);
+    for (size_t k = 0; k < 4; ++k) xf[k]     = inst.q[k];
+    for (size_t k = 0; k < 3; ++k) xf[4 + k] = inst.tx[k];
+    _refit(0, 0, n_instances(), s);
+}
+
+// recompute the bounds of the nodes from `node` (which covers [b, e)) down to `slot`
+template <typename T>
+void SdfInstances<T>::_refit(size_t node, size_t b, size_t e, size_t slot) {
+    size_t n = n_instances();
+    SdfBound s;
+    if (e - b == 1) {
+        s = instance_bound(read_bound(_params.data()), _params.data() + sdf_instance_xf_param(b));
+    } else {
+        size_t mid   = (b + e) / 2;
+        size_t left  = node + 1;
+        size_t right = node + 2 * (mid - b);
+        if (slot < mid) {
+            _refit(left, b, mid, slot);
+        } else {
+            _refit(right, mid, e, slot);
+        }
+        s = sdf_bound_union(
+            read_bound(_params.data() + sdf_instance_node_param(n, left)),
+            read_bound(_params.data() + sdf_instance_node_param(n, right))
+        );
+    }
+    write_bound(_params.data() + sdf_instance_node_param(n, node), s);
+}
+
+// explicit template instantiation
+template struct SdfInstances<float>;
+template struct SdfInstances<Dual<float>>;
+
+} // namespace stereo
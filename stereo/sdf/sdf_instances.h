@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stereo/sdf/sdf_bvh.h>
+
+// Instancing: many rigidly transformed copies of a single subtree.
+//
+// An `SdfInstances` node is the union of its child under each of a list of rigid
+// transforms. The child is serialized into the tape once; evaluators loop over the
+// instances, running the child's ops in the domain of each, and keep the nearest.
+//
+// The instances are culled with a bounding volume hierarchy of spheres (see sdf_bvh.h).
+// Each instance is bounded by the child's bounding sphere (given in the child's frame),
+// moved by the instance's transform, and the hierarchy is walked nearest-first, so the
+// number of instances visited per sample grows with log(instances), rather than with
+// their number. For an exact SDF whose surface lies within the bound, culling does not
+// change the result. (A conservative SDF may come out slightly larger than the full
+// union, but is still a valid bound).
+//
+// The parameter block holds, in order:
+//   - the child's bounding sphere (center, radius)                      4 params
+//   - the transform of each instance, in hierarchy order (q, tx)        7 per instance
+//   - the bounding sphere of each node of the hierarchy, in pre-order   4 per node
+// i.e. `15 * n` parameters for `n` instances. Only the transforms are differentiable.
+//
+// Instances may not be nested.
+//
+// Keep the layout in sync with sdf_eval.wgsl.
+
+namespace stereo {
+
+template <typename T>
+struct SdfInstance {
+    Quat<T>  q;
+    Vec<T,3> tx;
+};
+
+/// Parameters per instance, including its node of the hierarchy.
+constexpr size_t SdfInstanceParams = 15;
+
+/// The number of instances of an `Instances` op with `n_params` parameters.
+inline size_t sdf_instance_count(size_t n_params) {
+    return n_params / SdfInstanceParams;
+}
+
+/// The index of the first parameter of the transform of instance `i` (in hierarchy order).
+inline size_t sdf_instance_xf_param(size_t i) {
+    return 4 + 7 * i;
+}
+
+/// The index of the first parameter of the bounding sphere of node `i` of the hierarchy.
+inline size_t sdf_instance_node_param(size_t n_instances, size_t i) {
+    return 4 + 7 * n_instances + 4 * i;
+}
+
+/**
+ * @brief The union of many rigidly transformed instances of one subtree, culled
+ * by a bounding volume hierarchy.
+ */
+template <typename T>
+struct SdfInstances : public SdfUnop<T, SdfOp::Instances> {
+private:
+    std::vector<T>        _params;
+    std::vector<uint32_t> _slot; // index of each instance in hierarchy order
+
+    void _refit(size_t node, size_t b, size_t e, size_t slot);
+
+public:
+
+    /**
+     * @brief Instance `child` under each of `instances`.
+     *
+     * `bound` is a sphere (in the child's frame) which contains the child's surface.
+     * There must be at least one instance.
+     */
+    SdfInstances(
+        SdfNodeRef<T> child,
+        const Sphere<T,3>& bound,
+        const std::vector<SdfInstance<T>>& instances
+    );
+
+    size_t n_instances() const { return _slot.size(); }
+
+    /// The `i`th instance, in the order given to the constructor.
+    SdfInstance<T> instance(size_t i) const;
+
+    /**
+     * @brief Move the `i`th instance, and refit the bounds of the hierarchy above it.
+     *
+     * The structure of the hierarchy is kept, so culling becomes less effective if
+     * instances move far from where they were when the node was built.
+     */
+    void set_instance(size_t i, const SdfInstance<T>& xf);
+
+    size_t   n_params() const override { return _params.size(); }
+    const T* params()   const override { return _params.data(); }
+    bool     transforms_domain() const override { return true; }
+};
+
+} // namespace stereo
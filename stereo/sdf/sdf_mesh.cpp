@@ -0,0 +1,319 @@
+#include <stereo/sdf/sdf_mesh.h>
+#include <stereo/util/parallel.h>
+
+namespace stereo {
+
+namespace {
+
+using CellKey = uint64_t;
+
+constexpr uint32_t NoVert = std::numeric_limits<uint32_t>::max();
+
+// pack lattice coordinates of up to 21 bits each
+CellKey lattice_key(uint32_t x, uint32_t y, uint32_t z) {
+    return (uint64_t(x) << 42) | (uint64_t(y) << 21) | uint64_t(z);
+}
+
+// the offset of corner `k` of a cell
+vec3ui corner_offset(uint32_t k) {
+    return vec3ui(k & 1, (k >> 1) & 1, k >> 2);
+}
+
+// the point at lattice coordinates `c` (plus `offset`), with lattice spacing `cell`
+vec3 lattice_point(const range3& region, const vec3& cell, const vec3ui& c, float offset=0) {
+    return vec3(
+        region.lo.x + (c.x + offset) * cell.x,
+        region.lo.y + (c.y + offset) * cell.y,
+        region.lo.z + (c.z + offset) * cell.z
+    );
+}
+
+SdfCpuOutputRef eval_points(
+        const SdfCpuEvaluator& evaluator,
+        const SdfCpuExpr& expr,
+        const std::vector<vec3>& pts,
+        SdfEvalMode mode=SdfEvalMode::Value)
+{
+    SdfCpuInput input(pts.size(), 0);
+    input.write_samples_x(pts.data());
+    return evaluator.evaluate(expr, input, 1, ParamVariation::VaryDerivative, nullptr, mode);
+}
+
+// a quadric error function: the sum of squared distances to a set of planes
+struct Qef {
+    float ata[6] = {}; // symmetric: xx, xy, xz, yy, yz, zz
+    vec3  atb;
+    vec3  mass;
+    float n = 0;
+
+    // add the plane through `p` with normal `n_p`
+    void add(const vec3& p, const vec3& n_p) {
+        float d = n_p.dot(p);
+        ata[0] += n_p.x * n_p.x;
+        ata[1] += n_p.x * n_p.y;
+        ata[2] += n_p.x * n_p.z;
+        ata[3] += n_p.y * n_p.y;
+        ata[4] += n_p.y * n_p.z;
+        ata[5] += n_p.z * n_p.z;
+        atb  += n_p * d;
+        mass += p;
+        n    += 1;
+    }
+
+    // the point minimizing the error, pulled toward the mean of the plane points by
+    // `lambda` where the planes don't constrain it (e.g. on a flat face)
+    vec3 solve(float lambda) const {
+        vec3 m = mass / n;
+        // solve (AᵀA + λI) y = Aᵀb - AᵀA m, for x = m + y
+        float a = ata[0] + lambda, b = ata[1], c = ata[2];
+        float d = ata[3] + lambda, e = ata[4];
+        float f = ata[5] + lambda;
+        vec3 r = atb - vec3(
+            ata[0] * m.x + ata[1] * m.y + ata[2] * m.z,
+            ata[1] * m.x + ata[3] * m.y + ata[4] * m.z,
+            ata[2] * m.x + ata[4] * m.y + ata[5] * m.z
+        );
+        // inverse by cofactors
+        float c00 = d * f - e * e;
+        float c01 = c * e - b * f;
+        float c02 = b * e - c * d;
+        float c11 = a * f - c * c;
+        float c12 = b * c - a * e;
+        float c22 = a * d - b * b;
+        float det = a * c00 + b * c01 + c * c02;
+        vec3 y = vec3(
+            c00 * r.x + c01 * r.y + c02 * r.z,
+            c01 * r.x + c11 * r.y + c12 * r.z,
+            c02 * r.x + c12 * r.y + c22 * r.z
+        ) / det;
+        return m + y;
+    }
+};
+
+// a surface crossing on an edge of the lattice
+struct Crossing {
+    vec3 p;
+    vec3 n;
+};
+
+} // namespace
+
+
+range1i add_sdf_mesh(
+        Model& model,
+        const SdfCpuExpr& expr,
+        const SdfMeshOptions& opts,
+        const SdfCpuEvaluator& evaluator)
+{
+    const range3& region = opts.region;
+    int32_t no_prims = (int32_t) model.prims.size();
+    if (opts.max_depth > 20) {
+        std::cerr << "SDF mesh octree depth " << opts.max_depth << " is too deep "
+                  << "(at most 20)" << std::endl;
+        std::abort();
+    }
+
+    // refine the narrow band around the surface, level by level
+    std::vector<vec3ui> cells {vec3ui(0, 0, 0)};
+    vec3 extent = region.hi - region.lo;
+    vec3 cell;
+    for (uint32_t level = 0; ; ++level) {
+        cell = extent / (float) (1 << level);
+        float radius = cell.mag() / 2;
+        std::vector<vec3> centers(cells.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            centers[i] = lattice_point(region, cell, cells[i], 0.5f);
+        }
+        SdfCpuOutputRef f = eval_points(evaluator, expr, centers);
+        std::vector<vec3ui> near;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (std::abs(f->sdf_x[i]) <= radius) near.push_back(cells[i]);
+        }
+        if (level == opts.max_depth) {
+            cells = std::move(near);
+            break;
+        }
+        cells.clear();
+        for (const vec3ui& c : near) {
+            for (uint32_t k = 0; k < 8; ++k) {
+                vec3ui o = corner_offset(k);
+                cells.push_back(vec3ui(2 * c.x + o.x, 2 * c.y + o.y, 2 * c.z + o.z));
+            }
+        }
+    }
+    size_t n_cells = cells.size();
+    if (n_cells == 0) return {no_prims, no_prims - 1};
+
+    DenseMap<CellKey, uint32_t> cell_index;
+    for (size_t i = 0; i < n_cells; ++i) {
+        cell_index[lattice_key(cells[i].x, cells[i].y, cells[i].z)] = i;
+    }
+
+    // evaluate the corners of the cells
+    DenseMap<CellKey, uint32_t> corner_index;
+    std::vector<vec3>     corner_pts;
+    std::vector<uint32_t> cell_corners(8 * n_cells);
+    for (size_t i = 0; i < n_cells; ++i) {
+        for (uint32_t k = 0; k < 8; ++k) {
+            vec3ui o = corner_offset(k);
+            vec3ui c = vec3ui(cells[i].x + o.x, cells[i].y + o.y, cells[i].z + o.z);
+            auto [j, inserted] = corner_index.try_emplace(
+                lattice_key(c.x, c.y, c.z),
+                corner_pts.size()
+            );
+            if (inserted) corner_pts.push_back(lattice_point(region, cell, c));
+            cell_corners[8 * i + k] = j->second;
+        }
+    }
+    SdfCpuOutputRef corner_f = eval_points(evaluator, expr, corner_pts);
+    auto inside = [&](uint32_t corner) { return corner_f->sdf_x[corner] < 0; };
+
+    // find where the surface crosses the edges of the cells, and evaluate the normal
+    // there. edge `(c, axis)` runs from corner `c` along `axis`.
+    DenseMap<uint64_t, uint32_t> crossing_index;
+    std::vector<vec3> crossing_pts;
+    for (size_t i = 0; i < n_cells; ++i) {
+        for (uint32_t k = 0; k < 8; ++k) {
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                if (k & (1 << axis)) continue;
+                uint32_t c0 = cell_corners[8 * i + k];
+                uint32_t c1 = cell_corners[8 * i + (k | (1 << axis))];
+                if (inside(c0) == inside(c1)) continue;
+                auto [j, inserted] = crossing_index.try_emplace(
+                    (uint64_t(c0) << 2) | axis,
+                    crossing_pts.size()
+                );
+                if (not inserted) continue;
+                float f0 = corner_f->sdf_x[c0];
+                float f1 = corner_f->sdf_x[c1];
+                float t  = f0 / (f0 - f1);
+                crossing_pts.push_back(corner_pts[c0] + (corner_pts[c1] - corner_pts[c0]) * t);
+            }
+        }
+    }
+    SdfCpuOutputRef crossing_f = eval_points(evaluator, expr, crossing_pts, SdfEvalMode::Gradient);
+    std::vector<Crossing> crossings(crossing_pts.size());
+    for (size_t j = 0; j < crossing_pts.size(); ++j) {
+        // the tangent plane of the surface near the (linearly interpolated) crossing
+        vec3 n = crossing_f->normal_x[j];
+        crossings[j] = {crossing_pts[j] - n * crossing_f->sdf_x[j], n};
+    }
+
+    // place one vertex in each crossed cell. chunks of cells are processed in parallel,
+    // each into its own buffer; these are concatenated in order, so the result does not
+    // depend on the scheduling of threads.
+    size_t n_threads = evaluator.n_threads();
+    size_t grain     = std::max<size_t>(256, n_cells / (n_threads * 8));
+    size_t n_chunks  = (n_cells + grain - 1) / grain;
+    std::vector<std::vector<std::pair<uint32_t, vec3>>> chunk_verts(n_chunks);
+    parallel_for(
+        n_cells,
+        grain,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            std::vector<std::pair<uint32_t, vec3>>& out = chunk_verts[begin / grain];
+            for (size_t i = begin; i < end; ++i) {
+                Qef qef;
+                for (uint32_t k = 0; k < 8; ++k) {
+                    for (uint32_t axis = 0; axis < 3; ++axis) {
+                        if (k & (1 << axis)) continue;
+                        uint32_t c0 = cell_corners[8 * i + k];
+                        auto j = crossing_index.find((uint64_t(c0) << 2) | axis);
+                        if (j == crossing_index.end()) continue;
+                        const Crossing& x = crossings[j->second];
+                        qef.add(x.p, x.n);
+                    }
+                }
+                if (qef.n == 0) continue;
+                // keep the vertex inside its cell, where the solution is ill-conditioned
+                vec3 lo = lattice_point(region, cell, cells[i]);
+                vec3 p  = qef.solve(0.1f).clamp(lo, lo + cell);
+                out.push_back({(uint32_t) i, p});
+            }
+        },
+        n_threads
+    );
+
+    std::vector<uint32_t> cell_vert(n_cells, NoVert);
+    std::vector<vec3>     vert_pts;
+    uint32_t v0 = model.verts.size();
+    for (const auto& verts : chunk_verts) {
+        for (const auto& [i, p] : verts) {
+            cell_vert[i] = v0 + vert_pts.size();
+            vert_pts.push_back(p);
+        }
+    }
+    if (vert_pts.empty()) return {no_prims, no_prims - 1};
+    SdfCpuOutputRef vert_f = eval_points(evaluator, expr, vert_pts, SdfEvalMode::Gradient);
+    range3 bbox = range3::empty;
+    model.verts.reserve(model.verts.size() + vert_pts.size());
+    for (size_t j = 0; j < vert_pts.size(); ++j) {
+        model.verts.push_back({
+            .p  = vert_pts[j],
+            .n  = vert_f->normal_x[j].unit(),
+            .uv = vec2(),
+        });
+        bbox |= vert_pts[j];
+    }
+
+    // join the vertices around each crossed edge. an edge is visited from the cell
+    // whose lowest corner it starts at; that cell contains the surface, so it is in
+    // the narrow band.
+    std::vector<std::vector<uint32_t>> chunk_tris(n_chunks);
+    parallel_for(
+        n_cells,
+        grain,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            std::vector<uint32_t>& out = chunk_tris[begin / grain];
+            for (size_t i = begin; i < end; ++i) {
+                const vec3ui& c = cells[i];
+                uint32_t c0 = cell_corners[8 * i];
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    if (not crossing_index.contains((uint64_t(c0) << 2) | axis)) continue;
+                    // the other two cells' axes, in cyclic order
+                    uint32_t a1 = (axis + 1) % 3;
+                    uint32_t a2 = (axis + 2) % 3;
+                    if (c[a1] == 0 or c[a2] == 0) continue;
+                    vec3ui ring[4] = {c, c, c, c};
+                    ring[1][a1] -= 1;
+                    ring[2][a1] -= 1;
+                    ring[2][a2] -= 1;
+                    ring[3][a2] -= 1;
+                    uint32_t v[4];
+                    bool complete = true;
+                    for (size_t r = 0; r < 4; ++r) {
+                        auto j = cell_index.find(lattice_key(ring[r].x, ring[r].y, ring[r].z));
+                        if (j == cell_index.end() or cell_vert[j->second] == NoVert) {
+                            complete = false;
+                            break;
+                        }
+                        v[r] = cell_vert[j->second];
+                    }
+                    if (not complete or cell_vert[i] == NoVert) {
+                        continue;
+                    }
+                    // the ring winds counterclockwise around +axis; the surface faces
+                    // out, toward the outside end of the edge
+                    if (not inside(c0)) std::swap(v[1], v[3]);
+                    out.insert(out.end(), {v[0], v[1], v[2], v[0], v[2], v[3]});
+                }
+            }
+        },
+        n_threads
+    );
+
+    size_t i0 = model.indices.size();
+    for (const std::vector<uint32_t>& tris : chunk_tris) {
+        model.indices.insert(model.indices.end(), tris.begin(), tris.end());
+    }
+    if (model.indices.size() == i0) return {no_prims, no_prims - 1};
+    model.prims.push_back({
+        .index_range  = {(gpu_size_t) i0, (gpu_size_t) (model.indices.size() - 1)},
+        .geo_type     = PrimitiveType::Triangles,
+        .material_id  = opts.material_id,
+        .obj_to_world = xf3{},
+        .obj_bounds   = bbox,
+    });
+    return {no_prims, no_prims};
+}
+
+} // namespace stereo
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stereo/gpu/model.h>
+#include <stereo/sdf/sdf_cpu_eval.h>
+
+// Triangle meshes of SDF expressions, by dual contouring.
+//
+// The region to mesh is subdivided as an octree, keeping only the cells which may
+// contain the surface: over a cell of half-diagonal `r`, an SDF whose value at the
+// center is `|f| > r` can't reach zero. Only this narrow band is refined, so the cost
+// goes with the area of the surface rather than the volume of the region.
+//
+// At the finest level, each cell which the surface crosses gets one vertex, placed
+// by minimizing its distance to the tangent planes (from the evaluated `grad_f`) at
+// the points where the surface crosses the cell's edges. Each crossed edge then
+// produces a quad joining the vertices of the four cells around it. Sharp edges
+// and corners of the shapes are preserved, which marching cubes would round off.
+
+namespace stereo {
+
+struct SdfMeshOptions {
+    /// Region of space to mesh. The mesh is left open where the surface leaves it.
+    range3     region;
+    /// Depth of the octree: the finest cells divide `region` into `2^max_depth`
+    /// along each axis. At most 20.
+    uint32_t   max_depth   = 7;
+    MaterialId material_id = 0;
+};
+
+/**
+ * @brief Mesh the zero level set of `expr` within `opts.region`, and add it to `model`
+ * as a single triangle prim.
+ *
+ * Triangles are wound counterclockwise when seen from outside the surface (where the
+ * SDF is positive), and vertex normals are the normalized gradient of the SDF.
+ *
+ * Returns the range of prim ids added, which is empty if no surface was found.
+ */
+range1i add_sdf_mesh(
+    Model& model,
+    const SdfCpuExpr& expr,
+    const SdfMeshOptions& opts,
+    const SdfCpuEvaluator& evaluator=SdfCpuEvaluator()
+);
+
+} // namespace stereo
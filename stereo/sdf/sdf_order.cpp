@@ -0,0 +1,197 @@
+#include <numeric>
+
+#include <stereo/sdf/sdf_order.h>
+#include <stereo/util/parallel.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr uint32_t MaxCoord = (1u << SdfOrderBits) - 1;
+
+// samples per chunk of a parallel pass, at least
+constexpr size_t MinChunk = 1 << 14;
+
+// spread the low 10 bits of `v` so that there are two zero bits between each
+uint32_t spread_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// split `[0, n)` into chunks for a parallel pass. each chunk is one item of
+// `parallel_for()`, so the chunks are the same on every pass.
+size_t n_chunks(size_t n, size_t n_threads) {
+    return std::max<size_t>(1, std::min((n + MinChunk - 1) / MinChunk, n_threads * 4));
+}
+
+template <typename P>
+std::vector<gpu_size_t> sort_samples(P&& point, size_t n, SdfSampleOrder order, size_t n_threads) {
+    std::vector<gpu_size_t> index(n);
+    std::iota(index.begin(), index.end(), 0);
+    if (order == SdfSampleOrder::Unsorted or n < 2) return index;
+    if (n_threads == 0) n_threads = hardware_threads();
+    size_t chunks = n_chunks(n, n_threads);
+    size_t chunk  = (n + chunks - 1) / chunks;
+
+    // the bounding box of the (finite) points
+    std::vector<range3> chunk_bounds(chunks);
+    parallel_for(chunks, 1, [&](size_t c_begin, size_t c_end, size_t) {
+        for (size_t c = c_begin; c < c_end; ++c) {
+            range3 b = range3::empty;
+            for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+                vec3 p = point(i);
+                if (std::isfinite(p.x) and std::isfinite(p.y) and std::isfinite(p.z)) b |= p;
+            }
+            chunk_bounds[c] = b;
+        }
+    }, n_threads);
+    range3 bounds = range3::empty;
+    for (const range3& b : chunk_bounds) bounds |= b;
+    if (bounds.is_empty()) return index;
+    vec3  extent = bounds.hi - bounds.lo;
+    float scale  = MaxCoord / std::max({extent.x, extent.y, extent.z, 1e-30f});
+
+    // quantize and find the keys
+    std::vector<uint32_t> keys(n);
+    parallel_for(chunks, 1, [&](size_t c_begin, size_t c_end, size_t) {
+        for (size_t c = c_begin; c < c_end; ++c) {
+            for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+                vec3 t = (point(i) - bounds.lo) * scale;
+                uint32_t q[3];
+                for (size_t a = 0; a < 3; ++a) {
+                    // (false for NaN)
+                    q[a] = t[a] > 0 ? (uint32_t) std::min(t[a], (float) MaxCoord) : 0;
+                }
+                keys[i] = order == SdfSampleOrder::Hilbert
+                    ? hilbert_key(q[0], q[1], q[2])
+                    : morton_key (q[0], q[1], q[2]);
+            }
+        }
+    }, n_threads);
+    radix_sort(keys, index, 3 * SdfOrderBits, n_threads);
+    return index;
+}
+
+} // namespace
+
+
+uint32_t morton_key(uint32_t x, uint32_t y, uint32_t z) {
+    return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
+
+uint32_t hilbert_key(uint32_t x, uint32_t y, uint32_t z) {
+    // Skilling's transform [Skilling 2004]: convert the coordinates in place to the
+    // "transposed" Hilbert index, whose bits, read across the axes from the top bit
+    // down, are the bits of the index.
+    uint32_t v[3] = {x & MaxCoord, y & MaxCoord, z & MaxCoord};
+    for (uint32_t q = 1u << (SdfOrderBits - 1); q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (size_t a = 0; a < 3; ++a) {
+            if (v[a] & q) {
+                // invert the low bits of the first axis
+                v[0] ^= p;
+            } else {
+                // exchange the low bits of the first axis and this one
+                uint32_t t = (v[0] ^ v[a]) & p;
+                v[0] ^= t;
+                v[a] ^= t;
+            }
+        }
+    }
+    // gray encode
+    v[1] ^= v[0];
+    v[2] ^= v[1];
+    uint32_t t = 0;
+    for (uint32_t q = 1u << (SdfOrderBits - 1); q > 1; q >>= 1) {
+        if (v[2] & q) t ^= q - 1;
+    }
+    for (size_t a = 0; a < 3; ++a) v[a] ^= t;
+    // the first axis holds the most significant bit of each triple
+    return morton_key(v[2], v[1], v[0]);
+}
+
+void radix_sort(
+        std::vector<uint32_t>&   keys,
+        std::vector<gpu_size_t>& values,
+        uint32_t                 key_bits,
+        size_t                   n_threads)
+{
+    constexpr uint32_t DigitBits = 8;
+    constexpr uint32_t Buckets   = 1 << DigitBits;
+    size_t n = keys.size();
+    if (values.size() != n) {
+        std::cerr << "radix_sort() needs a value for each of its " << n << " keys" << std::endl;
+        std::abort();
+    }
+    if (n < 2) return;
+    if (n_threads == 0) n_threads = hardware_threads();
+    size_t chunks = n_chunks(n, n_threads);
+    size_t chunk  = (n + chunks - 1) / chunks;
+
+    std::vector<uint32_t>   keys_out(n);
+    std::vector<gpu_size_t> values_out(n);
+    // the count of each digit in each chunk, and then where the chunk writes them
+    std::vector<size_t> offsets(chunks * Buckets);
+    for (uint32_t shift = 0; shift < std::min(key_bits, 32u); shift += DigitBits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(chunks, 1, [&](size_t c_begin, size_t c_end, size_t) {
+            for (size_t c = c_begin; c < c_end; ++c) {
+                size_t* count = offsets.data() + c * Buckets;
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+                    count[(keys[i] >> shift) & (Buckets - 1)] += 1;
+                }
+            }
+        }, n_threads);
+        // skip digits which are the same for every key
+        size_t total = 0;
+        bool   uniform = false;
+        for (uint32_t d = 0; d < Buckets; ++d) {
+            size_t n_d = 0;
+            for (size_t c = 0; c < chunks; ++c) {
+                size_t count = offsets[c * Buckets + d];
+                offsets[c * Buckets + d] = total + n_d;
+                n_d += count;
+            }
+            uniform |= n_d == n;
+            total   += n_d;
+        }
+        if (uniform) continue;
+        // scatter; each chunk writes its keys in order, so the sort is stable
+        parallel_for(chunks, 1, [&](size_t c_begin, size_t c_end, size_t) {
+            for (size_t c = c_begin; c < c_end; ++c) {
+                size_t* cursor = offsets.data() + c * Buckets;
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+                    size_t j = cursor[(keys[i] >> shift) & (Buckets - 1)]++;
+                    keys_out[j]   = keys[i];
+                    values_out[j] = values[i];
+                }
+            }
+        }, n_threads);
+        std::swap(keys,   keys_out);
+        std::swap(values, values_out);
+    }
+}
+
+std::vector<gpu_size_t> sample_order(
+        const vec3*    pts,
+        size_t         n,
+        SdfSampleOrder order,
+        size_t         n_threads)
+{
+    return sort_samples([pts](size_t i) { return pts[i]; }, n, order, n_threads);
+}
+
+std::vector<gpu_size_t> sample_order(
+        const vec3gpu* pts,
+        size_t         n,
+        SdfSampleOrder order,
+        size_t         n_threads)
+{
+    return sort_samples([pts](size_t i) { return pts[i].v; }, n, order, n_threads);
+}
+
+} // namespace stereo
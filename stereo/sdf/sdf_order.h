@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+
+#include <stereo/sdf/sdf_structs.h>
+
+// Space-filling-curve orderings of SDF samples.
+//
+// Samples are evaluated in batches (SIMD lanes on the CPU, workgroups on the GPU), and a
+// batch costs about as much as its most expensive sample: every op of its tile's tape
+// runs for all of its lanes, the culled unions open the nodes needed by any lane, and
+// the GPU's `switch` diverges when neighboring invocations take different branches. If
+// the samples come in scattered order, every batch spans the whole scene. Sorting them
+// along a space-filling curve puts nearby samples in the same batch, so that they share
+// tiles, culled nodes and branches, and the data they touch stays in cache.
+//
+// The points are quantized to a 2^10 lattice over their bounding box (with the same
+// spacing along every axis), and sorted by the lattice cell's index along the curve.
+// A Morton (Z-order) key just interleaves the bits of the cell coordinates; a Hilbert
+// key costs a few more operations but never jumps between distant cells, so its
+// batches are slightly more compact. The sort is a parallel LSD radix sort of the keys.
+//
+// Sorting costs a few passes over the samples, and pays off when batches would
+// otherwise be incoherent: on the CPU, scattered samples of an untiled tape with a wide
+// culled union evaluate more than ten times faster once sorted, and a raster of samples
+// about 1.5x faster. Samples of a tiled tape are already grouped by tile (see
+// sdf_cpu_eval.h), so that sorting them gains little more. See `sdfbench order`.
+
+namespace stereo {
+
+/// Order in which samples are evaluated.
+enum struct SdfSampleOrder {
+    /// The order in which the samples were written.
+    Unsorted,
+    /// Along a Morton (Z-order) curve.
+    Morton,
+    /// Along a Hilbert curve.
+    Hilbert,
+};
+
+/// Bits per axis of the lattice on which samples are sorted.
+constexpr uint32_t SdfOrderBits = 10;
+
+/// The 30-bit Morton key of lattice cell `(x, y, z)`, whose coordinates are below 2^10.
+uint32_t morton_key(uint32_t x, uint32_t y, uint32_t z);
+
+/// The 30-bit index of lattice cell `(x, y, z)` along a 3D Hilbert curve of order 10.
+uint32_t hilbert_key(uint32_t x, uint32_t y, uint32_t z);
+
+/**
+ * @brief Sort `keys` ascending by a parallel, stable LSD radix sort, applying the
+ * same permutation to `values`.
+ *
+ * Only the low `key_bits` bits of the keys are compared. `values` must be as long as
+ * `keys`. If `n_threads` is zero, all hardware threads are used.
+ */
+void radix_sort(
+    std::vector<uint32_t>&   keys,
+    std::vector<gpu_size_t>& values,
+    uint32_t                 key_bits=32,
+    size_t                   n_threads=0
+);
+
+/**
+ * @brief The order in which to evaluate the `n` samples `pts`: entry `k` is the index
+ * of the `k`th sample to evaluate.
+ *
+ * For `SdfSampleOrder::Unsorted`, this is the identity. Non-finite points are sorted
+ * as if they were at the low corner of the bounding box of the others.
+ */
+std::vector<gpu_size_t> sample_order(
+    const vec3*    pts,
+    size_t         n,
+    SdfSampleOrder order,
+    size_t         n_threads=0
+);
+
+/// As above, for samples laid out for the GPU.
+std::vector<gpu_size_t> sample_order(
+    const vec3gpu* pts,
+    size_t         n,
+    SdfSampleOrder order,
+    size_t         n_threads=0
+);
+
+} // namespace stereo
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include <stereo/sdf/sdf_cpu_eval.h>
+#include <stereo/sdf/sdf_packing.h>
+
+namespace stereo {
+
+namespace {
+
+// sign, which is positive at zero
+float sign_nz(float x) {
+    return x >= 0 ? 1.f : -1.f;
+}
+
+} // namespace
+
+
+gpu_size_t sdf_record_words(SdfOutputLayout layout, SdfEvalMode mode) {
+    constexpr gpu_size_t Words[3][3] = {
+        // Value, Gradient, Dual
+        {0, 0, 0}, // Separate
+        {1, 2, 3}, // Packed
+        {1, 4, 8}, // Interleaved
+    };
+    return Words[(size_t) layout][(size_t) mode];
+}
+
+uint16_t sdf_float_to_half(float f) {
+    uint32_t x    = std::bit_cast<uint32_t>(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exp  = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    if (exp == 0xff) {
+        // inf, or a quiet nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    int32_t e = (int32_t) exp - 127 + 15;
+    if (e >= 31) return sign | 0x7c00;
+    if (e <= 0) {
+        // subnormal (or too small even for that)
+        if (e < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - e;
+        uint32_t h     = mant >> shift;
+        uint32_t rem   = mant & ((1u << shift) - 1);
+        uint32_t half  = 1u << (shift - 1);
+        if (rem > half or (rem == half and (h & 1))) h += 1;
+        return sign | h;
+    }
+    // (a carry out of the mantissa correctly bumps the exponent, up to inf)
+    uint32_t h   = ((uint32_t) e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 or (rem == 0x1000 and (h & 1))) h += 1;
+    return sign | h;
+}
+
+float sdf_half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0) {
+        float f = std::ldexp((float) mant, -24);
+        return sign ? -f : f;
+    }
+    uint32_t bits = exp == 31
+        ? sign | 0x7f800000 | (mant << 13)
+        : sign | ((exp + 112) << 23) | (mant << 13);
+    return std::bit_cast<float>(bits);
+}
+
+uint32_t sdf_pack_half2(const vec2& v) {
+    return (uint32_t) sdf_float_to_half(v.x) | ((uint32_t) sdf_float_to_half(v.y) << 16);
+}
+
+vec2 sdf_unpack_half2(uint32_t w) {
+    return vec2(sdf_half_to_float(w & 0xffff), sdf_half_to_float(w >> 16));
+}
+
+uint32_t sdf_pack_snorm2(const vec2& v) {
+    // (rounding as WGSL specifies: floor(0.5 + 32767 * clamp(x, -1, 1)))
+    auto snorm = [](float x) -> uint32_t {
+        int32_t i = (int32_t) std::floor(0.5f + 32767.f * std::clamp(x, -1.f, 1.f));
+        return (uint32_t) i & 0xffff;
+    };
+    return snorm(v.x) | (snorm(v.y) << 16);
+}
+
+vec2 sdf_unpack_snorm2(uint32_t w) {
+    auto snorm = [](uint32_t bits) {
+        return std::max((float) (int16_t) bits / 32767.f, -1.f);
+    };
+    return vec2(snorm(w & 0xffff), snorm(w >> 16));
+}
+
+vec2 sdf_oct_encode(const vec3& n) {
+    float s = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (s == 0) return vec2(0, 0);
+    vec2 p(n.x / s, n.y / s);
+    if (n.z < 0) {
+        // fold the lower hemisphere over the diagonals
+        p = vec2(
+            (1 - std::abs(p.y)) * sign_nz(p.x),
+            (1 - std::abs(p.x)) * sign_nz(p.y)
+        );
+    }
+    return p;
+}
+
+vec3 sdf_oct_decode(const vec2& p) {
+    vec3 v(p.x, p.y, 1 - std::abs(p.x) - std::abs(p.y));
+    float t = std::max(-v.z, 0.f);
+    v.x += v.x >= 0 ? -t : t;
+    v.y += v.y >= 0 ? -t : t;
+    return v.unit();
+}
+
+void sdf_tangent_frame(const vec3& n, vec3* t, vec3* b) {
+    float s = sign_nz(n.z);
+    float a = -1 / (s + n.z);
+    float c = n.x * n.y * a;
+    *t = vec3(1 + s * n.x * n.x * a, s * c, -s * n.x);
+    *b = vec3(c, s + n.y * n.y * a, -n.y);
+}
+
+uint32_t sdf_pack_normal(const vec3& g) {
+    return sdf_pack_snorm2(sdf_oct_encode(g));
+}
+
+vec3 sdf_unpack_normal(uint32_t w) {
+    return sdf_oct_decode(sdf_unpack_snorm2(w));
+}
+
+uint32_t sdf_pack_normal_tangent(const vec3& g, const vec3& g_dx, uint32_t n) {
+    float m = g.mag();
+    if (m == 0) return 0;
+    // d(g / |g|) = (g_dx - ĝ (ĝ . g_dx)) / |g|
+    vec3 g_hat = g / m;
+    vec3 d_hat = (g_dx - g_hat * g_hat.dot(g_dx)) / m;
+    vec3 t, b;
+    sdf_tangent_frame(sdf_unpack_normal(n), &t, &b);
+    return sdf_pack_half2(vec2(d_hat.dot(t), d_hat.dot(b)));
+}
+
+vec3 sdf_unpack_normal_tangent(uint32_t w, uint32_t n) {
+    vec3 t, b;
+    sdf_tangent_frame(sdf_unpack_normal(n), &t, &b);
+    vec2 c = sdf_unpack_half2(w);
+    return t * c.x + b * c.y;
+}
+
+void sdf_pack_record(SdfOutputLayout layout, const SdfCpuOutput& values, gpu_size_t i, uint32_t* record) {
+    bool  grad = values.mode >= SdfEvalMode::Gradient;
+    bool  dual = values.mode >= SdfEvalMode::Dual;
+    float f    = values.sdf_x[i];
+    float f_dx = dual ? values.sdf_dx[i] : 0.f;
+    switch (layout) {
+        case SdfOutputLayout::Packed: {
+            record[0] = sdf_pack_half2(vec2(f, f_dx));
+            if (grad) record[1] = sdf_pack_normal(values.normal_x[i]);
+            if (dual) record[2] = sdf_pack_normal_tangent(values.normal_x[i], values.normal_dx[i], record[1]);
+        } break;
+        case SdfOutputLayout::Interleaved: {
+            record[0] = std::bit_cast<uint32_t>(f);
+            if (grad) {
+                const vec3& g = values.normal_x[i];
+                for (size_t k = 0; k < 3; ++k) record[1 + k] = std::bit_cast<uint32_t>(g[k]);
+            }
+            if (dual) {
+                const vec3& g_dx = values.normal_dx[i];
+                record[4] = std::bit_cast<uint32_t>(f_dx);
+                for (size_t k = 0; k < 3; ++k) record[5 + k] = std::bit_cast<uint32_t>(g_dx[k]);
+            }
+        } break;
+        default: {
+            std::cerr << "SDF outputs of a separate layout have no records" << std::endl;
+            std::abort();
+        }
+    }
+}
+
+void sdf_unpack_records(
+        SdfOutputLayout layout,
+        SdfEvalMode     record_mode,
+        const uint32_t* words,
+        SdfCpuOutput&   out)
+{
+    if (layout == SdfOutputLayout::Separate or out.mode > record_mode) {
+        std::cerr << "SDF records cannot be decoded as " << (size_t) out.mode
+                  << " outputs of layout " << (size_t) layout << std::endl;
+        std::abort();
+    }
+    gpu_size_t stride = sdf_record_words(layout, record_mode);
+    bool grad = out.mode >= SdfEvalMode::Gradient;
+    bool dual = out.mode >= SdfEvalMode::Dual;
+    for (gpu_size_t i = 0; i < out.n_samples(); ++i) {
+        const uint32_t* r = words + (size_t) i * stride;
+        if (layout == SdfOutputLayout::Packed) {
+            vec2 f = sdf_unpack_half2(r[0]);
+            out.sdf_x[i] = f.x;
+            if (grad) out.normal_x[i] = sdf_unpack_normal(r[1]);
+            if (dual) {
+                out.sdf_dx[i]    = f.y;
+                out.normal_dx[i] = sdf_unpack_normal_tangent(r[2], r[1]);
+            }
+        } else {
+            out.sdf_x[i] = std::bit_cast<float>(r[0]);
+            if (grad) {
+                out.normal_x[i] = vec3(
+                    std::bit_cast<float>(r[1]),
+                    std::bit_cast<float>(r[2]),
+                    std::bit_cast<float>(r[3])
+                );
+            }
+            if (dual) {
+                out.sdf_dx[i]    = std::bit_cast<float>(r[4]);
+                out.normal_dx[i] = vec3(
+                    std::bit_cast<float>(r[5]),
+                    std::bit_cast<float>(r[6]),
+                    std::bit_cast<float>(r[7])
+                );
+            }
+        }
+    }
+}
+
+} // namespace stereo
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stereo/gpu/gpu_types.h>
+#include <stereo/sdf/sdf_tape.h>
+
+// Compact layouts of SDF evaluation results.
+//
+// By default an `SdfOutput` holds each output in a buffer of its own, at full precision,
+// with the normals padded to 16 bytes: 40 bytes per sample in `SdfEvalMode::Dual`. When
+// the results are only read back or streamed (e.g. dense slices for display), that
+// bandwidth dominates. The other layouts write one record of 32-bit words per sample
+// into a single buffer, whose fields are a prefix of the record of the next mode:
+//
+//   - `Packed`:      the distance and its tangent as two halves (`pack2x16float`), then
+//                    the unit normal in octahedral coordinates as two 16-bit snorms,
+//                    then the tangent of the unit normal as two halves, in a frame of
+//                    the plane orthogonal to the normal. 4 / 8 / 12 bytes.
+//   - `Interleaved`: the distance and the gradient, then their tangents, at full
+//                    precision and without padding. 4 / 16 / 32 bytes.
+//
+// (for `Value` / `Gradient` / `Dual`, against 4 / 20 / 40 for `Separate`.) The records
+// are encoded by sdf_packing.wgsl on the GPU, and decoded on the host by
+// `sdf_unpack_records()`, which is what `SdfReadback` does.
+//
+// `Packed` stores the direction of the gradient but not its length, which is 1 for an
+// exact distance field. Its normal tangent is the tangent of the *normalized* gradient;
+// for an exact distance field, that is the tangent of the gradient. Normals are good to
+// about 1e-4 radians, and the halves to 3 significant digits (so distances far from the
+// surface lose absolute precision; distances beyond 65504 become infinite).
+
+namespace stereo {
+
+struct SdfCpuOutput;
+
+// keep in sync with `SdfOutputLayout_*` in sdf_packing.wgsl
+enum struct SdfOutputLayout : uint32_t {
+    /// Each output in a buffer of its own, at full precision.
+    Separate,
+    /// Half-precision distances, and octahedral-encoded normals.
+    Packed,
+    /// The full-precision outputs of each sample, together.
+    Interleaved,
+};
+
+/// Number of 32-bit words per sample of a record of `layout`, for the outputs of `mode`;
+/// 0 for `Separate`.
+gpu_size_t sdf_record_words(SdfOutputLayout layout, SdfEvalMode mode);
+
+/// Convert to IEEE half precision, rounding to nearest even.
+uint16_t sdf_float_to_half(float f);
+float    sdf_half_to_float(uint16_t h);
+
+/// As WGSL's `pack2x16float()`, with `v.x` in the low bits.
+uint32_t sdf_pack_half2(const vec2& v);
+vec2     sdf_unpack_half2(uint32_t w);
+
+/// As WGSL's `pack2x16snorm()`, with `v.x` in the low bits.
+uint32_t sdf_pack_snorm2(const vec2& v);
+vec2     sdf_unpack_snorm2(uint32_t w);
+
+/// Octahedral coordinates in [-1, 1]^2 of the direction of `n`, which need not be
+/// normalized. The zero vector maps to +z.
+vec2 sdf_oct_encode(const vec3& n);
+/// The unit vector with octahedral coordinates `p`.
+vec3 sdf_oct_decode(const vec2& p);
+
+/**
+ * @brief An orthonormal basis `t, b` of the plane orthogonal to the unit vector `n`
+ * [Duff et al. 2017], continuous but for the sign of `n.z`.
+ */
+void sdf_tangent_frame(const vec3& n, vec3* t, vec3* b);
+
+/// The direction of the gradient `g`, as packed by `Packed`.
+uint32_t sdf_pack_normal(const vec3& g);
+vec3     sdf_unpack_normal(uint32_t w);
+
+/**
+ * @brief The tangent of the normalized gradient, given the gradient `g` and its
+ * tangent `g_dx`, as packed by `Packed` next to the packed normal `n`.
+ *
+ * The tangent of a unit vector is orthogonal to it, so it is stored by its two
+ * coordinates in the frame of the *decoded* normal, which the host rebuilds exactly.
+ */
+uint32_t sdf_pack_normal_tangent(const vec3& g, const vec3& g_dx, uint32_t n);
+vec3     sdf_unpack_normal_tangent(uint32_t w, uint32_t n);
+
+/**
+ * @brief Encode the outputs of `values.mode` for sample `i` of `values` into
+ * `record`, which holds `sdf_record_words(layout, values.mode)` words.
+ *
+ * The host counterpart of the GPU's encoder, for tests and for CPU producers.
+ */
+void sdf_pack_record(SdfOutputLayout layout, const SdfCpuOutput& values, gpu_size_t i, uint32_t* record);
+
+/**
+ * @brief Decode `out.n_samples()` consecutive records of `layout` from `words`.
+ *
+ * The records hold the outputs of `record_mode`, of which those of `out.mode` (which
+ * may not exceed `record_mode`) are decoded. `layout` may not be `Separate`.
+ */
+void sdf_unpack_records(
+    SdfOutputLayout layout,
+    SdfEvalMode     record_mode,
+    const uint32_t* words,
+    SdfCpuOutput&   out);
+
+} // namespace stereo
@@ -0,0 +1,550 @@
+#include <stereo/sdf/sdf_prune.h>
+#include <stereo/sdf/sdf_cpu_math.h>
+#include <stereo/sdf/sdf_instances.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr float Inf = std::numeric_limits<float>::infinity();
+
+using Vec3f = simd::Vec3<float>;
+
+bool is_domain_op(SdfOp op) {
+    return op >= SdfOp::Transform and op <= SdfOp::Instances;
+}
+
+// the Lipschitz constant of the quaternion rotation `qrot()` by `(u, w) = q[0, 4)`,
+// which need not be a unit quaternion. it leaves the axis `u` unchanged, and scales
+// the plane orthogonal to it by |(1 - 2|u|^2) + 2 w |u| i|, which is 1 for a unit `q`.
+float qrot_lipschitz(const float* q) {
+    float u2 = q[0] * q[0] + q[1] * q[1] + q[2] * q[2];
+    float w  = q[3];
+    float a  = 1 - 2 * u2;
+    return std::max(1.f, std::sqrt(a * a + 4 * w * w * u2));
+}
+
+// how much the domain op `op` may stretch distances. rigid transforms and mirrors are
+// isometries (given a unit quaternion or normal), and the repetitions are isometries
+// within each of their cells.
+float domain_lipschitz(const SdfGpuOp& op, const float* ps) {
+    switch (op.op) {
+        case SdfOp::Transform: return qrot_lipschitz(ps);
+        case SdfOp::Mirror: {
+            // the reflection `I - 2 n n^T` scales `n` by |1 - 2|n|^2|
+            float n2 = ps[0] * ps[0] + ps[1] * ps[1] + ps[2] * ps[2];
+            return std::max(1.f, std::abs(1 - 2 * n2));
+        }
+        case SdfOp::Instances: {
+            float k = 1;
+            size_t n = sdf_instance_count(op.param_end - op.param_start);
+            for (size_t i = 0; i < n; ++i) {
+                k = std::max(k, qrot_lipschitz(ps + sdf_instance_xf_param(i)));
+            }
+            return k;
+        }
+        default: return 1;
+    }
+}
+
+// the Lipschitz constant of the shape `op`, in its own domain. the shapes are exact
+// distances, but for a plane with a normal which is not of unit length, and a voxel
+// grid, whose trilinear interpolation of a 1-Lipschitz lattice has a slope of up to 1
+// along each axis.
+float shape_lipschitz(const SdfGpuOp& op, const float* ps) {
+    switch (op.op) {
+        case SdfOp::Plane:     return std::sqrt(ps[0] * ps[0] + ps[1] * ps[1] + ps[2] * ps[2]);
+        case SdfOp::VoxelGrid: return std::sqrt(3.f);
+        default:               return 1;
+    }
+}
+
+// the ball over which a (sub-)tape is being bounded, in the coordinates of its domain
+struct Ball {
+    simd::SdfDomain<float> center;
+    float                  radius;
+};
+
+// the bound on a sub-expression, and the index of the sub-expression's first op.
+// a sub-expression which stores a value slot can't be dropped, since later loads
+// may depend on it.
+struct Bound {
+    range  f;
+    size_t begin;
+    bool   has_store = false;
+};
+
+// the radius of a ball which contains the image of `ball` under the domain op `op`,
+// or infinity if none is known. the repetitions are discontinuous at the boundaries
+// of their cells (or sectors), so their image is only known if `ball` lies in one.
+float folded_radius(const SdfGpuOp& op, const simd::ParamBlock& ps, const Ball& ball) {
+    const Vec3f& c = ball.center.p;
+    float r = ball.radius;
+    switch (op.op) {
+        case SdfOp::Transform: return r * domain_lipschitz(op, ps.x);
+        case SdfOp::Repeat: {
+            Vec3f period = ps.vec3<float>(0);
+            Vec3f lo     = ps.vec3<float>(3);
+            Vec3f hi     = ps.vec3<float>(6);
+            for (size_t a = 0; a < 3; ++a) {
+                float p = (&period.x)[a];
+                if (not (p > 0)) continue;
+                float x  = (&c.x)[a];
+                auto  k  = [&](float v) {
+                    return std::clamp(std::round(v / p), (&lo.x)[a], (&hi.x)[a]);
+                };
+                if (k(x - r) != k(x + r)) return Inf;
+            }
+            return r;
+        }
+        case SdfOp::Mirror: return r * domain_lipschitz(op, ps.x); // (the fold is continuous)
+        case SdfOp::RotSym: {
+            size_t axis  = simd::sdf_axis(op.variant);
+            float  u     = (&c.x)[(axis + 1) % 3];
+            float  v     = (&c.x)[(axis + 2) % 3];
+            float  rho   = std::sqrt(u * u + v * v);
+            float  n     = std::max(std::round(ps.scalar<float>(0)), 1.f);
+            float  w     = 2.f * (float) M_PI / n;
+            if (n == 1.f) return r;
+            if (not (rho > r)) return Inf;
+            float  theta = std::atan2(v, u);
+            float  off   = std::abs(theta - simd::rotsym_angle(c, n, axis));
+            // the ball subtends at most asin(r / rho) on either side of its center
+            return off + std::asin(r / rho) < w / 2 ? r : Inf;
+        }
+        default: return Inf;
+    }
+}
+
+// the range of an `Instances` op over `ball`. the surface of each instance lies in its
+// bounding sphere `(c_k, r_k)`, so its distance from `p` is within `|p - c_k| ± r_k`.
+// the hierarchy is walked to find the nearest of those bounds.
+range instances_range(const SdfGpuOp& op, const float* params, const Ball& ball) {
+    struct Visit {
+        uint32_t node;
+        uint32_t b;
+        uint32_t e;
+    };
+    const float* ps = params + op.param_start;
+    size_t n  = sdf_instance_count(op.param_end - op.param_start);
+    range  f  = {Inf, Inf};
+    Visit  todo[64];
+    size_t n_todo = 0;
+    todo[n_todo++] = {0, 0, (uint32_t) n};
+    while (n_todo > 0) {
+        Visit v = todo[--n_todo];
+        const float* s = ps + sdf_instance_node_param(n, v.node);
+        float d = simd::length(ball.center.p - Vec3f{s[0], s[1], s[2]});
+        // nothing under the node is nearer than this (and `f.lo <= f.hi`)
+        if (d - s[3] >= f.hi) continue;
+        if (v.e - v.b == 1) {
+            f = {std::min(f.lo, d - s[3]), std::min(f.hi, d + s[3])};
+        } else {
+            uint32_t mid = (v.b + v.e) / 2;
+            todo[n_todo++] = {v.node + 1, v.b, mid};
+            todo[n_todo++] = {v.node + 2 * (mid - v.b), mid, v.e};
+        }
+    }
+    return {f.lo - ball.radius, f.hi + ball.radius};
+}
+
+range interval_union(range a, range b) {
+    return {std::min(a.lo, b.lo), std::min(a.hi, b.hi)};
+}
+
+range interval_intersect(range a, range b) {
+    return {std::max(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+range interval_negate(range a) {
+    return {-a.hi, -a.lo};
+}
+
+range interval_abs(range a) {
+    if (a.lo >= 0) return a;
+    if (a.hi <= 0) return interval_negate(a);
+    return {0, std::max(-a.lo, a.hi)};
+}
+
+} // namespace
+
+
+range prune_tape(
+        const SdfGpuOp* ops,
+        size_t n_ops,
+        const float* params,
+        const vec3& center,
+        float radius,
+        std::vector<SdfGpuOp>& out)
+{
+    std::vector<uint8_t> keep(n_ops, 1);
+    std::vector<Ball>    p_stack;
+    std::vector<Bound>   f_stack;
+    range                slots[SdfTape::MaxSlots];
+    p_stack.push_back({{Vec3f{center.x, center.y, center.z}}, radius});
+
+    auto drop = [&](size_t begin, size_t end) {
+        std::fill(keep.begin() + begin, keep.begin() + end, 0);
+    };
+
+    // the operands of the enclosing `BvhUnion` (if any) are bounded one at a time, and
+    // each is set aside as it ends. once they're all done, those which can't be the
+    // nearest are dropped, leaving their entries of the table empty. if too few are left
+    // to be worth culling, the union is flattened back into a chain: the `BvhUnion` and
+    // its table are dropped, and a `Union` is inserted after each operand but the first.
+    size_t bvh = n_ops;
+    size_t k   = 0;
+    std::vector<std::pair<size_t, Bound>> operands;
+    // (index of the op which a `Union` goes before, an op of the operand it ends). the
+    // union is only inserted if that op survives, since the whole chain may be dropped
+    std::vector<std::pair<size_t, size_t>> joins;
+    auto end_operands = [&](size_t i) {
+        while (bvh < n_ops and i == sdf_bvh_operand(ops, bvh, k + 1)) {
+            if (sdf_bvh_operand(ops, bvh, k) < i) {
+                operands.push_back({k, f_stack.back()});
+                f_stack.pop_back();
+            }
+            if (++k < sdf_bvh_count(ops[bvh])) continue;
+            float hi = Inf;
+            for (const auto& [j, b] : operands) hi = std::min(hi, b.f.hi);
+            Bound u {{Inf, Inf}, bvh};
+            std::vector<size_t> survivors;
+            for (const auto& [j, b] : operands) {
+                if (b.f.lo > hi and not b.has_store) {
+                    drop(sdf_bvh_operand(ops, bvh, j), sdf_bvh_operand(ops, bvh, j + 1));
+                } else {
+                    survivors.push_back(j);
+                    u.f = interval_union(u.f, b.f);
+                    u.has_store = u.has_store or b.has_store;
+                }
+            }
+            // the table costs an op per operand in every tile, so when few operands
+            // survive, a plain chain of unions is shorter (and no slower to walk)
+            size_t n = sdf_bvh_count(ops[bvh]);
+            if (survivors.size() < std::max<size_t>(SdfTape::MinBvhOperands, n / 8)) {
+                drop(bvh, sdf_bvh_operand(ops, bvh, 0));
+                for (size_t s = 1; s < survivors.size(); ++s) {
+                    size_t end = sdf_bvh_operand(ops, bvh, survivors[s] + 1);
+                    size_t op  = end - 1;
+                    while (not keep[op]) --op;
+                    joins.push_back({end, op});
+                }
+            }
+            f_stack.push_back(u);
+            operands.clear();
+            bvh = n_ops;
+        }
+    };
+
+    // find the ops to drop
+    for (size_t i = 0; i < n_ops; ++i) {
+        end_operands(i);
+        SdfGpuOp op = ops[i];
+        const Ball& ball = p_stack.back();
+        simd::ParamBlock ps {params + op.param_start, params + op.param_start};
+        if (op.op == SdfOp::PopDomain) {
+            // the sub-expression extends back to the op which pushed the domain.
+            // domain ops preserve distances (or, for folds, only ever bring copies
+            // nearer), so the range is unchanged.
+            p_stack.pop_back();
+            if (not f_stack.empty()) {
+                f_stack.back().begin = std::min<size_t>(f_stack.back().begin, op.push_index);
+                const SdfGpuOp& pushed = ops[op.push_index];
+                if (pushed.op == SdfOp::Instances) {
+                    // nothing is known inside the instances (see below), but their
+                    // union is bounded by the hierarchy
+                    f_stack.back().f = instances_range(pushed, params, p_stack.back());
+                }
+            }
+            continue;
+        }
+        if (is_domain_op(op.op)) {
+            Ball inner {ball.center, Inf};
+            if (simd::sdf_push_domain(op.op, op.variant, ps, ball.center, inner.center)) {
+                inner.radius = folded_radius(op, ps, ball);
+            }
+            // otherwise: there is no single image of the ball (e.g. under `Instances`, which
+            // has many), or the op is not implemented yet; nothing is known about the domain
+            p_stack.push_back(inner);
+            continue;
+        }
+        switch (op.op) {
+            case SdfOp::Union:
+            case SdfOp::Intersect:
+            case SdfOp::Subtract:
+            case SdfOp::Xor: {
+                Bound b = f_stack.back();
+                f_stack.pop_back();
+                Bound& a = f_stack.back();
+                switch (op.op) {
+                    case SdfOp::Union: {
+                        if (a.f.lo > b.f.hi and not a.has_store) {
+                            // `a` is never the nearest
+                            drop(a.begin, b.begin);
+                            keep[i] = 0;
+                            a.f = b.f;
+                        } else if (b.f.lo > a.f.hi and not b.has_store) {
+                            drop(b.begin, i + 1);
+                        } else {
+                            a.f = interval_union(a.f, b.f);
+                        }
+                    } break;
+                    case SdfOp::Intersect: {
+                        if (a.f.hi < b.f.lo and not a.has_store) {
+                            drop(a.begin, b.begin);
+                            keep[i] = 0;
+                            a.f = b.f;
+                        } else if (b.f.hi < a.f.lo and not b.has_store) {
+                            drop(b.begin, i + 1);
+                        } else {
+                            a.f = interval_intersect(a.f, b.f);
+                        }
+                    } break;
+                    case SdfOp::Subtract: {
+                        // there is no negation op, so only `b` can be dropped
+                        range neg_b = interval_negate(b.f);
+                        if (neg_b.hi < a.f.lo and not b.has_store) {
+                            drop(b.begin, i + 1);
+                        } else {
+                            a.f = interval_intersect(a.f, neg_b);
+                        }
+                    } break;
+                    default: {
+                        range u = interval_union(a.f, b.f);
+                        range n = interval_intersect(a.f, b.f);
+                        a.f = interval_intersect(u, interval_negate(n));
+                    } break;
+                }
+                a.has_store = a.has_store or b.has_store;
+            } break;
+            case SdfOp::Store: {
+                // the value stays on the stack, so this is part of the sub-expression
+                slots[op.slot] = f_stack.back().f;
+                f_stack.back().has_store = true;
+            } break;
+            case SdfOp::Load: {
+                // the stored value was computed in the same domain
+                f_stack.push_back({slots[op.slot], i});
+            } break;
+            case SdfOp::BvhUnion: {
+                bvh = i;
+                k   = 0;
+                // (skip the table of operands)
+                i = sdf_bvh_operand(ops, i, 0) - 1;
+            } break;
+            case SdfOp::Dilate: {
+                range& f = f_stack.back().f;
+                float r  = ps.scalar<float>(0);
+                f = {f.lo - r, f.hi - r};
+            } break;
+            case SdfOp::Shell: {
+                range& f = f_stack.back().f;
+                float r  = ps.scalar<float>(0);
+                f = interval_abs(f);
+                f = {f.lo - r, f.hi - r};
+            } break;
+            default: {
+                simd::SdfRange<float> f;
+                if (simd::sdf_shape(op.op, ps, ball.center, f)) {
+                    // Lipschitz bound
+                    float df = ball.radius * shape_lipschitz(op, ps.x);
+                    f_stack.push_back({{f.f - df, f.f + df}, i});
+                } else if (op.op >= SdfOp::Sphere) {
+                    // not implemented yet; nothing is known about the shape
+                    f_stack.push_back({{-Inf, Inf}, i});
+                }
+            } break;
+        }
+    }
+
+    end_operands(n_ops);
+
+    // copy the survivors (and the unions of flattened operands), renumbering the domain
+    // pops and the tables of operands. an op which was dropped maps to the next one which
+    // survives, so a dropped operand is left empty.
+    auto is_join = [&](size_t i, size_t j) {
+        return j < joins.size() and joins[j].first == i;
+    };
+    std::vector<gpu_size_t> new_index(n_ops + 1);
+    for (size_t i = 0, j = 0, n = 0; i <= n_ops; ++i) {
+        for (; is_join(i, j); ++j) n += keep[joins[j].second];
+        new_index[i] = n;
+        if (i < n_ops and keep[i]) ++n;
+    }
+    for (size_t i = 0, j = 0; i <= n_ops; ++i) {
+        for (; is_join(i, j); ++j) {
+            if (not keep[joins[j].second]) continue;
+            out.push_back({
+                .op          = SdfOp::Union,
+                .variant     = SdfOpVariant::None,
+                .param_start = 0,
+                .param_end   = 0,
+            });
+        }
+        if (i == n_ops or not keep[i]) continue;
+        SdfGpuOp op = ops[i];
+        if (op.op == SdfOp::PopDomain or op.op == SdfOp::BvhOperand) {
+            op.push_index = new_index[op.push_index];
+        }
+        out.push_back(op);
+    }
+
+    return f_stack.empty() ? range(-Inf, Inf) : f_stack.back().f;
+}
+
+float sdf_lipschitz(const SdfGpuOp* ops, size_t n_ops, const float* params) {
+    // every range op is as steep as the steepest of its operands, so the tape is as
+    // steep as its steepest shape, in the domain stretched by the ops above it
+    std::vector<float> stretch {1.f};
+    float k = 0;
+    for (size_t i = 0; i < n_ops; ++i) {
+        const SdfGpuOp& op = ops[i];
+        const float*    ps = params + op.param_start;
+        if (op.op == SdfOp::PopDomain) {
+            stretch.pop_back();
+        } else if (is_domain_op(op.op)) {
+            stretch.push_back(stretch.back() * domain_lipschitz(op, ps));
+        } else if (op.op == SdfOp::BvhUnion) {
+            // (skip the table of operands)
+            i = sdf_bvh_operand(ops, i, 0) - 1;
+        } else if (op.op >= SdfOp::Sphere) {
+            k = std::max(k, stretch.back() * shape_lipschitz(op, ps));
+        }
+    }
+    return k > 0 ? k : 1;
+}
+
+
+namespace {
+
+// a tape shared by a subtree of tiles, which is emitted at most once
+struct TileTape {
+    std::vector<SdfGpuOp> ops;
+    std::optional<SdfTile> emitted;
+};
+
+struct TileBuilder {
+    SdfTiledTape& tt;
+    vec3          cell;
+
+    SdfTile emit(TileTape& t) {
+        if (not t.emitted) {
+            gpu_size_t begin = tt.ops.size();
+            tt.ops.insert(tt.ops.end(), t.ops.begin(), t.ops.end());
+            t.emitted = SdfTile {begin, (gpu_size_t) tt.ops.size()};
+        }
+        return *t.emitted;
+    }
+
+    // prune the parent's tape over the tiles in [c0, c1)
+    void subdivide(TileTape& parent, const vec3ui& c0, const vec3ui& c1) {
+        vec3 lo, hi;
+        for (size_t a = 0; a < 3; ++a) {
+            lo[a] = tt.region.lo[a] + c0[a] * cell[a];
+            hi[a] = tt.region.lo[a] + c1[a] * cell[a];
+        }
+        vec3 center = (lo + hi) / 2.f;
+        vec3 half   = (hi - lo) / 2.f;
+        float radius = std::sqrt(half.x * half.x + half.y * half.y + half.z * half.z);
+
+        TileTape self;
+        prune_tape(
+            parent.ops.data(),
+            parent.ops.size(),
+            tt.tape.params_x.data(),
+            center,
+            radius,
+            self.ops
+        );
+        // pruning only ever removes ops, so the same length means the same tape
+        TileTape& t = self.ops.size() == parent.ops.size() ? parent : self;
+
+        vec3ui n = c1 - c0;
+        if (n.x * n.y * n.z == 1) {
+            tt.tiles[1 + (c0.z * tt.tile_dims.y + c0.y) * tt.tile_dims.x + c0.x] = emit(t);
+            return;
+        }
+        // split the longest axis
+        size_t axis = 0;
+        if (n[1] > n[axis]) axis = 1;
+        if (n[2] > n[axis]) axis = 2;
+        vec3ui mid_hi = c1;
+        vec3ui mid_lo = c0;
+        mid_hi[axis] = c0[axis] + n[axis] / 2;
+        mid_lo[axis] = mid_hi[axis];
+        subdivide(t, c0, mid_hi);
+        subdivide(t, mid_lo, c1);
+    }
+};
+
+} // namespace
+
+
+SdfTiledTape::SdfTiledTape(SdfTape tape):
+    tape(std::move(tape)),
+    region(),
+    tile_dims(0, 0, 0),
+    ops(this->tape.ops),
+    tiles{{0, (gpu_size_t) this->tape.ops.size()}} {}
+
+SdfTiledTape::SdfTiledTape(SdfTape tape, const range3& region, const vec3ui& tile_dims):
+    SdfTiledTape(std::move(tape))
+{
+    this->region    = region;
+    this->tile_dims = tile_dims;
+    size_t n = tile_dims.x * tile_dims.y * tile_dims.z;
+    if (n == 0) return;
+    tiles.resize(1 + n);
+
+    vec3 cell;
+    for (size_t a = 0; a < 3; ++a) {
+        cell[a] = (region.hi[a] - region.lo[a]) / tile_dims[a];
+    }
+    TileBuilder builder {*this, cell};
+    TileTape root {this->tape.ops, tiles[0]};
+    builder.subdivide(root, vec3ui(0, 0, 0), tile_dims);
+}
+
+gpu_size_t SdfTiledTape::tile_index(const vec3& p) const {
+    if (tiles.size() <= 1) return 0;
+    vec3ui c;
+    for (size_t a = 0; a < 3; ++a) {
+        float lo = region.lo[a];
+        float hi = region.hi[a];
+        if (not (p[a] >= lo and p[a] <= hi)) return 0;
+        float t = hi > lo ? (p[a] - lo) / (hi - lo) * tile_dims[a] : 0;
+        c[a] = std::min<uint32_t>(t, tile_dims[a] - 1);
+    }
+    return 1 + (c.z * tile_dims.y + c.y) * tile_dims.x + c.x;
+}
+
+SdfTileGrid SdfTiledTape::grid() const {
+    SdfTileGrid g {};
+    g.n_x = tile_dims.x;
+    g.n_y = tile_dims.y;
+    g.n_z = tile_dims.z;
+    if (tiles.size() <= 1) return g;
+    for (size_t a = 0; a < 3; ++a) {
+        float extent  = region.hi[a] - region.lo[a];
+        g.lo[a]       = region.lo[a];
+        g.hi[a]       = region.hi[a];
+        g.inv_cell[a] = extent > 0 ? tile_dims[a] / extent : 0;
+    }
+    return g;
+}
+
+SdfTapeView SdfTiledTape::view() const {
+    return {
+        .ops            = ops.data(),
+        .n_ops          = (gpu_size_t) ops.size(),
+        .params_x       = tape.params_x.data(),
+        .params_dx      = tape.params_dx.data(),
+        .n_params       = (gpu_size_t) tape.n_params(),
+        .tiles          = tiles.data(),
+        .n_tile_entries = (gpu_size_t) tiles.size(),
+        .grid           = grid(),
+        .stack_depth    = (gpu_size_t) tape.stack_depth(),
+    };
+}
+
+} // namespace stereo
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stereo/sdf/sdf_tape.h>
+
+// Hierarchical pruning of SDF tapes.
+//
+// Over a small region of space, most of a large CSG tree cannot affect the result:
+// a union branch which is far away from the region is never the minimum, and an
+// intersection branch which is deep inside never the maximum. We find such branches
+// by evaluating the tape over a ball in interval arithmetic, and drop them, producing
+// a shorter tape which gives exactly the same values (and gradients) within the ball.
+//
+// Leaf intervals come from the Lipschitz bound: an SDF changes by at most `r` over
+// a distance `r`, so over a ball of radius `r` around `c`, `f` lies in
+// `[f(c) - r, f(c) + r]`. Interior nodes combine their children's intervals.
+// This relies on every leaf being a true (or conservative) distance bound, and on
+// every domain op being 1-Lipschitz, so that the image of the ball lies in a ball of
+// the same radius. Rigid transforms and mirrors move the center of the ball but not its
+// radius. Repetitions (`Repeat`, `RotSym`) jump at the boundaries of their cells, so
+// a ball which straddles a boundary is not bounded, and nothing below it is pruned.
+// Where a node is steeper than that (a quaternion or a normal which is not of unit
+// length, or the interpolation of a voxel grid), its own Lipschitz constant scales the
+// radius; `sdf_lipschitz()` gives the constant of a whole tape from the same bounds.
+//
+// The operands of a culled union (`BvhUnion`) are bounded one by one, like those of a
+// chain of unions; the operands which can't be the nearest are dropped, and their
+// entries in the union's table are left empty.
+//
+// A sub-expression which `Store`s a value slot is never dropped, since a later `Load`
+// may need it; a `Load` is bounded by the interval recorded at its `Store`.
+//
+// `SdfTiledTape` applies this over a grid of tiles covering a region, subdividing
+// recursively so that each tile is pruned from its parent's already-shortened tape;
+// the cost per tile is then proportional to the local complexity of the scene,
+// rather than the size of the whole tree.
+
+namespace stereo {
+
+// keep in sync with `SdfTile` in sdf_structs.wgsl
+struct SdfTile {
+    gpu_size_t op_begin;
+    gpu_size_t op_end;
+};
+
+// keep in sync with `SdfTileGrid` in sdf_structs.wgsl
+struct alignas(16) SdfTileGrid {
+    float    lo[3];
+    uint32_t n_x;
+    float    inv_cell[3]; // tiles per unit length along each axis
+    uint32_t n_y;
+    float    hi[3];
+    uint32_t n_z;
+};
+
+/**
+ * @brief Remove the ops of a tape which cannot affect its value within a ball.
+ *
+ * `ops` is a tape (or a tape previously pruned by this function) whose parameters
+ * are `params`. The ops which survive are appended to `out`, with their `PopDomain`
+ * and `BvhOperand` indices renumbered relative to the start of the appended tape.
+ *
+ * Returns a conservative range for the value of the tape within the ball.
+ */
+range prune_tape(
+    const SdfGpuOp* ops,
+    size_t n_ops,
+    const float* params,
+    const vec3& center,
+    float radius,
+    std::vector<SdfGpuOp>& out
+);
+
+/**
+ * @brief A Lipschitz constant of the tape `ops`, whose parameters are `params`.
+ *
+ * The tape changes by at most this much per unit distance, so a sphere tracer may
+ * safely step by its value divided by this. Each shape contributes its own constant,
+ * times those of the domain ops above it; the range ops are no steeper than their
+ * operands. This is 1 for a tape of exact distances under rigid transforms. (As for
+ * pruning, the repetitions are assumed not to cut their child at a cell boundary.)
+ */
+float sdf_lipschitz(const SdfGpuOp* ops, size_t n_ops, const float* params);
+
+/**
+ * @brief The buffers of a tiled tape, as uploaded to the GPU, without ownership.
+ *
+ * This may point into an `SdfTiledTape`, or directly into a mapped file (see sdf_file.h).
+ */
+struct SdfTapeView {
+    /// All the ops; the full tape is entry 0 of `tiles`.
+    const SdfGpuOp* ops;
+    gpu_size_t      n_ops;
+    const float*    params_x;
+    const float*    params_dx;
+    gpu_size_t      n_params;
+    /// The full tape, followed by one entry per grid tile.
+    const SdfTile*  tiles;
+    gpu_size_t      n_tile_entries;
+    SdfTileGrid     grid;
+    gpu_size_t      stack_depth;
+};
+
+/**
+ * @brief A tape, plus a pruned copy of it for each tile of a grid.
+ *
+ * All the tapes are concatenated into `ops`. Entry 0 of `tiles` is the full tape,
+ * which is used for points outside of the grid. Tile `(x, y, z)` is entry
+ * `1 + (z * n_y + y) * n_x + x`. All the tapes share the parameters of `tape`.
+ *
+ * Pruning is done with the primal parameters of `tape` at construction. The tiles
+ * remain valid for any tangent (`params_dx`) but must be rebuilt if `params_x` changes,
+ * and must not be used with parameter variations that change `params_x`.
+ */
+struct SdfTiledTape {
+    SdfTape               tape;
+    range3                region;
+    vec3ui                tile_dims;
+    std::vector<SdfGpuOp> ops;
+    std::vector<SdfTile>  tiles;
+
+    /// A single tile holding the full tape, with no grid.
+    SdfTiledTape(SdfTape tape);
+
+    /// Prune `tape` over a grid of `tile_dims` tiles covering `region`.
+    SdfTiledTape(SdfTape tape, const range3& region, const vec3ui& tile_dims);
+
+    /// Number of grid tiles (not counting the full tape).
+    size_t n_tiles() const { return tiles.size() - 1; }
+
+    /// Index into `tiles` of the tape to use at point `p`.
+    gpu_size_t tile_index(const vec3& p) const;
+
+    /// Grid description to upload to the GPU.
+    SdfTileGrid grid() const;
+
+    /// A view of the buffers to upload to the GPU.
+    SdfTapeView view() const;
+};
+
+} // namespace stereo
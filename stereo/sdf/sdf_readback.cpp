@@ -0,0 +1,198 @@
+#include <cstring>
+
+#include <stereo/sdf/sdf_readback.h>
+
+namespace stereo {
+
+namespace {
+
+// offsets in a staging buffer are kept aligned, for the copies and the mapping
+constexpr size_t StagingAlign = 16;
+
+size_t align_up(size_t n) {
+    return (n + StagingAlign - 1) / StagingAlign * StagingAlign;
+}
+
+} // namespace
+
+
+SdfReadback::SdfReadback(wgpu::Device device, size_t n_slots):
+    _device(device)
+{
+    _slots.resize(std::max<size_t>(n_slots, 1));
+    for (auto& slot : _slots) slot = std::make_unique<Slot>();
+}
+
+SdfReadback::~SdfReadback() {
+    // (the map callbacks refer to the slots, so they must not be left in flight)
+    wait();
+    for (auto& slot : _slots) release_all(slot->buffer);
+}
+
+void SdfReadback::_on_mapped(WGPUBufferMapAsyncStatus status, void* userdata) {
+    Slot* slot  = static_cast<Slot*>(userdata);
+    slot->state = status == WGPUBufferMapAsyncStatus_Success ? SlotState::Mapped : SlotState::Failed;
+    if (slot->state == SlotState::Failed) {
+        std::cerr << "SDF readback could not map its staging buffer (status "
+                  << status << ")" << std::endl;
+    }
+}
+
+void SdfReadback::read(
+        const SdfOutput&    output,
+        gpu_size_t          begin,
+        gpu_size_t          n,
+        SdfEvalMode         mode,
+        SdfReadbackCallback callback)
+{
+    if (mode > output.mode()) {
+        std::cerr << "SDF readback of outputs which were not allocated" << std::endl;
+        std::abort();
+    }
+    if (n == 0 or begin > output.n_samples() or n > output.n_samples() - begin) {
+        std::cerr << "SDF readback of samples [" << begin << ", " << begin + n
+                  << ") from an output of " << output.n_samples() << std::endl;
+        std::abort();
+    }
+    // while the ring is full, wait for the oldest read, whose slot is next. (its
+    // callback may read again, and fill the ring once more)
+    while (_n_pending == _slots.size()) {
+        Slot& oldest = *_slots[_oldest];
+        while (oldest.state == SlotState::Mapping) {
+            wgpuDevicePoll(_device, true, nullptr);
+        }
+        _deliver_ready();
+    }
+    Slot& slot = *_slots[(_oldest + _n_pending) % _slots.size()];
+
+    // lay out the outputs of `mode`; or the whole records, which hold the outputs
+    // of the output's mode
+    bool   dual   = mode >= SdfEvalMode::Dual;
+    bool   grad   = mode >= SdfEvalMode::Gradient;
+    bool   packed = output.layout() != SdfOutputLayout::Separate;
+    size_t record_size = output.record_words() * sizeof(uint32_t);
+    size_t sizes[4] = {
+        packed ? n * record_size : n * sizeof(float),
+        dual and not packed ? n * sizeof(float)   : 0,
+        grad and not packed ? n * sizeof(vec3gpu) : 0,
+        dual and not packed ? n * sizeof(vec3gpu) : 0,
+    };
+    size_t size = 0;
+    for (size_t k = 0; k < 4; ++k) {
+        slot.offsets[k] = size;
+        size += align_up(sizes[k]);
+    }
+    if (slot.capacity < size) {
+        release_all(slot.buffer);
+        wgpu::BufferDescriptor bd;
+        bd.label = "SDF readback staging buffer";
+        bd.size  = size;
+        bd.usage = wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead;
+        bd.mappedAtCreation = false;
+        slot.buffer   = _device.createBuffer(bd);
+        slot.capacity = size;
+    }
+    slot.state       = SlotState::Mapping;
+    slot.n_samples   = n;
+    slot.mode        = mode;
+    slot.layout      = output.layout();
+    slot.record_mode = output.mode();
+    slot.size        = size;
+    slot.callback    = std::move(callback);
+    _n_pending      += 1;
+
+    // copy, then map once the copy is done
+    wgpu::Buffer srcs[4] = {
+        packed ? output.records().buffer() : output.sdf_x().buffer(),
+        output.sdf_dx().buffer(),
+        output.normal_x().buffer(),
+        output.normal_dx().buffer(),
+    };
+    size_t elem_sizes[4] = {
+        packed ? record_size : sizeof(float),
+        sizeof(float),
+        sizeof(vec3gpu),
+        sizeof(vec3gpu),
+    };
+    wgpu::CommandEncoder encoder = _device.createCommandEncoder();
+    for (size_t k = 0; k < 4; ++k) {
+        if (sizes[k] == 0) continue;
+        encoder.copyBufferToBuffer(srcs[k], begin * elem_sizes[k], slot.buffer, slot.offsets[k], sizes[k]);
+    }
+    wgpu::CommandBuffer commands = encoder.finish();
+    wgpu::Queue queue = _device.getQueue();
+    encoder.release();
+    queue.submit(commands);
+    queue.release();
+    wgpuBufferMapAsync(slot.buffer, WGPUMapMode_Read, 0, size, _on_mapped, &slot);
+}
+
+std::future<SdfCpuOutputRef> SdfReadback::read(
+        const SdfOutput& output,
+        gpu_size_t       begin,
+        gpu_size_t       n,
+        SdfEvalMode      mode)
+{
+    auto promise = std::make_shared<std::promise<SdfCpuOutputRef>>();
+    std::future<SdfCpuOutputRef> future = promise->get_future();
+    read(output, begin, n, mode, [promise](SdfCpuOutputRef values) {
+        promise->set_value(std::move(values));
+    });
+    return future;
+}
+
+std::future<SdfCpuOutputRef> SdfReadback::read(const SdfOutput& output) {
+    return read(output, 0, output.n_samples(), output.mode());
+}
+
+void SdfReadback::_deliver_ready() {
+    while (_n_pending > 0 and _slots[_oldest]->state != SlotState::Mapping) {
+        Slot& slot = *_slots[_oldest];
+        SdfCpuOutputRef values;
+        if (slot.state == SlotState::Mapped) {
+            const uint8_t* data = static_cast<const uint8_t*>(
+                wgpuBufferGetConstMappedRange(slot.buffer, 0, slot.size)
+            );
+            gpu_size_t n = slot.n_samples;
+            values = std::make_shared<SdfCpuOutput>(n, slot.mode);
+            if (slot.layout != SdfOutputLayout::Separate) {
+                const uint32_t* records = reinterpret_cast<const uint32_t*>(data + slot.offsets[0]);
+                sdf_unpack_records(slot.layout, slot.record_mode, records, *values);
+            } else {
+                std::memcpy(values->sdf_x.data(), data + slot.offsets[0], n * sizeof(float));
+                if (slot.mode >= SdfEvalMode::Dual) {
+                    std::memcpy(values->sdf_dx.data(), data + slot.offsets[1], n * sizeof(float));
+                }
+                const vec3gpu* normal_x  = reinterpret_cast<const vec3gpu*>(data + slot.offsets[2]);
+                const vec3gpu* normal_dx = reinterpret_cast<const vec3gpu*>(data + slot.offsets[3]);
+                for (size_t i = 0; i < values->normal_x.size();  ++i) values->normal_x[i]  = normal_x[i].v;
+                for (size_t i = 0; i < values->normal_dx.size(); ++i) values->normal_dx[i] = normal_dx[i].v;
+            }
+            wgpuBufferUnmap(slot.buffer);
+        }
+        // free the slot before the callback, which may read again
+        SdfReadbackCallback callback = std::move(slot.callback);
+        slot.callback = nullptr;
+        slot.state    = SlotState::Free;
+        _oldest       = (_oldest + 1) % _slots.size();
+        _n_pending   -= 1;
+        if (callback) callback(std::move(values));
+    }
+}
+
+void SdfReadback::poll() {
+    if (_n_pending == 0) return;
+    wgpuDevicePoll(_device, false, nullptr);
+    _deliver_ready();
+}
+
+void SdfReadback::wait() {
+    while (_n_pending > 0) {
+        if (_slots[_oldest]->state == SlotState::Mapping) {
+            wgpuDevicePoll(_device, true, nullptr);
+        }
+        _deliver_ready();
+    }
+}
+
+} // namespace stereo
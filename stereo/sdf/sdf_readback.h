@@ -0,0 +1,136 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <memory>
+
+#include <stereo/sdf/sdf_cpu_eval.h>
+#include <stereo/sdf/sdf_eval.h>
+
+// Reading the results of GPU SDF evaluations back to the host.
+//
+// A buffer can only be mapped for reading if it is used for nothing else, so results
+// are first copied from the `SdfOutput` into a staging buffer. `SdfReadback` keeps a
+// ring of staging buffers, which are reused from one read to the next (and only grown
+// when a read needs more room). A read encodes the copy and submits it to the queue at
+// once; since the queue runs in order, the copy sees the results of every evaluation
+// submitted before it, and none submitted after. The output may thus be reused by the
+// next evaluation right away: an optimizer can read back iteration `k`, and go on to
+// evaluate iteration `k + 1` into the same output while the copy and the mapping are
+// still in flight.
+//
+// Outputs of a packed layout (see sdf_packing.h) are copied as records, which are
+// decoded on delivery; the callback sees the same `SdfCpuOutput` in any layout.
+//
+// Mapping completes asynchronously. The ready reads are delivered (their callbacks
+// called, or their futures fulfilled) by `poll()`, which never blocks, in the order
+// in which they were requested. A read only blocks when every staging buffer of the
+// ring is still in flight; then it waits for the oldest, which is delivered first.
+
+namespace stereo {
+
+/// Called with the values read back, or with null if they could not be mapped.
+using SdfReadbackCallback = std::function<void(SdfCpuOutputRef)>;
+
+/**
+ * @brief A ring of staging buffers for reading `SdfOutput`s back to the host.
+ */
+struct SdfReadback {
+private:
+
+    enum struct SlotState {
+        Free,
+        Mapping,
+        Mapped,
+        Failed,
+    };
+
+    // a staging buffer, and the read it is serving. (held by pointer, since it is
+    // the userdata of the map callback)
+    struct Slot {
+        wgpu::Buffer        buffer   = nullptr;
+        size_t              capacity = 0;
+        SlotState           state    = SlotState::Free;
+        gpu_size_t          n_samples;
+        SdfEvalMode         mode;
+        // layout of the output, and the mode of its records (if not `Separate`)
+        SdfOutputLayout     layout;
+        SdfEvalMode         record_mode;
+        // byte offset of each output in the buffer: sdf_x, sdf_dx, normal_x, normal_dx
+        // (or of the records, first)
+        size_t              offsets[4];
+        size_t              size;
+        SdfReadbackCallback callback;
+    };
+
+    wgpu::Device                       _device;
+    std::vector<std::unique_ptr<Slot>> _slots;
+    // the reads not yet delivered are in the `_n_pending` slots from `_oldest` on,
+    // around the ring
+    size_t                             _oldest    = 0;
+    size_t                             _n_pending = 0;
+
+    static void _on_mapped(WGPUBufferMapAsyncStatus status, void* userdata);
+
+    // copy out and deliver the ready reads, oldest first, up to the first in flight
+    void _deliver_ready();
+
+public:
+
+    static constexpr size_t DefaultSlots = 3;
+
+    /// Create a ring of `n_slots` staging buffers (at least one), which are allocated
+    /// as they are first needed.
+    SdfReadback(wgpu::Device device, size_t n_slots=DefaultSlots);
+    SdfReadback(const SdfReadback&) = delete;
+    SdfReadback& operator=(const SdfReadback&) = delete;
+
+    /// Waits for the reads still in flight, and delivers them.
+    ~SdfReadback();
+
+    /**
+     * @brief Read the outputs of `mode` for the samples `[begin, begin + n)` of `output`.
+     *
+     * The copy is submitted at once, and `callback` is called from a later `poll()` or
+     * `wait()`, with an `SdfCpuOutput` of `n` samples. `n` must be positive, and `mode`
+     * may not exceed the mode of `output`. If every staging buffer is in flight, blocks
+     * until the oldest read is done (delivering it).
+     */
+    void read(
+        const SdfOutput&    output,
+        gpu_size_t          begin,
+        gpu_size_t          n,
+        SdfEvalMode         mode,
+        SdfReadbackCallback callback);
+
+    /**
+     * @brief As above, returning a future of the values.
+     *
+     * The future only becomes ready in a `poll()` or `wait()` of this readback, so
+     * those must be called before blocking on it.
+     */
+    std::future<SdfCpuOutputRef> read(
+        const SdfOutput& output,
+        gpu_size_t       begin,
+        gpu_size_t       n,
+        SdfEvalMode      mode);
+
+    /// Read every output of every sample of `output`.
+    std::future<SdfCpuOutputRef> read(const SdfOutput& output);
+
+    /**
+     * @brief Deliver the reads which are ready, without blocking.
+     *
+     * Polls the device, so that it also processes other pending callbacks.
+     */
+    void poll();
+
+    /// Block until every read in flight is done, and deliver them.
+    void wait();
+
+    /// Number of reads not yet delivered.
+    size_t n_pending() const { return _n_pending; }
+    size_t n_slots()   const { return _slots.size(); }
+};
+
+} // namespace stereo
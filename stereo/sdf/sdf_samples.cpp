@@ -0,0 +1,82 @@
+#include <stereo/sdf/sdf_samples.h>
+
+namespace stereo {
+
+namespace {
+
+void set_vec3(float* dst, const vec3& v) {
+    dst[0] = v.x;
+    dst[1] = v.y;
+    dst[2] = v.z;
+}
+
+// a lattice of `dims` cells, with corner `origin` and (whole) edges `extents`
+SdfSampleSet lattice(
+        SdfSampleKind kind,
+        const vec3&   origin,
+        const vec3    extents[3],
+        const vec3ui& dims)
+{
+    SdfSampleSet s;
+    s.kind = kind;
+    s.n_u  = dims.x;
+    s.n_v  = dims.y;
+    s.n_w  = dims.z;
+    set_vec3(s.origin, origin);
+    set_vec3(s.axis_u, extents[0] / (float) std::max<uint32_t>(dims.x, 1));
+    set_vec3(s.axis_v, extents[1] / (float) std::max<uint32_t>(dims.y, 1));
+    set_vec3(s.axis_w, extents[2] / (float) std::max<uint32_t>(dims.z, 1));
+    return s;
+}
+
+} // namespace
+
+
+SdfSampleSet SdfSampleSet::grid(const range3& box, const vec3ui& dims) {
+    vec3 d = box.hi - box.lo;
+    vec3 extents[3] = {vec3(d.x, 0, 0), vec3(0, d.y, 0), vec3(0, 0, d.z)};
+    return lattice(SdfSampleKind::Grid, box.lo, extents, dims);
+}
+
+SdfSampleSet SdfSampleSet::jittered(const range3& box, const vec3ui& dims, uint32_t seed) {
+    vec3 d = box.hi - box.lo;
+    vec3 extents[3] = {vec3(d.x, 0, 0), vec3(0, d.y, 0), vec3(0, 0, d.z)};
+    SdfSampleSet s = lattice(SdfSampleKind::Jittered, box.lo, extents, dims);
+    s.seed = seed;
+    return s;
+}
+
+SdfSampleSet SdfSampleSet::slice(
+        const vec3&   origin,
+        const vec3&   extent_u,
+        const vec3&   extent_v,
+        const vec2ui& dims)
+{
+    vec3 extents[3] = {extent_u, extent_v, vec3()};
+    return lattice(SdfSampleKind::Grid, origin, extents, vec3ui(dims.x, dims.y, 1));
+}
+
+SdfSampleSet SdfSampleSet::rays(
+        const vec3&   eye,
+        const vec3&   origin,
+        const vec3&   extent_u,
+        const vec3&   extent_v,
+        const vec2ui& dims,
+        float         t0,
+        float         dt,
+        uint32_t      n_steps)
+{
+    vec3 extents[3] = {extent_u, extent_v, vec3()};
+    SdfSampleSet s = lattice(SdfSampleKind::Rays, origin, extents, vec3ui(dims.x, dims.y, n_steps));
+    set_vec3(s.eye, eye);
+    s.t0 = t0;
+    s.dt = dt;
+    return s;
+}
+
+SdfSampleSet& SdfSampleSet::with_tangent(const vec3& tangent) {
+    set_vec3(dx, tangent);
+    return *this;
+}
+
+} // namespace stereo
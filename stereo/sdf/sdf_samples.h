@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stereo/gpu/gpu_types.h>
+
+// Procedural sets of SDF samples.
+//
+// A regular set of samples (a grid, a slice, or the steps along a fan of camera rays)
+// need not be held as an array of points: an `SdfSampleSet` describes it in a block of
+// about a hundred bytes, from which each sample is generated where it is evaluated, by
+// `point()` on the CPU or `sdf_sample_point()` (sdf_samples.wgsl) on the GPU. An
+// `SdfInput` or `SdfCpuInput` made from a sample set allocates no point or tangent
+// arrays, and has exactly `n_samples()` samples.
+//
+// Sample `i` of a set is cell `(u, v, w)` of a lattice of `n_u x n_v x n_w` cells,
+// where `i = (w * n_v + v) * n_u + u`:
+//
+//   - `Grid`:     the center of the cell.
+//   - `Jittered`: a random point in the cell, which is the same for the same `seed`.
+//   - `Rays`:     step `w` along the ray from `eye` through the center of pixel
+//                 `(u, v)` of an image plane, at distance `t0 + w * dt` from the eye.
+//                 All the rays' first steps come first, then their second steps, etc.
+//
+// A slice is a grid one cell thick. The samples of a set all share the tangent `dx`.
+// Sample sets are laid out in raster order, which is already coherent, so they are
+// not sorted (see sdf_order.h).
+
+namespace stereo {
+
+enum struct SdfSampleKind : uint32_t {
+    /// Points read from an array.
+    Explicit,
+    /// The centers of the cells of a lattice.
+    Grid,
+    /// A random point in each cell of a lattice.
+    Jittered,
+    /// Steps along camera rays.
+    Rays,
+};
+
+/// A 32-bit hash of `v` (the PCG hash of [Jarzynski and Olano 2020]). Keep in sync
+/// with `sdf_hash()` in sdf_samples.wgsl.
+inline uint32_t sdf_hash(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// keep in sync with `SdfSampleSet` in sdf_samples.wgsl
+struct alignas(16) SdfSampleSet {
+    /// The corner of the lattice (for `Rays`, of the image plane).
+    float         origin[3] = {};
+    SdfSampleKind kind = SdfSampleKind::Explicit;
+    /// The edges of a cell of the lattice.
+    float         axis_u[3] = {};
+    uint32_t      n_u = 0;
+    float         axis_v[3] = {};
+    uint32_t      n_v = 0;
+    float         axis_w[3] = {}; // (unused by `Rays`)
+    uint32_t      n_w = 0;
+    /// The tangent of every sample.
+    float         dx[3] = {};
+    uint32_t      seed = 0;
+    float         eye[3] = {};    // (`Rays` only)
+    float         t0   = 0;
+    float         dt   = 0;
+
+    /**
+     * @brief The centers of the `dims` cells of a lattice over `box`.
+     */
+    static SdfSampleSet grid(const range3& box, const vec3ui& dims);
+
+    /**
+     * @brief A random point in each of the `dims` cells of a lattice over `box`.
+     */
+    static SdfSampleSet jittered(const range3& box, const vec3ui& dims, uint32_t seed);
+
+    /**
+     * @brief The centers of the `dims` cells of the parallelogram with corner `origin`
+     * and edges `extent_u` and `extent_v`.
+     */
+    static SdfSampleSet slice(
+        const vec3&   origin,
+        const vec3&   extent_u,
+        const vec3&   extent_v,
+        const vec2ui& dims);
+
+    /**
+     * @brief `n_steps` steps along each ray from `eye` through the center of a pixel
+     * of an image of `dims` pixels, whose plane has corner `origin` and edges
+     * `extent_u` and `extent_v`. Step `k` is at distance `t0 + k * dt` from the eye.
+     */
+    static SdfSampleSet rays(
+        const vec3&   eye,
+        const vec3&   origin,
+        const vec3&   extent_u,
+        const vec3&   extent_v,
+        const vec2ui& dims,
+        float         t0,
+        float         dt,
+        uint32_t      n_steps);
+
+    /// Use `tangent` as the tangent of every sample.
+    SdfSampleSet& with_tangent(const vec3& tangent);
+
+    bool       procedural() const { return kind != SdfSampleKind::Explicit; }
+    vec3ui     dims()       const { return vec3ui(n_u, n_v, n_w); }
+    gpu_size_t n_samples()  const { return n_u * n_v * n_w; }
+    vec3       tangent()    const { return vec3(dx[0], dx[1], dx[2]); }
+
+    /// Sample `i` of a procedural set.
+    vec3 point(gpu_size_t i) const {
+        uint32_t u = i % n_u;
+        uint32_t v = (i / n_u) % n_v;
+        uint32_t w = i / (n_u * n_v);
+        vec3 o (origin[0], origin[1], origin[2]);
+        vec3 a_u(axis_u[0], axis_u[1], axis_u[2]);
+        vec3 a_v(axis_v[0], axis_v[1], axis_v[2]);
+        vec3 a_w(axis_w[0], axis_w[1], axis_w[2]);
+        switch (kind) {
+            case SdfSampleKind::Jittered: {
+                // three successive hashes of the index, as fractions of a cell
+                uint32_t h_u = sdf_hash(i ^ sdf_hash(seed));
+                uint32_t h_v = sdf_hash(h_u);
+                uint32_t h_w = sdf_hash(h_v);
+                constexpr float Scale = 1.f / (1u << 24);
+                return o + a_u * (u + (h_u >> 8) * Scale)
+                         + a_v * (v + (h_v >> 8) * Scale)
+                         + a_w * (w + (h_w >> 8) * Scale);
+            }
+            case SdfSampleKind::Rays: {
+                vec3 e(eye[0], eye[1], eye[2]);
+                vec3 d = o + a_u * (u + 0.5f) + a_v * (v + 0.5f) - e;
+                return e + d * ((t0 + w * dt) / d.mag());
+            }
+            default:
+                return o + a_u * (u + 0.5f) + a_v * (v + 0.5f) + a_w * (w + 0.5f);
+        }
+    }
+};
+
+} // namespace stereo
@@ -27,6 +27,13 @@ enum struct SdfOp: uint32_t {
     Elongate,
     CurveSweep,
     Helix,
+    Instances,
+    // value slots:
+    Store = 50,
+    Load,
+    // culled unions (see `SdfTape`):
+    BvhUnion = 60,
+    BvhOperand,
     // shapes:
     Sphere = 100,
     Box,
@@ -38,6 +45,8 @@ enum struct SdfOp: uint32_t {
     Triangle,
     Curve,
     ClosedCurve,
+    Mesh,
+    VoxelGrid,
 };
 
 enum struct SdfOpVariant: uint32_t {
@@ -171,9 +180,64 @@ template <typename T> struct SdfTransform: public SdfUnop<T, SdfOp::Transform> {
     SdfTransform(SdfNodeRef<T> child, Quat<T> q, Vec<T,3> tx):
         SdfUnop<T,SdfOp::Transform>(child), q(q), tx(tx) {}
     
-    const size_t n_params() const override { return 7; }
+    size_t       n_params() const override { return 7; }
     const T*     params()   const override { return &q[0]; }
-    const bool   transforms_domain() const override { return true; }
+    bool         transforms_domain() const override { return true; }
+};
+
+// domain folds. these map many copies of space onto one, so that a single child
+// is evaluated in place of many instances of it.
+
+/// Repeats its child on a grid with spacing `period`, over the cells `lo` to `hi`
+/// (inclusive) along each axis; cell `k` is offset by `k * period`. An axis whose
+/// period is zero is not repeated. The result is exact if the child fits within
+/// half a period of the origin, and symmetric about it; otherwise the nearest copy
+/// may be in a neighboring cell, and the distance is overestimated.
+template <typename T>
+struct SdfRepeat: public SdfUnop<T, SdfOp::Repeat> {
+    Vec<T,3> period;
+    Vec<T,3> lo;
+    Vec<T,3> hi;
+
+    SdfRepeat(SdfNodeRef<T> child, Vec<T,3> period, Vec<T,3> lo, Vec<T,3> hi):
+        SdfUnop<T,SdfOp::Repeat>(child), period(period), lo(lo), hi(hi) {}
+
+    size_t       n_params() const override { return 9; }
+    const T*     params()   const override { return &period[0]; }
+    bool         transforms_domain() const override { return true; }
+};
+
+/// Reflects the negative side of `plane` onto the positive side, so that the child
+/// (as seen on the positive side) is mirrored across the plane. `plane` has the same
+/// parameters as `SdfPlane`.
+template <typename T>
+struct SdfMirror: public SdfUnop<T, SdfOp::Mirror> {
+    Plane<T,3> plane;
+
+    SdfMirror(SdfNodeRef<T> child, Plane<T,3> plane):
+        SdfUnop<T,SdfOp::Mirror>(child), plane(plane) {}
+
+    size_t       n_params() const override { return 4; }
+    const T*     params()   const override { return reinterpret_cast<const T*>(&plane); }
+    bool         transforms_domain() const override { return true; }
+};
+
+/// Repeats its child `count` times around `axis` (one of the axis variants, through
+/// the origin). The child should lie within the sector of half-angle `pi / count`
+/// about the +u axis (+y for `XAxis`, +z for `YAxis`, +x for `ZAxis`). The count
+/// is not differentiable.
+template <typename T>
+struct SdfRotSym: public SdfUnop<T, SdfOp::RotSym> {
+    T            count;
+    SdfOpVariant axis;
+
+    SdfRotSym(SdfNodeRef<T> child, T count, SdfOpVariant axis=SdfOpVariant::ZAxis):
+        SdfUnop<T,SdfOp::RotSym>(child), count(count), axis(axis) {}
+
+    size_t       n_params() const override { return 1; }
+    const T*     params()   const override { return &count; }
+    const SdfOpVariant variant() const override { return axis; }
+    bool         transforms_domain() const override { return true; }
 };
 
 template <typename T>
@@ -186,7 +250,7 @@ struct SdfTriangle : public SdfNode<T> {
         SdfNode<T>(SdfOp::Triangle),
         pts{vertices[0], vertices[1], vertices[2]} {}
     
-    const size_t n_params() const override { return 9; }
+    size_t       n_params() const override { return 9; }
     const T*     params()   const override { return &pts[0][0]; }
 };
 
@@ -0,0 +1,561 @@
+#include <bit>
+#include <numeric>
+#include <optional>
+
+#include <stereo/sdf/sdf_tape.h>
+#include <stereo/sdf/sdf_bvh.h>
+
+namespace stereo {
+
+namespace {
+
+// the structure of an SDF subtree: the op, variant and parameters of its root,
+// followed by the ids of its children. two subtrees with equal keys always evaluate
+// to the same value in the same domain.
+struct SdfNodeKey {
+    std::vector<uint32_t> words;
+
+    bool operator==(const SdfNodeKey& other) const = default;
+};
+
+} // namespace
+
+} // namespace stereo
+
+template <>
+struct std::hash<stereo::SdfNodeKey> {
+    size_t operator()(const stereo::SdfNodeKey& k) const {
+        size_t h = 0x7a1bd2f0c3e98d15ULL; // nonce
+        for (uint32_t w : k.words) {
+            h = geom::hash_combine(h, std::hash<uint32_t>{}(w));
+        }
+        return h;
+    }
+};
+
+namespace stereo {
+
+namespace {
+
+// marks the key of an op with its children left out
+constexpr uint32_t NoChildren = 0xffffffff;
+
+constexpr uint32_t NoSlot = 0xffffffff;
+
+void push_param_words(std::vector<uint32_t>& words, float p) {
+    words.push_back(std::bit_cast<uint32_t>(p));
+}
+
+void push_param_words(std::vector<uint32_t>& words, const Dual<float>& p) {
+    words.push_back(std::bit_cast<uint32_t>(p.x));
+    words.push_back(std::bit_cast<uint32_t>(p.dx));
+}
+
+// the occurrences of a subtree within a single domain
+struct SdfNodeUses {
+    uint32_t refs      = 0;      // total occurrences
+    uint32_t remaining = 0;      // occurrences not yet emitted
+    uint32_t slot      = NoSlot; // slot holding the value, if it has been stored
+};
+
+/*
+ * Serializes an expression DAG, merging common subexpressions.
+ *
+ * Every distinct subtree is given an id (interned by structure, and memoized by node
+ * pointer, so that a shared node is only hashed once). Since the value of a subtree
+ * also depends on the domain it's evaluated in, reuse is tracked per (domain, subtree)
+ * pair, where the domain is identified by the chain of domain ops above it.
+ *
+ * The first pass counts how often each (domain, subtree) pair occurs, without
+ * descending into repeats (which will be replaced by a `Load`, so their contents
+ * are never emitted). The second pass emits the tape, storing each repeated subtree
+ * into a slot on its first occurrence and loading it thereafter.
+ *
+ * The second pass also orders operands to keep the stacks shallow. Chains of plain
+ * unions (or intersections) are flattened into a single n-ary op, and the operands of
+ * commutative ops are emitted deepest-first (Sethi-Ullman order): after the first
+ * operand, only one extra stack entry is held while evaluating each of the others.
+ * (min and max are exactly associative and commutative, so this does not change the
+ * result, except for which gradient is picked where two operands tie).
+ *
+ * A wide union chain is split into the operands whose surfaces have known bounding
+ * spheres, and which are self-contained (they contain nothing which is stored in a slot,
+ * so they can be evaluated in any order, or skipped), and the rest. If there are enough
+ * of the former, they are emitted as a `BvhUnion`, and the rest are unioned in after
+ * (only with `SdfMerge::Static`).
+ */
+template <typename T>
+struct TapeBuilder {
+    using Node = SdfNode<T>;
+    using Ref  = SdfNodeRef<T>;
+
+    SdfTape& tape;
+    SdfMerge merge;
+
+    DenseMap<SdfNodeKey,  uint32_t> key_ids;
+    DenseMap<const Node*, uint32_t> node_ids;
+    // (parent domain, domain op id) -> domain id
+    DenseMap<uint64_t, uint32_t>    domain_ids;
+    // (domain, subtree id) -> uses
+    DenseMap<uint64_t, SdfNodeUses> uses;
+    // (domain, subtree id) -> range stack depth needed to evaluate it
+    DenseMap<uint64_t, uint32_t>    depths;
+    // op id (without children) -> parameter block
+    DenseMap<uint32_t, std::pair<gpu_size_t, gpu_size_t>> param_blocks;
+    std::vector<uint32_t> free_slots;
+    // node -> sphere containing its surface, if known
+    DenseMap<const Node*, std::optional<SdfBound>> bounds;
+    // (domain, subtree id) -> whether the subtree can be emitted as a culled operand
+    DenseMap<uint64_t, bool> contained;
+    // number of `Instances` ops enclosing the op being emitted
+    uint32_t instance_depth = 0;
+    // whether the op being emitted is an operand of a `BvhUnion`
+    bool in_bvh_union = false;
+
+    TapeBuilder(SdfTape& tape, SdfMerge merge): tape(tape), merge(merge) {
+        for (uint32_t s = SdfTape::MaxSlots; s > 0; --s) {
+            free_slots.push_back(s - 1);
+        }
+    }
+
+    static uint64_t pair_key(uint32_t a, uint32_t b) {
+        return (uint64_t(a) << 32) | b;
+    }
+
+    uint32_t intern(SdfNodeKey&& key) {
+        auto [i, inserted] = key_ids.try_emplace(std::move(key), key_ids.size());
+        return i->second;
+    }
+
+    void push_header(const Node* node, std::vector<uint32_t>& words) {
+        if (merge == SdfMerge::Shared) {
+            // distinguish every node by its address
+            uint64_t addr = reinterpret_cast<uintptr_t>(node);
+            words.push_back(addr >> 32);
+            words.push_back(addr);
+        }
+        words.push_back((uint32_t) node->op());
+        words.push_back((uint32_t) node->variant());
+        words.push_back(node->n_params());
+        const T* ps = node->params();
+        for (size_t i = 0; i < node->n_params(); ++i) {
+            push_param_words(words, ps[i]);
+        }
+    }
+
+    uint32_t node_id(const Ref& node) {
+        auto i = node_ids.find(node.get());
+        if (i != node_ids.end()) return i->second;
+        SdfNodeKey key;
+        push_header(node.get(), key.words);
+        key.words.push_back(node->n_children());
+        for (size_t c = 0; c < node->n_children(); ++c) {
+            key.words.push_back(node_id(node->child(c)));
+        }
+        uint32_t id = intern(std::move(key));
+        node_ids[node.get()] = id;
+        return id;
+    }
+
+    // id of the op of `node` alone, without its children
+    uint32_t header_id(const Ref& node) {
+        SdfNodeKey key;
+        push_header(node.get(), key.words);
+        key.words.push_back(NoChildren);
+        return intern(std::move(key));
+    }
+
+    // the domain seen by the children of `node`, which is evaluated in `domain`
+    uint32_t inner_domain(const Ref& node, uint32_t domain) {
+        if (not node->transforms_domain()) return domain;
+        auto [i, inserted] = domain_ids.try_emplace(
+            pair_key(domain, header_id(node)),
+            domain_ids.size() + 1 // (0 is the outermost domain)
+        );
+        return i->second;
+    }
+
+    void count(const Ref& node, uint32_t domain) {
+        uint64_t k = pair_key(domain, node_id(node));
+        SdfNodeUses& u = uses[k];
+        u.remaining += 1;
+        if (u.refs++ > 0) return;
+        uint32_t inner = inner_domain(node, domain);
+        for (size_t c = 0; c < node->n_children(); ++c) {
+            count(node->child(c), inner);
+        }
+    }
+
+    static bool is_commutative(const Ref& node) {
+        SdfOp op = node->op();
+        return node->variant() == SdfOpVariant::None and (
+            op == SdfOp::Union or op == SdfOp::Intersect or op == SdfOp::Xor
+        );
+    }
+
+    static bool is_associative(const Ref& node) {
+        SdfOp op = node->op();
+        return node->variant() == SdfOpVariant::None and (
+            op == SdfOp::Union or op == SdfOp::Intersect
+        );
+    }
+
+    // collect the operands of a chain of `node`'s op. a node which occurs elsewhere
+    // is kept whole, so that its value can still be reused.
+    void gather_operands(const Ref& node, uint32_t domain, std::vector<Ref>& out) {
+        for (size_t c = 0; c < node->n_children(); ++c) {
+            Ref child = node->child(c);
+            if (child->op() == node->op() and is_associative(child) and
+                uses[pair_key(domain, node_id(child))].refs == 1)
+            {
+                gather_operands(child, domain, out);
+            } else {
+                out.push_back(child);
+            }
+        }
+    }
+
+    // the operands of `node` (evaluated in `domain`), in the order they should be emitted
+    std::vector<Ref> operands(const Ref& node, uint32_t domain) {
+        std::vector<Ref> out;
+        if (is_associative(node)) {
+            gather_operands(node, domain, out);
+        } else {
+            for (size_t c = 0; c < node->n_children(); ++c) {
+                out.push_back(node->child(c));
+            }
+        }
+        if (is_commutative(node)) {
+            uint32_t inner = inner_domain(node, domain);
+            std::vector<uint32_t> d;
+            for (const Ref& c : out) d.push_back(depth(c, inner));
+            std::vector<size_t> order(out.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(
+                order.begin(),
+                order.end(),
+                [&](size_t a, size_t b) { return d[a] > d[b]; }
+            );
+            std::vector<Ref> sorted;
+            for (size_t i : order) sorted.push_back(out[i]);
+            out = std::move(sorted);
+        }
+        return out;
+    }
+
+    // depth of the range stack needed to evaluate `node` in `domain`. this is an upper
+    // bound, as it doesn't account for values which will be loaded from a slot.
+    uint32_t depth(const Ref& node, uint32_t domain) {
+        uint64_t k = pair_key(domain, node_id(node));
+        auto i = depths.find(k);
+        if (i != depths.end()) return i->second;
+        uint32_t d = 1;
+        if (node->n_children() > 0) {
+            // the i-th operand is evaluated with `i` results already on the stack
+            uint32_t inner = inner_domain(node, domain);
+            std::vector<Ref> ops = operands(node, domain);
+            d = 0;
+            for (size_t j = 0; j < ops.size(); ++j) {
+                d = std::max<uint32_t>(d, depth(ops[j], inner) + std::min<size_t>(j, 1));
+            }
+        }
+        depths[k] = d;
+        return d;
+    }
+
+    // a sphere containing the surface of `node`, in the domain it's evaluated in, if
+    // one is known. the subtree's value is then at least the distance to the sphere
+    // (see sdf_bvh.h), which is preserved by each op below.
+    std::optional<SdfBound> bound(const Ref& node) {
+        auto i = bounds.find(node.get());
+        if (i != bounds.end()) return i->second;
+        std::optional<SdfBound> b = compute_bound(node);
+        bounds[node.get()] = b;
+        return b;
+    }
+
+    std::optional<SdfBound> compute_bound(const Ref& node) {
+        std::optional<SdfBound> a;
+        std::optional<SdfBound> b;
+        if (node->n_children() > 0) a = bound(node->child(0));
+        if (node->n_children() > 1) b = bound(node->child(1));
+        return sdf_node_bound(*node, a, b);
+    }
+
+    // whether `node`, evaluated in `domain`, may be emitted as a self-contained operand:
+    // none of its subtrees (except leaves, which aren't stored) occurs more than once.
+    bool self_contained(const Ref& node, uint32_t domain) {
+        if (node->n_children() == 0) return true;
+        uint64_t k = pair_key(domain, node_id(node));
+        auto i = contained.find(k);
+        if (i != contained.end()) return i->second;
+        bool ok = uses[k].refs <= 1;
+        uint32_t inner = inner_domain(node, domain);
+        for (size_t c = 0; ok and c < node->n_children(); ++c) {
+            ok = self_contained(node->child(c), inner);
+        }
+        contained[k] = ok;
+        return ok;
+    }
+
+    // emit the operands of a union chain which can be culled as a `BvhUnion`, if there
+    // are enough of them, and remove them from `operands`. returns whether it was emitted.
+    bool emit_bvh_union(std::vector<Ref>& operands, uint32_t domain) {
+        if (merge != SdfMerge::Static or in_bvh_union or
+            operands.size() < SdfTape::MinBvhOperands)
+        {
+            return false;
+        }
+        std::vector<Ref>      culled;
+        std::vector<Ref>      rest;
+        std::vector<SdfBound> culled_bounds;
+        for (const Ref& c : operands) {
+            std::optional<SdfBound> b = bound(c);
+            if (b and self_contained(c, domain)) {
+                culled.push_back(c);
+                culled_bounds.push_back(*b);
+            } else {
+                rest.push_back(c);
+            }
+        }
+        size_t n = culled.size();
+        if (n < SdfTape::MinBvhOperands) return false;
+
+        std::vector<uint32_t> order = sdf_bvh_order(culled_bounds);
+        std::vector<SdfBound> leaves(n);
+        for (size_t s = 0; s < n; ++s) leaves[s] = culled_bounds[order[s]];
+        std::vector<float> node_params;
+        for (const SdfBound& b : sdf_bvh_fit(leaves)) {
+            node_params.insert(node_params.end(), {b.center.x, b.center.y, b.center.z, b.radius});
+        }
+        gpu_size_t param_start = tape.n_params();
+        gpu_size_t param_end   = tape.extend(node_params.data(), node_params.size());
+
+        // the table of operands is filled in as they're emitted
+        size_t op_index = tape.ops.size();
+        tape.ops.push_back({
+            .op          = SdfOp::BvhUnion,
+            .int_param   = (int32_t) n,
+            .param_start = param_start,
+            .param_end   = param_end,
+        });
+        for (size_t s = 0; s <= n; ++s) {
+            tape.ops.push_back({
+                .op          = SdfOp::BvhOperand,
+                .push_index  = 0,
+                .param_start = 0,
+                .param_end   = 0,
+            });
+        }
+        in_bvh_union = true;
+        for (size_t s = 0; s < n; ++s) {
+            tape.ops[op_index + 1 + s].push_index = tape.ops.size();
+            emit(culled[order[s]], domain);
+        }
+        in_bvh_union = false;
+        tape.ops[op_index + 1 + n].push_index = tape.ops.size();
+        operands = std::move(rest);
+        return true;
+    }
+
+    void record_params(const Node* node, SdfParamRange range) {
+        if (node->n_params() > 0) {
+            tape.node_params[node] = range;
+        }
+    }
+
+    // record the parameter blocks of nodes which were never emitted, because
+    // they (or an ancestor) were loaded from a slot. they share the parameters of
+    // an identical node which was.
+    void record_unemitted_params(const Ref& node, DenseSet<const Node*>& visited) {
+        if (not visited.insert(node.get()).second) return;
+        if (node->n_params() > 0 and not tape.node_params.contains(node.get())) {
+            auto [begin, end] = param_blocks.at(header_id(node));
+            record_params(node.get(), {begin, end});
+        }
+        for (size_t c = 0; c < node->n_children(); ++c) {
+            record_unemitted_params(node->child(c), visited);
+        }
+    }
+
+    void emit(const Ref& node, uint32_t domain) {
+        uint32_t id = node_id(node);
+        uint64_t k  = pair_key(domain, id);
+        {
+            SdfNodeUses& u = uses[k];
+            // (an occurrence inside a repeat which couldn't get a slot was not counted)
+            if (u.remaining > 0) u.remaining -= 1;
+            if (u.slot != NoSlot) {
+                tape.ops.push_back({
+                    .op          = SdfOp::Load,
+                    .slot        = u.slot,
+                    .param_start = 0,
+                    .param_end   = 0,
+                });
+                if (u.remaining == 0) {
+                    free_slots.push_back(u.slot);
+                    u.slot = NoSlot;
+                }
+                return;
+            }
+        }
+
+        // identical ops share their parameters
+        gpu_size_t param_start = 0;
+        gpu_size_t param_end   = 0;
+        if (node->n_params() > 0) {
+            uint32_t op_id = header_id(node);
+            auto i = param_blocks.find(op_id);
+            if (i == param_blocks.end()) {
+                param_start = tape.n_params();
+                param_end   = tape.extend(node->params(), node->n_params());
+                param_blocks[op_id] = {param_start, param_end};
+            } else {
+                std::tie(param_start, param_end) = i->second;
+            }
+        }
+        record_params(node.get(), {param_start, param_end});
+        SdfGpuOp op {
+            .op          = node->op(),
+            .variant     = node->variant(),
+            .param_start = param_start,
+            .param_end   = param_end
+        };
+        std::vector<Ref> children = operands(node, domain);
+        if (node->transforms_domain()) {
+            // the domain is transformed on the way in, before the children are evaluated;
+            // the PopDomain op restores the outer domain (and transforms the range back)
+            // after the children are done.
+            uint32_t inner    = inner_domain(node, domain);
+            uint32_t op_index = tape.ops.size();
+            bool instances    = node->op() == SdfOp::Instances;
+            if (instances and instance_depth > 0) {
+                std::cerr << "SdfInstances may not be nested" << std::endl;
+                std::abort();
+            }
+            instance_depth += instances;
+            tape.ops.push_back(op);
+            for (const Ref& c : children) {
+                emit(c, inner);
+            }
+            instance_depth -= instances;
+            tape.ops.push_back({
+                .op          = SdfOp::PopDomain,
+                .push_index  = op_index,
+                .param_start = 0,
+                .param_end   = 0,
+            });
+        } else {
+            // range ops consume the results of their children, so they come after them.
+            // a flattened chain folds in each operand as soon as it's evaluated.
+            // the culled operands of a union come first, as a single value.
+            bool chain  = is_associative(node);
+            bool culled = chain and node->op() == SdfOp::Union and emit_bvh_union(children, domain);
+            for (size_t c = 0; c < children.size(); ++c) {
+                emit(children[c], domain);
+                if (chain and (culled or c > 0) and c + 1 < children.size()) {
+                    tape.ops.push_back(op);
+                }
+            }
+            if (not culled or not children.empty()) tape.ops.push_back(op);
+        }
+
+        // keep the value if it will be needed again. (a leaf is about as cheap to
+        // evaluate as to load, so isn't worth a slot).
+        SdfNodeUses& u = uses[k];
+        if (u.remaining > 0 and node->n_children() > 0 and not free_slots.empty()) {
+            u.slot = free_slots.back();
+            free_slots.pop_back();
+            tape.n_slots = std::max<size_t>(tape.n_slots, u.slot + 1);
+            tape.ops.push_back({
+                .op          = SdfOp::Store,
+                .slot        = u.slot,
+                .param_start = 0,
+                .param_end   = 0,
+            });
+        }
+    }
+};
+
+} // namespace
+
+
+size_t SdfTape::extend(const float* v, size_t n) {
+    params_x.insert(params_x.end(), v, v + n);
+    params_dx.insert(params_dx.end(), n, 0.);
+    return params_x.size();
+}
+
+size_t SdfTape::extend(const Dual<float>* v, size_t n) {
+    params_x.reserve(n_params() + n);
+    params_dx.reserve(n_params() + n);
+    for (size_t i = 0; i < n; ++i) {
+        params_x.push_back(v[i].x);
+        params_dx.push_back(v[i].dx);
+    }
+    return params_x.size();
+}
+
+size_t SdfTape::stack_depth() const {
+    size_t p_size = 1; // (the sample point)
+    size_t f_size = 0;
+    size_t depth  = 1;
+    // the operands of a `BvhUnion` are counted as if they were run in order, each
+    // unioned into those before it as it ends. (a walk which keeps the nearest value
+    // aside needs one entry fewer).
+    size_t bvh      = n_ops(); // the enclosing `BvhUnion`, if any
+    size_t bvh_base = 0;       // the range stack size at it
+    size_t k        = 0;       // the operand being run
+    for (size_t i = 0; i < n_ops(); ++i) {
+        const SdfGpuOp& op = ops[i];
+        while (bvh < n_ops() and k < sdf_bvh_count(ops[bvh]) and
+               i == sdf_bvh_operand(ops.data(), bvh, k + 1))
+        {
+            f_size = bvh_base + 1;
+            k += 1;
+        }
+        switch (op.op) {
+            case SdfOp::PopDomain: p_size -= 1; break;
+            case SdfOp::Union:
+            case SdfOp::Intersect:
+            case SdfOp::Subtract:
+            case SdfOp::Xor:       f_size -= 1; break;
+            case SdfOp::Shell:
+            case SdfOp::Dilate:
+            case SdfOp::Store:     break;
+            case SdfOp::Load:      f_size += 1; break;
+            case SdfOp::BvhUnion: {
+                bvh      = i;
+                bvh_base = f_size;
+                k        = 0;
+                // (skip the table of operands)
+                i = sdf_bvh_operand(ops.data(), i, 0) - 1;
+            } break;
+            default:
+                if (op.op >= SdfOp::Sphere) {
+                    f_size += 1;
+                } else {
+                    p_size += 1;
+                }
+                break;
+        }
+        depth = std::max({depth, p_size, f_size});
+    }
+    return depth;
+}
+
+template <typename T>
+requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+SdfTape::SdfTape(SdfNodeRef<T> expr, SdfMerge merge) {
+    TapeBuilder<T> builder {*this, merge};
+    builder.count(expr, 0);
+    builder.emit(expr, 0);
+    DenseSet<const SdfNode<T>*> visited;
+    builder.record_unemitted_params(expr, visited);
+}
+
+// explicit template instantiation
+template SdfTape::SdfTape(SdfNodeRef<float> expr, SdfMerge merge);
+template SdfTape::SdfTape(SdfNodeRef<Dual<float>> expr, SdfMerge merge);
+
+} // namespace stereo
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <vector>
+
+#include <stereo/sdf/sdf_structs.h>
+
+namespace stereo {
+
+enum struct ParamVariation {
+    VaryParam,
+    VaryDerivative,
+    VaryBoth,
+};
+
+/**
+ * @brief What an evaluation computes. Each mode computes everything the modes before
+ * it do, and the evaluators run a specialized interpreter for each, which skips the
+ * work (and the output buffers) of the modes after it.
+ */
+enum struct SdfEvalMode {
+    /// Distances only, e.g. for ray marching or occupancy tests.
+    Value,
+    /// Distances and normals.
+    Gradient,
+    /// Distances and normals, and their tangents along the sample and parameter tangents.
+    Dual,
+};
+
+// keep in sync with `SdfOp` in sdf_structs.wgsl
+struct SdfGpuOp {
+    SdfOp op;
+    union {
+        SdfOpVariant variant;
+        uint32_t     push_index;
+        uint32_t     slot;
+        int32_t      int_param;
+    };
+    gpu_size_t param_start;
+    gpu_size_t param_end;
+};
+
+struct ParamOffset {
+    gpu_size_t x_offset  = 0;
+    gpu_size_t dx_offset = 0;
+};
+
+/// The number of operands of the `BvhUnion` op `op`.
+inline size_t sdf_bvh_count(const SdfGpuOp& op) {
+    return op.int_param;
+}
+
+/// The index of the first op of operand `k` of the `BvhUnion` op `ops[i]`. Operand `k`
+/// ends where operand `k + 1` begins, and `k == sdf_bvh_count()` gives the end of the
+/// union. An operand may be empty, if it was pruned.
+inline size_t sdf_bvh_operand(const SdfGpuOp* ops, size_t i, size_t k) {
+    return ops[i + 1 + k].push_index;
+}
+
+/// The half-open range of a parameter block within a tape.
+struct SdfParamRange {
+    gpu_size_t begin;
+    gpu_size_t end;
+};
+
+/// Which nodes of an expression are merged when serializing it.
+enum struct SdfMerge {
+    /// Merge structurally identical subtrees, even if they are different objects.
+    Identical,
+    /// Merge only nodes which are the same object. Use this if parameters will be
+    /// updated in place, so that separately-built nodes keep separate parameters.
+    Shared,
+    /// Merge as `Identical`, and also cull wide unions (see `SdfTape`). The bounds of
+    /// the culled operands are fit to the parameters the tape is built with, so the
+    /// values of the parameters (`params_x`, of every variation) must not change
+    /// afterwards; their tangents may.
+    Static,
+};
+
+/**
+ * @brief A serialized SDF expression tree.
+ *
+ * This is the "program" run by the stack machine in `sdf_eval.wgsl` (and by
+ * `SdfCpuEvaluator`). Domain-transforming ops are emitted before their children
+ * (they push a new domain) and are followed by a `PopDomain` op which points back
+ * at them (so the range can be transformed back on the way out). All other ops
+ * are emitted after their children, in postfix order.
+ *
+ * The expression is serialized as a DAG: a subtree which occurs more than once
+ * (either because the same node is shared, or because two subtrees are structurally
+ * identical, with identical parameters) under the same chain of domain transforms is
+ * evaluated only once. Its first occurrence is followed by a `Store` op, which copies
+ * the result into one of `MaxSlots` value slots, and later occurrences are replaced by
+ * a single `Load` op. Identical nodes also share a single parameter block, even where
+ * their values can't be reused (e.g. under different transforms). Because of this,
+ * the parameters of the tape are not in one-to-one correspondence with the nodes of
+ * the tree; `node_params` gives the block used by each node. With `SdfMerge::Shared`,
+ * only repeated references to the same node are merged.
+ *
+ * A wide union (one with at least `MinBvhOperands` operands whose bounds are known) is
+ * emitted as a `BvhUnion` op, which is followed by a table of `n + 1` `BvhOperand` ops
+ * holding the index of the first op of each of its `n` operands (and of the op after the
+ * last), relative to the start of the tape, and then by the operands themselves. Each
+ * operand is a self-contained sub-tape which leaves one value: it neither stores nor
+ * loads a slot. The parameters of the `BvhUnion` op are a hierarchy of bounding spheres
+ * over the operands (see sdf_bvh.h), which evaluators may walk nearest-first, skipping
+ * the operands which can't be nearer than the nearest found so far; the value is the
+ * same as the union's. (Or they may run the operands in order, unioning each one in as
+ * it ends). Operands whose bounds aren't known are unioned in after the `BvhUnion`.
+ * Culled unions are not nested, and are only built with `SdfMerge::Static`: the bounds
+ * are not refit when parameters are updated in place, so an operand which moved out of
+ * its stale sphere would be wrongly skipped.
+ *
+ * The tape holds a single copy of the parameters; `params_x` and `params_dx` always
+ * have the same length, `n_params()`.
+ */
+struct SdfTape {
+    /// Number of value slots available to `Store` / `Load`.
+    /// Keep in sync with `SLOT_COUNT` in sdf_eval.wgsl.
+    static constexpr size_t MaxSlots = 8;
+    /// The fewest bounded operands for which a union is emitted as a `BvhUnion`.
+    static constexpr size_t MinBvhOperands = 16;
+
+    std::vector<SdfGpuOp> ops;
+    std::vector<float>    params_x;
+    std::vector<float>    params_dx;
+    size_t                n_slots = 0;
+    /// The parameter block of each node which has parameters, by node address.
+    DenseMap<const void*, SdfParamRange> node_params;
+
+    SdfTape() = default;
+
+    template <typename T>
+    requires (std::is_same_v<T, float> || std::is_same_v<T, Dual<float>>)
+    SdfTape(SdfNodeRef<T> expr, SdfMerge merge=SdfMerge::Identical);
+
+    size_t n_params() const { return params_x.size(); }
+    size_t n_ops()    const { return ops.size(); }
+
+    /**
+     * @brief The number of entries needed by the larger of the domain and range stacks
+     * to run the tape (or any tape pruned from it).
+     *
+     * When serializing, the operands of unions and intersections are reordered to keep
+     * this as small as possible.
+     */
+    size_t stack_depth() const;
+
+    size_t extend(const float* v, size_t n);
+    size_t extend(const Dual<float>* v, size_t n);
+};
+
+} // namespace stereo
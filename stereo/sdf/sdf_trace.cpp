@@ -0,0 +1,361 @@
+#include <fstream>
+
+#include <stereo/sdf/sdf_trace.h>
+#include <stereo/util/parallel.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr float  Inf = std::numeric_limits<float>::infinity();
+constexpr size_t W   = SdfCpuProbe::Width;
+
+// side of the square tiles of the screen which are traced by one thread, in pixels
+constexpr uint32_t TileSize = 4 * SdfTracer::PacketSize;
+
+// packets of at most this many rays split into their rays
+constexpr uint32_t MaxPacketSplit = W;
+
+// a rectangle of pixels whose rays are marched together; a single pixel is a ray
+struct Packet {
+    uint32_t x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1)
+    float    t;              // fraction of the way from the near plane to the far plane
+    uint32_t steps;
+    // (rays only) the last point, and its radius; both as fractions of the ray
+    float    t_prev;
+    float    r_prev;
+    float    relaxation;
+    // (rays only) the point whose sphere was smallest relative to the pixel
+    float    best_t;
+    float    best_err;
+
+    bool is_ray() const { return x1 - x0 == 1 and y1 - y0 == 1; }
+};
+
+// a packet being marched, with the geometry of its rays
+struct Lane {
+    Packet p;
+    // the central ray runs from `o` to `o + d`
+    vec3   o;
+    vec3   d;
+    float  d_mag;
+    // the corner rays, less the central ray: `a + t b`
+    vec3   a[4];
+    vec3   b[4];
+    float  b_max;
+};
+
+struct Tracer {
+    const SdfTraceFrame&    frame;
+    const SdfTraceSettings& settings;
+    float                   lipschitz;
+    // the width of a pixel on the near and far planes
+    float                   foot_near;
+    float                   foot_far;
+    SdfTraceImage&          image;
+
+    vec2 pixel_uv(float x, float y) const {
+        return vec2(x / settings.dims.x, y / settings.dims.y);
+    }
+
+    Packet packet(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, float t) const {
+        return {x0, y0, x1, y1, t, 0, t, 0, settings.relaxation, t, Inf};
+    }
+
+    Lane lane(const Packet& p) const {
+        Lane l;
+        l.p = p;
+        vec3 far;
+        vec2 c = pixel_uv((p.x0 + p.x1) / 2.f, (p.y0 + p.y1) / 2.f);
+        frame.ray(c.x, c.y, &l.o, &far);
+        l.d     = far - l.o;
+        l.d_mag = l.d.mag();
+        l.b_max = 0;
+        if (not p.is_ray()) {
+            for (size_t k = 0; k < 4; ++k) {
+                vec3 o_k, far_k;
+                vec2 uv = pixel_uv(
+                    ((k & 1) ? p.x1 - 1 : p.x0) + 0.5f,
+                    ((k & 2) ? p.y1 - 1 : p.y0) + 0.5f
+                );
+                frame.ray(uv.x, uv.y, &o_k, &far_k);
+                l.a[k]  = o_k - l.o;
+                l.b[k]  = (far_k - o_k) - l.d;
+                l.b_max = std::max(l.b_max, l.b[k].mag());
+            }
+        }
+        return l;
+    }
+
+    // the packet's rays carry on from `p.t`: as four packets, or (if small enough)
+    // as rays
+    void split(const Packet& p, std::vector<Packet>& pending, SdfTraceStats& stats) const {
+        uint32_t w = p.x1 - p.x0;
+        uint32_t h = p.y1 - p.y0;
+        stats.splits += 1;
+        if (w * h <= MaxPacketSplit) {
+            for (uint32_t y = p.y0; y < p.y1; ++y) {
+                for (uint32_t x = p.x0; x < p.x1; ++x) {
+                    pending.push_back(packet(x, y, x + 1, y + 1, p.t));
+                }
+            }
+            return;
+        }
+        uint32_t xs[3] = {p.x0, w > 1 ? p.x0 + w / 2 : p.x1, p.x1};
+        uint32_t ys[3] = {p.y0, h > 1 ? p.y0 + h / 2 : p.y1, p.y1};
+        for (size_t j = 0; j < 2; ++j) {
+            for (size_t i = 0; i < 2; ++i) {
+                if (xs[i] < xs[i + 1] and ys[j] < ys[j + 1]) {
+                    pending.push_back(packet(xs[i], ys[j], xs[i + 1], ys[j + 1], p.t));
+                }
+            }
+        }
+    }
+
+    // step a packet whose central point has the value `f`. returns whether it is done.
+    bool step_packet(Lane& l, float f, std::vector<Packet>& pending, SdfTraceStats& stats) const {
+        Packet& p = l.p;
+        stats.packet_steps += 1;
+        // every ray's point is within `r` of the central point, and stays within the
+        // central sphere as long as the packet moves at most `slack` from where it is
+        float r = 0;
+        for (size_t k = 0; k < 4; ++k) r = std::max(r, (l.a[k] + l.b[k] * p.t).mag());
+        float slack = f / lipschitz - r;
+        if (slack < r or ++p.steps >= settings.max_steps) {
+            split(p, pending, stats);
+            return true;
+        }
+        p.t += slack / (l.b_max + l.d_mag);
+        // (a packet which passes the far plane misses, and its rays keep their
+        // infinite depth)
+        return p.t >= 1;
+    }
+
+    // step a ray whose point has the value `f`. returns whether it is done, and
+    // if it hit, sets `hit`.
+    bool step_ray(Lane& l, float f, bool* hit, SdfTraceStats& stats) const {
+        Packet& p = l.p;
+        stats.ray_steps += 1;
+        *hit = false;
+        // (all distances as fractions of the ray)
+        float r = f / (lipschitz * l.d_mag);
+        if (p.relaxation > 1 and r + p.r_prev < p.t - p.t_prev) {
+            // the spheres don't overlap, so the surface may have been skipped. go back,
+            // and stay unrelaxed.
+            p.t = p.t_prev + p.r_prev;
+            p.relaxation = 1;
+        } else {
+            float foot = foot_near + p.t * (foot_far - foot_near);
+            float eps  = settings.hit_scale * foot / l.d_mag;
+            float err  = r / eps;
+            if (err < p.best_err) {
+                p.best_t   = p.t;
+                p.best_err = err;
+            }
+            if (r < eps) {
+                *hit = true;
+                return true;
+            }
+            p.t_prev = p.t;
+            p.r_prev = r;
+            // (the far plane ends the ray, so the last step is not relaxed past it)
+            float t_next = p.t + p.relaxation * r;
+            p.t = t_next < 1 ? t_next : p.t + r;
+        }
+        // (past the far plane, the ray misses, however near it passed a surface)
+        if (p.t >= 1) return true;
+        if (++p.steps >= settings.max_steps) {
+            // give up; take the nearest miss, if it was near enough
+            if (p.best_err < 4) {
+                p.t  = p.best_t;
+                *hit = true;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // trace the pixels [x0, x1) x [y0, y1)
+    void trace_tile(
+            uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+            SdfCpuProbe& probe,
+            SdfTraceStats& stats) const
+    {
+        std::vector<Packet> pending;
+        uint32_t step = settings.packets ? SdfTracer::PacketSize : 1;
+        for (uint32_t y = y0; y < y1; y += step) {
+            for (uint32_t x = x0; x < x1; x += step) {
+                pending.push_back(packet(x, y, std::min(x + step, x1), std::min(y + step, y1), 0));
+            }
+        }
+        // rays which hit, whose normals are found at the end
+        std::vector<Packet> hits;
+        Lane   lanes[W];
+        size_t n_lanes = 0;
+        vec3   pts[W];
+        float  f[W];
+        while (true) {
+            while (n_lanes < W and not pending.empty()) {
+                lanes[n_lanes++] = lane(pending.back());
+                pending.pop_back();
+            }
+            if (n_lanes == 0) break;
+            for (size_t i = 0; i < n_lanes; ++i) {
+                pts[i] = lanes[i].o + lanes[i].d * lanes[i].p.t;
+            }
+            probe.values(pts, n_lanes, f);
+            // (backwards, so that a finished lane can be replaced by the last)
+            for (size_t i = n_lanes; i-- > 0;) {
+                Lane& l   = lanes[i];
+                bool done = false;
+                if (l.p.is_ray()) {
+                    bool hit;
+                    done = step_ray(l, f[i], &hit, stats);
+                    if (hit) hits.push_back(l.p);
+                } else {
+                    done = step_packet(l, f[i], pending, stats);
+                }
+                if (done) lanes[i] = lanes[--n_lanes];
+            }
+        }
+        // the normals of the hits
+        vec3 grad[W];
+        for (size_t i = 0; i < hits.size(); i += W) {
+            size_t n = std::min(W, hits.size() - i);
+            for (size_t k = 0; k < n; ++k) {
+                const Packet& p = hits[i + k];
+                vec3 near, far;
+                vec2 uv = pixel_uv(p.x0 + 0.5f, p.y0 + 0.5f);
+                frame.ray(uv.x, uv.y, &near, &far);
+                pts[k] = near + (far - near) * p.t;
+            }
+            probe.gradients(pts, n, f, grad);
+            for (size_t k = 0; k < n; ++k) {
+                const Packet& p = hits[i + k];
+                size_t j = p.y0 * settings.dims.x + p.x0;
+                float  m = grad[k].mag();
+                image.depth[j]  = frame.near + p.t * (frame.far - frame.near);
+                image.normal[j] = m > 0 ? grad[k] / m : vec3();
+            }
+        }
+    }
+};
+
+} // namespace
+
+
+SdfTracer::SdfTracer(size_t n_threads):
+    _n_threads(n_threads > 0 ? n_threads : hardware_threads()) {}
+
+SdfTraceImage SdfTracer::trace(
+        const SdfCpuExpr&       expr,
+        const SdfTraceFrame&    frame,
+        const SdfTraceSettings& settings) const
+{
+    vec2ui dims = settings.dims;
+    SdfTraceImage image;
+    image.dims = dims;
+    image.depth.assign((size_t) dims.x * dims.y, Inf);
+    image.normal.assign((size_t) dims.x * dims.y, vec3());
+    if (dims.x == 0 or dims.y == 0) return image;
+
+    const SdfTape& tape = expr.tiled_tape().tape;
+    float foot_near = std::max(
+        (frame.near_corners[1] - frame.near_corners[0]).mag() / dims.x,
+        (frame.near_corners[2] - frame.near_corners[0]).mag() / dims.y
+    );
+    float foot_far = std::max(
+        (frame.far_corners[1] - frame.far_corners[0]).mag() / dims.x,
+        (frame.far_corners[2] - frame.far_corners[0]).mag() / dims.y
+    );
+    Tracer tracer {
+        frame,
+        settings,
+        sdf_lipschitz(tape.ops.data(), tape.n_ops(), expr.params_x().data()),
+        foot_near,
+        foot_far,
+        image,
+    };
+
+    // each thread has its own probe, and counts its own steps
+    std::vector<std::unique_ptr<SdfCpuProbe>> probes(_n_threads);
+    std::vector<SdfTraceStats> stats(_n_threads);
+    vec2ui n_tiles((dims.x + TileSize - 1) / TileSize, (dims.y + TileSize - 1) / TileSize);
+    parallel_for(
+        (size_t) n_tiles.x * n_tiles.y,
+        1,
+        [&](size_t begin, size_t end, size_t thread_index) {
+            std::unique_ptr<SdfCpuProbe>& probe = probes[thread_index];
+            if (not probe) probe = std::make_unique<SdfCpuProbe>(expr);
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t x0 = (i % n_tiles.x) * TileSize;
+                uint32_t y0 = (i / n_tiles.x) * TileSize;
+                tracer.trace_tile(
+                    x0,
+                    y0,
+                    std::min(x0 + TileSize, dims.x),
+                    std::min(y0 + TileSize, dims.y),
+                    *probe,
+                    stats[thread_index]
+                );
+            }
+        },
+        _n_threads
+    );
+    for (const SdfTraceStats& s : stats) {
+        image.stats.ray_steps    += s.ray_steps;
+        image.stats.packet_steps += s.packet_steps;
+        image.stats.splits       += s.splits;
+    }
+    return image;
+}
+
+std::vector<uint8_t> SdfTraceImage::depth_image() const {
+    float lo =  Inf;
+    float hi = -Inf;
+    for (float d : depth) {
+        if (std::isfinite(d)) {
+            lo = std::min(lo, d);
+            hi = std::max(hi, d);
+        }
+    }
+    float scale = hi > lo ? 1 / (hi - lo) : 0;
+    std::vector<uint8_t> pixels(depth.size());
+    for (size_t i = 0; i < depth.size(); ++i) {
+        if (not std::isfinite(depth[i])) continue;
+        pixels[i] = (uint8_t) std::lround(255 - 191 * (depth[i] - lo) * scale);
+    }
+    return pixels;
+}
+
+std::vector<uint8_t> SdfTraceImage::normal_image() const {
+    std::vector<uint8_t> pixels(3 * normal.size());
+    for (size_t i = 0; i < normal.size(); ++i) {
+        if (not std::isfinite(depth[i])) continue;
+        for (size_t k = 0; k < 3; ++k) {
+            pixels[3 * i + k] = (uint8_t) std::lround(127.5f * (std::clamp(normal[i][k], -1.f, 1.f) + 1));
+        }
+    }
+    return pixels;
+}
+
+bool write_pnm(std::string_view path, const uint8_t* pixels, const vec2ui& dims, size_t channels) {
+    if (channels != 1 and channels != 3) {
+        std::cerr << "Cannot write an image of " << channels << " channels" << std::endl;
+        return false;
+    }
+    std::ofstream out(std::string(path), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Cannot open image for writing: " << path << std::endl;
+        return false;
+    }
+    out << (channels == 1 ? "P5" : "P6") << "\n" << dims.x << " " << dims.y << "\n255\n";
+    out.write(reinterpret_cast<const char*>(pixels), (size_t) dims.x * dims.y * channels);
+    if (!out) {
+        std::cerr << "Error writing image: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace stereo
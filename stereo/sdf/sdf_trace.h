@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stereo/gpu/camera.h>
+#include <stereo/sdf/sdf_cpu_eval.h>
+
+// A CPU sphere tracer for SDF expressions, for headless previews and reference images.
+//
+// Each pixel's ray runs from the near plane to the far plane of a camera. It is marched
+// by sphere tracing [Hart 1996]: at a point where the field is `f`, no surface is
+// nearer than `f / L`, where `L` is the Lipschitz constant of the tape (see
+// `sdf_lipschitz()`). Steps are over-relaxed by a factor `w` [Keinert et al. 2014]:
+// when the spheres at two successive points do not overlap, the relaxed step may have
+// crossed the surface, so the ray goes back to the last point and steps by its radius
+// alone, without relaxation for the rest of the ray. A ray hits where its sphere is
+// smaller than a fraction of the pixel's footprint.
+//
+// Neighboring rays visit nearly the same points until they come close to a surface,
+// so the rays of each 8x8 block of pixels are first marched together, as a cone
+// around the block's central ray. The packet's points at any depth lie within a
+// distance `R` of the central point (the rays are affine in the pixel coordinates),
+// so the packet steps by the part of the central sphere outside `R`. Where that is
+// less than `R` (the cone is near a surface), the packet splits into four, which carry
+// on from there; a packet of at most 16 rays splits into its rays. Packets are always
+// stepped conservatively; only rays are over-relaxed.
+//
+// The screen is traced in tiles, in parallel. Within a tile, the packets and rays in
+// flight are evaluated together in batches of `SdfCpuProbe::Width` points, each batch
+// by the tape of its tile if it has one (see `SdfTiledTape`).
+
+namespace stereo {
+
+/**
+ * @brief The corners of the near and far planes of a view, in world coordinates.
+ *
+ * Corner `k` is at the left (`k & 1 == 0`) or right, top (`k & 2 == 0`) or bottom of
+ * the image. The ray through pixel coordinates `(u, v)` in `[0, 1]^2` joins the
+ * bilinear interpolations of the near and of the far corners.
+ */
+struct SdfTraceFrame {
+    vec3  near_corners[4];
+    vec3  far_corners[4];
+    /// Camera depths of the near and far planes.
+    float near;
+    float far;
+
+    /// The view of `cam`, found by unprojecting the corners of its clip volume.
+    template <typename T>
+    static SdfTraceFrame from_camera(const Camera<T>& cam) {
+        using vec3z = typename Camera<T>::vec3z;
+        SdfTraceFrame frame;
+        for (size_t k = 0; k < 4; ++k) {
+            T x = (k & 1) ? 1 : -1;
+            T y = (k & 2) ? -1 : 1;
+            vec3z n = cam.cam_to_world * cam.unproject_cam(vec3z(x, y, -1));
+            vec3z f = cam.cam_to_world * cam.unproject_cam(vec3z(x, y,  1));
+            frame.near_corners[k] = vec3(n.x, n.y, n.z);
+            frame.far_corners[k]  = vec3(f.x, f.y, f.z);
+        }
+        frame.near = cam.near();
+        frame.far  = cam.far();
+        return frame;
+    }
+
+    /// The ends of the ray through `(u, v)` on the near and far planes.
+    void ray(float u, float v, vec3* near_pt, vec3* far_pt) const {
+        auto lerp = [u, v](const vec3* c) {
+            vec3 top    = c[0] + (c[1] - c[0]) * u;
+            vec3 bottom = c[2] + (c[3] - c[2]) * u;
+            return top + (bottom - top) * v;
+        };
+        *near_pt = lerp(near_corners);
+        *far_pt  = lerp(far_corners);
+    }
+};
+
+struct SdfTraceSettings {
+    vec2ui   dims       = {512, 512};
+    /// Over-relaxation factor of the rays' steps, in [1, 2).
+    float    relaxation = 1.6f;
+    /// A ray hits where its sphere is smaller than this fraction of a pixel.
+    float    hit_scale  = 0.5f;
+    /// Steps after which a ray gives up (and a packet splits).
+    uint32_t max_steps  = 256;
+    /// Whether to march 8x8 packets before the rays; if not, every ray starts alone.
+    bool     packets    = true;
+};
+
+struct SdfTraceStats {
+    /// Evaluations of single rays, and of the central rays of packets.
+    size_t ray_steps    = 0;
+    size_t packet_steps = 0;
+    /// Packets which were split, into packets or rays.
+    size_t splits       = 0;
+};
+
+struct SdfTraceImage {
+    vec2ui             dims;
+    /// The camera depth of each pixel's hit, in raster order; infinite where it misses.
+    std::vector<float> depth;
+    /// The unit normal at each pixel's hit; zero where it misses.
+    std::vector<vec3>  normal;
+    SdfTraceStats      stats;
+
+    /// Depth as 8-bit gray, from white at the nearest hit to dark at the farthest;
+    /// misses are black.
+    std::vector<uint8_t> depth_image()  const;
+    /// Normals as 8-bit RGB, mapping [-1, 1] to [0, 255]; misses are black.
+    std::vector<uint8_t> normal_image() const;
+};
+
+/**
+ * @brief Write 8-bit pixels of `channels` 1 (gray) or 3 (RGB) to a binary PGM or
+ * PPM file. Returns whether the file was written.
+ */
+bool write_pnm(std::string_view path, const uint8_t* pixels, const vec2ui& dims, size_t channels);
+
+struct SdfTracer {
+private:
+    size_t _n_threads;
+
+public:
+
+    /// Side of the square packets of rays which are marched together, in pixels.
+    static constexpr uint32_t PacketSize = 8;
+
+    /// Create a tracer using `n_threads` threads, or all hardware threads if zero.
+    SdfTracer(size_t n_threads=0);
+
+    size_t n_threads() const { return _n_threads; }
+
+    /// Trace the first variation of `expr` over the view `frame`.
+    SdfTraceImage trace(
+        const SdfCpuExpr&       expr,
+        const SdfTraceFrame&    frame,
+        const SdfTraceSettings& settings={}) const;
+
+    /// Trace the first variation of `expr` as seen by `cam`.
+    template <typename T>
+    SdfTraceImage trace(
+        const SdfCpuExpr&       expr,
+        const Camera<T>&        cam,
+        const SdfTraceSettings& settings={}) const
+    {
+        return trace(expr, SdfTraceFrame::from_camera(cam), settings);
+    }
+};
+
+} // namespace stereo
@@ -0,0 +1,502 @@
+#include <algorithm>
+#include <numeric>
+
+#include <stereo/sdf/sdf_trimesh.h>
+
+namespace stereo {
+
+namespace {
+
+constexpr float Inf = std::numeric_limits<float>::infinity();
+
+// bins per axis when splitting a node by the surface area heuristic
+constexpr size_t SahBins = 16;
+// past this depth, nodes are split at the median instead, so that the depth of the
+// hierarchy (and so the stack of a walk) stays bounded
+constexpr size_t MaxSahDepth = 40;
+// the walks hold at most one pending sibling per level
+constexpr size_t MaxWalk = 64;
+
+float dot(const vec3& a, const vec3& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+vec3 cross(const vec3& a, const vec3& b) {
+    return {
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x,
+    };
+}
+
+float length(const vec3& v) {
+    return std::sqrt(dot(v, v));
+}
+
+struct BuildTri {
+    vec3 v[3];
+    vec3 lo;
+    vec3 hi;
+    vec3 centroid;
+};
+
+struct BuildNode {
+    vec3     lo;
+    vec3     hi;
+    uint32_t count; // zero for an interior node
+    uint32_t index; // right child, or first triangle
+    vec3     center;
+    float    radius;
+    vec3     area;
+};
+
+struct Box {
+    vec3 lo { Inf,  Inf,  Inf};
+    vec3 hi {-Inf, -Inf, -Inf};
+
+    void add(const vec3& p) {
+        for (size_t a = 0; a < 3; ++a) {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+    }
+
+    void add(const Box& b) {
+        add(b.lo);
+        add(b.hi);
+    }
+
+    float area() const {
+        vec3 d = hi - lo;
+        if (d.x < 0) return 0;
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+struct Builder {
+    std::vector<BuildTri>  tris;
+    std::vector<BuildNode> nodes;
+
+    // build the subtree over `tris[b, e)`, returning the index of its root
+    uint32_t build(size_t b, size_t e, size_t depth) {
+        uint32_t node = nodes.size();
+        nodes.push_back({});
+        Box box;
+        Box centroids;
+        for (size_t i = b; i < e; ++i) {
+            box.add(Box {tris[i].lo, tris[i].hi});
+            centroids.add(tris[i].centroid);
+        }
+        fit_dipole(node, b, e);
+        nodes[node].lo = box.lo;
+        nodes[node].hi = box.hi;
+        if (e - b <= SdfMeshLeafSize) {
+            nodes[node].count = e - b;
+            nodes[node].index = b;
+            return node;
+        }
+        size_t mid = split(b, e, centroids, depth);
+        build(b, mid, depth + 1);
+        uint32_t right = build(mid, e, depth + 1);
+        nodes[node].count = 0;
+        nodes[node].index = right;
+        return node;
+    }
+
+    // reorder `tris[b, e)` into two sides, returning the start of the second
+    size_t split(size_t b, size_t e, const Box& centroids, size_t depth) {
+        size_t axis = 0;
+        vec3 extent = centroids.hi - centroids.lo;
+        for (size_t a = 1; a < 3; ++a) {
+            if (extent[a] > extent[axis]) axis = a;
+        }
+        auto by_axis = [&](const BuildTri& s, const BuildTri& t) {
+            return s.centroid[axis] < t.centroid[axis];
+        };
+        size_t mid = (b + e) / 2;
+        if (depth >= MaxSahDepth or not (extent[axis] > 0)) {
+            std::nth_element(tris.begin() + b, tris.begin() + mid, tris.begin() + e, by_axis);
+            return mid;
+        }
+
+        // bin the centroids along each axis, and sweep for the cheapest split
+        float best_cost  = Inf;
+        size_t best_axis = 0;
+        size_t best_bin  = 0;
+        for (size_t a = 0; a < 3; ++a) {
+            if (not (extent[a] > 0)) continue;
+            Box    bins[SahBins];
+            size_t counts[SahBins] = {};
+            float  scale = SahBins / extent[a];
+            for (size_t i = b; i < e; ++i) {
+                size_t k = bin(tris[i].centroid[a], centroids.lo[a], scale);
+                bins[k].add(Box {tris[i].lo, tris[i].hi});
+                counts[k] += 1;
+            }
+            // the cost of splitting after bin `k`: the area of each side, times
+            // its number of triangles
+            float  right_area[SahBins];
+            size_t right_count[SahBins];
+            Box    r;
+            size_t n_r = 0;
+            for (size_t k = SahBins - 1; k > 0; --k) {
+                r.add(bins[k]);
+                n_r += counts[k];
+                right_area[k]  = r.area();
+                right_count[k] = n_r;
+            }
+            Box    l;
+            size_t n_l = 0;
+            for (size_t k = 0; k + 1 < SahBins; ++k) {
+                l.add(bins[k]);
+                n_l += counts[k];
+                if (n_l == 0 or right_count[k + 1] == 0) continue;
+                float cost = l.area() * n_l + right_area[k + 1] * right_count[k + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin  = k;
+                }
+            }
+        }
+        if (best_cost == Inf) {
+            std::nth_element(tris.begin() + b, tris.begin() + mid, tris.begin() + e, by_axis);
+            return mid;
+        }
+        float scale = SahBins / extent[best_axis];
+        auto i = std::partition(tris.begin() + b, tris.begin() + e, [&](const BuildTri& t) {
+            return bin(t.centroid[best_axis], centroids.lo[best_axis], scale) <= best_bin;
+        });
+        return i - tris.begin();
+    }
+
+    static size_t bin(float x, float lo, float scale) {
+        return std::min<size_t>(SahBins - 1, (size_t) ((x - lo) * scale));
+    }
+
+    // the dipole of `tris[b, e)`, and a sphere about its center containing them
+    void fit_dipole(uint32_t node, size_t b, size_t e) {
+        vec3  area  {0.f, 0.f, 0.f};
+        vec3  c     {0.f, 0.f, 0.f};
+        vec3  mean  {0.f, 0.f, 0.f};
+        float total = 0;
+        for (size_t i = b; i < e; ++i) {
+            const BuildTri& t = tris[i];
+            vec3  n = cross(t.v[1] - t.v[0], t.v[2] - t.v[0]) * 0.5f;
+            float a = length(n);
+            area  += n;
+            c     += t.centroid * a;
+            mean  += t.centroid;
+            total += a;
+        }
+        // (degenerate triangles have no area, and no effect on the winding number)
+        c = total > 0 ? c / total : mean / (float) (e - b);
+        float r = 0;
+        for (size_t i = b; i < e; ++i) {
+            for (size_t k = 0; k < 3; ++k) r = std::max(r, length(tris[i].v[k] - c));
+        }
+        nodes[node].center = c;
+        nodes[node].radius = r;
+        nodes[node].area   = area;
+    }
+};
+
+// the vector to `p` from the nearest point of the segment `(a, b)`
+vec3 seg_offset(const vec3& p, const vec3& a, const vec3& b) {
+    vec3  ab = b - a;
+    float t  = std::clamp(dot(p - a, ab) / dot(ab, ab), 0.f, 1.f);
+    return p - a - ab * (std::isfinite(t) ? t : 0.f);
+}
+
+// the vector to `p` from the nearest point of the triangle `(a, b, c)`
+// (by Voronoi regions, after Ericson, "Real-Time Collision Detection")
+vec3 tri_offset(const vec3& p, const vec3& a, const vec3& b, const vec3& c) {
+    vec3  ab = b - a;
+    vec3  ac = c - a;
+    vec3  ap = p - a;
+    float d1 = dot(ab, ap);
+    float d2 = dot(ac, ap);
+    if (d1 <= 0 and d2 <= 0) return ap;
+    vec3  bp = p - b;
+    float d3 = dot(ab, bp);
+    float d4 = dot(ac, bp);
+    if (d3 >= 0 and d4 <= d3) return bp;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 and d1 >= 0 and d3 <= 0) return ap - ab * (d1 / (d1 - d3));
+    vec3  cp = p - c;
+    float d5 = dot(ab, cp);
+    float d6 = dot(ac, cp);
+    if (d6 >= 0 and d5 <= d6) return cp;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 and d2 >= 0 and d6 <= 0) return ap - ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0 and (d4 - d3) >= 0 and (d5 - d6) >= 0) {
+        return bp - (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+    float denom = 1.f / (va + vb + vc);
+    if (not std::isfinite(denom)) {
+        // degenerate; only the edges are left
+        vec3 e[3] = {seg_offset(p, a, b), seg_offset(p, b, c), seg_offset(p, c, a)};
+        size_t k = 0;
+        for (size_t j = 1; j < 3; ++j) {
+            if (dot(e[j], e[j]) < dot(e[k], e[k])) k = j;
+        }
+        return e[k];
+    }
+    return ap - ab * (vb * denom) - ac * (vc * denom);
+}
+
+float tri_dist2(const vec3& p, const vec3& a, const vec3& b, const vec3& c) {
+    vec3 q = tri_offset(p, a, b, c);
+    return dot(q, q);
+}
+
+// squared distance from `p` to the box of the node at `s`
+float box_dist2(const vec3& p, const float* s) {
+    float d2 = 0;
+    for (size_t a = 0; a < 3; ++a) {
+        float d = std::max({s[a] - p[a], p[a] - s[4 + a], 0.f});
+        d2 += d * d;
+    }
+    return d2;
+}
+
+// the solid angle of the triangle `(a, b, c)` seen from `p`, over 4pi
+// (after Van Oosterom and Strackee)
+float tri_winding(const vec3& p, const vec3& a, const vec3& b, const vec3& c) {
+    vec3  u  = a - p;
+    vec3  v  = b - p;
+    vec3  w  = c - p;
+    float lu = length(u);
+    float lv = length(v);
+    float lw = length(w);
+    float det = dot(u, cross(v, w));
+    float div = lu * lv * lw + dot(u, v) * lw + dot(v, w) * lu + dot(w, u) * lv;
+    return std::atan2(det, div) / (2.f * (float) M_PI);
+}
+
+float value(float x)              { return x; }
+float value(const Dual<float>& x) { return x.x; }
+
+vec3 load_vec(const float* s) {
+    return {s[0], s[1], s[2]};
+}
+
+} // namespace
+
+
+std::vector<vec3> model_triangles(const Model& model, range1i prims) {
+    std::vector<vec3> tri_verts;
+    for (int32_t i = prims.lo; i <= prims.hi; ++i) {
+        const Model::Prim& prim = model.prims[i];
+        if (prim.geo_type != PrimitiveType::Triangles) continue;
+        for (uint32_t k = prim.index_range.lo; k + 2 <= prim.index_range.hi; k += 3) {
+            for (uint32_t j = 0; j < 3; ++j) {
+                tri_verts.push_back(prim.obj_to_world * model.verts[model.indices[k + j]].p);
+            }
+        }
+    }
+    return tri_verts;
+}
+
+vec3 sdf_triangle_closest(const vec3& p, const vec3& a, const vec3& b, const vec3& c) {
+    return p - tri_offset(p, a, b, c);
+}
+
+std::vector<float> sdf_mesh_params(const std::vector<vec3>& tri_verts) {
+    size_t n = tri_verts.size() / 3;
+    if (n == 0) {
+        std::cerr << "SdfMesh needs at least one triangle" << std::endl;
+        std::abort();
+    }
+    if (n >= (1 << 24) / SdfMeshNodeParams) {
+        std::cerr << "SdfMesh has too many triangles (" << n << ")" << std::endl;
+        std::abort();
+    }
+    Builder bld;
+    bld.tris.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        BuildTri& t = bld.tris[i];
+        Box box;
+        for (size_t k = 0; k < 3; ++k) {
+            t.v[k] = tri_verts[3 * i + k];
+            box.add(t.v[k]);
+        }
+        t.lo       = box.lo;
+        t.hi       = box.hi;
+        t.centroid = (t.v[0] + t.v[1] + t.v[2]) / 3.f;
+    }
+    bld.nodes.reserve(2 * n / SdfMeshLeafSize + 1);
+    bld.build(0, n, 0);
+
+    size_t n_nodes = bld.nodes.size();
+    std::vector<float> ps(sdf_mesh_tri_param(n_nodes, n), 0.f);
+    ps[0] = n_nodes;
+    ps[1] = n;
+    for (size_t i = 0; i < n_nodes; ++i) {
+        const BuildNode& node = bld.nodes[i];
+        float* s = ps.data() + sdf_mesh_node_param(i);
+        for (size_t a = 0; a < 3; ++a) {
+            s[a]      = node.lo[a];
+            s[4 + a]  = node.hi[a];
+            s[8 + a]  = node.center[a];
+            s[12 + a] = node.area[a];
+        }
+        s[3]  = node.count;
+        s[7]  = node.index;
+        s[11] = node.radius;
+    }
+    for (size_t t = 0; t < n; ++t) {
+        float* s = ps.data() + sdf_mesh_tri_param(n_nodes, t);
+        for (size_t k = 0; k < 3; ++k) {
+            for (size_t a = 0; a < 3; ++a) s[3 * k + a] = bld.tris[t].v[k][a];
+        }
+    }
+    return ps;
+}
+
+bool sdf_mesh_params_valid(const float* ps, size_t n_params) {
+    // a count or index stored as a float: an integer in [0, limit)
+    auto index = [](float x, size_t limit, size_t* out) {
+        if (not (x >= 0 and x < (float) limit and x == std::floor(x))) return false;
+        *out = (size_t) x;
+        return true;
+    };
+    constexpr size_t MaxCount = 1 << 24;
+    size_t n_nodes;
+    size_t n_tris;
+    if (n_params < 2 or
+        not index(ps[0], MaxCount, &n_nodes) or
+        not index(ps[1], MaxCount, &n_tris) or
+        n_nodes == 0 or n_tris == 0 or
+        sdf_mesh_tri_param(n_nodes, n_tris) != n_params)
+    {
+        return false;
+    }
+    // walk the nodes in depth-first order, left child first, checking that each is
+    // the next one stored
+    std::vector<std::pair<size_t, size_t>> todo {{0, 0}}; // node, depth
+    size_t next = 0;
+    while (not todo.empty()) {
+        auto [node, depth] = todo.back();
+        todo.pop_back();
+        if (node != next or depth >= MaxWalk) return false;
+        next += 1;
+        const float* s = ps + sdf_mesh_node_param(node);
+        size_t count;
+        size_t i;
+        if (not index(s[3], n_tris + 1, &count) or not index(s[7], MaxCount, &i)) {
+            return false;
+        }
+        if (count > 0) {
+            if (i + count > n_tris) return false;
+        } else {
+            if (i <= node + 1 or i >= n_nodes) return false;
+            todo.push_back({i,        depth + 1});
+            todo.push_back({node + 1, depth + 1});
+        }
+    }
+    return next == n_nodes;
+}
+
+uint32_t sdf_mesh_nearest(const float* ps, const vec3& p, float* dist2) {
+    size_t   n_nodes = (size_t) ps[0];
+    float    best    = Inf;
+    uint32_t best_t  = 0;
+    uint32_t todo[MaxWalk];
+    size_t   n_todo  = 0;
+    todo[n_todo++] = 0;
+    while (n_todo > 0) {
+        uint32_t     node = todo[--n_todo];
+        const float* s    = ps + sdf_mesh_node_param(node);
+        if (box_dist2(p, s) >= best) continue;
+        uint32_t count = (uint32_t) s[3];
+        uint32_t index = (uint32_t) s[7];
+        if (count > 0) {
+            for (uint32_t t = index; t < index + count; ++t) {
+                const float* v = ps + sdf_mesh_tri_param(n_nodes, t);
+                float d2 = tri_dist2(p, load_vec(v), load_vec(v + 3), load_vec(v + 6));
+                if (d2 < best) {
+                    best   = d2;
+                    best_t = t;
+                }
+            }
+        } else {
+            // visit the nearer child first
+            uint32_t l  = node + 1;
+            uint32_t r  = index;
+            float    dl = box_dist2(p, ps + sdf_mesh_node_param(l));
+            float    dr = box_dist2(p, ps + sdf_mesh_node_param(r));
+            if (dl < dr) std::swap(l, r);
+            todo[n_todo++] = l;
+            todo[n_todo++] = r;
+        }
+    }
+    if (dist2) *dist2 = best;
+    return best_t;
+}
+
+float sdf_mesh_winding(const float* ps, const vec3& p) {
+    size_t   n_nodes = (size_t) ps[0];
+    float    w       = 0;
+    uint32_t todo[MaxWalk];
+    size_t   n_todo  = 0;
+    todo[n_todo++] = 0;
+    while (n_todo > 0) {
+        uint32_t     node = todo[--n_todo];
+        const float* s    = ps + sdf_mesh_node_param(node);
+        vec3  d = load_vec(s + 8) - p;
+        float r = length(d);
+        if (r > SdfMeshWindingBeta * s[11]) {
+            // far away: the solid angle of a dipole
+            w += dot(load_vec(s + 12), d) / (4.f * (float) M_PI * r * r * r);
+            continue;
+        }
+        uint32_t count = (uint32_t) s[3];
+        uint32_t index = (uint32_t) s[7];
+        if (count > 0) {
+            for (uint32_t t = index; t < index + count; ++t) {
+                const float* v = ps + sdf_mesh_tri_param(n_nodes, t);
+                w += tri_winding(p, load_vec(v), load_vec(v + 3), load_vec(v + 6));
+            }
+        } else {
+            todo[n_todo++] = node + 1;
+            todo[n_todo++] = index;
+        }
+    }
+    return w;
+}
+
+
+template <typename T>
+SdfMesh<T>::SdfMesh(const Model& model, range1i prims):
+    SdfNode<T>(SdfOp::Mesh)
+{
+    std::vector<float> ps = sdf_mesh_params(model_triangles(model, prims));
+    _params.assign(ps.begin(), ps.end());
+}
+
+template <typename T>
+SdfMesh<T>::SdfMesh(const std::vector<vec3>& verts, const std::vector<uint32_t>& indices):
+    SdfNode<T>(SdfOp::Mesh)
+{
+    std::vector<vec3> tri_verts;
+    size_t n = indices.size() - indices.size() % 3;
+    tri_verts.reserve(n);
+    for (size_t k = 0; k < n; ++k) {
+        tri_verts.push_back(verts[indices[k]]);
+    }
+    std::vector<float> ps = sdf_mesh_params(tri_verts);
+    _params.assign(ps.begin(), ps.end());
+}
+
+template <typename T>
+size_t SdfMesh<T>::n_triangles() const {
+    return (size_t) value(_params[1]);
+}
+
+// explicit template instantiation
+template struct SdfMesh<float>;
+template struct SdfMesh<Dual<float>>;
+
+} // namespace stereo
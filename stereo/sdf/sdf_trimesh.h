@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+
+#include <stereo/gpu/model.h>
+#include <stereo/sdf/sdf_structs.h>
+
+// Triangle meshes as SDF leaves.
+//
+// An `SdfMesh` node is the signed distance to a triangle mesh. The unsigned distance
+// is found by a closest-point query over a bounding volume hierarchy of boxes, built
+// by the surface area heuristic; its value and gradient are then exactly those of the
+// `Triangle` op for the nearest triangle. The sign comes from the generalized winding
+// number of the mesh at the sample (which is 1 inside a closed, outward-facing mesh,
+// and 0 outside): the sample is inside if it is over one half. The winding number is
+// approximated hierarchically [Barill et al. 2018]: the triangles under a node whose
+// bounding sphere is far from the sample (more than `SdfMeshWindingBeta` radii) are
+// replaced by a single dipole, the sum of their area vectors, at their area-weighted
+// centroid. Nearer nodes are opened, down to the exact solid angles of the triangles
+// at the leaves. Both queries visit a number of nodes which grows with log(triangles).
+//
+// Meshes need not be closed: across a hole the winding number passes smoothly through
+// one half, so the sign flips somewhere near the hole, rather than everywhere behind it.
+//
+// The whole structure is stored in the op's parameter block (indices as floats, which
+// are exact up to 2^24):
+//   - the number of nodes, and the number of triangles                        2 params
+//   - each node, in depth-first order (the left child of an interior node
+//     follows it; `index` is its right child, or for a leaf, its first
+//     triangle, and `count` is the number of triangles of a leaf, or zero):
+//         box lo, count, box hi, index, centroid, radius, area vector, (pad)  16 per node
+//   - each triangle, in hierarchy order (three vertices)                      9 per triangle
+// The vertices are not differentiable; tangents of the parameters are ignored.
+//
+// Meshes are evaluated only on the CPU (see `SdfCpuEvaluator`); sdf_eval.wgsl does not
+// implement the `Mesh` op.
+
+namespace stereo {
+
+/// Parameters per node of a mesh hierarchy.
+constexpr size_t SdfMeshNodeParams = 16;
+/// Parameters per triangle of a mesh.
+constexpr size_t SdfMeshTriParams  = 9;
+/// Most triangles in a leaf of a mesh hierarchy.
+constexpr size_t SdfMeshLeafSize   = 4;
+/// Nodes farther than this many bounding radii from a sample are approximated when
+/// finding the winding number.
+constexpr float  SdfMeshWindingBeta = 2.f;
+
+/// The index of the first parameter of node `i` of a mesh hierarchy.
+inline size_t sdf_mesh_node_param(size_t i) {
+    return 2 + SdfMeshNodeParams * i;
+}
+
+/// The index of the first parameter of triangle `t` of a mesh with `n_nodes` nodes.
+inline size_t sdf_mesh_tri_param(size_t n_nodes, size_t t) {
+    return 2 + SdfMeshNodeParams * n_nodes + SdfMeshTriParams * t;
+}
+
+/**
+ * @brief The vertices of the triangle prims `prims` (an inclusive range of prim ids, as
+ * returned by `add_model()`) of `model`, three per triangle, with the prims' transforms
+ * applied. Prims of other types are skipped.
+ */
+std::vector<vec3> model_triangles(const Model& model, range1i prims);
+
+/// The point of the triangle `(a, b, c)` nearest to `p`.
+vec3 sdf_triangle_closest(const vec3& p, const vec3& a, const vec3& b, const vec3& c);
+
+/**
+ * @brief Build the parameter block of a mesh from a list of triangles (three vertices
+ * each, wound counterclockwise when seen from outside).
+ *
+ * There must be at least one triangle.
+ */
+std::vector<float> sdf_mesh_params(const std::vector<vec3>& tri_verts);
+
+/**
+ * @brief Whether the `n_params` parameters `ps` (e.g. read from a file) are a well-formed
+ * mesh, which the walks below can traverse without reading out of bounds: the counts
+ * match the size of the block, and the nodes form a hierarchy in depth-first order,
+ * shallow enough for the walks' stacks, whose leaves hold triangles of the mesh.
+ */
+bool sdf_mesh_params_valid(const float* ps, size_t n_params);
+
+/**
+ * @brief The index of the triangle of the mesh with parameters `ps` nearest to `p`.
+ *
+ * If `dist2` is not null, it receives the squared distance to that triangle.
+ */
+uint32_t sdf_mesh_nearest(const float* ps, const vec3& p, float* dist2=nullptr);
+
+/// The (approximate) generalized winding number of the mesh with parameters `ps` at `p`.
+float sdf_mesh_winding(const float* ps, const vec3& p);
+
+/// The first parameter of triangle `t` of the mesh with parameters `ps`.
+inline const float* sdf_mesh_triangle(const float* ps, uint32_t t) {
+    return ps + sdf_mesh_tri_param((size_t) ps[0], t);
+}
+
+/**
+ * @brief The signed distance to a triangle mesh.
+ */
+template <typename T>
+struct SdfMesh : public SdfNode<T> {
+private:
+    std::vector<T> _params;
+
+public:
+
+    /**
+     * @brief The mesh of the triangle prims `prims` of `model` (see `model_triangles()`).
+     *
+     * There must be at least one triangle.
+     */
+    SdfMesh(const Model& model, range1i prims);
+
+    /// The mesh of the triangles `indices` (three per triangle) into `verts`.
+    SdfMesh(const std::vector<vec3>& verts, const std::vector<uint32_t>& indices);
+
+    size_t n_triangles() const;
+
+    size_t   n_params() const override { return _params.size(); }
+    const T* params()   const override { return _params.data(); }
+};
+
+} // namespace stereo
@@ -1,32 +1,301 @@
+#include <bit>
+
 #include <stereo/sdf/visualize_sdf.h>
 #include <stereo/gpu/shader.h>
 
 namespace stereo {
 
+namespace {
+
+using Node = SdfNode<Dual<float>>;
+
+// values may be up to this much farther from a changed bound than the field, to allow
+// for rounding
+constexpr float DistSlack = 1e-3f;
+
+// given that a child of `ancestor` changed, and is at least the distance to `b` both
+// before and after (see visualize_sdf.h), a sphere which `ancestor` keeps the same
+// distance from, if one is known
+std::optional<SdfBound> lift_bound(const Node& ancestor, std::optional<SdfBound> b) {
+    if (not b) return b;
+    if (ancestor.variant() != SdfOpVariant::None and ancestor.n_children() == 2) {
+        // a smooth blend may change farther away than either operand
+        return std::nullopt;
+    }
+    switch (ancestor.op()) {
+        // mins and maxes of the operands and their negations
+        case SdfOp::Union:
+        case SdfOp::Intersect:
+        case SdfOp::Subtract:
+        case SdfOp::Xor:
+            return b;
+        // offsets of the child's value, and rigid domain ops
+        case SdfOp::Dilate:
+        case SdfOp::Shell:
+        case SdfOp::Transform:
+        case SdfOp::Repeat:
+        case SdfOp::Mirror:
+        case SdfOp::RotSym:
+            return sdf_node_bound(ancestor, b, std::nullopt);
+        default: return std::nullopt;
+    }
+}
+
+} // namespace
+
+
 VisualizeSdf::VisualizeSdf(
         wgpu::Instance instance,
         wgpu::Device device,
         SdfNodeRef<Dual<float>> expr):
     _window(instance, device, vec2ui(2048, 2048)),
     _sdf_eval(device),
+    _expr(expr),
     _sdf_expr(_sdf_eval, expr),
     _device(device),
-    _vis_expr_layout {
+    _field_dims(_window.surface_dims),
+    _n_tiles(
+        (_field_dims.x + TileSize - 1) / TileSize,
+        (_field_dims.y + TileSize - 1) / TileSize
+    ),
+    // a single mip level: the field is bound as a storage texture, whose views may only
+    // span one level
+    _field(
+        device,
+        _field_dims,
+        wgpu::TextureFormat::RGBA16Float,
+        "SDF visualizer field",
+        wgpu::TextureUsage::TextureBinding | // drawn by visualize_sdf.wgsl
+        wgpu::TextureUsage::StorageBinding,  // written by visualize_sdf_field.wgsl
+        1
+    ),
+    _field_layout {
         device,
         {
-            storage_buffer_layout<SdfGpuOp>(0, BufferTarget::Read, wgpu::ShaderStage::Fragment),
-            storage_buffer_layout<float>(1, BufferTarget::Read, wgpu::ShaderStage::Fragment),
-            storage_buffer_layout<float>(2, BufferTarget::Read, wgpu::ShaderStage::Fragment),
+            texture_storage_layout(0, wgpu::ShaderStage::None, wgpu::TextureFormat::RGBA16Float),
+            compute_r_buffer_layout<gpu_size_t>(1),
         },
-        "SDF visualizer expression layout",
+        "SDF visualizer field layout",
+    },
+    _draw_layout {
+        device,
+        {
+            texture_layout(0, wgpu::ShaderStage::Fragment),
+        },
+        "SDF visualizer draw layout",
+    },
+    _dirty_buffer(
+        device,
+        _n_tiles.x * _n_tiles.y,
+        BufferKind::Storage,
+        wgpu::BufferUsage::CopyDst
+    ),
+    _field_bindgroup {
+        device,
+        _field_layout,
+        {
+            texture_entry(0, _field),
+            buffer_entry<gpu_size_t>(1, _dirty_buffer, _n_tiles.x * _n_tiles.y),
+        },
+        "SDF visualizer field bindgroup",
+    },
+    _draw_bindgroup {
+        device,
+        _draw_layout,
+        {
+            texture_entry(0, _field),
+        },
+        "SDF visualizer draw bindgroup",
     },
     _vis_pipeline(
         device,
         shader_from_file(device, "resource/shaders/sdf/visualize_sdf.wgsl"),
         wgpu::PrimitiveTopology::TriangleStrip,
         {_window.surface_format},
-        {_sdf_eval.expr_layout()}
-    ) {}
+        {_draw_layout}
+    ),
+    _nodes(_snapshot()),
+    _dirty(_n_tiles.x * _n_tiles.y, true)
+{
+    _find_tile_dists();
+}
+
+wgpu::ComputePipeline VisualizeSdf::_field_pipeline(gpu_size_t stack_size) {
+    // stack sizes are powers of two, starting from the smallest
+    size_t i = std::countr_zero(stack_size / SdfMinStackSize);
+    wgpu::ComputePipeline& pipeline = _field_pipelines[i];
+    if (pipeline) return pipeline;
+
+    wgpu::ShaderModule shader = shader_from_file(
+        _device,
+        "resource/shaders/sdf/visualize_sdf_field.wgsl",
+        {
+            {"STACK_SIZE", stack_size},
+            // only the value is drawn
+            {"EVAL_MODE",  (uint32_t) SdfEvalMode::Value},
+        }
+    );
+    if (not shader) {
+        std::cerr << "Failed to load SDF visualizer field shader." << std::endl;
+        std::abort();
+    }
+
+    pipeline = create_compute_pipeline(
+        _device,
+        shader,
+        {
+            _sdf_eval.expr_layout(),
+            _field_layout,
+        },
+        "SDF visualizer field pipeline"
+    );
+    return pipeline;
+}
+
+DenseMap<const Node*, VisualizeSdf::NodeState> VisualizeSdf::_snapshot() const {
+    DenseMap<const Node*, NodeState>               nodes;
+    DenseMap<const Node*, std::optional<SdfBound>> bounds;
+    std::vector<const Node*>                       path;
+    // the bound of `node` in the domain it's evaluated in
+    auto bound = [&](auto& self, const Node& node) -> std::optional<SdfBound> {
+        auto i = bounds.find(&node);
+        if (i != bounds.end()) return i->second;
+        std::optional<SdfBound> a;
+        std::optional<SdfBound> b;
+        if (node.n_children() > 0) a = self(self, *node.child(0));
+        if (node.n_children() > 1) b = self(self, *node.child(1));
+        std::optional<SdfBound> result = sdf_node_bound(node, a, b);
+        bounds[&node] = result;
+        return result;
+    };
+    auto visit = [&](auto& self, const SdfNodeRef<Dual<float>>& node) -> void {
+        auto [i, inserted] = nodes.try_emplace(node.get());
+        NodeState& state = i->second;
+        if (inserted) {
+            state.node = node;
+            const Dual<float>* ps = node->params();
+            for (size_t k = 0; k < node->n_params(); ++k) state.params.push_back(ps[k].x);
+            for (size_t c = 0; c < node->n_children(); ++c) {
+                state.children.push_back(node->child(c).get());
+            }
+        }
+        // (before the children are visited, which may move `state`)
+        std::optional<SdfBound> b = bound(bound, *node);
+        for (auto a = path.rbegin(); b and a != path.rend(); ++a) b = lift_bound(**a, b);
+        state.bounds.push_back(b);
+        path.push_back(node.get());
+        for (size_t c = 0; c < node->n_children(); ++c) self(self, node->child(c));
+        path.pop_back();
+    };
+    visit(visit, _expr);
+    return nodes;
+}
+
+std::pair<vec3, float> VisualizeSdf::_tile_extent(gpu_size_t tile) const {
+    // (in pixels)
+    gpu_size_t x0 = (tile % _n_tiles.x) * TileSize;
+    gpu_size_t y0 = (tile / _n_tiles.x) * TileSize;
+    gpu_size_t x1 = std::min(x0 + TileSize, _field_dims.x);
+    gpu_size_t y1 = std::min(y0 + TileSize, _field_dims.y);
+    vec2 c((x0 + x1) / 2.f, (y0 + y1) / 2.f);
+    // the same mapping as visualize_sdf_field.wgsl; pixel rows run downward
+    float s = 2.f * ViewExtent / _field_dims.x;
+    float t = 2.f * ViewExtent / _field_dims.y;
+    vec3  p(c.x * s - ViewExtent, ViewExtent - c.y * t, 0.f);
+    vec2  half_extent((x1 - x0) * s / 2.f, (y1 - y0) * t / 2.f);
+    return {p, std::sqrt(half_extent.x * half_extent.x + half_extent.y * half_extent.y)};
+}
+
+void VisualizeSdf::_find_tile_dists() {
+    gpu_size_t n_tiles = _n_tiles.x * _n_tiles.y;
+    std::vector<vec3> centers(n_tiles);
+    for (gpu_size_t t = 0; t < n_tiles; ++t) centers[t] = _tile_extent(t).first;
+    SdfCpuInput input(n_tiles, 0);
+    input.write_samples_x(centers.data());
+    SdfCpuOutputRef out = _cpu_eval.evaluate(
+        SdfCpuExpr(_expr),
+        input,
+        1,
+        ParamVariation::VaryDerivative,
+        nullptr,
+        SdfEvalMode::Value
+    );
+    _tile_dist.resize(n_tiles);
+    for (gpu_size_t t = 0; t < n_tiles; ++t) _tile_dist[t] = std::abs(out->sdf_x[t]);
+}
+
+void VisualizeSdf::update() {
+    DenseMap<const Node*, NodeState> nodes = _snapshot();
+
+    // the bounds of the nodes which changed, before and after
+    std::vector<SdfBound> changed;
+    bool everything = false;
+    auto add = [&](const NodeState& state) {
+        for (const std::optional<SdfBound>& b : state.bounds) {
+            if (b) changed.push_back(*b);
+            else   everything = true;
+        }
+    };
+    for (const auto& [node, state] : nodes) {
+        auto i = _nodes.find(node);
+        if (i == _nodes.end()) {
+            add(state);
+        } else if (i->second.params != state.params or i->second.children != state.children) {
+            add(i->second);
+            add(state);
+        }
+    }
+    for (const auto& [node, state] : _nodes) {
+        if (not nodes.contains(node)) add(state);
+    }
+    _nodes = std::move(nodes);
+    if (changed.empty() and not everything) return;
+
+    gpu_size_t n_tiles = _n_tiles.x * _n_tiles.y;
+    for (gpu_size_t t = 0; t < n_tiles and not everything; ++t) {
+        if (_dirty[t]) continue;
+        auto [c, h] = _tile_extent(t);
+        float reach = _tile_dist[t] + 2.f * h + DistSlack;
+        for (const SdfBound& b : changed) {
+            vec3 v = c - b.center;
+            if (std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z) - b.radius <= reach) {
+                _dirty[t] = true;
+                break;
+            }
+        }
+    }
+    if (everything) std::fill(_dirty.begin(), _dirty.end(), true);
+    _sdf_expr = SdfGpuExpr(_sdf_eval, _expr);
+    _find_tile_dists();
+}
+
+void VisualizeSdf::set_expr(SdfNodeRef<Dual<float>> expr) {
+    _expr  = expr;
+    _nodes = _snapshot();
+    std::fill(_dirty.begin(), _dirty.end(), true);
+    _sdf_expr = SdfGpuExpr(_sdf_eval, _expr);
+    _find_tile_dists();
+}
+
+void VisualizeSdf::_evaluate_tiles(wgpu::CommandEncoder encoder) {
+    std::vector<gpu_size_t> tiles;
+    for (gpu_size_t t = 0; t < _dirty.size(); ++t) {
+        if (_dirty[t]) tiles.push_back(t);
+    }
+    if (tiles.empty()) return;
+    _dirty_buffer.submit_write(tiles);
+
+    wgpu::ComputePipeline pipeline = _field_pipeline(sdf_stack_size(_sdf_expr.stack_depth()));
+    wgpu::ComputePassEncoder pass = encoder.beginComputePass();
+    pass.setPipeline(pipeline);
+    pass.setBindGroup(0, _sdf_expr.bindgroup(), 0, nullptr);
+    pass.setBindGroup(1, _field_bindgroup,      0, nullptr);
+    // one workgroup per 16x16 block of a tile
+    pass.dispatchWorkgroups(TileSize / 16, TileSize / 16, tiles.size());
+    pass.end();
+    pass.release();
+    std::fill(_dirty.begin(), _dirty.end(), false);
+}
 
 void VisualizeSdf::do_frame() {
     wgpu::TextureView backbuffer = _window.next_target();
@@ -35,6 +304,9 @@ void VisualizeSdf::do_frame() {
     enc_desc.label = "Visualize SDF command encoder";
     wgpu::CommandEncoder encoder = _device.createCommandEncoder(enc_desc);
     
+    // bring the field up to date; idle frames only draw it
+    _evaluate_tiles(encoder);
+    
     wgpu::RenderPassDescriptor pass_desc;
     wgpu::RenderPassColorAttachment render_attachment = wgpu::Default;
     render_attachment.view = backbuffer;
@@ -52,7 +324,7 @@ void VisualizeSdf::do_frame() {
     
     // render stuff
     render_pass.setPipeline(_vis_pipeline);
-    render_pass.setBindGroup(0, _sdf_expr.bindgroup(), 0, nullptr);
+    render_pass.setBindGroup(0, _draw_bindgroup, 0, nullptr);
     render_pass.draw(4, 1, 0, 0); // draw one quad
     
     // clean up
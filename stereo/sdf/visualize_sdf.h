@@ -3,35 +3,117 @@
 #include <stereo/gpu/window.h>
 #include <stereo/gpu/bindgroup.h>
 #include <stereo/gpu/render_pipeline.h>
+#include <stereo/gpu/texture.h>
+#include <stereo/sdf/sdf_bvh.h>
+#include <stereo/sdf/sdf_cpu_eval.h>
 #include <stereo/sdf/sdf_eval.h>
 
+// Draws the cross-section z = 0 of an SDF in a window.
+//
+// The field is not evaluated per frame: it is held in a texture, one texel per pixel,
+// which each frame only draws. The texture is split into square tiles, and when the
+// expression changes (see `update()`), only the tiles whose values may have changed are
+// evaluated again, by a compute pass over the list of dirty tiles.
+//
+// The dirty tiles are found from the bounds of the nodes which changed (see sdf_bvh.h).
+// A changed node is at least the distance `s` to its bounding sphere, both before and
+// after the change. A min or max over it (a union, intersection, difference or xor) then
+// changes only where both its old and new values are at least `s`, or both at most
+// `-s` (for a negated operand); a dilation, or a rigid domain op, moves the sphere as it
+// moves the bound of its child. So wherever the root changes, the magnitude of its old
+// value is at least the distance to one of the changed spheres, carried up to the root.
+// The field is 1-Lipschitz, so a tile of half-diagonal `h` is evaluated again only if a
+// changed sphere is within `|f(c)| + 2h` of its center `c`, where `f(c)` is kept from the
+// last update. Where no sphere is known (an unbounded shape, or a smooth blend or other
+// op without a bound above the change), every tile is evaluated again.
+
 namespace stereo {
 
 struct VisualizeSdf {
+public:
+
+    /// Side of the square tiles of the field which are evaluated together, in pixels.
+    /// Keep in sync with visualize_sdf_field.wgsl.
+    static constexpr gpu_size_t TileSize = 128;
+    /// Half the width of the view of the plane, in world units. Keep in sync with
+    /// visualize_sdf_field.wgsl.
+    static constexpr float ViewExtent = 4.f;
+
 private:
-    
-    Window       _window;
-    SdfEvaluator _sdf_eval;
-    SdfGpuExpr   _sdf_expr;
-    
-    wgpu::Device    _device;
-    // we need our own bindgroup because the layout effectively specifies
-    // whether it talks to a compute or a render pipeline
-    BindGroupLayout _vis_expr_layout;
-    BindGroup       _vis_expr_bindgroup;
-    RenderPipeline  _vis_pipeline;
+
+    using Node = SdfNode<Dual<float>>;
+
+    // a node as of the last update. the node is held, so that its address is not
+    // reused by a different node before the next update.
+    struct NodeState {
+        SdfNodeRef<Dual<float>>              node;
+        std::vector<float>                   params;
+        std::vector<const Node*>             children;
+        // the bound of each occurrence of the node in the tree, carried up to the
+        // root, if one is known
+        std::vector<std::optional<SdfBound>> bounds;
+    };
+
+    Window                  _window;
+    SdfEvaluator            _sdf_eval;
+    SdfCpuEvaluator         _cpu_eval;
+    SdfNodeRef<Dual<float>> _expr;
+    SdfGpuExpr              _sdf_expr;
+
+    wgpu::Device            _device;
+    vec2ui                  _field_dims;
+    vec2ui                  _n_tiles;
+    Texture                 _field;
+    // the field pass writes the field; the draw pass reads it
+    BindGroupLayout         _field_layout;
+    BindGroupLayout         _draw_layout;
+    DataBuffer<gpu_size_t>  _dirty_buffer;
+    BindGroup               _field_bindgroup;
+    BindGroup               _draw_bindgroup;
+    RenderPipeline          _vis_pipeline;
+    // by stack size, as in `SdfEvaluator`
+    wgpu::ComputePipeline   _field_pipelines[5];
+
+    DenseMap<const Node*, NodeState> _nodes;
+    // the magnitude of the field at the center of each tile, as of the last update
+    std::vector<float>      _tile_dist;
+    // tiles to evaluate before the next frame is drawn
+    std::vector<bool>       _dirty;
+
+    wgpu::ComputePipeline _field_pipeline(gpu_size_t stack_size);
+
+    // record the state of every node of the expression
+    DenseMap<const Node*, NodeState> _snapshot() const;
+    // the point of the plane at the center of `tile`, and the tile's half-diagonal
+    std::pair<vec3, float> _tile_extent(gpu_size_t tile) const;
+    // find the magnitude of the field at the center of each tile
+    void _find_tile_dists();
+    // evaluate the dirty tiles of the field
+    void _evaluate_tiles(wgpu::CommandEncoder encoder);
 
 public:
-    
+
     VisualizeSdf(
             wgpu::Instance instance,
             wgpu::Device device,
             SdfNodeRef<Dual<float>> expr);
-    
+
+    /**
+     * @brief Evaluate the parts of the field which may have changed since the last
+     * update.
+     *
+     * Call after changing the parameters or children of any nodes of the expression.
+     * The tiles are evaluated by the next `do_frame()`.
+     */
+    void update();
+
+    /// Draw `expr` instead of the current expression. The whole field is evaluated again.
+    void set_expr(SdfNodeRef<Dual<float>> expr);
+
     void do_frame();
-    
+
     const Window* window() const { return &_window; }
-    
+
 };
 
 } // namespace stereo
@@ -0,0 +1,399 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include <stereo/sdf/sdf_cpu_eval.h>
+#include <stereo/sdf/sdf_packing.h>
+#include <stereo/sdf/sdf_static.h>
+#include <stereo/sdf/sdf_trace.h>
+#include <stereo/util/dumb_argparse.h>
+
+// Benchmarks of the CPU SDF evaluator.
+//
+//   sdfbench order [--samples N] [--spheres N] [--threads N]
+//       Time sorting the samples along space-filling curves (see sdf_order.h), and
+//       evaluating them in each order, for coherent (raster) and scattered samples.
+//
+//   sdfbench static [--samples N] [--threads N]
+//       Time a small fixed scene built as a compile-time expression (see sdf_static.h)
+//       against the same scene run by the tape interpreter, in each evaluation mode.
+//
+//   sdfbench layout [--samples N] [--spheres N]
+//       Encode dual evaluation results in each output layout (see sdf_packing.h), and
+//       report the bytes per sample, and the worst errors after decoding: of the
+//       distance and its tangent, of the normal's direction (in radians), and of the
+//       normal's tangent (relative).
+//
+//   sdfbench trace [--size N] [--spheres N] [--threads N] [--out PREFIX]
+//       Sphere trace an N x N image of the static scene and of a tiled union of random
+//       spheres (see sdf_trace.h), with and without packets, and report the throughput,
+//       the evaluations per ray, and the pixels where the packets' image differs from
+//       that of the rays alone (in whether they hit, or by over 1% in depth). A ray
+//       which a packet carried part of the way steps through other points, so the two
+//       may differ where it grazes a surface at about the hit tolerance; expect only a
+//       handful of such pixels. With `--out`, write the depth and normals to
+//       PREFIX-*.pgm / .ppm.
+
+using namespace stereo;
+
+using dualf = Dual<float>;
+using Clock = std::chrono::steady_clock;
+
+// best wall time of `reps` runs of `fn`, in milliseconds
+template <typename F>
+double time_ms(F&& fn, int reps=3) {
+    double best = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < reps; ++i) {
+        auto start = Clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> dt = Clock::now() - start;
+        best = std::min(best, dt.count());
+    }
+    return best;
+}
+
+// a union of `n` random spheres in [-4, 4]^3; wide enough to be culled by a `BvhUnion`
+// (with `SdfMerge::Static`)
+SdfNodeRef<dualf> random_spheres(size_t n, std::mt19937& rng) {
+    std::uniform_real_distribution<float> pos(-4, 4);
+    std::uniform_real_distribution<float> rad(0.05, 0.25);
+    SdfNodeRef<dualf> root;
+    for (size_t i = 0; i < n; ++i) {
+        SdfNodeRef<dualf> s = std::make_shared<SdfSphere<dualf>>(
+            Sphere<dualf,3>(Vec<dualf,3>(pos(rng), pos(rng), pos(rng)), dualf(rad(rng)))
+        );
+        root = root ? SdfNodeRef<dualf>(std::make_shared<SdfUnion<dualf>>(root, s)) : s;
+    }
+    return root;
+}
+
+// about `n` points on a lattice over [-4, 4]^3, in raster order
+std::vector<vec3> raster_samples(size_t n) {
+    size_t w = std::max<size_t>(1, std::cbrt((double) n));
+    std::vector<vec3> pts;
+    pts.reserve(w * w * w);
+    for (size_t z = 0; z < w; ++z) {
+        for (size_t y = 0; y < w; ++y) {
+            for (size_t x = 0; x < w; ++x) {
+                pts.push_back(vec3(x + 0.5f, y + 0.5f, z + 0.5f) * (8.f / w) - vec3(4.f));
+            }
+        }
+    }
+    return pts;
+}
+
+// `n` uniformly random points in [-4, 4]^3
+std::vector<vec3> scattered_samples(size_t n, std::mt19937& rng) {
+    std::uniform_real_distribution<float> pos(-4, 4);
+    std::vector<vec3> pts(n);
+    for (vec3& p : pts) p = vec3(pos(rng), pos(rng), pos(rng));
+    return pts;
+}
+
+void bench_order(int argc, char** argv) {
+    size_t n_samples = get_option_u32(argc, argv, "--samples").value_or(1 << 20);
+    size_t n_spheres = get_option_u32(argc, argv, "--spheres").value_or(1024);
+    size_t n_threads = get_option_u32(argc, argv, "--threads").value_or(0);
+    std::mt19937 rng {1};
+    SdfTape tape {random_spheres(n_spheres, rng), SdfMerge::Static};
+    SdfCpuExpr flat  {tape};
+    SdfCpuExpr tiled {SdfTiledTape(tape, range3(vec3(-4.f), vec3(4.f)), vec3ui(8, 8, 8))};
+    SdfCpuEvaluator evaluator {n_threads};
+    
+    std::pair<const char*, std::vector<vec3>> sample_sets[] = {
+        {"raster",    raster_samples(n_samples)},
+        {"scattered", scattered_samples(n_samples, rng)},
+    };
+    std::pair<const char*, const SdfCpuExpr*> exprs[] = {
+        {"flat",  &flat},
+        {"tiled", &tiled},
+    };
+    std::pair<const char*, SdfSampleOrder> orders[] = {
+        {"unsorted", SdfSampleOrder::Unsorted},
+        {"morton",   SdfSampleOrder::Morton},
+        {"hilbert",  SdfSampleOrder::Hilbert},
+    };
+    
+    std::cout << n_spheres << " spheres, " << evaluator.n_threads() << " threads; "
+              << "gradient evaluation" << std::endl;
+    std::cout << std::left
+              << std::setw(11) << "samples"
+              << std::setw(7)  << "tape"
+              << std::setw(10) << "order"
+              << std::right
+              << std::setw(10) << "sort ms"
+              << std::setw(10) << "eval ms"
+              << std::setw(10) << "total ms" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (auto& [samples_name, pts] : sample_sets) {
+        for (auto& [expr_name, expr] : exprs) {
+            for (auto& [order_name, order] : orders) {
+                SdfCpuInput input {(gpu_size_t) pts.size(), 0, order};
+                double sort_ms = time_ms([&] { input.write_samples_x(pts.data()); });
+                SdfCpuOutputRef output;
+                double eval_ms = time_ms([&] {
+                    output = evaluator.evaluate(
+                        *expr, input, 1, ParamVariation::VaryDerivative, output, SdfEvalMode::Gradient
+                    );
+                });
+                std::cout << std::left
+                          << std::setw(11) << samples_name
+                          << std::setw(7)  << expr_name
+                          << std::setw(10) << order_name
+                          << std::right
+                          << std::setw(10) << sort_ms
+                          << std::setw(10) << eval_ms
+                          << std::setw(10) << sort_ms + eval_ms << std::endl;
+            }
+        }
+    }
+}
+
+// a table with a bowl on it, as a compile-time expression
+auto table_scene() {
+    return sdf::union_(
+        sdf::box(vec3(-2.f, -0.1f, -1.f), vec3(2.f, 0.1f, 1.f)),
+        sdf::mirror(
+            sdf::mirror(
+                sdf::cylinder(vec3(1.8f, -2.f, 0.8f), vec3(1.8f, -0.1f, 0.8f), 0.1f),
+                vec3(1.f, 0.f, 0.f), 0.f
+            ),
+            vec3(0.f, 0.f, 1.f), 0.f
+        ),
+        sdf::subtract(
+            sdf::shell(sdf::sphere(vec3(0.f, 0.6f, 0.f), 0.5f), 0.03f),
+            sdf::plane(vec3(0.f, -1.f, 0.f), 0.7f)
+        ),
+        sdf::transform(
+            sdf::capsule(vec3(-0.3f, 0.f, 0.f), vec3(0.3f, 0.f, 0.f), 0.05f),
+            vec4(0.f, 0.f, 0.2588190f, 0.9659258f),
+            vec3(1.f, 0.25f, 0.3f)
+        )
+    );
+}
+
+void bench_static(int argc, char** argv) {
+    size_t n_samples = get_option_u32(argc, argv, "--samples").value_or(1 << 20);
+    size_t n_threads = get_option_u32(argc, argv, "--threads").value_or(0);
+    std::mt19937 rng {1};
+    auto scene = table_scene();
+    SdfCpuExpr interpreted {sdf::node(scene)};
+    SdfCpuEvaluator evaluator {n_threads};
+    std::vector<vec3> pts  = scattered_samples(n_samples, rng);
+    std::vector<vec3> dpts = scattered_samples(n_samples, rng);
+    SdfCpuInput input {(gpu_size_t) n_samples, (gpu_size_t) n_samples, SdfSampleOrder::Hilbert};
+    input.write_samples_x(pts.data());
+    input.write_samples_dx(dpts.data());
+    std::pair<const char*, SdfEvalMode> modes[] = {
+        {"value",    SdfEvalMode::Value},
+        {"gradient", SdfEvalMode::Gradient},
+        {"dual",     SdfEvalMode::Dual},
+    };
+
+    std::cout << n_samples << " samples, " << evaluator.n_threads() << " threads" << std::endl;
+    std::cout << std::left
+              << std::setw(10) << "mode"
+              << std::right
+              << std::setw(10) << "tape ms"
+              << std::setw(10) << "static ms"
+              << std::setw(10) << "speedup"
+              << std::setw(12) << "max |df|" << std::endl;
+    for (auto& [mode_name, mode] : modes) {
+        SdfCpuOutputRef out_tape;
+        SdfCpuOutputRef out_static;
+        double tape_ms = time_ms([&] {
+            out_tape = evaluator.evaluate(
+                interpreted, input, 1, ParamVariation::VaryDerivative, out_tape, mode
+            );
+        });
+        double static_ms = time_ms([&] {
+            out_static = sdf::evaluate(scene, input, out_static, mode, evaluator.n_threads());
+        });
+        float err = 0;
+        for (size_t i = 0; i < n_samples; ++i) {
+            err = std::max(err, std::abs(out_tape->sdf_x[i] - out_static->sdf_x[i]));
+        }
+        std::cout << std::left
+                  << std::setw(10) << mode_name
+                  << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << tape_ms
+                  << std::setw(10) << static_ms
+                  << std::setprecision(2)
+                  << std::setw(10) << tape_ms / static_ms
+                  << std::scientific << std::setprecision(1)
+                  << std::setw(12) << err
+                  << std::defaultfloat << std::endl;
+    }
+}
+
+void bench_layout(int argc, char** argv) {
+    size_t n_samples = get_option_u32(argc, argv, "--samples").value_or(1 << 18);
+    size_t n_spheres = get_option_u32(argc, argv, "--spheres").value_or(64);
+    std::mt19937 rng {1};
+    SdfCpuExpr expr {SdfTape(random_spheres(n_spheres, rng), SdfMerge::Static)};
+    SdfCpuEvaluator evaluator;
+    std::vector<vec3> pts  = raster_samples(n_samples);
+    std::vector<vec3> dpts = scattered_samples(pts.size(), rng);
+    SdfCpuInput input {(gpu_size_t) pts.size(), (gpu_size_t) pts.size()};
+    input.write_samples_x(pts.data());
+    input.write_samples_dx(dpts.data());
+    SdfCpuOutputRef exact = evaluator.evaluate(expr, input, 1);
+    gpu_size_t n = exact->n_samples();
+    std::pair<const char*, SdfOutputLayout> layouts[] = {
+        {"packed",      SdfOutputLayout::Packed},
+        {"interleaved", SdfOutputLayout::Interleaved},
+    };
+    
+    std::cout << n << " samples of " << n_spheres << " spheres; dual evaluation" << std::endl;
+    std::cout << std::left
+              << std::setw(13) << "layout"
+              << std::right
+              << std::setw(8)  << "bytes"
+              << std::setw(9)  << "ratio"
+              << std::setw(11) << "max |df|"
+              << std::setw(11) << "max |ddf|"
+              << std::setw(11) << "max angle"
+              << std::setw(11) << "max rel dn" << std::endl;
+    // (the normals of `Separate` are padded to 16 bytes)
+    size_t separate_bytes = 2 * sizeof(float) + 2 * sizeof(vec3gpu);
+    std::cout << std::left << std::setw(13) << "separate"
+              << std::right << std::setw(8) << separate_bytes << std::endl;
+    for (auto& [layout_name, layout] : layouts) {
+        gpu_size_t words = sdf_record_words(layout, SdfEvalMode::Dual);
+        std::vector<uint32_t> records((size_t) n * words);
+        for (gpu_size_t i = 0; i < n; ++i) {
+            sdf_pack_record(layout, *exact, i, records.data() + (size_t) i * words);
+        }
+        SdfCpuOutput decoded {n};
+        sdf_unpack_records(layout, SdfEvalMode::Dual, records.data(), decoded);
+        
+        // packed normals are directions, and their tangents those of the directions
+        float err_f = 0, err_df = 0, err_angle = 0, err_dn = 0;
+        for (gpu_size_t i = 0; i < n; ++i) {
+            vec3 g  = exact->normal_x[i];
+            vec3 dg = exact->normal_dx[i];
+            float m = g.mag();
+            if (m == 0) continue;
+            vec3 g_hat = g / m;
+            vec3 d_hat = (dg - g_hat * g_hat.dot(dg)) / m;
+            // (from the chord, which unlike `acos()` is precise for small angles)
+            float angle = 2 * std::asin(std::min((decoded.normal_x[i].unit() - g_hat).mag() / 2, 1.f));
+            vec3  dn_ref = layout == SdfOutputLayout::Packed ? d_hat : dg;
+            float dn_mag = dn_ref.mag();
+            err_f     = std::max(err_f,     std::abs(decoded.sdf_x[i]  - exact->sdf_x[i]));
+            err_df    = std::max(err_df,    std::abs(decoded.sdf_dx[i] - exact->sdf_dx[i]));
+            err_angle = std::max(err_angle, angle);
+            if (dn_mag > 0) err_dn = std::max(err_dn, (decoded.normal_dx[i] - dn_ref).mag() / dn_mag);
+        }
+        size_t bytes = words * sizeof(uint32_t);
+        std::cout << std::left
+                  << std::setw(13) << layout_name
+                  << std::right
+                  << std::setw(8)  << bytes
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(9)  << (double) separate_bytes / bytes
+                  << std::scientific << std::setprecision(1)
+                  << std::setw(11) << err_f
+                  << std::setw(11) << err_df
+                  << std::setw(11) << err_angle
+                  << std::setw(11) << err_dn
+                  << std::defaultfloat << std::endl;
+    }
+}
+
+void bench_trace(int argc, char** argv) {
+    uint32_t size      = get_option_u32(argc, argv, "--size").value_or(512);
+    size_t   n_spheres = get_option_u32(argc, argv, "--spheres").value_or(1024);
+    size_t   n_threads = get_option_u32(argc, argv, "--threads").value_or(0);
+    std::optional<size_t> out = find_cmd_option(argc, argv, "--out");
+    std::string prefix = out and *out + 1 < (size_t) argc ? argv[*out + 1] : "";
+    std::mt19937 rng {1};
+    SdfTape spheres {random_spheres(n_spheres, rng), SdfMerge::Static};
+    SdfCpuExpr table {sdf::node(table_scene())};
+    SdfCpuExpr tiled {SdfTiledTape(spheres, range3(vec3(-4.f), vec3(4.f)), vec3ui(8, 8, 8))};
+    struct Scene {
+        const char*       name;
+        const SdfCpuExpr* expr;
+        float             radius; // of the camera's orbit
+    };
+    Scene scenes[] = {
+        {"table",   &table, 5.f},
+        {"spheres", &tiled, 14.f},
+    };
+    SdfTracer tracer {n_threads};
+    SdfTraceSettings settings;
+    settings.dims = vec2ui(size, size);
+    size_t n_rays = (size_t) size * size;
+
+    std::cout << size << " x " << size << " pixels, " << tracer.n_threads() << " threads" << std::endl;
+    std::cout << std::left
+              << std::setw(9)  << "scene"
+              << std::setw(9)  << "march"
+              << std::right
+              << std::setw(9)  << "ms"
+              << std::setw(10) << "Mrays/s"
+              << std::setw(11) << "steps/ray"
+              << std::setw(8)  << "hits"
+              << std::setw(9)  << "diff px" << std::endl;
+    for (const Scene& scene : scenes) {
+        Camera<float> cam;
+        cam.set_perspective(50, 1, 0.5f, 50.f);
+        cam.orbit(vec3(0.f), scene.radius, 0.4f, 0.6f, vec3(0.f, 1.f, 0.f));
+        SdfTraceImage rays;
+        for (bool packets : {false, true}) {
+            settings.packets = packets;
+            SdfTraceImage image;
+            double ms = time_ms([&] { image = tracer.trace(*scene.expr, cam, settings); });
+            size_t hits = 0;
+            size_t diff = 0;
+            for (size_t i = 0; i < n_rays; ++i) {
+                float z = image.depth[i];
+                if (std::isfinite(z)) hits += 1;
+                if (packets and (std::isfinite(z) != std::isfinite(rays.depth[i])
+                        or std::abs(z - rays.depth[i]) > 0.01f * z)) {
+                    diff += 1;
+                }
+            }
+            const SdfTraceStats& st = image.stats;
+            std::cout << std::left
+                      << std::setw(9)  << scene.name
+                      << std::setw(9)  << (packets ? "packets" : "rays")
+                      << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(9)  << ms
+                      << std::setprecision(2)
+                      << std::setw(10) << n_rays / (ms * 1000)
+                      << std::setw(11) << (double) (st.ray_steps + st.packet_steps) / n_rays
+                      << std::setw(8)  << hits;
+            if (packets) std::cout << std::setw(9) << diff;
+            std::cout << std::defaultfloat << std::endl;
+            if (not packets) {
+                rays = std::move(image);
+            } else if (not prefix.empty()) {
+                std::string path = prefix + "-" + scene.name;
+                write_pnm(path + "-depth.pgm",  image.depth_image().data(),  image.dims, 1);
+                write_pnm(path + "-normal.ppm", image.normal_image().data(), image.dims, 3);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string_view bench = argc > 1 ? argv[1] : "";
+    if (bench == "order") {
+        bench_order(argc, argv);
+    } else if (bench == "static") {
+        bench_static(argc, argv);
+    } else if (bench == "layout") {
+        bench_layout(argc, argv);
+    } else if (bench == "trace") {
+        bench_trace(argc, argv);
+    } else {
+        std::cerr << "usage: sdfbench order [--samples N] [--spheres N] [--threads N]\n"
+                  << "       sdfbench static [--samples N] [--threads N]\n"
+                  << "       sdfbench layout [--samples N] [--spheres N]\n"
+                  << "       sdfbench trace [--size N] [--spheres N] [--threads N] [--out PREFIX]" << std::endl;
+        return 1;
+    }
+    return 0;
+}
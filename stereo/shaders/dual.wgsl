@@ -36,7 +36,7 @@ fn d_subf(a: Dual, b: f32) -> Dual {
 fn d_fsub(a: f32, b: Dual) -> Dual {
     return Dual(
         a  - b.x,
-        b.dx,
+        -b.dx,
     );
 }
 
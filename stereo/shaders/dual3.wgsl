@@ -249,9 +249,15 @@ fn dq_conj(q: DualQ) -> DualQ {
 }
 
 fn dqv_mul(q: DualQ, v: DualV3) -> DualV3 {
+    // qrot() is quadratic in q, so we can't just rotate by the tangent of q;
+    // differentiate v' = v + w * b + u x b, where b = 2 (u x v):
+    let u:  vec3f = q.x.xyz;
+    let du: vec3f = q.dx.xyz;
+    let b:  vec3f = 2.0 * cross(u, v.x);
+    let db: vec3f = 2.0 * cross(du, v.x);
     return DualV3(
         qrot(q.x, v.x),
-        qrot(q.x, v.dx) + qrot(q.dx, v.x),
+        qrot(q.x, v.dx) + q.dx.w * b + q.x.w * db + cross(du, b) + cross(u, db),
     );
 }
 
@@ -6,10 +6,28 @@
 //   function parameters, so we have to access via global variables >:(
 //   expects sdf_params_x, sdf_params_dx to be visible in the global scope.
 
+// the tangent of the parameter at `j`. only shader variants which evaluate tangents
+// read them; the others see constant zeros, which the compiler can fold away.
+fn load_dx(j: Index) -> f32 {
+    if EVAL_MODE == SdfEvalMode_Dual {
+        return sdf_params_dx[j];
+    }
+    return 0.;
+}
+
 fn load_scalard(offs: ParamOffset) -> Dual {
     return Dual(
-        sdf_params_x [offs.x_offset],
-        sdf_params_dx[offs.dx_offset],
+        sdf_params_x[offs.x_offset],
+        load_dx(offs.dx_offset),
+    );
+}
+
+fn load_vecf(offs: ParamOffset) -> vec3f {
+    let i: Index = offs.x_offset;
+    return vec3f(
+        sdf_params_x[i + 0],
+        sdf_params_x[i + 1],
+        sdf_params_x[i + 2],
     );
 }
 
@@ -22,9 +40,9 @@ fn load_vecd(offs: ParamOffset) -> DualV3 {
         sdf_params_x[i + 2],
     );
     let dx: vec3f = vec3f(
-        sdf_params_dx[j + 0],
-        sdf_params_dx[j + 1],
-        sdf_params_dx[j + 2],
+        load_dx(j + 0),
+        load_dx(j + 1),
+        load_dx(j + 2),
     );
     return DualV3(x, dx);
 }
@@ -39,10 +57,10 @@ fn load_quatd(offs: ParamOffset) -> DualQ {
         sdf_params_x[i + 3],
     );
     let dq: vec4f = vec4f(
-        sdf_params_dx[j + 0],
-        sdf_params_dx[j + 1],
-        sdf_params_dx[j + 2],
-        sdf_params_dx[j + 3],
+        load_dx(j + 0),
+        load_dx(j + 1),
+        load_dx(j + 2),
+        load_dx(j + 3),
     );
     return DualQ(q, dq);
 }
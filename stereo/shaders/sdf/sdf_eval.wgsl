@@ -6,8 +6,9 @@
 // >>>>>>> ALERT: NONSTANDARD INCLUDE BEHAVIOR <<<<<<<
 // because wgpu doesn't support passing storage arrays as fn parameters,
 // we have to resort to using named global variables. this file
-// must be included _below_ the definitions of the ops and params arrays,
-// which must be named `sdf_tree`, `sdf_params_x`, and `sdf_params_dx` respectively.
+// must be included _below_ the definitions of the ops, params and tile arrays,
+// which must be named `sdf_tree`, `sdf_params_x`, `sdf_params_dx` and `sdf_tiles`
+// respectively.
 
 struct SdfContext {
     x:   SdfDomain,
@@ -15,25 +16,142 @@ struct SdfContext {
 }
 
 // @id(1000) override STACK_SIZE: u32 = 16u; // (incorrectly) not supported in wgpu
+// the host substitutes the value of this to fit the tape; see `sdf_stack_size()`
 const STACK_SIZE: u32 = 16u;
+// the `SdfEvalMode` of the shader variant, also substituted by the host. below
+// `SdfEvalMode_Dual`, no tangents are loaded; in `SdfEvalMode_Value`, the ops which
+// only transform a gradient are skipped.
+const EVAL_MODE: u32 = 2u;
+// keep in sync with `SdfTape::MaxSlots`
+const SLOT_COUNT: u32 = 8u;
 
+// instancing (see sdf_instances.h for the layout of the parameters)
+const INSTANCE_PARAMS: u32 = 15u;
+// the walk holds at most one pending sibling per level of the hierarchy
+// (see sdf_bvh.h for the layout of the nodes)
+const INSTANCE_WALK_SIZE: u32 = 32u;
+// no operand of a culled union is being evaluated
+const SDF_NO_OPERAND: u32 = 0xffffffffu;
+// larger than any distance
+const SDF_FAR: f32 = 3.0e38;
+
+struct SdfInstanceWalk {
+    // (node, first instance, end instance)
+    todo: array<vec3u, INSTANCE_WALK_SIZE>,
+    size: u32,
+}
+
+fn sdf_load_instance(offs: ParamOffset, k: u32) -> RigidTransformD {
+    return load_transformd(ParamOffset(offs.x_offset + 4u + 7u * k, offs.dx_offset + 4u + 7u * k));
+}
+
+// find the next leaf of the hierarchy whose nodes start at `sdf_params_x[nodes]` which
+// may be nearer to `p` than `best`, or -1 if there are none left. nodes are visited
+// nearest-first.
+fn sdf_next_instance(
+    walk:  ptr<function, SdfInstanceWalk>,
+    nodes: u32,
+    p:     vec3f,
+    best:  f32) -> i32
+{
+    while (*walk).size > 0u {
+        (*walk).size -= 1u;
+        let v: vec3u = (*walk).todo[(*walk).size];
+        let k: u32 = nodes + 4u * v.x;
+        let c = vec3f(sdf_params_x[k], sdf_params_x[k + 1u], sdf_params_x[k + 2u]);
+        if length(p - c) - sdf_params_x[k + 3u] >= best {
+            continue;
+        }
+        if v.z - v.y == 1u {
+            return i32(v.y);
+        }
+        let mid: u32 = (v.y + v.z) / 2u;
+        var l = vec3u(v.x + 1u, v.y, mid);
+        var r = vec3u(v.x + 2u * (mid - v.y), mid, v.z);
+        let kl: u32 = nodes + 4u * l.x;
+        let kr: u32 = nodes + 4u * r.x;
+        let cl = vec3f(sdf_params_x[kl], sdf_params_x[kl + 1u], sdf_params_x[kl + 2u]);
+        let cr = vec3f(sdf_params_x[kr], sdf_params_x[kr + 1u], sdf_params_x[kr + 2u]);
+        if length(p - cl) - sdf_params_x[kl + 3u] < length(p - cr) - sdf_params_x[kr + 3u] {
+            // visit the nearer child first
+            let t = l;
+            l = r;
+            r = t;
+        }
+        (*walk).todo[(*walk).size]      = l;
+        (*walk).todo[(*walk).size + 1u] = r;
+        (*walk).size += 2u;
+    }
+    return -1;
+}
+
+// evaluate the full (unpruned) tape
 fn sdf_eval(
     offsets:   ParamOffset,
     sample_pt: SdfDomain) -> SdfContext
+{
+    let tile: SdfTile = sdf_tiles[0];
+    return sdf_eval_ops(tile.op_begin, tile.op_end, offsets, sample_pt);
+}
+
+// evaluate the tape in `sdf_tree[op_begin, op_end)`
+fn sdf_eval_ops(
+    op_begin:  u32,
+    op_end:    u32,
+    offsets:   ParamOffset,
+    sample_pt: SdfDomain) -> SdfContext
 {
     var p_stack:   array<SdfDomain, STACK_SIZE>;
     var f_p_stack: array<SdfRange,  STACK_SIZE>;
+    var slots:     array<SdfRange,  SLOT_COUNT>;
     var p_size:    u32 = 1;
     var f_p_size:  u32 = 0;
+    // the walk over the instances of an `Instances` op (which can't be nested)
+    var walk:      SdfInstanceWalk;
+    var inst_k:    u32 = 0;
+    var inst_best: SdfRange;
+    // the walk over the operands of a `BvhUnion` op (which can't be nested either)
+    var bvh_walk:  SdfInstanceWalk;
+    var bvh_op:    u32 = 0;
+    var bvh_nodes: u32 = 0;
+    var bvh_end:   u32 = SDF_NO_OPERAND; // end of the operand being evaluated
+    var bvh_value: bool = false;         // whether that operand pushed a value
+    var bvh_best:  SdfRange;
     p_stack[0] = sample_pt;
-    for (var i: u32 = 0; i < arrayLength(&sdf_tree); i++) {
+    for (var i: u32 = op_begin; i <= op_end; i++) {
+        // at the end of an operand of a culled union, take the minimum and jump
+        // to the next operand that may be nearer, or past the union
+        while i == bvh_end {
+            if bvh_value {
+                bvh_best  = sdf_union(bvh_best, f_p_stack[f_p_size - 1]);
+                f_p_size -= 1u;
+            }
+            let n: u32 = sdf_tree[bvh_op].variant;
+            let k: i32 = sdf_next_instance(&bvh_walk, bvh_nodes, p_stack[p_size - 1].p.x, bvh_best.f.x);
+            if k >= 0 {
+                // the table after the union holds the start of each operand
+                // (relative to the start of the tape), and then the end of the last
+                i         = op_begin + sdf_tree[bvh_op + 1u + u32(k)].variant;
+                bvh_end   = op_begin + sdf_tree[bvh_op + 2u + u32(k)].variant;
+                bvh_value = i < bvh_end;
+            } else {
+                f_p_stack[f_p_size] = bvh_best;
+                f_p_size += 1u;
+                i       = op_begin + sdf_tree[bvh_op + 1u + n].variant;
+                bvh_end = SDF_NO_OPERAND;
+            }
+        }
+        if i >= op_end {
+            break;
+        }
         var op = sdf_tree[i];
         var is_pop: bool = false;
+        var pushed_idx: u32 = 0u;
         if op.kind == OpEnum_PopDomain {
             p_size -= 1u;
-            // `variant` holds the pushed op's index in this case:
-            let pushed_idx: u32 = u32(op.variant);
-            op      = sdf_tree[pushed_idx];
+            // `variant` holds the pushed op's index (relative to the start of the tape)
+            pushed_idx = u32(op.variant);
+            op      = sdf_tree[op_begin + pushed_idx];
             is_pop  = true;
         }
         let offs = ParamOffset(
@@ -64,26 +182,130 @@ fn sdf_eval(
                 f_p_stack[f_p_size - 2] = sdf_subtract(f_a, f_b);
                 f_p_size -= 1u;
             }
+            case OpEnum_Xor: {
+                let f_a: SdfRange = f_p_stack[f_p_size - 2];
+                let f_b: SdfRange = f_p_stack[f_p_size - 1];
+                f_p_stack[f_p_size - 2] = sdf_xor(f_a, f_b);
+                f_p_size -= 1u;
+            }
+            // value slots
+            case OpEnum_Store: {
+                // `variant` holds the slot index
+                slots[u32(op.variant)] = f_p_stack[f_p_size - 1];
+            }
+            case OpEnum_Load: {
+                f_p_stack[f_p_size] = slots[u32(op.variant)];
+                f_p_size += 1u;
+            }
             case OpEnum_Transform: {
-                let xf: RigidTransformD = load_transformd(offs);
                 if is_pop {
                     // transform the normal
                     // nb: the normal is transformed by the inverse transpose
                     // of the rotation part; but since the rotation is orthogonal,
                     // the inverse transpose is the same as the original matrix
-                    let f_p = f_p_stack[f_p_size - 1];
-                    let n   = dqv_mul(xf.q, f_p.grad_f);
-                    f_p_stack[f_p_size - 1].grad_f = n;
+                    if EVAL_MODE != SdfEvalMode_Value {
+                        let xf: RigidTransformD = load_transformd(offs);
+                        let f_p = f_p_stack[f_p_size - 1];
+                        let n   = dqv_mul(xf.q, f_p.grad_f);
+                        f_p_stack[f_p_size - 1].grad_f = n;
+                    }
                 } else {
                     // inverse transform the domain
-                    p_stack[p_size] = sdf_transform(xf, p);
+                    p_stack[p_size] = sdf_transform(load_transformd(offs), p);
+                    p_size += 1u;
+                }
+            }
+            case OpEnum_Repeat: {
+                // a translation, so the gradient is unchanged on pop
+                if !is_pop {
+                    let period: DualV3 = load_vecd(offs);
+                    let lo: vec3f = load_vecf(ParamOffset(offs.x_offset + 3, offs.dx_offset + 3));
+                    let hi: vec3f = load_vecf(ParamOffset(offs.x_offset + 6, offs.dx_offset + 6));
+                    p_stack[p_size] = sdf_repeat(period, lo, hi, p);
                     p_size += 1u;
                 }
             }
+            case OpEnum_Mirror: {
+                let plane: PlaneD = load_planed(offs);
+                if is_pop {
+                    // `p` is the outer domain again
+                    if EVAL_MODE != SdfEvalMode_Value {
+                        f_p_stack[f_p_size - 1] = sdf_unmirror(plane, p, f_p_stack[f_p_size - 1]);
+                    }
+                } else {
+                    p_stack[p_size] = sdf_mirror(plane, p);
+                    p_size += 1u;
+                }
+            }
+            case OpEnum_RotSym: {
+                // the count is not differentiable
+                let count: f32 = sdf_params_x[offs.x_offset];
+                if is_pop {
+                    if EVAL_MODE != SdfEvalMode_Value {
+                        f_p_stack[f_p_size - 1] = sdf_unrotsym(count, op.variant, p, f_p_stack[f_p_size - 1]);
+                    }
+                } else {
+                    p_stack[p_size] = sdf_rotsym(count, op.variant, p);
+                    p_size += 1u;
+                }
+            }
+            case OpEnum_Instances: {
+                // the child ops are run once per instance visited: each pop jumps back
+                // to the start of the child, until the walk is done
+                let n: u32 = (op.parameter_end - op.parameter_begin) / INSTANCE_PARAMS;
+                if is_pop {
+                    // `p` is the outer domain again
+                    var f: SdfRange = f_p_stack[f_p_size - 1];
+                    if EVAL_MODE != SdfEvalMode_Value {
+                        let xf: RigidTransformD = sdf_load_instance(offs, inst_k);
+                        f.grad_f = dqv_mul(xf.q, f.grad_f);
+                    }
+                    inst_best = sdf_union(inst_best, f);
+                    let k: i32 = sdf_next_instance(&walk, offs.x_offset + 4u + 7u * n, p.p.x, inst_best.f.x);
+                    if k >= 0 {
+                        inst_k = u32(k);
+                        p_stack[p_size] = sdf_transform(sdf_load_instance(offs, inst_k), p);
+                        p_size   += 1u;
+                        f_p_size -= 1u;
+                        i = op_begin + pushed_idx;
+                    } else {
+                        f_p_stack[f_p_size - 1] = inst_best;
+                    }
+                } else {
+                    walk.size    = 1u;
+                    walk.todo[0] = vec3u(0u, 0u, n);
+                    inst_best    = SdfRange(
+                        Dual(SDF_FAR, 0.),
+                        DualV3(vec3f(0.), vec3f(0.)),
+                    );
+                    // (there is at least one instance, and nothing is nearer than SDF_FAR)
+                    inst_k = u32(sdf_next_instance(&walk, offs.x_offset + 4u + 7u * n, p.p.x, SDF_FAR));
+                    p_stack[p_size] = sdf_transform(sdf_load_instance(offs, inst_k), p);
+                    p_size += 1u;
+                }
+            }
+            case OpEnum_BvhUnion: {
+                // start the walk; the check at the top of the loop (at the next op, as if
+                // an empty operand had just ended) finds the first operand to evaluate
+                bvh_op    = i;
+                bvh_nodes = offs.x_offset;
+                bvh_walk.size    = 1u;
+                bvh_walk.todo[0] = vec3u(0u, 0u, op.variant);
+                bvh_best  = SdfRange(
+                    Dual(SDF_FAR, 0.),
+                    DualV3(vec3f(0.), vec3f(0.)),
+                );
+                bvh_end   = i + 1u;
+                bvh_value = false;
+            }
             case OpEnum_Dilate: {
                 let r: Dual = load_scalard(offs);
                 f_p_stack[f_p_size - 1] = sdf_dilate(f_p_stack[f_p_size - 1], r);
             }
+            case OpEnum_Shell: {
+                let r: Dual = load_scalard(offs);
+                f_p_stack[f_p_size - 1] = sdf_shell(f_p_stack[f_p_size - 1], r);
+            }
             // shapes
             case OpEnum_Sphere: {
                 let sphere = load_sphered(offs);
@@ -1,24 +1,43 @@
 // sdf_eval_main.wgsl
 // #include "sdf_structs.wgsl"
+// #include "sdf_samples.wgsl"
+// #include "sdf_packing.wgsl"
 
 struct WorkRange {
     n_samples:    u32,
     n_variations: u32,
+    use_tiles:    u32,
+    // whether the samples are sorted; see `SdfInput`
+    sorted:       u32,
+    // whether each variation is a distinct expression of a batch, whose tape is
+    // the tile of the same index; see `SdfGpuExprBatch`
+    batched:      u32,
+    // words per sample of the output records, if not `SdfOutputLayout_Separate`
+    out_stride:   u32,
 }
 
+// the `SdfOutputLayout` of the shader variant, substituted by the host
+const OUTPUT_LAYOUT: u32 = 0u;
+
 const wg_size: vec3u = vec3u(8,8,1);
 
 // expression
 @group(0) @binding(0) var<storage,read> sdf_tree:      array<SdfOp>;
 @group(0) @binding(1) var<storage,read> sdf_params_x:  array<f32>;
 @group(0) @binding(2) var<storage,read> sdf_params_dx: array<f32>;
+@group(0) @binding(3) var<storage,read> sdf_tile_grid: SdfTileGrid;
+@group(0) @binding(4) var<storage,read> sdf_tiles:     array<SdfTile>;
 
 // samples
 @group(1) @binding(0) var<storage,read> sdf_pts_x:     array<vec3f>;
 @group(1) @binding(1) var<storage,read> sdf_pts_dx:    array<vec3f>;
+@group(1) @binding(2) var<storage,read> sdf_pts_order: array<u32>;
+// (if procedural, the samples are generated from this, and the arrays are unused)
+@group(1) @binding(3) var<uniform>      sdf_pts_set:   SdfSampleSet;
 
-// output
-@group(2) @binding(0) var<storage,read_write> sdf_out_sdf_x:     array<f32>;
+// output. binding 0 holds the bits of the distances, or the records of the packed
+// layouts (which need no more bindings than that)
+@group(2) @binding(0) var<storage,read_write> sdf_out_words:     array<u32>;
 @group(2) @binding(1) var<storage,read_write> sdf_out_sdf_dx:    array<f32>;
 @group(2) @binding(2) var<storage,read_write> sdf_out_normals:   array<vec3f>;
 @group(2) @binding(3) var<storage,read_write> sdf_out_d_normals: array<vec3f>;
@@ -43,7 +62,7 @@ fn main(
         @builtin(global_invocation_id)   global_id:    vec3u)
 {
     // x-axis: sample point variation
-    // y-axis: parameter variation
+    // y-axis: parameter variation (or expression of a batch)
     if global_id.x >= work_range.n_samples    { return; }
     if global_id.y >= work_range.n_variations { return; }
     let param_index: ParamOffset = param_offsets[global_id.y];
@@ -51,16 +70,27 @@ fn main(
     pt_index.x_offset  += global_id.x;
     pt_index.dx_offset += global_id.x;
     
-    let p: DualV3 = DualV3(
-        sdf_pts_x [pt_index.x_offset],
-        sdf_pts_dx[pt_index.dx_offset],
-    );
+    // (the sample tangents are only read by `SdfEvalMode_Dual`)
+    var p: DualV3;
+    if sdf_pts_set.kind != SdfSampleKind_Explicit {
+        p = DualV3(sdf_sample_point(sdf_pts_set, pt_index.x_offset), sdf_pts_set.dx);
+    } else {
+        p = DualV3(sdf_pts_x[pt_index.x_offset], vec3f(0.));
+        if EVAL_MODE == SdfEvalMode_Dual {
+            p.dx = sdf_pts_dx[pt_index.dx_offset];
+        }
+    }
     
-    let x: SdfDomain = SdfDomain(
-        p,
-        dm3_identity(),
-    );
-    let result: SdfContext = sdf_eval(param_index, x);
+    let x: SdfDomain = SdfDomain(p);
+    // run the tape pruned for the sample's tile, if there is one
+    var tile_index: u32 = 0u;
+    if work_range.batched != 0u {
+        tile_index = global_id.y;
+    } else if work_range.use_tiles != 0u {
+        tile_index = sdf_tile_index(sdf_tile_grid, p.x);
+    }
+    let tile: SdfTile = sdf_tiles[tile_index];
+    let result: SdfContext = sdf_eval_ops(tile.op_begin, tile.op_end, param_index, x);
     
     // let result = SdfContext(
     //     x,
@@ -76,17 +106,50 @@ fn main(
     //     )
     // );
     
-    // compute the final index
-    let threads_per_workgroup: u32 = wg_size.x * wg_size.y * wg_size.z;
-    let workgroup_index: u32 = workgroup_id.x
-        + workgroup_id.y * wg_size.x
-        + workgroup_id.z * wg_size.x * wg_size.y;
-    let out_index: u32 = workgroup_index * threads_per_workgroup + local_index;
+    // compute the final index. outputs are laid out variation-major:
+    // all the samples for variation 0, then all the samples for variation 1, etc.
+    // sorted samples are written back to their original index.
+    var sample_index: u32 = global_id.x;
+    if work_range.sorted != 0u {
+        sample_index = sdf_pts_order[global_id.x];
+    }
+    let out_index: u32 = global_id.y * work_range.n_samples + sample_index;
     
-    // write the output
+    // write the outputs of the mode (the others are not bound at full size)
     let sdf: SdfRange = result.f_x;
-    sdf_out_sdf_x[out_index]   = sdf.f.x;
-    sdf_out_sdf_dx[out_index]  = sdf.f.dx;
-    sdf_out_normals[out_index] = sdf.grad_f.x;
-    sdf_out_normals[out_index] = sdf.grad_f.dx;
+    if OUTPUT_LAYOUT == SdfOutputLayout_Packed {
+        let k: u32 = out_index * work_range.out_stride;
+        let f_dx: f32 = select(0., sdf.f.dx, EVAL_MODE == SdfEvalMode_Dual);
+        sdf_out_words[k] = pack2x16float(vec2f(sdf.f.x, f_dx));
+        if EVAL_MODE != SdfEvalMode_Value {
+            let n: u32 = sdf_pack_normal(sdf.grad_f.x);
+            sdf_out_words[k + 1u] = n;
+            if EVAL_MODE == SdfEvalMode_Dual {
+                sdf_out_words[k + 2u] = sdf_pack_normal_tangent(sdf.grad_f.x, sdf.grad_f.dx, n);
+            }
+        }
+    } else if OUTPUT_LAYOUT == SdfOutputLayout_Interleaved {
+        let k: u32 = out_index * work_range.out_stride;
+        sdf_out_words[k] = bitcast<u32>(sdf.f.x);
+        if EVAL_MODE != SdfEvalMode_Value {
+            sdf_out_words[k + 1u] = bitcast<u32>(sdf.grad_f.x.x);
+            sdf_out_words[k + 2u] = bitcast<u32>(sdf.grad_f.x.y);
+            sdf_out_words[k + 3u] = bitcast<u32>(sdf.grad_f.x.z);
+        }
+        if EVAL_MODE == SdfEvalMode_Dual {
+            sdf_out_words[k + 4u] = bitcast<u32>(sdf.f.dx);
+            sdf_out_words[k + 5u] = bitcast<u32>(sdf.grad_f.dx.x);
+            sdf_out_words[k + 6u] = bitcast<u32>(sdf.grad_f.dx.y);
+            sdf_out_words[k + 7u] = bitcast<u32>(sdf.grad_f.dx.z);
+        }
+    } else {
+        sdf_out_words[out_index] = bitcast<u32>(sdf.f.x);
+        if EVAL_MODE != SdfEvalMode_Value {
+            sdf_out_normals[out_index] = sdf.grad_f.x;
+        }
+        if EVAL_MODE == SdfEvalMode_Dual {
+            sdf_out_sdf_dx[out_index]    = sdf.f.dx;
+            sdf_out_d_normals[out_index] = sdf.grad_f.dx;
+        }
+    }
 }
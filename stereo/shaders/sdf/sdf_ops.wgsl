@@ -27,11 +27,13 @@ fn sdf_subtract(f_a: SdfRange, f_b: SdfRange) -> SdfRange {
     );
 }
 
-/*
 fn sdf_xor(f_a: SdfRange, f_b: SdfRange) -> SdfRange {
-    // xxx todo
+    // (A ∪ B) - (A ∩ B)
+    return sdf_subtract(
+        sdf_union(f_a, f_b),
+        sdf_intersection(f_a, f_b),
+    );
 }
-*/
 
 fn sdf_dilate(f: SdfRange, r: Dual) -> SdfRange {
     return SdfRange(
@@ -40,10 +42,108 @@ fn sdf_dilate(f: SdfRange, r: Dual) -> SdfRange {
     );
 }
 
+fn sdf_shell(f: SdfRange, r: Dual) -> SdfRange {
+    // |f| - r; the gradient flips on the inside
+    return SdfRange(
+        d_sub(d_abs(f.f), r),
+        dv3_select(f.grad_f, dv3_neg(f.grad_f), f.f.x < 0.),
+    );
+}
+
 fn sdf_transform(xf: RigidTransformD, p: SdfDomain) -> SdfDomain {
     let xf_inv: RigidTransformD = dtx_inverse(xf);
-    return SdfDomain(
-        dtxv_apply(xf_inv, p.p),
-        dm3_dot(dq_mat(xf_inv.q), p.J),
+    return SdfDomain(dtxv_apply(xf_inv, p.p));
+}
+
+// domain folds
+
+const SDF_TAU: f32 = 6.2831853071795864769;
+
+// fold the domain into the nearest cell `k` of a grid with spacing `period`,
+// with `k` clamped to [lo, hi]. an axis whose period is not positive is not repeated.
+fn sdf_repeat(period: DualV3, lo: vec3f, hi: vec3f, p: SdfDomain) -> SdfDomain {
+    let c: vec3f = period.x;
+    let k: vec3f = select(clamp(round(p.p.x / c), lo, hi), vec3f(0.), c <= vec3f(0.));
+    return SdfDomain(DualV3(p.p.x - k * c, p.p.dx - k * period.dx));
+}
+
+// reflect the negative side of `plane` onto the positive side
+fn sdf_mirror(plane: PlaneD, p: SdfDomain) -> SdfDomain {
+    let s: Dual = d_add(dv3_dot(p.p, plane.n), plane.d);
+    if s.x >= 0. {
+        return p;
+    }
+    return SdfDomain(dv3_sub(p.p, dv3_dscale(d_fscale(2., s), plane.n)));
+}
+
+// transform the gradient of a mirrored sub-expr back to the outer domain `p`
+fn sdf_unmirror(plane: PlaneD, p: SdfDomain, f: SdfRange) -> SdfRange {
+    // a reflection is its own inverse transpose
+    let s:   f32  = dot(p.p.x, plane.n.x) + plane.d.x;
+    let g_n: Dual = dv3_dot(f.grad_f, plane.n);
+    return SdfRange(
+        f.f,
+        dv3_select(
+            f.grad_f,
+            dv3_sub(f.grad_f, dv3_dscale(d_fscale(2., g_n), plane.n)),
+            s < 0.,
+        ),
+    );
+}
+
+// rotation by `angle` about one of the coordinate axes
+fn sdf_axis_rotation(axis: OpVariant, angle: f32) -> mat3x3f {
+    let c: f32 = cos(angle);
+    let s: f32 = sin(angle);
+    switch axis {
+        case OpVariant_X_Axis: {
+            return mat3x3f(
+                1., 0., 0.,
+                0.,  c,  s,
+                0., -s,  c,
+            );
+        }
+        case OpVariant_Y_Axis: {
+            return mat3x3f(
+                 c, 0., -s,
+                0., 1., 0.,
+                 s, 0.,  c,
+            );
+        }
+        default: {
+            return mat3x3f(
+                 c,  s, 0.,
+                -s,  c, 0.,
+                0., 0., 1.,
+            );
+        }
+    }
+}
+
+// the angle of the sector, of `count` around `axis`, which contains `p`
+fn sdf_rotsym_angle(p: vec3f, count: f32, axis: OpVariant) -> f32 {
+    var uv: vec2f;
+    switch axis {
+        case OpVariant_X_Axis: { uv = p.yz; }
+        case OpVariant_Y_Axis: { uv = p.zx; }
+        default:               { uv = p.xy; }
+    }
+    let w: f32 = SDF_TAU / max(round(count), 1.);
+    return round(atan2(uv.y, uv.x) / w) * w;
+}
+
+// rotate the domain about `axis` into the sector of `count` centered on the +u axis
+fn sdf_rotsym(count: f32, axis: OpVariant, p: SdfDomain) -> SdfDomain {
+    let r: mat3x3f = sdf_axis_rotation(axis, -sdf_rotsym_angle(p.p.x, count, axis));
+    return SdfDomain(DualV3(r * p.p.x, r * p.p.dx));
+}
+
+// transform the gradient of a sub-expr under rotational symmetry back to the
+// outer domain `p`
+fn sdf_unrotsym(count: f32, axis: OpVariant, p: SdfDomain, f: SdfRange) -> SdfRange {
+    let r: mat3x3f = sdf_axis_rotation(axis, sdf_rotsym_angle(p.p.x, count, axis));
+    return SdfRange(
+        f.f,
+        DualV3(r * f.grad_f.x, r * f.grad_f.dx),
     );
 }
@@ -0,0 +1,60 @@
+// sdf_packing.wgsl
+// compact layouts of the evaluation outputs; see sdf_packing.h
+
+const SdfOutputLayout_Separate:    u32 = 0;
+const SdfOutputLayout_Packed:      u32 = 1;
+const SdfOutputLayout_Interleaved: u32 = 2;
+
+// sign, which is positive at zero
+fn sdf_sign_nz(v: vec2f) -> vec2f {
+    return select(vec2f(-1.), vec2f(1.), v >= vec2f(0.));
+}
+
+// keep in sync with `sdf_oct_encode()`
+fn sdf_oct_encode(n: vec3f) -> vec2f {
+    let s: f32 = abs(n.x) + abs(n.y) + abs(n.z);
+    if s == 0. { return vec2f(0.); }
+    let p: vec2f = n.xy / s;
+    if n.z < 0. {
+        // fold the lower hemisphere over the diagonals
+        return (vec2f(1.) - abs(p.yx)) * sdf_sign_nz(p);
+    }
+    return p;
+}
+
+// keep in sync with `sdf_oct_decode()`
+fn sdf_oct_decode(p: vec2f) -> vec3f {
+    var v = vec3f(p, 1. - abs(p.x) - abs(p.y));
+    let t: f32 = max(-v.z, 0.);
+    v.x += select(t, -t, v.x >= 0.);
+    v.y += select(t, -t, v.y >= 0.);
+    return normalize(v);
+}
+
+// an orthonormal basis of the plane orthogonal to the unit vector `n` [Duff et al. 2017];
+// keep in sync with `sdf_tangent_frame()`
+fn sdf_tangent_frame(n: vec3f) -> mat2x3f {
+    let s: f32 = select(-1., 1., n.z >= 0.);
+    let a: f32 = -1. / (s + n.z);
+    let c: f32 = n.x * n.y * a;
+    return mat2x3f(
+        vec3f(1. + s * n.x * n.x * a, s * c, -s * n.x),
+        vec3f(c, s + n.y * n.y * a, -n.y),
+    );
+}
+
+// the direction of the gradient `g`
+fn sdf_pack_normal(g: vec3f) -> u32 {
+    return pack2x16snorm(sdf_oct_encode(g));
+}
+
+// the tangent of the normalized gradient, in the frame of the packed normal `n`
+// as the host will decode it; keep in sync with `sdf_pack_normal_tangent()`
+fn sdf_pack_normal_tangent(g: vec3f, g_dx: vec3f, n: u32) -> u32 {
+    let m: f32 = length(g);
+    if m == 0. { return 0u; }
+    let g_hat: vec3f = g / m;
+    let d_hat: vec3f = (g_dx - g_hat * dot(g_hat, g_dx)) / m;
+    let frame: mat2x3f = sdf_tangent_frame(sdf_oct_decode(unpack2x16snorm(n)));
+    return pack2x16float(vec2f(dot(d_hat, frame[0]), dot(d_hat, frame[1])));
+}
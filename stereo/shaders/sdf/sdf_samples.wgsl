@@ -0,0 +1,53 @@
+// sdf_samples.wgsl
+// procedural sample sets; see sdf_samples.h
+
+const SdfSampleKind_Explicit: u32 = 0;
+const SdfSampleKind_Grid:     u32 = 1;
+const SdfSampleKind_Jittered: u32 = 2;
+const SdfSampleKind_Rays:     u32 = 3;
+
+struct SdfSampleSet {
+    origin: vec3f,
+    kind:   u32,
+    axis_u: vec3f,
+    n_u:    u32,
+    axis_v: vec3f,
+    n_v:    u32,
+    axis_w: vec3f,
+    n_w:    u32,
+    dx:     vec3f,
+    seed:   u32,
+    eye:    vec3f,
+    t0:     f32,
+    dt:     f32,
+}
+
+// the PCG hash [Jarzynski and Olano 2020]; keep in sync with `sdf_hash()`
+fn sdf_hash(v: u32) -> u32 {
+    let state: u32 = v * 747796405u + 2891336453u;
+    let word:  u32 = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// sample `i` of a procedural set; keep in sync with `SdfSampleSet::point()`
+fn sdf_sample_point(s: SdfSampleSet, i: u32) -> vec3f {
+    let cell = vec3f(vec3u(i % s.n_u, (i / s.n_u) % s.n_v, i / (s.n_u * s.n_v)));
+    switch s.kind {
+        case SdfSampleKind_Jittered: {
+            // three successive hashes of the index, as fractions of a cell
+            let h_u: u32 = sdf_hash(i ^ sdf_hash(s.seed));
+            let h_v: u32 = sdf_hash(h_u);
+            let h_w: u32 = sdf_hash(h_v);
+            let t = cell + vec3f(vec3u(h_u, h_v, h_w) >> vec3u(8u)) * (1. / 16777216.);
+            return s.origin + s.axis_u * t.x + s.axis_v * t.y + s.axis_w * t.z;
+        }
+        case SdfSampleKind_Rays: {
+            let d: vec3f = s.origin + s.axis_u * (cell.x + 0.5) + s.axis_v * (cell.y + 0.5) - s.eye;
+            return s.eye + d * ((s.t0 + cell.z * s.dt) / length(d));
+        }
+        default: {
+            let t = cell + vec3f(0.5);
+            return s.origin + s.axis_u * t.x + s.axis_v * t.y + s.axis_w * t.z;
+        }
+    }
+}
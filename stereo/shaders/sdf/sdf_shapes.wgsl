@@ -3,20 +3,37 @@
 fn sdf_sphere(sphere: SphereD, d: SdfDomain) -> SdfRange {
     let r: DualV3 = dv3_sub(d.p, sphere.center);
     let f: Dual   = d_sub(dv3_length(r), sphere.radius);
-    let n: DualV3 = dv3_divd(r, f);
+    let n: DualV3 = dv3_normalize(r);
     return SdfRange(f, n);
 }
 
 fn sdf_box(box: BoxD, x: SdfDomain) -> SdfRange {
-    // todo: normal calculation is degenerate on the surface
-    let d_lo: vec3f = x.p.x - box.lo.x; // distance from lo extreme to p
-    let d_hi: vec3f = x.p.x - box.hi.x; // ...
-    let surface_pt: DualV3 = dv3_selectv(box.lo, box.hi, abs(d_lo) < abs(d_hi));
-    let v: DualV3 = dv3_sub(x.p, surface_pt); // vector from the surface to p
-    let d: Dual = dv3_length(v);
-    let inside: bool = all(d_lo > vec3f(0)) && all(d_hi < vec3f(0));
-    let f: Dual = d_select(d, d_neg(d), inside);
-    return SdfRange(f, dv3_divd(v, d));
+    let below: vec3<bool> = x.p.x < box.lo.x;
+    let above: vec3<bool> = x.p.x > box.hi.x;
+    if any(below) || any(above) {
+        // outside: distance to the nearest point on the box
+        let c: DualV3 = dv3_selectv(dv3_selectv(x.p, box.lo, below), box.hi, above);
+        let v: DualV3 = dv3_sub(x.p, c); // vector from the surface to p
+        let d: Dual   = dv3_length(v);
+        return SdfRange(d, dv3_divd(v, d));
+    }
+    // inside: (negative) distance to the nearest face
+    let d_lo: DualV3 = dv3_sub(box.lo, x.p);
+    let d_hi: DualV3 = dv3_sub(x.p, box.hi);
+    let to_hi: vec3<bool> = d_hi.x > d_lo.x;
+    let q: DualV3 = dv3_selectv(d_lo, d_hi, to_hi);
+    let s: vec3f  = select(vec3f(-1.), vec3f(1.), to_hi);
+    var f: Dual   = Dual(q.x.x, q.dx.x);
+    var n: vec3f  = vec3f(s.x, 0., 0.);
+    if q.x.y > f.x {
+        f = Dual(q.x.y, q.dx.y);
+        n = vec3f(0., s.y, 0.);
+    }
+    if q.x.z > f.x {
+        f = Dual(q.x.z, q.dx.z);
+        n = vec3f(0., 0., s.z);
+    }
+    return SdfRange(f, DualV3(n, vec3f(0.)));
 }
 
 fn sdf_cylinder(cylinder: CylinderD, x: SdfDomain) -> SdfRange {
@@ -39,10 +56,14 @@ fn sdf_cylinder(cylinder: CylinderD, x: SdfDomain) -> SdfRange {
     // radial vector 
     let r_vec: DualV3 = dv3_sub(dv3_sub(x.p, cylinder.p0), dv3_dscale(s, a));
     let r_hat: DualV3 = dv3_divd(r_vec, r_dist);
-    // sdf is negative (inside shape) iff (s, r) both negative:
-    let sign: f32 = select(1., -1., s.x < 0 && r.x < 0);
+    let a_len: Dual   = d_sqrt(a2);
+    let a_hat: DualV3 = dv3_divd(a, a_len);
+    // sdf is negative (inside shape) iff (t, r) both negative:
+    let inside: bool = t.x < 0 && r.x < 0;
     let zero: Dual = Dual(0., 0.);
     let one:  Dual = Dual(1., 0.);
+    // inside, the distance is to the nearer of the wall and the cap:
+    let d_in: Dual = d_max(r, d_mul(t, a_len));
     // clamped coordinates, to project orthogonally to wall/cap
     t = d_max(t, zero);
     r = d_max(r, zero);
@@ -50,7 +71,7 @@ fn sdf_cylinder(cylinder: CylinderD, x: SdfDomain) -> SdfRange {
     let y2: Dual = d_mul(d_mul(t, t), a2);
     // squared distance to surface point
     let z2: Dual = d_add(d_mul(r, r), y2);
-    let dist: Dual = d_sqrt(z2);
+    let dist: Dual = d_select(d_sqrt(z2), d_in, inside);
     
     // compute normal
     var n: DualV3;
@@ -60,12 +81,12 @@ fn sdf_cylinder(cylinder: CylinderD, x: SdfDomain) -> SdfRange {
         s = d_clamp(s, zero, one);
         if r_dist.x <= cylinder.radius.x {
             // projects to cap face
-            n = dv3_select(a, dv3_neg(a), s.x < 0.5);
+            n = dv3_select(a_hat, dv3_neg(a_hat), s.x < 0.5);
         } else {
             // projects to cap rim
             let surf_pt: DualV3 = dv3_add(
                 dv3_add(cylinder.p0, dv3_dscale(s, a)),
-                dv3_dscale(r_dist, r_hat)
+                dv3_dscale(cylinder.radius, r_hat)
             );
             let v: DualV3 = dv3_sub(x.p, surf_pt);
             n = dv3_divd(v, dist);
@@ -76,13 +97,13 @@ fn sdf_cylinder(cylinder: CylinderD, x: SdfDomain) -> SdfRange {
     {
         // p is interior and the cap is closer than the wall.
         // normal points along the axis, toward the cap
-        n = dv3_fscale(select(-1., 1., s.x < 0.5), a);
+        n = dv3_fscale(select(1., -1., s.x < 0.5), a_hat);
     } else {
         // p projects to the cylinder wall
         n = r_hat;
     }
     
-    return SdfRange(d_fscale(sign, dist), n);
+    return SdfRange(dist, n);
 }
 
 fn sdf_capsule(capsule: CapsuleD, x: SdfDomain) -> SdfRange {
@@ -132,18 +153,25 @@ fn sdf_triangle(triangle: TriD, x: SdfDomain) -> SdfRange {
     let b2: DualV3 = dv3_sub(x.p, triangle.p2);
     let n:  DualV3 = dv3_cross(v0, v2); // tri normal
     
+    // p projects to the interior of the face iff it is on the inner side of all three edges
     let inside: bool = 
             sign(dot(cross(v0.x, n.x), b0.x)) +
             sign(dot(cross(v1.x, n.x), b1.x)) +
-            sign(dot(cross(v2.x, n.x), b2.x)) < 2.0;
+            sign(dot(cross(v2.x, n.x), b2.x)) >= 2.0;
     var d: Dual;
     var normal: DualV3;
     if inside {
+        // projection inside the triangle face
+        let n_hat: DualV3 = dv3_normalize(n);
+        let h: Dual = dv3_dot(n_hat, b0); // signed height above the plane
+        d = d_abs(h);
+        normal = dv3_select(dv3_neg(n_hat), n_hat, h.x > 0.);
+    } else {
         // outside the triangle
-        // find the projected point on each edge
-        let v_e0: DualV3 = dv3_sub(dv3_project_to_segment(b0, v0), b0);
-        let v_e1: DualV3 = dv3_sub(dv3_project_to_segment(b1, v1), b1);
-        let v_e2: DualV3 = dv3_sub(dv3_project_to_segment(b2, v2), b2);
+        // find the vector from the projected point on each edge to p
+        let v_e0: DualV3 = dv3_sub(b0, dv3_project_to_segment(b0, v0));
+        let v_e1: DualV3 = dv3_sub(b1, dv3_project_to_segment(b1, v1));
+        let v_e2: DualV3 = dv3_sub(b2, dv3_project_to_segment(b2, v2));
         // distance to each edge
         let d0: Dual = dv3_length(v_e0);
         let d1: Dual = dv3_length(v_e1);
@@ -159,12 +187,7 @@ fn sdf_triangle(triangle: TriD, x: SdfDomain) -> SdfRange {
             d      = d2;
             normal = v_e2;
         }
-        normal = dv3_divd(normal, d_sqrt(d));
-    } else {
-        // projection inside the triangle face
-        let x: Dual = dv3_dot(n, b0);
-        d = d_div(d_mul(x, x), dv3_length2(n));
-        normal = dv3_select(dv3_neg(n), n, dot(n.x, b0.x) > 0.);
+        normal = dv3_divd(normal, d);
     }
     return SdfRange(d, normal);
 }
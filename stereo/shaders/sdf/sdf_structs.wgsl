@@ -17,20 +17,27 @@ const OpEnum_PopDomain:   OpEnum =  0; // ✓
 const OpEnum_Union:       OpEnum =  1; // ✓
 const OpEnum_Intersect:   OpEnum =  2; // ✓
 const OpEnum_Subtract:    OpEnum =  3; // ✓
-const OpEnum_Xor:         OpEnum =  4;
-const OpEnum_Shell:       OpEnum =  5;
+const OpEnum_Xor:         OpEnum =  4; // ✓
+const OpEnum_Shell:       OpEnum =  5; // ✓
 const OpEnum_Dilate:      OpEnum =  6; // ✓
 // domain operations:
 const OpEnum_Transform:   OpEnum =  7; // ✓
 const OpEnum_Revolve:     OpEnum =  8;
-const OpEnum_Repeat:      OpEnum =  9;
-const OpEnum_Mirror:      OpEnum = 10;
-const OpEnum_RotSym:      OpEnum = 11;
+const OpEnum_Repeat:      OpEnum =  9; // ✓
+const OpEnum_Mirror:      OpEnum = 10; // ✓
+const OpEnum_RotSym:      OpEnum = 11; // ✓
 const OpEnum_Extrude:     OpEnum = 12;
 const OpEnum_Envelope:    OpEnum = 13;
 const OpEnum_Elongate:    OpEnum = 14;
 const OpEnum_CurveSweep:  OpEnum = 15;
 const OpEnum_Helix:       OpEnum = 16;
+const OpEnum_Instances:   OpEnum = 17; // ✓
+// value slots:
+const OpEnum_Store:       OpEnum = 50; // ✓
+const OpEnum_Load:        OpEnum = 51; // ✓
+// culled unions:
+const OpEnum_BvhUnion:    OpEnum = 60; // ✓
+const OpEnum_BvhOperand:  OpEnum = 61; // ✓
 // shapes:
 const OpEnum_Sphere:      OpEnum = 100; // ✓
 const OpEnum_Box:         OpEnum = 101; // ✓
@@ -42,6 +49,13 @@ const OpEnum_Plane:       OpEnum = 106; // ✓
 const OpEnum_Triangle:    OpEnum = 107; // ✓
 const OpEnum_Curve:       OpEnum = 108;
 const Openum_ClosedCurve: OpEnum = 109;
+const OpEnum_Mesh:        OpEnum = 110; // (CPU only)
+const OpEnum_VoxelGrid:   OpEnum = 111; // (CPU only)
+
+// evaluation modes; keep in sync with `SdfEvalMode` in sdf_tape.h
+const SdfEvalMode_Value:    u32 = 0;
+const SdfEvalMode_Gradient: u32 = 1;
+const SdfEvalMode_Dual:     u32 = 2;
 
 const OpVariant_None      = 0;
 // envelope / sweep curve classes:
@@ -66,7 +80,6 @@ struct SdfOp {
 
 struct SdfDomain {
     p: DualV3,
-    J: DualM3,
 }
 
 struct SdfRange {
@@ -79,6 +92,33 @@ struct ParamOffset {
     dx_offset: Index,
 }
 
+// range of ops in `sdf_tree` making up one (pruned) tape
+struct SdfTile {
+    op_begin: Index,
+    op_end:   Index,
+}
+
+// a grid of tiles, each with its own pruned tape.
+// tile (x, y, z) is at index `1 + (z * n_y + y) * n_x + x` in the tile array;
+// index 0 is the full tape, for points outside the grid.
+struct SdfTileGrid {
+    lo:       vec3f,
+    n_x:      u32,
+    inv_cell: vec3f,
+    n_y:      u32,
+    hi:       vec3f,
+    n_z:      u32,
+}
+
+fn sdf_tile_index(grid: SdfTileGrid, p: vec3f) -> u32 {
+    let n = vec3u(grid.n_x, grid.n_y, grid.n_z);
+    if any(n == vec3u(0)) || any(p < grid.lo) || any(p > grid.hi) {
+        return 0u;
+    }
+    let c = min(vec3u((p - grid.lo) * grid.inv_cell), n - vec3u(1));
+    return 1u + (c.z * n.y + c.y) * n.x + c.x;
+}
+
 // shape structures:
 
 struct BoxD {
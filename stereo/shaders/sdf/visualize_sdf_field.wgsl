@@ -0,0 +1,53 @@
+// visualize_sdf_field.wgsl
+// #include "sdf_structs.wgsl"
+
+// evaluates the field of the SDF visualizer into a texture, over a list of dirty tiles;
+// see `VisualizeSdf`
+
+// keep in sync with `VisualizeSdf::TileSize`
+const TILE_SIZE: u32 = 128u;
+// half the width of the view, in world units. keep in sync with `VisualizeSdf::ViewExtent`
+const VIEW_EXTENT: f32 = 4.;
+
+const wg_size: vec3u = vec3u(16,16,1);
+
+// expression
+@group(0) @binding(0) var<storage,read> sdf_tree:      array<SdfOp>;
+@group(0) @binding(1) var<storage,read> sdf_params_x:  array<f32>;
+@group(0) @binding(2) var<storage,read> sdf_params_dx: array<f32>;
+@group(0) @binding(4) var<storage,read> sdf_tiles:     array<SdfTile>;
+
+// field
+@group(1) @binding(0) var                  field:       texture_storage_2d<rgba16float,write>;
+// the index of each tile to evaluate, row-major over the tiles of the field
+@group(1) @binding(1) var<storage,read>    dirty_tiles: array<u32>;
+
+// included here so it can see the expression buffers above:
+// #include "sdf_eval.wgsl"
+
+// the point of the plane z = 0 seen at the center of pixel `px` of the window
+fn view_point(px: vec2u, dims: vec2u) -> vec3f {
+    var uv = (vec2f(px) + vec2f(0.5)) / vec2f(dims);
+    // (pixel rows run downward)
+    uv.y = 1. - uv.y;
+    let st = (2. * uv - vec2f(1.)) * VIEW_EXTENT;
+    return vec3f(st, 0.);
+}
+
+@compute @workgroup_size(wg_size.x, wg_size.y, wg_size.z)
+fn main(
+        @builtin(workgroup_id)           workgroup_id: vec3u,
+        @builtin(local_invocation_id)    local_id:     vec3u)
+{
+    // x, y: the pixel within the tile; z: the dirty tile
+    let dims:    vec2u = textureDimensions(field);
+    let tiles_x: u32   = (dims.x + TILE_SIZE - 1u) / TILE_SIZE;
+    let tile:    u32   = dirty_tiles[workgroup_id.z];
+    let tile_px: vec2u = vec2u(tile % tiles_x, tile / tiles_x) * TILE_SIZE;
+    let px:      vec2u = tile_px + workgroup_id.xy * wg_size.xy + local_id.xy;
+    if px.x >= dims.x || px.y >= dims.y { return; }
+    
+    let x: SdfDomain = SdfDomain(DualV3(view_point(px, dims), vec3f(0.)));
+    let result: SdfContext = sdf_eval(ParamOffset(0, 0), x);
+    textureStore(field, px, vec4f(result.f_x.f.x, 0., 0., 1.));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace stereo {
+
+/// Number of worker threads to use for CPU-parallel work.
+inline size_t hardware_threads() {
+#if defined(__EMSCRIPTEN__)
+    return 1;
+#else
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+#endif
+}
+
+/**
+ * @brief Run `fn(begin, end, thread_index)` over the range `[0, n)` split into
+ * chunks of `grain` items, using up to `n_threads` threads.
+ *
+ * Chunks are handed out dynamically, so uneven per-item cost is balanced across threads.
+ * `thread_index` is in `[0, n_threads)` and is stable for the duration of one call;
+ * it may be used to index per-thread scratch buffers. The calling thread participates
+ * as thread 0. If `n_threads` is zero, all hardware threads are used.
+ *
+ * Returns the number of threads actually used.
+ */
+template <typename F>
+size_t parallel_for(size_t n, size_t grain, F&& fn, size_t n_threads=0) {
+    if (n == 0) return 0;
+    grain = std::max<size_t>(grain, 1);
+    size_t n_chunks = (n + grain - 1) / grain;
+    if (n_threads == 0) n_threads = hardware_threads();
+    n_threads = std::min(n_threads, n_chunks);
+
+    std::atomic<size_t> next_chunk = 0;
+    auto worker = [&](size_t thread_index) {
+        while (true) {
+            size_t chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= n_chunks) break;
+            size_t begin = chunk * grain;
+            size_t end   = std::min(n, begin + grain);
+            fn(begin, end, thread_index);
+        }
+    };
+
+    if (n_threads <= 1) {
+        worker(0);
+        return 1;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads - 1);
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    return n_threads;
+}
+
+} // namespace stereo
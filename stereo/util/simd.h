@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+
+// Fixed-width "lane" vectors, for writing structure-of-arrays math which the
+// compiler will vectorize (we build with `-march=native`, so these become AVX2 / AVX-512
+// ops where available, and plain scalar loops on targets without SIMD, e.g. wasm).
+//
+// Everything here is deliberately written as trivial fixed-trip-count loops
+// rather than intrinsics, so that the same code works on every backend.
+//
+// `select()` follows the WGSL argument order: `select(f, t, cond)` picks `t`
+// where `cond` is true. This makes it easy to compare CPU ports of shader code
+// side-by-side with the original.
+
+namespace stereo {
+namespace simd {
+
+template <typename T, size_t W>
+struct Lanes {
+    static constexpr size_t width = W;
+    using elem_t = T;
+
+    alignas(sizeof(T) * W) T v[W];
+
+    Lanes() = default;
+    Lanes(T s) {
+        for (size_t i = 0; i < W; ++i) v[i] = s;
+    }
+
+    static Lanes load(const T* src) {
+        Lanes out;
+        for (size_t i = 0; i < W; ++i) out.v[i] = src[i];
+        return out;
+    }
+
+    void store(T* dst) const {
+        for (size_t i = 0; i < W; ++i) dst[i] = v[i];
+    }
+
+          T& operator[](size_t i)       { return v[i]; }
+    const T& operator[](size_t i) const { return v[i]; }
+
+#define SIMD_LANES_ASSIGN_OP(op) \
+    Lanes& operator op##=(const Lanes& o) { \
+        for (size_t i = 0; i < W; ++i) v[i] op##= o.v[i]; \
+        return *this; \
+    } \
+    Lanes& operator op##=(T s) { \
+        for (size_t i = 0; i < W; ++i) v[i] op##= s; \
+        return *this; \
+    }
+
+    SIMD_LANES_ASSIGN_OP(+)
+    SIMD_LANES_ASSIGN_OP(-)
+    SIMD_LANES_ASSIGN_OP(*)
+    SIMD_LANES_ASSIGN_OP(/)
+
+#undef SIMD_LANES_ASSIGN_OP
+
+    Lanes operator-() const {
+        Lanes out;
+        for (size_t i = 0; i < W; ++i) out.v[i] = -v[i];
+        return out;
+    }
+};
+
+// masks hold 0 or 1 in an int of the same width as a float lane, so that selecting
+// with them compiles to a blend. (with `bool` lanes, gcc emits a branch per lane).
+template <size_t W>
+using Mask = Lanes<int32_t, W>;
+
+#define SIMD_LANES_BINOP(op) \
+    template <typename T, size_t W> \
+    inline Lanes<T,W> operator op(const Lanes<T,W>& a, const Lanes<T,W>& b) { \
+        Lanes<T,W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] op b.v[i]; \
+        return out; \
+    } \
+    template <typename T, size_t W> \
+    inline Lanes<T,W> operator op(const Lanes<T,W>& a, T b) { \
+        Lanes<T,W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] op b; \
+        return out; \
+    } \
+    template <typename T, size_t W> \
+    inline Lanes<T,W> operator op(T a, const Lanes<T,W>& b) { \
+        Lanes<T,W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a op b.v[i]; \
+        return out; \
+    }
+
+SIMD_LANES_BINOP(+)
+SIMD_LANES_BINOP(-)
+SIMD_LANES_BINOP(*)
+SIMD_LANES_BINOP(/)
+
+#undef SIMD_LANES_BINOP
+
+#define SIMD_LANES_CMP(op) \
+    template <typename T, size_t W> \
+    inline Mask<W> operator op(const Lanes<T,W>& a, const Lanes<T,W>& b) { \
+        Mask<W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] op b.v[i]; \
+        return out; \
+    } \
+    template <typename T, size_t W> \
+    inline Mask<W> operator op(const Lanes<T,W>& a, T b) { \
+        Mask<W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] op b; \
+        return out; \
+    } \
+    template <typename T, size_t W> \
+    inline Mask<W> operator op(T a, const Lanes<T,W>& b) { \
+        Mask<W> out; \
+        for (size_t i = 0; i < W; ++i) out.v[i] = a op b.v[i]; \
+        return out; \
+    }
+
+SIMD_LANES_CMP(<)
+SIMD_LANES_CMP(>)
+SIMD_LANES_CMP(<=)
+SIMD_LANES_CMP(>=)
+
+#undef SIMD_LANES_CMP
+
+// mask logic
+
+template <size_t W>
+inline Mask<W> operator&&(const Mask<W>& a, const Mask<W>& b) {
+    Mask<W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] & b.v[i];
+    return out;
+}
+
+template <size_t W>
+inline Mask<W> operator||(const Mask<W>& a, const Mask<W>& b) {
+    Mask<W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] | b.v[i];
+    return out;
+}
+
+template <size_t W>
+inline Mask<W> operator!(const Mask<W>& a) {
+    Mask<W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = a.v[i] ^ 1;
+    return out;
+}
+
+template <size_t W>
+inline bool any(const Mask<W>& m) {
+    int32_t b = 0;
+    for (size_t i = 0; i < W; ++i) b |= m.v[i];
+    return b != 0;
+}
+
+template <size_t W>
+inline bool all(const Mask<W>& m) {
+    int32_t b = 1;
+    for (size_t i = 0; i < W; ++i) b &= m.v[i];
+    return b != 0;
+}
+
+// scalar fallbacks, so generic code can also be instantiated on plain floats
+
+inline bool any(bool b) { return b; }
+inline bool all(bool b) { return b; }
+
+template <typename T>
+requires std::is_arithmetic_v<T>
+inline T select(T f, T t, bool cond) { return cond ? t : f; }
+
+template <typename T, size_t W>
+inline Lanes<T,W> select(const Lanes<T,W>& f, const Lanes<T,W>& t, const Mask<W>& cond) {
+    Lanes<T,W> out;
+    for (size_t i = 0; i < W; ++i) {
+        T a = f.v[i];
+        T b = t.v[i];
+        out.v[i] = cond.v[i] ? b : a;
+    }
+    return out;
+}
+
+// elementwise functions
+
+#define SIMD_LANES_FN1(fn, expr) \
+    template <typename T, size_t W> \
+    inline Lanes<T,W> fn(const Lanes<T,W>& a) { \
+        Lanes<T,W> out; \
+        for (size_t i = 0; i < W; ++i) { \
+            T x = a.v[i]; \
+            out.v[i] = (expr); \
+        } \
+        return out; \
+    }
+
+SIMD_LANES_FN1(sqrt,  std::sqrt(x))
+SIMD_LANES_FN1(abs,   std::abs(x))
+SIMD_LANES_FN1(floor, std::floor(x))
+SIMD_LANES_FN1(ceil,  std::ceil(x))
+SIMD_LANES_FN1(round, std::round(x))
+SIMD_LANES_FN1(sin,   std::sin(x))
+SIMD_LANES_FN1(cos,   std::cos(x))
+SIMD_LANES_FN1(sign,  (T) ((x > 0) - (x < 0)))
+
+#undef SIMD_LANES_FN1
+
+template <typename T, size_t W>
+inline Lanes<T,W> min(const Lanes<T,W>& a, const Lanes<T,W>& b) {
+    Lanes<T,W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = std::min(a.v[i], b.v[i]);
+    return out;
+}
+
+template <typename T, size_t W>
+inline Lanes<T,W> max(const Lanes<T,W>& a, const Lanes<T,W>& b) {
+    Lanes<T,W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = std::max(a.v[i], b.v[i]);
+    return out;
+}
+
+template <typename T, size_t W>
+inline Lanes<T,W> atan2(const Lanes<T,W>& y, const Lanes<T,W>& x) {
+    Lanes<T,W> out;
+    for (size_t i = 0; i < W; ++i) out.v[i] = std::atan2(y.v[i], x.v[i]);
+    return out;
+}
+
+template <typename T, size_t W>
+inline T hmin(const Lanes<T,W>& a) {
+    T m = a.v[0];
+    for (size_t i = 1; i < W; ++i) m = std::min(m, a.v[i]);
+    return m;
+}
+
+template <typename T, size_t W>
+inline T hmax(const Lanes<T,W>& a) {
+    T m = a.v[0];
+    for (size_t i = 1; i < W; ++i) m = std::max(m, a.v[i]);
+    return m;
+}
+
+template <typename T, size_t W>
+inline T hsum(const Lanes<T,W>& a) {
+    T s = 0;
+    for (size_t i = 0; i < W; ++i) s += a.v[i];
+    return s;
+}
+
+using std::sqrt;
+using std::abs;
+using std::floor;
+using std::ceil;
+using std::round;
+using std::sin;
+using std::cos;
+using std::atan2;
+using std::min;
+using std::max;
+
+inline float sign(float x) { return (float) ((x > 0) - (x < 0)); }
+
+} // namespace simd
+} // namespace stereo
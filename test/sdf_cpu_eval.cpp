@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstdio>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include <stereo/sdf/sdf_cpu_eval.h>
+#include <stereo/sdf/sdf_file.h>
+#include <stereo/sdf/sdf_instances.h>
+
+using namespace stereo;
+
+namespace {
+
+constexpr size_t NumSpheres = 20;
+constexpr size_t NumPoints  = 1000;
+
+SdfNodeRef<float> sphere(const vec3& c, float r) {
+    return std::make_shared<SdfSphere<float>>(Sphere<float,3>(c, r));
+}
+
+SdfNodeRef<float> box(const vec3& lo, const vec3& hi) {
+    return std::make_shared<SdfBox<float>>(Rect<float,3>(lo, hi));
+}
+
+// a union of a rotated box, a row of spheres wide enough to be culled, and
+// a few instances of a small box
+SdfNodeRef<float> test_tree() {
+    SdfNodeRef<float> root = std::make_shared<SdfTransform<float>>(
+        box(vec3(-0.3f, -0.2f, -0.1f), vec3(0.3f, 0.2f, 0.1f)),
+        Quat<float>(0.2f, 0.4f, 0.4f, 0.8f),
+        vec3(0.1f, -0.5f, 0.2f)
+    );
+    for (size_t i = 0; i < NumSpheres; ++i) {
+        float t = i / (NumSpheres - 1.f);
+        root = std::make_shared<SdfUnion<float>>(
+            root,
+            sphere(vec3(2 * t - 1, 0.6f, 0.3f * t), 0.05f + 0.05f * t)
+        );
+    }
+    std::vector<SdfInstance<float>> instances;
+    for (size_t i = 0; i < 5; ++i) {
+        instances.push_back({
+            Quat<float>(0.f, 0.f, 0.6f, 0.8f),
+            vec3(0.4f * i - 0.8f, -0.7f, 0.1f * i),
+        });
+    }
+    SdfNodeRef<float> child = box(vec3(-0.1f), vec3(0.1f));
+    return std::make_shared<SdfUnion<float>>(
+        root,
+        std::make_shared<SdfInstances<float>>(
+            child,
+            Sphere<float,3>(vec3(0.f), 0.2f),
+            instances
+        )
+    );
+}
+
+size_t count_ops(const SdfTape& tape, SdfOp op) {
+    return std::count_if(tape.ops.begin(), tape.ops.end(), [op](const SdfGpuOp& o) {
+        return o.op == op;
+    });
+}
+
+SdfCpuInput test_input(size_t n) {
+    std::mt19937 rng(17);
+    std::uniform_real_distribution<float> u(-1.2f, 1.2f);
+    std::vector<vec3> pts(n);
+    for (vec3& p : pts) p = vec3(u(rng), u(rng), u(rng));
+    SdfCpuInput input(n, 0);
+    input.write_samples_x(pts.data());
+    return input;
+}
+
+// an expression with one tangent variation per parameter, each seeded with that
+// parameter alone
+SdfCpuExpr seeded_expr(const SdfTape& tape) {
+    gpu_size_t n = tape.n_params();
+    SdfCpuExpr expr(tape, 1, n);
+    std::vector<float> dx(n, 0.f);
+    for (gpu_size_t k = 0; k < n; ++k) {
+        dx[k] = 1;
+        expr.update_variation_params(k, 0, nullptr, dx.data(), n);
+        dx[k] = 0;
+    }
+    return expr;
+}
+
+} // namespace
+
+
+TEST(SdfCpuEval, TestTapeHasEveryOp) {
+    SdfTape tape(test_tree(), SdfMerge::Static);
+    EXPECT_GT(count_ops(tape, SdfOp::Transform), 0);
+    EXPECT_EQ(count_ops(tape, SdfOp::BvhUnion),  1);
+    EXPECT_EQ(count_ops(tape, SdfOp::Instances), 1);
+}
+
+TEST(SdfCpuEval, GradientMatchesTangents) {
+    SdfTape    tape(test_tree(), SdfMerge::Static);
+    gpu_size_t n = tape.n_params();
+    SdfCpuExpr expr = seeded_expr(tape);
+    SdfCpuInput input = test_input(NumPoints);
+
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    std::vector<float> d_loss(NumPoints);
+    for (float& d : d_loss) d = u(rng);
+
+    SdfCpuEvaluator evaluator;
+    std::vector<float> grad = evaluator.gradient(expr, input, d_loss.data());
+    SdfCpuOutputRef out = evaluator.evaluate(expr, input, n, ParamVariation::VaryDerivative);
+    ASSERT_EQ(grad.size(), n);
+    for (gpu_size_t k = 0; k < n; ++k) {
+        double expected = 0;
+        for (size_t i = 0; i < NumPoints; ++i) {
+            expected += d_loss[i] * out->sdf_dx[k * NumPoints + i];
+        }
+        EXPECT_NEAR(grad[k], expected, 1e-3 * (1 + std::abs(expected))) << "parameter " << k;
+    }
+}
+
+TEST(SdfCpuEval, TangentsMatchSingleVariations) {
+    // tangents evaluated together (on a `DualN`) are the same as those evaluated alone
+    SdfTape    tape(test_tree(), SdfMerge::Static);
+    gpu_size_t n = tape.n_params();
+    SdfCpuExpr expr = seeded_expr(tape);
+    SdfCpuInput input = test_input(NumPoints);
+    SdfCpuEvaluator evaluator;
+    SdfCpuOutputRef all = evaluator.evaluate(expr, input, n, ParamVariation::VaryDerivative);
+
+    std::vector<float> dx(n, 0.f);
+    for (gpu_size_t k = 0; k < n; k += 7) {
+        SdfCpuExpr single(tape);
+        dx[k] = 1;
+        single.update_params(0, nullptr, dx.data(), n);
+        dx[k] = 0;
+        SdfCpuOutputRef one = evaluator.evaluate(single, input, 1, ParamVariation::VaryDerivative);
+        for (size_t i = 0; i < NumPoints; ++i) {
+            ASSERT_EQ(one->sdf_x[i],  all->sdf_x[k * NumPoints + i]);
+            ASSERT_EQ(one->sdf_dx[i], all->sdf_dx[k * NumPoints + i]) << "parameter " << k;
+        }
+    }
+}
+
+TEST(SdfCpuEval, TilesMatchFullTape) {
+    SdfTape tape(test_tree(), SdfMerge::Static);
+    SdfCpuExpr flat(tape);
+    SdfCpuExpr tiled(SdfTiledTape(tape, range3(vec3(-1.2f), vec3(1.2f)), vec3ui(4, 4, 4)));
+    ASSERT_GT(tiled.tiled_tape().n_tiles(), 1);
+    SdfCpuInput input = test_input(NumPoints);
+    SdfCpuEvaluator evaluator;
+    SdfCpuOutputRef a = evaluator.evaluate(flat,  input, 1);
+    SdfCpuOutputRef b = evaluator.evaluate(tiled, input, 1);
+    for (size_t i = 0; i < NumPoints; ++i) {
+        EXPECT_FLOAT_EQ(a->sdf_x[i], b->sdf_x[i]) << "sample " << i;
+    }
+}
+
+TEST(SdfCpuEval, FileRoundTrip) {
+    SdfNodeRef<float> tree = test_tree();
+    SdfTape tape(tree, SdfMerge::Static);
+    SdfTiledTape tiled(tape, range3(vec3(-1.2f), vec3(1.2f)), vec3ui(2, 2, 2));
+    std::string path = testing::TempDir() + "sdf_cpu_eval_test.sdf";
+    ASSERT_TRUE(save_sdf_file(path, tiled, tree));
+    SdfFileRef file = load_sdf_file(path);
+    ASSERT_NE(file, nullptr);
+
+    SdfCpuInput input = test_input(NumPoints);
+    SdfCpuEvaluator evaluator;
+    SdfCpuOutputRef a = evaluator.evaluate(SdfCpuExpr(tiled), input, 1);
+    SdfCpuOutputRef b = evaluator.evaluate(SdfCpuExpr(file->tiled_tape()), input, 1);
+    for (size_t i = 0; i < NumPoints; ++i) {
+        ASSERT_EQ(a->sdf_x[i],    b->sdf_x[i]);
+        ASSERT_EQ(a->normal_x[i], b->normal_x[i]);
+    }
+    std::remove(path.c_str());
+}